@@ -0,0 +1,552 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "dbserver.h"
+#include "cache.h"
+#include "logstore.h"
+#include "lsmstore.h"
+#include "queue.h"
+#include "reactor.h"
+#include "admin.h"
+#include "wal.h"
+#include "repl.h"
+
+/*
+ * Admin socket: a thread of its own serves the statistics `stats`
+ * prints over HTTP, so they can be scraped without anyone at the
+ * console and without a scrape ever waiting in the work queue.
+ *
+ *   GET /metrics   Prometheus text format
+ *   GET /stats     JSON
+ *
+ * Each connection gets one reply and is closed. Requests are served
+ * one at a time, so a connection has a second in all to send its
+ * request and another to take the reply, however it spreads them over
+ * reads; a slower client is dropped so it can't hold up the next scrape.
+ */
+
+#define ADMIN_REQUEST_MAX 1024
+#define ADMIN_TIMEOUT_NS 1000000000L
+
+static int admin_fd = -1;
+static const char *op_names[] = {"read", "write", "delete"};
+static const char *kind_names[LAT_KINDS] = {"queue_wait", "service", "total"};
+static const char *repl_states[] = {"connecting", "snapshot", "streaming"};
+static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+#define N_QUANTILES (sizeof(quantiles) / sizeof(quantiles[0]))
+
+/* a port number listens on 127.0.0.1 only; anything else is the path
+ * of a Unix socket
+ */
+int admin_open(const char *addr) {
+    char *end;
+    long port = strtol(addr, &end, 10);
+    int fd;
+    if (*addr && *end == 0) {
+        struct sockaddr_in in = {.sin_family = AF_INET, .sin_port = htons(port),
+                                 .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+        int opt = 1;
+        fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            perror("admin socket");
+            exit(1);
+        }
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+        if (bind(fd, (struct sockaddr *)&in, sizeof(in)) < 0) {
+            perror("can't bind admin port");
+            exit(1);
+        }
+    } else {
+        struct sockaddr_un un = {.sun_family = AF_UNIX};
+        if (strlen(addr) >= sizeof(un.sun_path)) {
+            fprintf(stderr, "admin socket path too long: %s\n", addr);
+            exit(1);
+        }
+        strcpy(un.sun_path, addr);
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            perror("admin socket");
+            exit(1);
+        }
+        unlink(addr);
+        if (bind(fd, (struct sockaddr *)&un, sizeof(un)) < 0) {
+            perror("can't bind admin socket");
+            exit(1);
+        }
+    }
+    if (listen(fd, 16) < 0) {
+        perror("admin listen failed");
+        exit(1);
+    }
+    admin_fd = fd;
+    return fd;
+}
+
+void admin_stop(void) {
+    if (admin_fd >= 0) {
+        shutdown(admin_fd, SHUT_RDWR);
+    }
+}
+
+static void json_latency(FILE *f) {
+    static struct histogram h;
+    fprintf(f, "\"latency_us\":{");
+    for (int i = 0; i < 3; i++) {
+        fprintf(f, "%s\"%s\":{", i ? "," : "", op_names[i]);
+        for (int k = 0; k < LAT_KINDS; k++) {
+            latency_sum(i, k, &h);
+            fprintf(f, "%s\"%s\":{\"count\":%ld,\"mean\":%.1f", k ? "," : "", kind_names[k], h.count,
+                    h.count ? h.sum / 1e3 / h.count : 0.0);
+            fprintf(f, ",\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"p99.9\":%.1f,\"max\":%.1f}",
+                    hist_percentile(&h, 0.5) / 1e3, hist_percentile(&h, 0.9) / 1e3,
+                    hist_percentile(&h, 0.99) / 1e3, hist_percentile(&h, 0.999) / 1e3, h.max / 1e3);
+        }
+        fprintf(f, "}");
+    }
+    fprintf(f, "}");
+}
+
+static void json_replication(FILE *f) {
+    static struct repl_stats rs;
+    repl_get_stats(&rs);
+    if (rs.primary) {
+        fprintf(f, ",\"replication\":{\"head\":%lu,\"first\":%lu,\"backlog_bytes\":%ld,"
+                "\"backlog_max\":%ld,\"fell_behind\":%ld,\"replicas\":[", rs.head, rs.first, rs.backlog_bytes,
+                rs.backlog_max, rs.fell_behind);
+        for (int i = 0; i < rs.replicas; i++) {
+            struct repl_replica_stats *r = &rs.replica[i];
+            fprintf(f, "%s{\"addr\":\"%s\",\"state\":\"%s\",\"applied\":%lu,\"behind\":%lu,"
+                    "\"lag_us\":%ld,\"unsent_bytes\":%ld,\"snapshots\":%ld}", i ? "," : "",
+                    r->addr, repl_states[r->state], r->acked, rs.head > r->acked ? rs.head - r->acked : 0,
+                    r->lag_us, r->unsent, r->snapshots);
+        }
+        fprintf(f, "]}");
+    }
+    if (rs.following) {
+        fprintf(f, ",\"replica_of\":{\"primary\":\"%s\",\"state\":\"%s\",\"applied\":%lu,"
+                "\"primary_head\":%lu,\"behind\":%lu,\"lag_us\":%ld,\"changes\":%ld,\"errors\":%ld,"
+                "\"connects\":%ld,\"snapshots\":%ld,\"snapshot_keys\":%ld}",
+                rs.primary_addr, repl_states[rs.state], rs.applied, rs.primary_head,
+                rs.primary_head > rs.applied ? rs.primary_head - rs.applied : 0, rs.lag_us, rs.changes,
+                rs.errors, rs.connects, rs.snapshots, rs.snapshot_keys);
+    }
+}
+
+static void write_json(FILE *f) {
+    struct request_stats sum;
+    struct db_usage u;
+    struct cache_stats cs;
+    stats_sum(&sum);
+    db_usage(&u);
+    cache_get_stats(&cs);
+
+    fprintf(f, "{\"objects\":%d", count_valid_objects());
+    fprintf(f, ",\"requests\":{\"read\":%ld,\"write\":%ld,\"delete\":%ld,\"failed\":%ld}",
+            sum.reads, sum.writes, sum.deletes, sum.failed);
+    fprintf(f, ",\"connections_accepted\":%ld,\"bytes_in\":%ld,\"bytes_out\":%ld",
+            sum.accepted, sum.bytes_in, sum.bytes_out);
+    if (shard_mode) {
+        fprintf(f, ",\"shards\":[");
+        for (int i = 0; i < acceptors; i++) {
+            struct request_stats st;
+            reactor_get_stats(i, &st);
+            fprintf(f, "%s{\"run\":%ld,\"forwarded\":%ld}", i ? "," : "",
+                    st.reads + st.writes + st.deletes, st.forwarded);
+        }
+        fprintf(f, "]");
+    } else {
+        fprintf(f, ",\"shed\":{\"busy\":%ld,\"expired\":%ld,\"deferred\":%ld}",
+                sum.shed_busy, sum.shed_expired, sum.deferred);
+        fprintf(f, ",\"pool\":{\"workers\":%d,\"min\":%d,\"max\":%d,\"grows\":%ld,\"shrinks\":%ld}",
+                queue_active_workers(), pool_min, pool_max, pool_grows, pool_shrinks);
+        fprintf(f, ",\"queue\":{\"length\":%d,\"high_water\":%ld,\"workers\":[", queue_length(),
+                sum.queue_high);
+        for (int i = 0; i < queue_workers(); i++) {
+            struct queue_worker_stats qs;
+            queue_worker_stats(i, &qs);
+            fprintf(f, "%s{\"depth\":%d,\"run\":%ld,\"stolen\":%ld}", i ? "," : "",
+                    qs.depth, qs.taken, qs.steals);
+        }
+        fprintf(f, "]}");
+    }
+    fprintf(f, ",\"table\":{\"keys\":%d,\"index_bytes\":%ld,\"record_bytes\":%ld,"
+            "\"key_bytes\":%ld,\"key_dead_bytes\":%ld}",
+            u.keys, u.index_bytes, u.record_bytes, u.key_bytes, u.key_dead_bytes);
+    fprintf(f, ",\"cache\":{\"hits\":%ld,\"misses\":%ld,\"evictions\":%ld,\"bytes\":%ld,\"budget\":%ld}",
+            cs.hits, cs.misses, cs.evictions, cs.bytes, cs.budget);
+    if (storage_engine == DB_ENGINE_LOG) {
+        struct log_stats ls;
+        log_get_stats(&ls);
+        fprintf(f, ",\"log\":{\"files\":%d,\"bytes\":%ld,\"live_bytes\":%ld,\"compactions\":%ld,"
+                "\"compacted_bytes\":%ld}",
+                ls.files, ls.bytes, ls.live_bytes, ls.compactions, ls.compacted_bytes);
+    }
+    if (storage_engine == DB_ENGINE_LSM) {
+        struct lsm_stats ls;
+        lsm_get_stats(&ls);
+        fprintf(f, ",\"lsm\":{\"mem_bytes\":%ld,\"flushes\":%ld,\"compactions\":%ld,"
+                "\"compacted_bytes\":%ld,\"stalls\":%ld,\"table_reads\":%ld,\"bloom_skips\":%ld,\"levels\":[",
+                ls.mem_bytes, ls.flushes, ls.compactions, ls.compacted_bytes, ls.stalls,
+                ls.table_reads, ls.bloom_skips);
+        for (int level = 0; level < LSM_LEVELS; level++) {
+            fprintf(f, "%s{\"tables\":%d,\"bytes\":%ld}", level ? "," : "",
+                    ls.tables[level], ls.level_bytes[level]);
+        }
+        fprintf(f, "]}");
+    }
+    if (wal_mode) {
+        static struct wal_stats ws;
+        wal_get_stats(&ws);
+        fprintf(f, ",\"wal\":{\"syncs\":%ld,\"writes\":%ld,\"failures\":%ld,\"append_failures\":%ld,"
+                "\"failed\":%s,\"bytes\":%ld,\"window_us\":%d,\"batch_max\":%d",
+                ws.syncs, ws.writes, ws.failures, ws.append_failures, ws.failed ? "true" : "false",
+                ws.bytes, ws.window_us, ws.batch_max);
+        fprintf(f, ",\"batch\":{\"mean\":%.1f,\"p50\":%ld,\"p99\":%ld,\"max\":%ld}",
+                ws.syncs ? (double)ws.batch.sum / ws.syncs : 0.0, hist_percentile(&ws.batch, 0.5),
+                hist_percentile(&ws.batch, 0.99), ws.batch.max);
+        fprintf(f, ",\"sync_us\":{\"mean\":%.1f,\"p50\":%.1f,\"p99\":%.1f,\"max\":%.1f}}",
+                ws.syncs ? ws.latency.sum / 1e3 / ws.syncs : 0.0, hist_percentile(&ws.latency, 0.5) / 1e3,
+                hist_percentile(&ws.latency, 0.99) / 1e3, ws.latency.max / 1e3);
+    }
+    json_replication(f);
+    fprintf(f, ",");
+    json_latency(f);
+    fprintf(f, "}\n");
+}
+
+static void prom_metric(FILE *f, const char *name, const char *type, const char *help) {
+    fprintf(f, "# HELP dbserver_%s %s\n# TYPE dbserver_%s %s\n", name, help, name, type);
+}
+
+static void prom_latency(FILE *f) {
+    static struct histogram h;
+    prom_metric(f, "latency_seconds", "summary",
+                "Request latency by operation and phase (queue wait, service, total).");
+    for (int i = 0; i < 3; i++) {
+        for (int k = 0; k < LAT_KINDS; k++) {
+            char labels[64];
+            latency_sum(i, k, &h);
+            snprintf(labels, sizeof(labels), "op=\"%s\",phase=\"%s\"", op_names[i], kind_names[k]);
+            for (int q = 0; q < N_QUANTILES; q++) {
+                fprintf(f, "dbserver_latency_seconds{%s,quantile=\"%g\"} %.9f\n", labels, quantiles[q],
+                        hist_percentile(&h, quantiles[q]) / 1e9);
+            }
+            fprintf(f, "dbserver_latency_seconds_sum{%s} %.9f\n", labels, h.sum / 1e9);
+            fprintf(f, "dbserver_latency_seconds_count{%s} %ld\n", labels, h.count);
+        }
+    }
+    prom_metric(f, "latency_max_seconds", "gauge", "Largest latency seen since the last reset.");
+    for (int i = 0; i < 3; i++) {
+        for (int k = 0; k < LAT_KINDS; k++) {
+            latency_sum(i, k, &h);
+            fprintf(f, "dbserver_latency_max_seconds{op=\"%s\",phase=\"%s\"} %.9f\n",
+                    op_names[i], kind_names[k], h.max / 1e9);
+        }
+    }
+}
+
+static void prom_replication(FILE *f) {
+    static struct repl_stats rs;
+    repl_get_stats(&rs);
+    if (rs.primary) {
+        prom_metric(f, "repl_head_seq", "counter", "Changes logged for replicas.");
+        fprintf(f, "dbserver_repl_head_seq %lu\n", rs.head);
+        prom_metric(f, "repl_backlog_bytes", "gauge", "Bytes of changes kept for replicas to catch up from.");
+        fprintf(f, "dbserver_repl_backlog_bytes %ld\n", rs.backlog_bytes);
+        prom_metric(f, "repl_fell_behind_total", "counter", "Times a replica fell out of the backlog.");
+        fprintf(f, "dbserver_repl_fell_behind_total %ld\n", rs.fell_behind);
+        prom_metric(f, "repl_replicas", "gauge", "Replicas connected.");
+        fprintf(f, "dbserver_repl_replicas %d\n", rs.replicas);
+        prom_metric(f, "repl_replica_behind", "gauge", "Changes a replica has yet to apply.");
+        for (int i = 0; i < rs.replicas; i++) {
+            struct repl_replica_stats *r = &rs.replica[i];
+            fprintf(f, "dbserver_repl_replica_behind{replica=\"%s\"} %lu\n", r->addr,
+                    rs.head > r->acked ? rs.head - r->acked : 0);
+        }
+        prom_metric(f, "repl_replica_lag_seconds", "gauge", "Replica apply lag, as it last reported.");
+        for (int i = 0; i < rs.replicas; i++) {
+            fprintf(f, "dbserver_repl_replica_lag_seconds{replica=\"%s\"} %.6f\n", rs.replica[i].addr,
+                    rs.replica[i].lag_us / 1e6);
+        }
+    }
+    if (rs.following) {
+        prom_metric(f, "repl_applied_seq", "counter", "Last change from the primary applied.");
+        fprintf(f, "dbserver_repl_applied_seq %lu\n", rs.applied);
+        prom_metric(f, "repl_behind", "gauge", "Changes the primary had made that are not applied yet.");
+        fprintf(f, "dbserver_repl_behind %lu\n", rs.primary_head > rs.applied ? rs.primary_head - rs.applied : 0);
+        prom_metric(f, "repl_lag_seconds", "gauge", "Time from the primary logging a change to applying it.");
+        fprintf(f, "dbserver_repl_lag_seconds %.6f\n", rs.lag_us / 1e6);
+        prom_metric(f, "repl_connected", "gauge", "1 while following the primary.");
+        fprintf(f, "dbserver_repl_connected %d\n", rs.state != REPL_CONNECTING);
+        prom_metric(f, "repl_snapshots_total", "counter", "Snapshots taken from the primary.");
+        fprintf(f, "dbserver_repl_snapshots_total %ld\n", rs.snapshots);
+    }
+}
+
+static void write_prometheus(FILE *f) {
+    struct request_stats sum;
+    struct db_usage u;
+    struct cache_stats cs;
+    stats_sum(&sum);
+    db_usage(&u);
+    cache_get_stats(&cs);
+
+    prom_metric(f, "requests_total", "counter", "Requests served by operation.");
+    fprintf(f, "dbserver_requests_total{op=\"read\"} %ld\n", sum.reads);
+    fprintf(f, "dbserver_requests_total{op=\"write\"} %ld\n", sum.writes);
+    fprintf(f, "dbserver_requests_total{op=\"delete\"} %ld\n", sum.deletes);
+    prom_metric(f, "failed_requests_total", "counter", "Requests answered with X or cut off.");
+    fprintf(f, "dbserver_failed_requests_total %ld\n", sum.failed);
+    prom_metric(f, "connections_accepted_total", "counter", "Client connections accepted.");
+    fprintf(f, "dbserver_connections_accepted_total %ld\n", sum.accepted);
+    prom_metric(f, "received_bytes_total", "counter", "Request bytes read from clients.");
+    fprintf(f, "dbserver_received_bytes_total %ld\n", sum.bytes_in);
+    prom_metric(f, "sent_bytes_total", "counter", "Reply bytes written to clients.");
+    fprintf(f, "dbserver_sent_bytes_total %ld\n", sum.bytes_out);
+    prom_metric(f, "objects", "gauge", "Keys in the database.");
+    fprintf(f, "dbserver_objects %d\n", count_valid_objects());
+
+    if (shard_mode) {
+        prom_metric(f, "shard_requests_total", "counter", "Requests run by each shard.");
+        for (int i = 0; i < acceptors; i++) {
+            struct request_stats st;
+            reactor_get_stats(i, &st);
+            fprintf(f, "dbserver_shard_requests_total{shard=\"%d\"} %ld\n", i,
+                    st.reads + st.writes + st.deletes);
+        }
+        prom_metric(f, "shard_forwarded_total", "counter", "Requests a shard passed to the owning shard.");
+        for (int i = 0; i < acceptors; i++) {
+            struct request_stats st;
+            reactor_get_stats(i, &st);
+            fprintf(f, "dbserver_shard_forwarded_total{shard=\"%d\"} %ld\n", i, st.forwarded);
+        }
+    } else {
+        int n = queue_workers();
+        struct queue_worker_stats qs[n];
+        for (int i = 0; i < n; i++) {
+            queue_worker_stats(i, &qs[i]);
+        }
+        prom_metric(f, "shed_requests_total", "counter", "Requests answered X without being run.");
+        fprintf(f, "dbserver_shed_requests_total{reason=\"busy\"} %ld\n", sum.shed_busy);
+        fprintf(f, "dbserver_shed_requests_total{reason=\"deadline\"} %ld\n", sum.shed_expired);
+        prom_metric(f, "deferred_connections_total", "counter", "Connections held back while the queue was full.");
+        fprintf(f, "dbserver_deferred_connections_total %ld\n", sum.deferred);
+        prom_metric(f, "workers", "gauge", "Worker threads taking new work.");
+        fprintf(f, "dbserver_workers %d\n", queue_active_workers());
+        prom_metric(f, "pool_resizes_total", "counter", "Times the worker pool grew or shrank.");
+        fprintf(f, "dbserver_pool_resizes_total{direction=\"grow\"} %ld\n", pool_grows);
+        fprintf(f, "dbserver_pool_resizes_total{direction=\"shrink\"} %ld\n", pool_shrinks);
+        prom_metric(f, "queue_length", "gauge", "Requests waiting for a worker.");
+        fprintf(f, "dbserver_queue_length %d\n", queue_length());
+        prom_metric(f, "queue_high_water", "gauge", "Deepest any worker's queue has been.");
+        fprintf(f, "dbserver_queue_high_water %ld\n", sum.queue_high);
+        prom_metric(f, "worker_queue_length", "gauge", "Requests waiting in each worker's queue.");
+        for (int i = 0; i < n; i++) {
+            fprintf(f, "dbserver_worker_queue_length{worker=\"%d\"} %d\n", i, qs[i].depth);
+        }
+        prom_metric(f, "worker_requests_total", "counter", "Requests each worker has run.");
+        for (int i = 0; i < n; i++) {
+            fprintf(f, "dbserver_worker_requests_total{worker=\"%d\"} %ld\n", i, qs[i].taken);
+        }
+        prom_metric(f, "worker_steals_total", "counter", "Requests a worker took from a peer's queue.");
+        for (int i = 0; i < n; i++) {
+            fprintf(f, "dbserver_worker_steals_total{worker=\"%d\"} %ld\n", i, qs[i].steals);
+        }
+    }
+
+    prom_metric(f, "table_bytes", "gauge", "Memory used by the key table.");
+    fprintf(f, "dbserver_table_bytes{part=\"index\"} %ld\n", u.index_bytes);
+    fprintf(f, "dbserver_table_bytes{part=\"records\"} %ld\n", u.record_bytes);
+    fprintf(f, "dbserver_table_bytes{part=\"keys\"} %ld\n", u.key_bytes);
+    prom_metric(f, "cache_hits_total", "counter", "Reads served from the value cache.");
+    fprintf(f, "dbserver_cache_hits_total %ld\n", cs.hits);
+    prom_metric(f, "cache_misses_total", "counter", "Reads the value cache could not serve.");
+    fprintf(f, "dbserver_cache_misses_total %ld\n", cs.misses);
+    prom_metric(f, "cache_evictions_total", "counter", "Values evicted from the cache.");
+    fprintf(f, "dbserver_cache_evictions_total %ld\n", cs.evictions);
+    prom_metric(f, "cache_bytes", "gauge", "Bytes held in the value cache.");
+    fprintf(f, "dbserver_cache_bytes %ld\n", cs.bytes);
+
+    if (storage_engine == DB_ENGINE_LOG) {
+        struct log_stats ls;
+        log_get_stats(&ls);
+        prom_metric(f, "log_bytes", "gauge", "Bytes in log segment files.");
+        fprintf(f, "dbserver_log_bytes %ld\n", ls.bytes);
+        prom_metric(f, "log_live_bytes", "gauge", "Bytes in log segments still in use.");
+        fprintf(f, "dbserver_log_live_bytes %ld\n", ls.live_bytes);
+        prom_metric(f, "log_compactions_total", "counter", "Log segments compacted.");
+        fprintf(f, "dbserver_log_compactions_total %ld\n", ls.compactions);
+    }
+    if (storage_engine == DB_ENGINE_LSM) {
+        struct lsm_stats ls;
+        lsm_get_stats(&ls);
+        prom_metric(f, "lsm_memtable_bytes", "gauge", "Bytes in the LSM memtables.");
+        fprintf(f, "dbserver_lsm_memtable_bytes %ld\n", ls.mem_bytes);
+        prom_metric(f, "lsm_level_bytes", "gauge", "Bytes in each LSM level.");
+        for (int level = 0; level < LSM_LEVELS; level++) {
+            fprintf(f, "dbserver_lsm_level_bytes{level=\"%d\"} %ld\n", level, ls.level_bytes[level]);
+        }
+        prom_metric(f, "lsm_compactions_total", "counter", "LSM compactions run.");
+        fprintf(f, "dbserver_lsm_compactions_total %ld\n", ls.compactions);
+        prom_metric(f, "lsm_write_stalls_total", "counter", "Writers that waited for a memtable flush.");
+        fprintf(f, "dbserver_lsm_write_stalls_total %ld\n", ls.stalls);
+    }
+    if (wal_mode) {
+        static struct wal_stats ws;
+        wal_get_stats(&ws);
+        prom_metric(f, "wal_syncs_total", "counter", "WAL syncs (fdatasync group commits).");
+        fprintf(f, "dbserver_wal_syncs_total %ld\n", ws.syncs);
+        prom_metric(f, "wal_sync_failures_total", "counter", "WAL syncs that failed.");
+        fprintf(f, "dbserver_wal_sync_failures_total %ld\n", ws.failures);
+        prom_metric(f, "wal_append_failures_total", "counter", "WAL appends that failed.");
+        fprintf(f, "dbserver_wal_append_failures_total %ld\n", ws.append_failures);
+        prom_metric(f, "wal_failed", "gauge", "1 once the WAL has failed and writes are refused.");
+        fprintf(f, "dbserver_wal_failed %d\n", ws.failed);
+        prom_metric(f, "wal_batch_size", "summary", "Writes made durable by one WAL sync.");
+        for (int q = 0; q < N_QUANTILES; q++) {
+            fprintf(f, "dbserver_wal_batch_size{quantile=\"%g\"} %ld\n", quantiles[q],
+                    hist_percentile(&ws.batch, quantiles[q]));
+        }
+        fprintf(f, "dbserver_wal_batch_size_sum %ld\n", ws.batch.sum);
+        fprintf(f, "dbserver_wal_batch_size_count %ld\n", ws.batch.count);
+        prom_metric(f, "wal_sync_seconds", "summary", "Time taken by one WAL sync.");
+        for (int q = 0; q < N_QUANTILES; q++) {
+            fprintf(f, "dbserver_wal_sync_seconds{quantile=\"%g\"} %.9f\n", quantiles[q],
+                    hist_percentile(&ws.latency, quantiles[q]) / 1e9);
+        }
+        fprintf(f, "dbserver_wal_sync_seconds_sum %.9f\n", ws.latency.sum / 1e9);
+        fprintf(f, "dbserver_wal_sync_seconds_count %ld\n", ws.latency.count);
+        prom_metric(f, "wal_bytes", "gauge", "Bytes in the WAL file.");
+        fprintf(f, "dbserver_wal_bytes %ld\n", ws.bytes);
+    }
+    prom_replication(f);
+    prom_latency(f);
+}
+
+/* wait until fd is ready for events, or -1 once deadline (clock_ns)
+ * has passed
+ */
+static int wait_ready(int fd, short events, long deadline) {
+    while (1) {
+        long left = (deadline - clock_ns()) / 1000000;
+        if (left <= 0) {
+            return -1;
+        }
+        struct pollfd p = {.fd = fd, .events = events};
+        int n = poll(&p, 1, left);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        return n > 0 ? 0 : -1;
+    }
+}
+
+static int write_all(int fd, const char *buf, size_t len, long deadline) {
+    while (len > 0) {
+        if (wait_ready(fd, POLLOUT, deadline) < 0) {
+            return -1;
+        }
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* read up to the end of the request headers; only the request line
+ * matters. 0 if they haven't all come by the deadline
+ */
+static int read_request(int fd, char *buf, int max, long deadline) {
+    int got = 0;
+    while (got < max - 1) {
+        if (wait_ready(fd, POLLIN, deadline) < 0) {
+            return 0;
+        }
+        int n = read(fd, buf + got, max - 1 - got);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        got += n;
+        buf[got] = 0;
+        if (strstr(buf, "\r\n\r\n") || strstr(buf, "\n\n")) {
+            break;
+        }
+    }
+    buf[got] = 0;
+    return got;
+}
+
+static void admin_serve(int fd) {
+    char req[ADMIN_REQUEST_MAX];
+    char path[256];
+    char *body = NULL;
+    size_t body_len = 0;
+    const char *status = "200 OK", *type = "text/plain; version=0.0.4";
+    long deadline = clock_ns() + ADMIN_TIMEOUT_NS;
+
+    if (read_request(fd, req, sizeof(req), deadline) == 0 || sscanf(req, "GET %255s", path) != 1) {
+        write_all(fd, "HTTP/1.0 400 Bad Request\r\n\r\n", 28, deadline);
+        return;
+    }
+    FILE *f = open_memstream(&body, &body_len);
+    if (f == NULL) {
+        return;
+    }
+    if (strcmp(path, "/metrics") == 0) {
+        write_prometheus(f);
+    } else if (strcmp(path, "/stats") == 0) {
+        type = "application/json";
+        write_json(f);
+    } else {
+        status = "404 Not Found";
+        type = "text/plain";
+        fprintf(f, "try /metrics or /stats\n");
+    }
+    fclose(f);
+
+    char head[256];
+    deadline = clock_ns() + ADMIN_TIMEOUT_NS;
+    int n = snprintf(head, sizeof(head),
+                     "HTTP/1.0 %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+                     status, type, body_len);
+    if (write_all(fd, head, n, deadline) == 0) {
+        write_all(fd, body, body_len, deadline);
+    }
+    free(body);
+}
+
+void* admin_thread(void *arg) {
+    while (!shutdown_flag) {
+        int fd = accept4(admin_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (shutdown_flag) {
+                break;
+            }
+            if (errno != EINTR) {
+                perror("admin accept failed");
+            }
+            continue;
+        }
+        admin_serve(fd);
+        close(fd);
+    }
+    close(admin_fd);
+    return NULL;
+}
@@ -0,0 +1,8 @@
+#ifndef ADMIN_H
+#define ADMIN_H
+
+int admin_open(const char *addr);
+void* admin_thread(void *arg);
+void admin_stop(void);
+
+#endif
@@ -0,0 +1,228 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "cache.h"
+
+/* bounded in-memory cache of values, in front of the data files.
+ *
+ * the byte budget is split evenly over CACHE_PARTS partitions chosen by
+ * key hash, each with its own mutex, chained hash table and CLOCK ring.
+ * a hit only sets the entry's reference bit; when a partition is over
+ * budget the clock hand sweeps the ring, clearing reference bits and
+ * evicting the first entry it finds without one.
+ *
+ * callers keep the cache coherent with storage: database.c updates it
+ * while holding the segment lock for the key, so a value is replaced or
+ * removed before any later read of that key can run.
+ */
+#define CACHE_PARTS 16
+#define CACHE_MIN_BUCKETS 64
+
+struct cache_entry {
+    struct cache_entry *hnext;  /* hash chain */
+    struct cache_entry *prev;   /* clock ring */
+    struct cache_entry *next;
+    uint32_t hash;
+    int len;
+    int ref;
+    char *data;                 /* points past the key */
+    char key[];
+};
+
+struct cache_part {
+    pthread_mutex_t lock;
+    struct cache_entry **buckets;
+    uint32_t mask;
+    int count;
+    struct cache_entry *hand;
+    long bytes;
+    long hits;
+    long misses;
+    long evictions;
+} __attribute__((aligned(64)));
+
+static struct cache_part parts[CACHE_PARTS] = {
+    [0 ... CACHE_PARTS - 1] = {.lock = PTHREAD_MUTEX_INITIALIZER}
+};
+static long part_budget = 0;
+
+static inline struct cache_part *part_of(uint32_t hash) {
+    /* the low bits pick the index bucket and the top bits the database
+     * segment; use the middle for the partition */
+    return &parts[(hash >> 12) & (CACHE_PARTS - 1)];
+}
+
+static inline long entry_size(struct cache_entry *e) {
+    return sizeof(*e) + strlen(e->key) + 1 + e->len;
+}
+
+void cache_init(long budget) {
+    part_budget = budget / CACHE_PARTS;
+}
+
+static struct cache_entry **find_slot(struct cache_part *p, const char *key, uint32_t hash) {
+    struct cache_entry **pp = &p->buckets[hash & p->mask];
+    while (*pp && ((*pp)->hash != hash || strcmp((*pp)->key, key) != 0)) {
+        pp = &(*pp)->hnext;
+    }
+    return pp;
+}
+
+static void unlink_entry(struct cache_part *p, struct cache_entry **pp) {
+    struct cache_entry *e = *pp;
+    *pp = e->hnext;
+    if (e->next == e) {
+        p->hand = NULL;
+    } else {
+        e->prev->next = e->next;
+        e->next->prev = e->prev;
+        if (p->hand == e) {
+            p->hand = e->next;
+        }
+    }
+    p->bytes -= entry_size(e);
+    p->count--;
+    free(e);
+}
+
+static void evict(struct cache_part *p) {
+    while (p->bytes > part_budget && p->hand) {
+        struct cache_entry *e = p->hand;
+        if (e->ref) {
+            e->ref = 0;
+            p->hand = e->next;
+            continue;
+        }
+        unlink_entry(p, find_slot(p, e->key, e->hash));
+        p->evictions++;
+    }
+}
+
+static void grow(struct cache_part *p) {
+    uint32_t size = p->buckets ? (p->mask + 1) * 2 : CACHE_MIN_BUCKETS;
+    struct cache_entry **b = calloc(size, sizeof(*b));
+    if (b == NULL) {
+        return;
+    }
+    for (uint32_t i = 0; p->buckets && i <= p->mask; i++) {
+        struct cache_entry *e = p->buckets[i];
+        while (e) {
+            struct cache_entry *next = e->hnext;
+            e->hnext = b[e->hash & (size - 1)];
+            b[e->hash & (size - 1)] = e;
+            e = next;
+        }
+    }
+    free(p->buckets);
+    p->buckets = b;
+    p->mask = size - 1;
+}
+
+/* copy the cached value for key into buf; returns its length or -1
+ */
+int cache_get(const char *key, uint32_t hash, char *buf, int max) {
+    if (part_budget == 0) {
+        return -1;
+    }
+    struct cache_part *p = part_of(hash);
+    int len = -1;
+    pthread_mutex_lock(&p->lock);
+    if (p->buckets) {
+        struct cache_entry *e = *find_slot(p, key, hash);
+        if (e && e->len <= max) {
+            e->ref = 1;
+            memcpy(buf, e->data, e->len);
+            len = e->len;
+        }
+    }
+    if (len < 0) {
+        p->misses++;
+    } else {
+        p->hits++;
+    }
+    pthread_mutex_unlock(&p->lock);
+    return len;
+}
+
+void cache_put(const char *key, uint32_t hash, const char *data, int len) {
+    if (part_budget == 0) {
+        return;
+    }
+    struct cache_part *p = part_of(hash);
+    int klen = strlen(key) + 1;
+    struct cache_entry *e = malloc(sizeof(*e) + klen + len);
+    if (e == NULL) {
+        cache_remove(key, hash);
+        return;
+    }
+    e->hash = hash;
+    e->len = len;
+    e->ref = 0;
+    memcpy(e->key, key, klen);
+    e->data = e->key + klen;
+    memcpy(e->data, data, len);
+
+    pthread_mutex_lock(&p->lock);
+    if (p->buckets == NULL || p->count > p->mask) {
+        grow(p);
+    }
+    if (p->buckets == NULL || entry_size(e) > part_budget / 8) {
+        /* too big to be worth caching; still drop any stale copy */
+        if (p->buckets && *find_slot(p, key, hash)) {
+            unlink_entry(p, find_slot(p, key, hash));
+        }
+        pthread_mutex_unlock(&p->lock);
+        free(e);
+        return;
+    }
+    struct cache_entry **pp = find_slot(p, key, hash);
+    if (*pp) {
+        unlink_entry(p, pp);
+        pp = find_slot(p, key, hash);
+    }
+    e->hnext = NULL;
+    *pp = e;
+    if (p->hand == NULL) {
+        e->prev = e->next = e;
+        p->hand = e;
+    } else {
+        /* insert just behind the hand so it is the last to be swept */
+        e->next = p->hand;
+        e->prev = p->hand->prev;
+        e->prev->next = e;
+        p->hand->prev = e;
+    }
+    p->count++;
+    p->bytes += entry_size(e);
+    evict(p);
+    pthread_mutex_unlock(&p->lock);
+}
+
+void cache_remove(const char *key, uint32_t hash) {
+    if (part_budget == 0) {
+        return;
+    }
+    struct cache_part *p = part_of(hash);
+    pthread_mutex_lock(&p->lock);
+    if (p->buckets) {
+        struct cache_entry **pp = find_slot(p, key, hash);
+        if (*pp) {
+            unlink_entry(p, pp);
+        }
+    }
+    pthread_mutex_unlock(&p->lock);
+}
+
+void cache_get_stats(struct cache_stats *st) {
+    memset(st, 0, sizeof(*st));
+    st->budget = part_budget * CACHE_PARTS;
+    for (int i = 0; i < CACHE_PARTS; i++) {
+        pthread_mutex_lock(&parts[i].lock);
+        st->hits += parts[i].hits;
+        st->misses += parts[i].misses;
+        st->evictions += parts[i].evictions;
+        st->bytes += parts[i].bytes;
+        pthread_mutex_unlock(&parts[i].lock);
+    }
+}
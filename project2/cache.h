@@ -0,0 +1,20 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdint.h>
+
+struct cache_stats {
+    long hits;
+    long misses;
+    long evictions;
+    long bytes;
+    long budget;
+};
+
+void cache_init(long budget);
+int cache_get(const char *key, uint32_t hash, char *buf, int max);
+void cache_put(const char *key, uint32_t hash, const char *data, int len);
+void cache_remove(const char *key, uint32_t hash);
+void cache_get_stats(struct cache_stats *st);
+
+#endif
@@ -1,120 +1,1921 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <zlib.h>
 #include "database.h"
+#include "cache.h"
+#include "logstore.h"
+#include "lsmstore.h"
+#include "wal.h"
 
 #define INVALID 0
 #define BUSY 1
 #define VALID 2
 
-struct db_record db_table[MAX_KEYS];
+/* the table is split into segments by the top bits of the key hash.
+ * each segment is a complete table of its own - index, records, key
+ * arena, free list - behind its own reader/writer lock, so lookups of
+ * keys in different segments share nothing and reads of keys in the
+ * same segment only share a read lock. a write or delete holds its
+ * segment's write lock across the file operation, which makes writes
+ * and deletes of the same key linearizable.
+ *
+ * a record is named by segment and local index: id = local << SEG_BITS
+ * | segment, which is also the number of its data file, DIR/data.<id>.
+ */
+#define SEG_BITS 6
+#define NSEGMENTS (1 << SEG_BITS)
+
+/* records live in fixed-size chunks so a segment grows without ever
+ * moving existing entries; key bytes are packed into a separate arena
+ * and a record only keeps a 32-bit reference to them.
+ */
+#define RECORD_CHUNK_SHIFT 10
+#define RECORD_CHUNK (1 << RECORD_CHUNK_SHIFT)
+#define MAX_RECORD_CHUNKS (1 << 14)
+
+#define ARENA_BLOCK_SHIFT 14
+#define ARENA_BLOCK (1 << ARENA_BLOCK_SHIFT)
+#define MAX_ARENA_BLOCKS (1 << 14)
+
+/* open-addressing (linear probing) index on the key. entries hold
+ * slot+1 so a zeroed table starts out empty; the hash is kept next to
+ * it so most mismatches are rejected without touching the key.
+ *
+ * when the index fills up it is not rehashed in one go: a table twice
+ * the size becomes current and every insert or delete moves a few
+ * buckets over from the old one. lookups check both until the old
+ * table is drained. buckets already moved (or deleted while still in
+ * the old table) are marked INDEX_MOVED so probe runs stay intact.
+ */
+#define INDEX_INITIAL 64
+#define INDEX_MOVED -1
+#define MIGRATE_STEP 64
+
+struct index_entry {
+    uint32_t hash;
+    int slot;                   /* local record index + 1, 0 = empty */
+};
+
+struct key_index {
+    struct index_entry *entries;
+    uint32_t mask;
+    int count;
+};
+
+struct segment {
+    pthread_rwlock_t lock;
+    struct key_index cur_index;
+    struct key_index old_index;
+    uint32_t migrate_pos;
+    int live_objects;
+    int next_unused;
+    int *free_slots;
+    int n_free;
+    int max_free;
+    int n_record_chunks;
+    int n_arena_blocks;
+    int arena_used;             /* in the newest block */
+    long arena_dead;
+    int index_log_fd;           /* file engine: changes since the checkpoint */
+    long index_log_bytes;
+    struct db_record *record_chunks[MAX_RECORD_CHUNKS];
+    char *arena_blocks[MAX_ARENA_BLOCKS];
+} __attribute__((aligned(64)));
+
+static struct segment segments[NSEGMENTS] = {
+    [0 ... NSEGMENTS - 1] = {
+        .lock = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP,
+        .arena_used = ARENA_BLOCK,
+    }
+};
+
+static int engine = DB_ENGINE_FILES;
+
+/* every engine's files go under here (db_directory) */
+static char db_dir[DB_DIR_MAX] = "/tmp";
+
+/* with a WAL (db_durable), every change is logged while its segment is
+ * still locked, so the log has each key's changes in the order they were
+ * made, and the call returns only once wal_commit() says it is on disk.
+ * the log engine's own appends are its log records. once the WAL has
+ * failed no more changes are made (wal_refused)
+ */
+static int durable = 0;
+static int wal_window_us;
+static int wal_batch_max;
+
+/* db_replicate(): told of every change, in the same places */
+static db_change_fn change_fn;
 
 int db_write(char *name, char *data, int len);
 int db_read(char *name, char *buf);
 int db_delete(char *name);
 int find_key(char *key);
-int free_index();
+int new_record(char *name);
 int count_valid_objects();
 void db_cleanup(void);
 
-int find_key(char *key) {
-    for (int i=0; i<MAX_KEYS; i++) {
-        if (db_table[i].status == VALID) {
-            if (strcmp(db_table[i].record_name,key) == 0) {
-                return i;
-            }
+static inline struct db_record *record(struct segment *sg, int index) {
+    return &sg->record_chunks[index >> RECORD_CHUNK_SHIFT][index & (RECORD_CHUNK - 1)];
+}
+
+static inline char *record_key(struct segment *sg, struct db_record *r) {
+    return sg->arena_blocks[r->key_ref >> ARENA_BLOCK_SHIFT] + (r->key_ref & (ARENA_BLOCK - 1));
+}
+
+static inline int record_id(struct segment *sg, int index) {
+    return (index << SEG_BITS) | (int)(sg - segments);
+}
+
+static void data_path(char *buf, int id, const char *suffix) {
+    sprintf(buf, "%s/data.%d%s", db_dir, id, suffix);
+}
+
+static uint32_t key_hash(const char *key) {
+    uint32_t h = 2166136261u;
+    while (*key) {
+        h ^= (unsigned char)*key++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static inline struct segment *segment_of(uint32_t hash) {
+    return &segments[hash >> (32 - SEG_BITS)];
+}
+
+/* copy key into the arena, reusing the record's old space if it fits
+ */
+static int store_key(struct segment *sg, struct db_record *r, const char *key) {
+    int len = strlen(key) + 1;
+    if (r->key_cap >= len) {
+        memcpy(record_key(sg, r), key, len);
+        return 0;
+    }
+    if (sg->arena_used + len > ARENA_BLOCK) {
+        if (sg->n_arena_blocks == MAX_ARENA_BLOCKS ||
+            (sg->arena_blocks[sg->n_arena_blocks] = malloc(ARENA_BLOCK)) == NULL) {
+            return -1;
         }
+        sg->arena_dead += ARENA_BLOCK - sg->arena_used;
+        sg->n_arena_blocks++;
+        sg->arena_used = 0;
     }
-    return -1;
+    sg->arena_dead += r->key_cap;
+    r->key_ref = ((uint32_t)(sg->n_arena_blocks - 1) << ARENA_BLOCK_SHIFT) | sg->arena_used;
+    r->key_cap = len;
+    memcpy(record_key(sg, r), key, len);
+    sg->arena_used += len;
+    return 0;
 }
 
-int free_index() {
-    for (int i=0; i<MAX_KEYS; i++) {
-        if (db_table[i].status == INVALID) {
+static int index_init(struct key_index *ix, uint32_t size) {
+    ix->entries = calloc(size, sizeof(struct index_entry));
+    if (ix->entries == NULL) {
+        return -1;
+    }
+    ix->mask = size - 1;
+    ix->count = 0;
+    return 0;
+}
+
+static int index_lookup(struct segment *sg, struct key_index *ix, const char *key, uint32_t hash) {
+    if (ix->entries == NULL) {
+        return -1;
+    }
+    for (uint32_t i = hash & ix->mask; ix->entries[i].slot != 0; i = (i + 1) & ix->mask) {
+        if (ix->entries[i].slot > 0 && ix->entries[i].hash == hash &&
+            strcmp(record_key(sg, record(sg, ix->entries[i].slot - 1)), key) == 0) {
             return i;
-        } 
+        }
     }
     return -1;
 }
 
-int db_write(char *name, char *data, int len) {
-    int index = find_key(name);
+static void index_insert(struct key_index *ix, uint32_t hash, int slot) {
+    uint32_t i = hash & ix->mask;
+    while (ix->entries[i].slot != 0) {
+        i = (i + 1) & ix->mask;
+    }
+    ix->entries[i].hash = hash;
+    ix->entries[i].slot = slot + 1;
+    ix->count++;
+}
+
+/* backward-shift deletion: pull later members of the probe run into the
+ * hole so the current table never needs tombstones
+ */
+static void index_remove(struct key_index *ix, uint32_t pos) {
+    uint32_t i = pos;
+    uint32_t j = pos;
+    while (1) {
+        j = (j + 1) & ix->mask;
+        if (ix->entries[j].slot == 0) {
+            break;
+        }
+        uint32_t home = ix->entries[j].hash & ix->mask;
+        if ((j > i && (home <= i || home > j)) || (j < i && home <= i && home > j)) {
+            ix->entries[i] = ix->entries[j];
+            i = j;
+        }
+    }
+    ix->entries[i].slot = 0;
+    ix->count--;
+}
+
+static void migrate_buckets(struct segment *sg, int n) {
+    struct key_index *old = &sg->old_index;
+    if (old->entries == NULL) {
+        return;
+    }
+    for (; n > 0 && sg->migrate_pos <= old->mask; n--, sg->migrate_pos++) {
+        struct index_entry *e = &old->entries[sg->migrate_pos];
+        if (e->slot > 0) {
+            index_insert(&sg->cur_index, e->hash, e->slot - 1);
+            e->slot = INDEX_MOVED;
+            old->count--;
+        }
+    }
+    if (sg->migrate_pos > old->mask) {
+        free(old->entries);
+        old->entries = NULL;
+        old->count = 0;
+    }
+}
+
+/* called before every index insert; keeps the load factor under 1/2
+ */
+static int index_reserve(struct segment *sg) {
+    if (sg->cur_index.entries == NULL) {
+        return index_init(&sg->cur_index, INDEX_INITIAL);
+    }
+    migrate_buckets(sg, MIGRATE_STEP);
+    if ((sg->cur_index.count + 1) * 2 <= sg->cur_index.mask + 1) {
+        return 0;
+    }
+    /* only one resize in flight: finish the previous one first */
+    migrate_buckets(sg, sg->old_index.mask + 1);
+    struct key_index bigger;
+    if (index_init(&bigger, (sg->cur_index.mask + 1) * 2) < 0) {
+        return -1;
+    }
+    sg->old_index = sg->cur_index;
+    sg->cur_index = bigger;
+    sg->migrate_pos = 0;
+    migrate_buckets(sg, MIGRATE_STEP);
+    return 0;
+}
+
+static int segment_find(struct segment *sg, const char *key, uint32_t hash) {
+    int pos = index_lookup(sg, &sg->cur_index, key, hash);
+    if (pos != -1) {
+        return sg->cur_index.entries[pos].slot - 1;
+    }
+    pos = index_lookup(sg, &sg->old_index, key, hash);
+    return pos == -1 ? -1 : sg->old_index.entries[pos].slot - 1;
+}
+
+static int free_index(struct segment *sg) {
+    if (sg->n_free > 0) {
+        return sg->free_slots[--sg->n_free];
+    }
+    if ((sg->next_unused >> RECORD_CHUNK_SHIFT) == sg->n_record_chunks) {
+        if (sg->n_record_chunks == MAX_RECORD_CHUNKS) {
+            return -1;
+        }
+        struct db_record *chunk = calloc(RECORD_CHUNK, sizeof(struct db_record));
+        if (chunk == NULL) {
+            return -1;
+        }
+        sg->record_chunks[sg->n_record_chunks++] = chunk;
+    }
+    return sg->next_unused++;
+}
+
+static void release_slot(struct segment *sg, int index) {
+    if (sg->n_free == sg->max_free) {
+        int n = sg->max_free ? sg->max_free * 2 : 64;
+        int *p = realloc(sg->free_slots, n * sizeof(int));
+        if (p == NULL) {
+            return;             /* slot leaks; the record stays unusable */
+        }
+        sg->free_slots = p;
+        sg->max_free = n;
+    }
+    sg->free_slots[sg->n_free++] = index;
+}
+
+/* claim a free slot for name and add it to the index. the record starts
+ * out BUSY; it only counts as an object once its data is written.
+ * caller holds the segment write lock.
+ */
+static int segment_insert(struct segment *sg, const char *name, uint32_t hash) {
+    if (index_reserve(sg) < 0) {
+        return -1;
+    }
+    int index = free_index(sg);
     if (index == -1) {
-        index = free_index();
-        if (index == -1) {
+        return -1;
+    }
+    struct db_record *r = record(sg, index);
+    if (store_key(sg, r, name) < 0) {
+        release_slot(sg, index);
+        return -1;
+    }
+    r->status = BUSY;
+    index_insert(&sg->cur_index, hash, index);
+    return index;
+}
+
+/* take a record out of the index; its slot is not freed */
+static void unindex_record(struct segment *sg, int index) {
+    struct db_record *r = record(sg, index);
+    char *key = record_key(sg, r);
+    uint32_t hash = key_hash(key);
+    int pos;
+    if ((pos = index_lookup(sg, &sg->cur_index, key, hash)) != -1) {
+        index_remove(&sg->cur_index, pos);
+    } else if ((pos = index_lookup(sg, &sg->old_index, key, hash)) != -1) {
+        sg->old_index.entries[pos].slot = INDEX_MOVED;
+        sg->old_index.count--;
+    }
+    migrate_buckets(sg, MIGRATE_STEP);
+    if (r->status == VALID) {
+        sg->live_objects--;
+    }
+    r->status = INVALID;
+}
+
+static void drop_record(struct segment *sg, int index) {
+    unindex_record(sg, index);
+    release_slot(sg, index);
+}
+
+/* which of parts a key belongs to. each part gets a contiguous run of
+ * segments, as even as they divide (NSEGMENTS / parts, rounded down or
+ * up), so parts split the table along segment lines. with more parts
+ * than segments each gets an even slice of the hash range instead
+ */
+int db_partition(char *name, int parts) {
+    uint32_t hash = key_hash(name);
+    if (parts > NSEGMENTS) {
+        return ((uint64_t)hash * parts) >> 32;
+    }
+    return (hash >> (32 - SEG_BITS)) * parts >> SEG_BITS;
+}
+
+/* record id of key, or -1
+ */
+int find_key(char *key) {
+    uint32_t hash = key_hash(key);
+    struct segment *sg = segment_of(hash);
+    pthread_rwlock_rdlock(&sg->lock);
+    int index = segment_find(sg, key, hash);
+    int id = index == -1 ? -1 : record_id(sg, index);
+    pthread_rwlock_unlock(&sg->lock);
+    return id;
+}
+
+/* add name to the index without storing any data, returning its record
+ * id; used by the benchmarks to populate large tables quickly
+ */
+int new_record(char *name) {
+    uint32_t hash = key_hash(name);
+    struct segment *sg = segment_of(hash);
+    pthread_rwlock_wrlock(&sg->lock);
+    int index = segment_insert(sg, name, hash);
+    int id = index == -1 ? -1 : record_id(sg, index);
+    pthread_rwlock_unlock(&sg->lock);
+    return id;
+}
+
+/* the file engine's index survives restarts (see db_open): each segment
+ * has a checkpoint, dbindex/NN.ckpt, listing its live records (slot,
+ * length, key) and a log, NN.log, of every change since, appended under
+ * the segment's write lock. once the log passes INDEX_LOG_MAX the writer
+ * that noticed rewrites the checkpoint and empties the log; db_cleanup
+ * does it for every segment. replaying a log on top of a newer
+ * checkpoint (a crash between the two steps) is harmless, since it ends
+ * in the same state.
+ *
+ * startup maps each checkpoint and reads it front to back, putting each
+ * key back in the slot it had so it keeps its data file, then
+ * replays the log. segments are independent, so they load in parallel.
+ */
+#define INDEX_DIR "dbindex"         /* under db_dir */
+#define INDEX_MAGIC 0x78646264      /* "dbdx" */
+#define INDEX_LOG_MAX (1 << 20)
+
+struct checkpoint_header {
+    uint32_t magic;
+    uint32_t count;
+    uint32_t next_unused;
+    uint32_t crc;               /* of count, next_unused and the entries */
+};
+
+struct checkpoint_entry {
+    uint32_t index;
+    uint32_t len;
+    uint16_t klen;              /* key bytes follow */
+} __attribute__((packed));
+
+struct index_log_rec {
+    uint32_t crc;               /* of the rest and the key */
+    uint32_t index;
+    uint32_t len;
+    uint16_t klen;              /* key bytes follow */
+    uint8_t op;                 /* W or D */
+    uint8_t pad;
+};
+
+static int persist_index = 0;
+
+static void index_path(char *buf, int seg, const char *ext) {
+    sprintf(buf, "%s/%s/%02d.%s", db_dir, INDEX_DIR, seg, ext);
+}
+
+static uint32_t index_log_crc(struct index_log_rec *rec, const char *key) {
+    uint32_t crc = crc32(0, (unsigned char *)&rec->index, sizeof(*rec) - sizeof(rec->crc));
+    return crc32(crc, (unsigned char *)key, rec->klen);
+}
+
+static uint32_t checkpoint_crc(struct checkpoint_header *h, const char *entries, long len) {
+    uint32_t crc = crc32(0, (unsigned char *)&h->count, sizeof(h->count) + sizeof(h->next_unused));
+    return crc32(crc, (unsigned char *)entries, len);
+}
+
+/* write the segment's live records to its checkpoint and empty its log.
+ * caller holds the write lock (or is alone)
+ */
+static int checkpoint_segment(struct segment *sg) {
+    int seg = sg - segments;
+    long size = sizeof(struct checkpoint_header);
+    struct checkpoint_header h = {.magic = INDEX_MAGIC, .next_unused = sg->next_unused};
+    for (int i = 0; i < sg->next_unused; i++) {
+        struct db_record *r = record(sg, i);
+        if (r->status == VALID) {
+            size += sizeof(struct checkpoint_entry) + strlen(record_key(sg, r));
+            h.count++;
+        }
+    }
+    char *buf = malloc(size);
+    if (buf == NULL) {
+        return -1;
+    }
+    char *p = buf + sizeof(h);
+    for (int i = 0; i < sg->next_unused; i++) {
+        struct db_record *r = record(sg, i);
+        if (r->status == VALID) {
+            char *key = record_key(sg, r);
+            struct checkpoint_entry e = {.index = i, .len = r->len, .klen = strlen(key)};
+            memcpy(p, &e, sizeof(e));
+            memcpy(p + sizeof(e), key, e.klen);
+            p += sizeof(e) + e.klen;
+        }
+    }
+    h.crc = checkpoint_crc(&h, buf + sizeof(h), size - sizeof(h));
+    memcpy(buf, &h, sizeof(h));
+
+    char path[DB_PATH_MAX], tmp[DB_PATH_MAX + 8];
+    index_path(path, seg, "ckpt");
+    sprintf(tmp, "%s.tmp", path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    int ok = fd >= 0 && write(fd, buf, size) == size && fdatasync(fd) == 0;
+    if (fd >= 0) {
+        close(fd);
+    }
+    free(buf);
+    if (!ok || rename(tmp, path) < 0) {
+        perror(path);
+        unlink(tmp);
+        return -1;
+    }
+    /* the new checkpoint's name must last before the log is emptied; if
+     * it can't, keep the log, which replays on top of either checkpoint */
+    char dir[DB_PATH_MAX];
+    sprintf(dir, "%s/%s", db_dir, INDEX_DIR);
+    int dir_fd = open(dir, O_RDONLY | O_CLOEXEC);
+    ok = dir_fd >= 0 && fsync(dir_fd) == 0;
+    if (dir_fd >= 0) {
+        close(dir_fd);
+    }
+    if (!ok) {
+        perror(dir);
+        return -1;
+    }
+    if (ftruncate(sg->index_log_fd, 0) < 0) {
+        perror("index log");
+    }
+    sg->index_log_bytes = 0;
+    return 0;
+}
+
+/* log a change to a file engine record; op W after its value is in
+ * place, D before the value is removed. caller holds the write lock
+ */
+static void index_log(struct segment *sg, char op, int index) {
+    if (!persist_index) {
+        return;
+    }
+    struct db_record *r = record(sg, index);
+    char *key = record_key(sg, r);
+    struct index_log_rec rec = {.index = index, .len = r->len, .klen = strlen(key), .op = op};
+    rec.crc = index_log_crc(&rec, key);
+    struct iovec iov[2] = {{&rec, sizeof(rec)}, {key, rec.klen}};
+    if (writev(sg->index_log_fd, iov, 2) != sizeof(rec) + rec.klen) {
+        perror("index log");
+        return;
+    }
+    sg->index_log_bytes += sizeof(rec) + rec.klen;
+    if (sg->index_log_bytes > INDEX_LOG_MAX) {
+        checkpoint_segment(sg);
+    }
+}
+
+/* make sure slots below n exist */
+static int reserve_slots(struct segment *sg, int n) {
+    while (sg->n_record_chunks << RECORD_CHUNK_SHIFT < n) {
+        if (sg->n_record_chunks == MAX_RECORD_CHUNKS ||
+            (sg->record_chunks[sg->n_record_chunks] = calloc(RECORD_CHUNK, sizeof(struct db_record))) == NULL) {
+            return -1;
+        }
+        sg->n_record_chunks++;
+    }
+    if (sg->next_unused < n) {
+        sg->next_unused = n;
+    }
+    return 0;
+}
+
+/* at startup: key is stored in slot index with a value of len bytes,
+ * whatever the slot or the key held before
+ */
+static int place_record(struct segment *sg, const char *key, int index, uint32_t len) {
+    uint32_t hash = key_hash(key);
+    if (reserve_slots(sg, index + 1) < 0) {
+        return -1;
+    }
+    int old = segment_find(sg, key, hash);
+    struct db_record *r = record(sg, index);
+    if (old != index) {
+        if (old != -1) {
+            unindex_record(sg, old);
+        }
+        if (r->status == VALID) {
+            unindex_record(sg, index);
+        }
+        if (index_reserve(sg) < 0 || store_key(sg, r, key) < 0) {
             return -1;
         }
+        index_insert(&sg->cur_index, hash, index);
+    }
+    if (r->status != VALID) {
+        r->status = VALID;
+        sg->live_objects++;
+    }
+    r->len = len;
+    return 0;
+}
+
+static int load_checkpoint(struct segment *sg, int seg) {
+    char path[DB_PATH_MAX];
+    index_path(path, seg, "ckpt");
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    struct stat st;
+    char *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size >= sizeof(struct checkpoint_header)) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "%s: can't map\n", path);
+        return -1;
+    }
+    struct checkpoint_header h;
+    memcpy(&h, map, sizeof(h));
+    if (h.magic != INDEX_MAGIC || checkpoint_crc(&h, map + sizeof(h), st.st_size - sizeof(h)) != h.crc) {
+        fprintf(stderr, "%s: bad checkpoint\n", path);
+        munmap(map, st.st_size);
+        return -1;
+    }
+    /* size the index for the whole segment up front so it never grows
+     * during the load */
+    uint32_t size = INDEX_INITIAL;
+    while (size < 2 * (h.count + 1)) {
+        size *= 2;
+    }
+    int status = index_init(&sg->cur_index, size) < 0 || reserve_slots(sg, h.next_unused) < 0 ? -1 : 0;
+    char *p = map + sizeof(h), *end = map + st.st_size;
+    uint32_t i;
+    for (i = 0; status == 0 && i < h.count; i++) {
+        struct checkpoint_entry e;
+        if (end - p < (long)sizeof(e)) {
+            break;
+        }
+        memcpy(&e, p, sizeof(e));
+        if (end - p - (long)sizeof(e) < e.klen || e.index >= h.next_unused) {
+            break;
+        }
+        char key[e.klen + 1];
+        memcpy(key, p + sizeof(e), e.klen);
+        key[e.klen] = 0;
+        p += sizeof(e) + e.klen;
+        status = place_record(sg, key, e.index, e.len);
+    }
+    if (status == 0 && i < h.count) {
+        fprintf(stderr, "%s: bad checkpoint\n", path);
+        status = -1;
+    }
+    munmap(map, st.st_size);
+    return status;
+}
+
+/* replay the log and leave it open for appending; anything after its
+ * last intact record is cut off
+ */
+static int load_index_log(struct segment *sg, int seg) {
+    char path[DB_PATH_MAX];
+    index_path(path, seg, "log");
+    int fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(path);
+        return -1;
+    }
+    long off = 0;
+    char *map = st.st_size > 0 ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0) : NULL;
+    if (map == MAP_FAILED) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+    while (off + sizeof(struct index_log_rec) <= st.st_size) {
+        struct index_log_rec rec;
+        memcpy(&rec, map + off, sizeof(rec));
+        char key[rec.klen + 1];
+        if (off + sizeof(rec) + rec.klen > st.st_size) {
+            break;
+        }
+        memcpy(key, map + off + sizeof(rec), rec.klen);
+        key[rec.klen] = 0;
+        if (index_log_crc(&rec, key) != rec.crc) {
+            break;
+        }
+        if (rec.op == 'W') {
+            place_record(sg, key, rec.index, rec.len);
+        } else {
+            int index = segment_find(sg, key, key_hash(key));
+            if (index != -1) {
+                unindex_record(sg, index);
+            }
+        }
+        off += sizeof(rec) + rec.klen;
+    }
+    if (map) {
+        munmap(map, st.st_size);
+    }
+    if (off < st.st_size) {
+        fprintf(stderr, "%s: truncated to last intact record at %ld\n", path, off);
+        ftruncate(fd, off);
+    }
+    sg->index_log_fd = fd;
+    sg->index_log_bytes = off;
+    return 0;
+}
+
+/* load one segment's index and free every slot nothing came back to */
+static int load_segment(int seg) {
+    struct segment *sg = &segments[seg];
+    int status = load_checkpoint(sg, seg);
+    if (load_index_log(sg, seg) < 0) {
+        return -1;
+    }
+    for (int i = sg->next_unused - 1; i >= 0; i--) {
+        if (record(sg, i)->status != VALID) {
+            release_slot(sg, i);
+        }
+    }
+    return status;
+}
+
+struct load_job {
+    int first;
+    int step;
+    int status;
+};
+
+static void *load_thread(void *arg) {
+    struct load_job *job = arg;
+    for (int seg = job->first; seg < NSEGMENTS; seg += job->step) {
+        if (load_segment(seg) < 0) {
+            job->status = -1;
+        }
+    }
+    return NULL;
+}
+
+static int index_open(void) {
+    char dir[DB_PATH_MAX];
+    sprintf(dir, "%s/%s", db_dir, INDEX_DIR);
+    if (mkdir(dir, 0777) < 0 && errno != EEXIST) {
+        perror(dir);
+        return -1;
+    }
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    n = n < 1 ? 1 : n > NSEGMENTS ? NSEGMENTS : n;
+    struct load_job jobs[n];
+    pthread_t tids[n];
+    int started[n], status = 0;
+    for (int i = 0; i < n; i++) {
+        jobs[i] = (struct load_job){.first = i, .step = n};
+        started[i] = pthread_create(&tids[i], NULL, load_thread, &jobs[i]) == 0;
+        if (!started[i]) {
+            load_thread(&jobs[i]);
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        if (started[i]) {
+            pthread_join(tids[i], NULL);
+        }
+        status |= jobs[i].status;
+    }
+    /* a segment that didn't load would be checkpointed without the keys
+     * it lost, so don't open at all */
+    if (status < 0) {
+        fprintf(stderr, "%s: index not fully loaded\n", dir);
+        return -1;
+    }
+    persist_index = 1;
+    return 0;
+}
+
+/* checkpoint every segment; with nothing else running */
+static void index_checkpoint(void) {
+    for (int i = 0; i < NSEGMENTS; i++) {
+        checkpoint_segment(&segments[i]);
     }
-    db_table[index].status = BUSY;
-    char filename[32];
-    sprintf(filename,"/tmp/data.%d",index);
-    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0777); 
+}
+
+static inline struct log_loc record_loc(struct db_record *r) {
+    return (struct log_loc){.file = r->file, .offset = r->offset, .len = r->len};
+}
+
+/* the file engine writes a new file and renames it over the old one, so
+ * a reader that already has the old file open keeps sending the old
+ * value whole
+ */
+static int stage_file(int id, char *data, int len) {
+    char tmpname[DB_PATH_MAX];
+    data_path(tmpname, id, ".tmp");
+    int fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0777);
     if (fd < 0)  {
-        db_table[index].status = INVALID;
         perror("file opening error");
         return -1;
     }
-    int write_done = write(fd, data, len); 
+    int write_done = write(fd, data, len);
     close(fd);
-    if(write_done != len) {
-        db_table[index].status = INVALID;
+    if (write_done != len) {
+        unlink(tmpname);
         perror("write failed: invalid length");
         return -1;
     }
-    strncpy(db_table[index].record_name, name, sizeof(db_table[index].record_name));
-    db_table[index].status = VALID;
     return 0;
 }
 
-int db_read(char *name, char *buf) {
-    int index = find_key(name);
-    if (index == -1) {
-        perror("no such record");
+static int commit_file(int id) {
+    char filename[DB_PATH_MAX], tmpname[DB_PATH_MAX];
+    data_path(filename, id, "");
+    data_path(tmpname, id, ".tmp");
+    if (rename(tmpname, filename) < 0) {
+        unlink(tmpname);
+        perror("rename");
+        return -1;
+    }
+    return 0;
+}
+
+/* the storage half of each operation, per engine. caller holds the
+ * segment lock: write lock for store and remove, read lock for load.
+ */
+static int store_value(struct segment *sg, int index, const char *name, char *data, int len) {
+    struct db_record *r = record(sg, index);
+    if (engine == DB_ENGINE_LOG) {
+        struct log_loc loc;
+        if (log_append(name, data, len, 0, &loc) < 0) {
+            return -1;
+        }
+        if (r->status == VALID) {
+            struct log_loc old = record_loc(r);
+            log_release(name, &old);
+        }
+        r->file = loc.file;
+        r->offset = loc.offset;
+        r->len = len;
+        return 0;
+    }
+    int id = record_id(sg, index);
+    if (stage_file(id, data, len) < 0 || commit_file(id) < 0) {
+        return -1;
+    }
+    r->len = len;
+    return 0;
+}
+
+/* open the value for sending instead of reading it */
+static int open_value(struct segment *sg, int index, struct db_value *v) {
+    struct db_record *r = record(sg, index);
+    if (engine == DB_ENGINE_LOG) {
+        struct log_loc loc = record_loc(r);
+        v->fd = log_open_value(&loc);
+        v->offset = loc.offset;
+    } else {
+        char filename[DB_PATH_MAX];
+        data_path(filename, record_id(sg, index), "");
+        v->fd = open(filename, O_RDONLY | O_CLOEXEC);
+        v->offset = 0;
+    }
+    if (v->fd < 0) {
+        perror("file opening error");
         return -1;
     }
-    char filename[32];
-    sprintf(filename,"/tmp/data.%d",index);
-    int fd = open(filename, O_RDONLY); 
+    v->len = r->len;
+    return v->len;
+}
+
+static int load_value(struct segment *sg, int index, char *buf) {
+    struct db_record *r = record(sg, index);
+    if (engine == DB_ENGINE_LOG) {
+        struct log_loc loc = record_loc(r);
+        return log_read(&loc, buf, DB_INLINE_MAX);
+    }
+    char filename[DB_PATH_MAX];
+    data_path(filename, record_id(sg, index), "");
+    int fd = open(filename, O_RDONLY);
     if (fd < 0) {
         perror("file opening error");
         return -1;
     }
-    int size = read(fd, buf, 4096); 
+    int size = read(fd, buf, DB_INLINE_MAX);
     close(fd);
     return size;
 }
 
-int db_delete(char *name) {
-    int index = find_key(name);
-    if (index == -1) {
-        perror("no such record");
-        return -1;
+static int remove_value(struct segment *sg, int index, const char *name) {
+    struct db_record *r = record(sg, index);
+    if (engine == DB_ENGINE_LOG) {
+        struct log_loc loc = record_loc(r), tomb;
+        if (log_append(name, NULL, 0, LOG_TOMBSTONE, &tomb) < 0) {
+            return -1;
+        }
+        log_release(name, &loc);
+        return 0;
     }
-    if (db_table[index].status == BUSY) {
-        return -1;
+    char filename[DB_PATH_MAX];
+    data_path(filename, record_id(sg, index), "");
+    return unlink(filename);
+}
+
+/* the LSM engine keeps its own index on disk; the segment locks are
+ * only used to serialize operations on the same key. a value too big
+ * to keep in the tree goes to a blob, as db_write_end does it
+ */
+static int lsm_write(char *name, uint32_t hash, char *data, int len) {
+    int status;
+    if (len > DB_INLINE_MAX) {
+        struct db_stream s = {.fd = -1};
+        status = db_write_begin(&s, len) < 0 || db_write_chunk(&s, data, len) < 0 ? -1 :
+            lsm_put_blob(name, s.path, len);
+        if (s.fd >= 0) {
+            db_write_abort(&s);
+        }
+    } else {
+        status = lsm_put(name, data, len);
     }
-    char filename[32];
-    sprintf(filename, "/tmp/data.%d", index);
-    if (unlink(filename) == 0){
-        db_table[index].status = INVALID;
-        return 0;
+    if (status < 0 || len > DB_INLINE_MAX) {
+        cache_remove(name, hash);
+    } else {
+        cache_put(name, hash, data, len);
     }
-    return -1;
+    return status < 0 ? -1 : 0;
 }
 
-int count_valid_objects() {
-    int count = 0;
-    for (int i = 0; i < MAX_KEYS; i++) {
-        if (db_table[i].status == VALID) {
-            count++;
+static int lsm_read(char *name, uint32_t hash, char *buf) {
+    int size = cache_get(name, hash, buf, DB_INLINE_MAX);
+    if (size < 0) {
+        long len = lsm_read_value(name, buf, DB_INLINE_MAX, NULL);
+        if (len >= 0 && len <= DB_INLINE_MAX) {
+            cache_put(name, hash, buf, len);
         }
+        size = len < DB_INLINE_MAX ? len : DB_INLINE_MAX;
     }
-    return count;
+    return size;
 }
 
-void db_cleanup(void) {
-    system("rm -f /tmp/data.*");
-}
\ No newline at end of file
+static int lsm_remove(char *name, uint32_t hash) {
+    int status = lsm_delete(name);
+    cache_remove(name, hash);
+    return status;
+}
+
+/* write, read and delete with the segment already locked */
+static int write_value(struct segment *sg, char *name, uint32_t hash, char *data, int len) {
+    if (engine == DB_ENGINE_LSM) {
+        return lsm_write(name, hash, data, len);
+    }
+    int index = segment_find(sg, name, hash);
+    if (index == -1) {
+        index = segment_insert(sg, name, hash);
+        if (index == -1) {
+            return -1;
+        }
+    }
+    struct db_record *r = record(sg, index);
+    if (store_value(sg, index, name, data, len) < 0) {
+        /* a failed write leaves the old value in place */
+        if (r->status != VALID) {
+            drop_record(sg, index);
+        }
+        cache_remove(name, hash);
+        return -1;
+    }
+    if (r->status != VALID) {
+        r->status = VALID;
+        sg->live_objects++;
+    }
+    if (engine == DB_ENGINE_FILES) {
+        index_log(sg, 'W', index);
+    }
+    if (len <= DB_INLINE_MAX) {
+        cache_put(name, hash, data, len);
+    } else {
+        cache_remove(name, hash);
+    }
+    return 0;
+}
+
+/* as db_read_value; with load set, a value on disk that fits in
+ * DB_INLINE_MAX is read into buf (and cached) rather than opened
+ */
+static int read_value(struct segment *sg, char *name, uint32_t hash, char *buf, struct db_value *v,
+                      int load) {
+    v->fd = -1;
+    v->offset = 0;
+    if (engine == DB_ENGINE_LSM) {
+        int size = cache_get(name, hash, buf, DB_INLINE_MAX);
+        if (size < 0) {
+            long len = lsm_read_value(name, buf, DB_INLINE_MAX, &v->fd);
+            size = (v->fd >= 0 || len < DB_INLINE_MAX) ? len : DB_INLINE_MAX;
+        }
+        return v->len = size;
+    }
+    int index = segment_find(sg, name, hash);
+    if (index == -1 || record(sg, index)->status != VALID) {
+        return v->len = -1;
+    }
+    int size = cache_get(name, hash, buf, DB_INLINE_MAX);
+    if (size >= 0) {
+        v->len = size;
+    } else if (load && record(sg, index)->len <= DB_INLINE_MAX) {
+        size = v->len = load_value(sg, index, buf);
+        if (size >= 0 && size == record(sg, index)->len) {
+            cache_put(name, hash, buf, size);
+        }
+    } else {
+        size = open_value(sg, index, v);
+    }
+    return size;
+}
+
+static int delete_value(struct segment *sg, char *name, uint32_t hash) {
+    if (engine == DB_ENGINE_LSM) {
+        return lsm_remove(name, hash);
+    }
+    int index = segment_find(sg, name, hash);
+    if (index == -1 || record(sg, index)->status != VALID) {
+        return -1;
+    }
+    if (engine == DB_ENGINE_FILES) {
+        index_log(sg, 'D', index);
+    }
+    if (remove_value(sg, index, name) < 0) {
+        return -1;
+    }
+    drop_record(sg, index);
+    cache_remove(name, hash);
+    return 0;
+}
+
+/* log a change that was just made; caller holds its segment lock. the
+ * WAL comes first, so a change it failed to take is not sent to the
+ * replicas either
+ */
+static int journal(char op, char *name, char *data, int len) {
+    if (durable && engine != DB_ENGINE_LOG && wal_append(op, name, data, len) < 0) {
+        return -1;
+    }
+    if (change_fn) {
+        struct db_change c = {.op = op, .key = name, .data = data, .fd = -1, .len = len};
+        change_fn(&c, 1, 0);
+    }
+    return 0;
+}
+
+/* a failed append or sync can't undo the change it was for (a value file
+ * renamed over, a memtable entry replaced), so that write is answered X
+ * though it may be seen until a restart, and if only the sync failed it
+ * has also been replicated. after that no change is made at all, so X
+ * means not written
+ */
+static int wal_refused(void) {
+    return durable && wal_failed();
+}
+
+/* while the server runs the WAL is retired once it passes
+ * WAL_RETIRE_BYTES, by the writer that notices, after its own commit:
+ * appends carry on in a new file while everything the old one holds is
+ * put on disk elsewhere. a change is logged only after it is made (see
+ * journal), so once the old file is closed one syncfs covers the file
+ * engine's data files and index logs; the LSM engine's memtable is
+ * flushed to a table first. the index logs keep their own checkpoints
+ * (index_log), so a restart reads at most WAL_RETIRE_BYTES of WAL
+ */
+static pthread_mutex_t retire_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void wal_retire_running(void) {
+    if (pthread_mutex_trylock(&retire_lock) != 0) {
+        return;
+    }
+    if (wal_full() && wal_rotate() == 0) {
+        int fd = open(db_dir, O_RDONLY | O_CLOEXEC);
+        if ((engine == DB_ENGINE_LSM && lsm_flush() < 0) || fd < 0 || syncfs(fd) < 0) {
+            perror("wal retire");
+        } else {
+            wal_drop_old();
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    pthread_mutex_unlock(&retire_lock);
+}
+
+/* after unlocking: wait for the change to be on disk */
+static int commit(int status) {
+    if (!durable || status < 0) {
+        return status;
+    }
+    status = wal_commit();
+    if (engine != DB_ENGINE_LOG && wal_full()) {
+        wal_retire_running();
+    }
+    return status;
+}
+
+int db_write(char *name, char *data, int len) {
+    if (wal_refused()) {
+        return -1;
+    }
+    uint32_t hash = key_hash(name);
+    struct segment *sg = segment_of(hash);
+    pthread_rwlock_wrlock(&sg->lock);
+    int status = write_value(sg, name, hash, data, len);
+    if (status == 0) {
+        status = journal('W', name, data, len);
+    }
+    pthread_rwlock_unlock(&sg->lock);
+    return commit(status);
+}
+
+int db_read(char *name, char *buf) {
+    uint32_t hash = key_hash(name);
+    struct segment *sg = segment_of(hash);
+    pthread_rwlock_rdlock(&sg->lock);
+    if (engine == DB_ENGINE_LSM) {
+        int size = lsm_read(name, hash, buf);
+        pthread_rwlock_unlock(&sg->lock);
+        return size;
+    }
+    int index = segment_find(sg, name, hash);
+    if (index == -1 || record(sg, index)->status != VALID) {
+        pthread_rwlock_unlock(&sg->lock);
+        return -1;
+    }
+    int size = cache_get(name, hash, buf, DB_INLINE_MAX);
+    if (size < 0) {
+        size = load_value(sg, index, buf);
+        if (size >= 0 && size == record(sg, index)->len) {
+            cache_put(name, hash, buf, size);
+        }
+    }
+    pthread_rwlock_unlock(&sg->lock);
+    return size;
+}
+
+/* db_read for the server: a value that is only on disk is not read but
+ * opened, and v says what range of which descriptor to send (the caller
+ * closes it). values from the cache or the LSM engine are copied into
+ * buf with v->fd = -1. read misses don't fill the cache, since the value
+ * never passes through memory here; writes still do.
+ */
+int db_read_value(char *name, char *buf, struct db_value *v) {
+    uint32_t hash = key_hash(name);
+    struct segment *sg = segment_of(hash);
+    pthread_rwlock_rdlock(&sg->lock);
+    int size = read_value(sg, name, hash, buf, v, 0);
+    pthread_rwlock_unlock(&sg->lock);
+    return size;
+}
+
+static long stream_seq;
+
+int db_write_begin(struct db_stream *s, int len) {
+    if (len > DB_VALUE_MAX) {
+        fprintf(stderr, "value of %d bytes is too large\n", len);
+        return -1;
+    }
+    s->len = len;
+    s->written = 0;
+    s->crc = crc32(0, NULL, 0);
+    sprintf(s->path, "%s/data.stream.%d.%ld", db_dir, getpid(),
+            __atomic_fetch_add(&stream_seq, 1, __ATOMIC_RELAXED));
+    s->fd = open(s->path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0777);
+    if (s->fd < 0) {
+        perror(s->path);
+        return -1;
+    }
+    return 0;
+}
+
+int db_write_chunk(struct db_stream *s, char *data, int n) {
+    if (s->written + n > s->len) {
+        return -1;
+    }
+    for (int done = 0; done < n; ) {
+        int w = write(s->fd, data + done, n - done);
+        if (w < 0 && errno == EINTR) {
+            continue;
+        }
+        if (w <= 0) {
+            perror("write failed");
+            return -1;
+        }
+        done += w;
+    }
+    if (engine == DB_ENGINE_LOG || durable) {
+        s->crc = crc32(s->crc, (unsigned char *)data, n);
+    }
+    s->written += n;
+    return 0;
+}
+
+void db_write_abort(struct db_stream *s) {
+    close(s->fd);
+    unlink(s->path);
+}
+
+/* move the finished temp file to where the engine keeps the value */
+static int commit_stream(struct segment *sg, int index, const char *name, struct db_stream *s) {
+    struct db_record *r = record(sg, index);
+    if (engine == DB_ENGINE_LOG) {
+        struct log_loc loc;
+        if (log_append_file(name, s->fd, s->len, s->crc, &loc) < 0) {
+            return -1;
+        }
+        if (r->status == VALID) {
+            struct log_loc old = record_loc(r);
+            log_release(name, &old);
+        }
+        r->file = loc.file;
+        r->offset = loc.offset;
+    } else {
+        char filename[DB_PATH_MAX];
+        data_path(filename, record_id(sg, index), "");
+        if (rename(s->path, filename) < 0) {
+            perror("rename");
+            return -1;
+        }
+    }
+    r->len = s->len;
+    return 0;
+}
+
+int db_write_end(struct db_stream *s, char *name) {
+    if (s->written != s->len || wal_refused()) {
+        db_write_abort(s);
+        return -1;
+    }
+    uint32_t hash = key_hash(name);
+    struct segment *sg = segment_of(hash);
+    int status = -1;
+    pthread_rwlock_wrlock(&sg->lock);
+    cache_remove(name, hash);
+    if (engine == DB_ENGINE_LSM) {
+        status = lsm_put_blob(name, s->path, s->len) < 0 ? -1 : 0;
+    } else {
+        int index = segment_find(sg, name, hash);
+        if (index == -1) {
+            index = segment_insert(sg, name, hash);
+        }
+        if (index != -1) {
+            struct db_record *r = record(sg, index);
+            status = commit_stream(sg, index, name, s);
+            if (status == 0 && r->status != VALID) {
+                r->status = VALID;
+                sg->live_objects++;
+            } else if (status < 0 && r->status != VALID) {
+                drop_record(sg, index);
+            }
+            if (status == 0 && engine == DB_ENGINE_FILES) {
+                index_log(sg, 'W', index);
+            }
+        }
+    }
+    /* the temp file has been moved, but s->fd still reads it */
+    if (status == 0 && durable && engine != DB_ENGINE_LOG) {
+        status = wal_append_file(name, s->fd, s->len, s->crc);
+    }
+    if (status == 0 && change_fn) {
+        struct db_change c = {.op = 'W', .key = name, .fd = s->fd, .len = s->len};
+        change_fn(&c, 1, 0);
+    }
+    pthread_rwlock_unlock(&sg->lock);
+    db_write_abort(s);          /* whatever is left of the temp file */
+    return commit(status);
+}
+
+int db_delete(char *name) {
+    if (wal_refused()) {
+        return -1;
+    }
+    uint32_t hash = key_hash(name);
+    struct segment *sg = segment_of(hash);
+    pthread_rwlock_wrlock(&sg->lock);
+    int status = delete_value(sg, name, hash);
+    if (status == 0) {
+        status = journal('D', name, NULL, 0);
+    }
+    pthread_rwlock_unlock(&sg->lock);
+    return commit(status);
+}
+
+/* batches. all the segments a batch touches are locked at once, in
+ * segment order so two batches can't deadlock, and its keys are then
+ * handled in the order their values lie in storage: by record id (the
+ * file number) for the file engine, by file and offset for the log, by
+ * key for the LSM tree, whose tables are sorted by key. for the log
+ * engine the whole batch is one append.
+ */
+static uint64_t batch_lock(struct db_batch_op *ops, int n, int write) {
+    uint64_t mask = 0;
+    for (int i = 0; i < n; i++) {
+        ops[i].hash = key_hash(ops[i].name);
+        mask |= 1ULL << (ops[i].hash >> (32 - SEG_BITS));
+    }
+    for (int i = 0; i < NSEGMENTS; i++) {
+        if (mask & (1ULL << i)) {
+            if (write) {
+                pthread_rwlock_wrlock(&segments[i].lock);
+            } else {
+                pthread_rwlock_rdlock(&segments[i].lock);
+            }
+        }
+    }
+    return mask;
+}
+
+static void batch_unlock(uint64_t mask) {
+    for (int i = 0; i < NSEGMENTS; i++) {
+        if (mask & (1ULL << i)) {
+            pthread_rwlock_unlock(&segments[i].lock);
+        }
+    }
+}
+
+/* the same key twice sorts together, in batch order */
+static int compare_where(const void *a, const void *b) {
+    const struct db_batch_op *x = *(struct db_batch_op **)a, *y = *(struct db_batch_op **)b;
+    if (x->where != y->where) {
+        return x->where < y->where ? -1 : 1;
+    }
+    int c = strcmp(x->name, y->name);
+    return c ? c : (x > y) - (x < y);
+}
+
+/* the ops whose status is still 0, in storage order, looking each key
+ * up (and with insert, adding the ones that are new); returns how many.
+ * keys that aren't stored yet sort last
+ */
+static int batch_order(struct db_batch_op *ops, int n, int insert, struct db_batch_op **order) {
+    int m = 0;
+    for (int i = 0; i < n; i++) {
+        struct db_batch_op *op = &ops[i];
+        op->index = -1;
+        op->where = 0;
+        if (op->status < 0) {
+            continue;
+        }
+        if (engine != DB_ENGINE_LSM) {
+            struct segment *sg = segment_of(op->hash);
+            op->index = segment_find(sg, op->name, op->hash);
+            if (op->index == -1 && insert) {
+                op->index = segment_insert(sg, op->name, op->hash);
+            }
+            struct db_record *r = op->index == -1 ? NULL : record(sg, op->index);
+            if (r == NULL || r->status != VALID) {
+                op->where = UINT64_MAX;
+            } else if (engine == DB_ENGINE_LOG) {
+                op->where = (uint64_t)r->file << 32 | r->offset;
+            } else {
+                op->where = record_id(sg, op->index);
+            }
+        }
+        order[m++] = op;
+    }
+    qsort(order, m, sizeof(*order), compare_where);
+    return m;
+}
+
+/* an op the same key later in the batch overrides */
+static inline int superseded(struct db_batch_op **order, int m, int i) {
+    return i + 1 < m && strcmp(order[i]->name, order[i + 1]->name) == 0;
+}
+
+/* after an all-or-nothing write failed: forget the keys it added */
+static void batch_drop_new(struct db_batch_op **order, int m) {
+    for (int i = 0; i < m; i++) {
+        struct segment *sg = segment_of(order[i]->hash);
+        if (order[i]->index != -1 && record(sg, order[i]->index)->status != VALID) {
+            drop_record(sg, order[i]->index);
+        }
+        order[i]->status = -1;
+    }
+}
+
+/* a stored value becomes the key's current one */
+static void batch_install(struct db_batch_op *op, struct log_loc *loc) {
+    struct segment *sg = segment_of(op->hash);
+    struct db_record *r = record(sg, op->index);
+    if (loc) {
+        if (r->status == VALID) {
+            struct log_loc old = record_loc(r);
+            log_release(op->name, &old);
+        }
+        r->file = loc->file;
+        r->offset = loc->offset;
+    }
+    r->len = op->len;
+    if (r->status != VALID) {
+        r->status = VALID;
+        sg->live_objects++;
+    }
+    if (engine == DB_ENGINE_FILES) {
+        index_log(sg, 'W', op->index);
+    }
+    if (op->len <= DB_INLINE_MAX) {
+        cache_put(op->name, op->hash, op->data, op->len);
+    } else {
+        cache_remove(op->name, op->hash);
+    }
+}
+
+/* log engine: one append for every write or delete in the batch */
+static void log_batch(struct db_batch_op **order, int m, int del, int atomic) {
+    struct log_batch_rec *recs = malloc(m * sizeof(*recs));
+    struct db_batch_op **done = malloc(m * sizeof(*done));
+    int n = 0, ok = recs && done;
+    for (int i = 0; ok && i < m; i++) {
+        struct db_batch_op *op = order[i];
+        if (op->index == -1 && !del) {
+            op->status = -1;        /* out of memory for the key */
+            ok = !atomic;
+            continue;
+        }
+        if (del && (op->index == -1 || record(segment_of(op->hash), op->index)->status != VALID ||
+                    (i > 0 && strcmp(order[i - 1]->name, op->name) == 0))) {
+            op->status = -1;        /* no such key, or deleted by the op before */
+            continue;
+        }
+        if (!del && superseded(order, m, i)) {
+            continue;
+        }
+        recs[n] = (struct log_batch_rec){.key = op->name, .data = del ? NULL : op->data,
+                                         .len = del ? 0 : op->len,
+                                         .flags = del ? LOG_TOMBSTONE : 0};
+        done[n++] = op;
+    }
+    if (!ok || (n > 0 && log_append_batch(recs, n, atomic) < 0)) {
+        if (!del) {
+            batch_drop_new(order, m);
+        }
+        for (int i = 0; i < m; i++) {
+            order[i]->status = -1;
+        }
+    } else {
+        for (int i = 0; i < n; i++) {
+            struct db_batch_op *op = done[i];
+            struct segment *sg = segment_of(op->hash);
+            if (del) {
+                struct log_loc old = record_loc(record(sg, op->index));
+                log_release(op->name, &old);
+                drop_record(sg, op->index);
+                cache_remove(op->name, op->hash);
+            } else {
+                batch_install(op, &recs[i].loc);
+            }
+        }
+    }
+    free(recs);
+    free(done);
+}
+
+/* file engine, all or nothing: every value is written to its temp file
+ * before any is renamed into place
+ */
+static void files_batch_atomic(struct db_batch_op **order, int m) {
+    int staged = 0, ok = 1;
+    for (; ok && staged < m; staged++) {
+        struct db_batch_op *op = order[staged];
+        if (!superseded(order, m, staged)) {
+            ok = op->index != -1 &&
+                stage_file(record_id(segment_of(op->hash), op->index), op->data, op->len) == 0;
+        }
+    }
+    for (int i = 0; i < staged; i++) {
+        struct db_batch_op *op = order[i];
+        if (superseded(order, m, i) || op->index == -1) {
+            continue;
+        }
+        int id = record_id(segment_of(op->hash), op->index);
+        if (ok && commit_file(id) == 0) {
+            batch_install(op, NULL);
+        } else if (ok) {
+            struct segment *sg = segment_of(op->hash);
+            if (record(sg, op->index)->status != VALID) {
+                drop_record(sg, op->index);
+            }
+            op->status = -1;
+        } else {
+            char tmpname[DB_PATH_MAX];
+            data_path(tmpname, id, ".tmp");
+            unlink(tmpname);
+        }
+    }
+    if (!ok) {
+        batch_drop_new(order, m);
+    }
+}
+
+/* LSM engine, all or nothing */
+static void lsm_batch_atomic(struct db_batch_op **order, int m) {
+    const char **keys = malloc(m * sizeof(*keys));
+    const char **data = malloc(m * sizeof(*data));
+    int *lens = malloc(m * sizeof(*lens));
+    int n = 0;
+    for (int i = 0; keys && data && lens && i < m; i++) {
+        if (!superseded(order, m, i)) {
+            keys[n] = order[i]->name;
+            data[n] = order[i]->data;
+            lens[n++] = order[i]->len;
+        }
+    }
+    int status = keys && data && lens ? lsm_put_batch(keys, data, lens, n) : -1;
+    for (int i = 0; i < m; i++) {
+        order[i]->status = status;
+        if (status == 0) {
+            cache_put(order[i]->name, order[i]->hash, order[i]->data, order[i]->len);
+        } else {
+            cache_remove(order[i]->name, order[i]->hash);
+        }
+    }
+    free(keys);
+    free(data);
+    free(lens);
+}
+
+static int batch_done(struct db_batch_op *ops, int n) {
+    int done = 0;
+    for (int i = 0; i < n; i++) {
+        done += ops[i].status == 0;
+    }
+    return done;
+}
+
+/* room for journal_batch to describe a batch's changes in, allocated
+ * before the batch changes anything, so a change is never made and then
+ * left out of the replication log or the WAL for want of memory
+ */
+struct journal {
+    struct db_change *changes;  /* if replicating */
+    struct wal_rec *recs;       /* if durable, but not the log engine */
+};
+
+static void journal_free(struct journal *j) {
+    free(j->changes);
+    free(j->recs);
+}
+
+static int journal_alloc(struct journal *j, int n) {
+    int wal = durable && engine != DB_ENGINE_LOG;
+    j->changes = change_fn ? malloc(n * sizeof(*j->changes)) : NULL;
+    j->recs = wal ? malloc(n * sizeof(*j->recs)) : NULL;
+    if ((change_fn && j->changes == NULL) || (wal && j->recs == NULL)) {
+        journal_free(j);
+        return -1;
+    }
+    return 0;
+}
+
+/* log what a write or delete batch changed, in the caller's order, as
+ * one append, then replicate it (see journal). on failure nothing done
+ * counts as done
+ */
+static void journal_batch(struct journal *j, struct db_batch_op *ops, int n, char op, int atomic) {
+    if (durable && engine != DB_ENGINE_LOG) {
+        int m = 0;
+        for (int i = 0; i < n; i++) {
+            if (ops[i].status == 0) {
+                j->recs[m++] = (struct wal_rec){.op = op, .key = ops[i].name,
+                                                .data = op == 'W' ? ops[i].data : NULL,
+                                                .len = op == 'W' ? ops[i].len : 0};
+            }
+        }
+        if (m > 0 && wal_append_batch(j->recs, m, atomic) < 0) {
+            for (int i = 0; i < n; i++) {
+                ops[i].status = -1;
+            }
+            return;
+        }
+    }
+    if (change_fn) {
+        int m = 0;
+        for (int i = 0; i < n; i++) {
+            if (ops[i].status == 0) {
+                j->changes[m++] = (struct db_change){.op = op, .key = ops[i].name, .fd = -1,
+                                                     .data = op == 'W' ? ops[i].data : NULL,
+                                                     .len = op == 'W' ? ops[i].len : 0};
+            }
+        }
+        if (m > 0) {
+            change_fn(j->changes, m, atomic);
+        }
+    }
+}
+
+/* after unlocking: wait until the batch is on disk */
+static int commit_batch(struct db_batch_op *ops, int n) {
+    int done = batch_done(ops, n);
+    if (done > 0 && commit(0) < 0) {
+        for (int i = 0; i < n; i++) {
+            ops[i].status = -1;
+        }
+        return 0;
+    }
+    return done;
+}
+
+/* read every key in ops; returns how many were found */
+int db_read_batch(struct db_batch_op *ops, int n) {
+    struct db_batch_op **order = malloc(n * sizeof(*order));
+    uint64_t mask = batch_lock(ops, n, 0);
+    for (int i = 0; i < n; i++) {
+        ops[i].status = 0;
+    }
+    if (order) {
+        batch_order(ops, n, 0, order);
+    }
+    for (int i = 0; i < n; i++) {
+        struct db_batch_op *op = order ? order[i] : &ops[i];
+        op->len = read_value(segment_of(op->hash), op->name, op->hash, op->data, &op->value, 1);
+        op->status = op->len >= 0 ? 0 : -1;
+    }
+    batch_unlock(mask);
+    free(order);
+    return batch_done(ops, n);
+}
+
+/* store every value in ops; with DB_BATCH_ATOMIC either all of them or
+ * (if any can't be) none, and no reader sees part of the batch. values
+ * in an atomic batch can be at most DB_INLINE_MAX bytes. returns how
+ * many were stored
+ */
+int db_write_batch(struct db_batch_op *ops, int n, int flags) {
+    int atomic = flags & DB_BATCH_ATOMIC;
+    int too_big = 0;
+    for (int i = 0; i < n; i++) {
+        ops[i].status = ops[i].len > (atomic ? DB_INLINE_MAX : DB_VALUE_MAX) ? -1 : 0;
+        too_big |= ops[i].status < 0;
+    }
+    struct db_batch_op **order = malloc(n * sizeof(*order));
+    struct journal j;
+    if ((atomic && too_big) || wal_refused() || order == NULL || journal_alloc(&j, n) < 0) {
+        for (int i = 0; i < n; i++) {
+            ops[i].status = -1;
+        }
+        free(order);
+        return 0;
+    }
+    uint64_t mask = batch_lock(ops, n, 1);
+    int m = batch_order(ops, n, engine != DB_ENGINE_LSM, order);
+    if (engine == DB_ENGINE_LOG) {
+        log_batch(order, m, 0, atomic);
+    } else if (atomic && engine == DB_ENGINE_LSM) {
+        lsm_batch_atomic(order, m);
+    } else if (atomic) {
+        files_batch_atomic(order, m);
+    } else {
+        for (int i = 0; i < m; i++) {
+            struct db_batch_op *op = order[i];
+            op->status = write_value(segment_of(op->hash), op->name, op->hash, op->data, op->len);
+        }
+    }
+    journal_batch(&j, ops, n, 'W', atomic);
+    batch_unlock(mask);
+    journal_free(&j);
+    free(order);
+    return commit_batch(ops, n);
+}
+
+/* delete every key in ops; returns how many there were */
+int db_delete_batch(struct db_batch_op *ops, int n) {
+    struct db_batch_op **order = malloc(n * sizeof(*order));
+    struct journal j;
+    if (wal_refused() || order == NULL || journal_alloc(&j, n) < 0) {
+        for (int i = 0; i < n; i++) {
+            ops[i].status = -1;
+        }
+        free(order);
+        return 0;
+    }
+    uint64_t mask = batch_lock(ops, n, 1);
+    for (int i = 0; i < n; i++) {
+        ops[i].status = 0;
+    }
+    int m = batch_order(ops, n, 0, order);
+    if (engine == DB_ENGINE_LOG) {
+        log_batch(order, m, 1, 0);
+    } else {
+        for (int i = 0; i < m; i++) {
+            struct db_batch_op *op = order[i];
+            op->status = delete_value(segment_of(op->hash), op->name, op->hash);
+        }
+    }
+    journal_batch(&j, ops, n, 'D', 0);
+    batch_unlock(mask);
+    journal_free(&j);
+    free(order);
+    return commit_batch(ops, n);
+}
+
+/* log engine: rebuild the index from the segment files at startup
+ */
+static void log_replay(const char *key, struct log_loc *loc, int flags) {
+    uint32_t hash = key_hash(key);
+    struct segment *sg = segment_of(hash);
+    pthread_rwlock_wrlock(&sg->lock);
+    int index = segment_find(sg, key, hash);
+    if (flags & LOG_TOMBSTONE) {
+        if (index != -1) {
+            struct log_loc old = record_loc(record(sg, index));
+            log_release(key, &old);
+            drop_record(sg, index);
+        }
+        pthread_rwlock_unlock(&sg->lock);
+        return;
+    }
+    if (index == -1 && (index = segment_insert(sg, key, hash)) == -1) {
+        pthread_rwlock_unlock(&sg->lock);
+        return;
+    }
+    struct db_record *r = record(sg, index);
+    if (r->status == VALID) {
+        struct log_loc old = record_loc(r);
+        log_release(key, &old);
+    } else {
+        r->status = VALID;
+        sg->live_objects++;
+    }
+    r->file = loc->file;
+    r->offset = loc->offset;
+    r->len = loc->len;
+    pthread_rwlock_unlock(&sg->lock);
+}
+
+/* log engine: the compactor is about to delete the file holding loc;
+ * move the value to the active file if it is still the current one, or
+ * carry a tombstone over if the key is still deleted
+ */
+static void log_relocate(const char *key, struct log_loc *loc, const char *data, int flags) {
+    uint32_t hash = key_hash(key);
+    struct segment *sg = segment_of(hash);
+    pthread_rwlock_wrlock(&sg->lock);
+    int index = segment_find(sg, key, hash);
+    struct db_record *r = index == -1 ? NULL : record(sg, index);
+    struct log_loc moved;
+    if (flags & LOG_TOMBSTONE) {
+        /* written again since: the newer value already wins on replay */
+        if (r == NULL || r->status != VALID) {
+            log_append(key, NULL, 0, LOG_TOMBSTONE, &moved);
+        }
+    } else if (r && r->status == VALID && r->file == loc->file && r->offset == loc->offset &&
+               log_append(key, data, loc->len, 0, &moved) == 0) {
+        log_release(key, loc);
+        r->file = moved.file;
+        r->offset = moved.offset;
+    }
+    pthread_rwlock_unlock(&sg->lock);
+}
+
+/* file and LSM engines with a WAL: redo a logged change at startup */
+static void wal_replay(char op, const char *key, const char *data, int len) {
+    char *name = (char *)key;
+    uint32_t hash = key_hash(name);
+    struct segment *sg = segment_of(hash);
+    pthread_rwlock_wrlock(&sg->lock);
+    if (op == 'D') {
+        delete_value(sg, name, hash);
+    } else {
+        write_value(sg, name, hash, (char *)data, len);
+    }
+    pthread_rwlock_unlock(&sg->lock);
+}
+
+/* log every change and return from it only once it is on disk, syncing
+ * for up to batch_max writers at a time; a writer that starts a sync
+ * waits up to window_us for others first. call before db_open
+ */
+void db_durable(int window_us, int batch_max) {
+    durable = 1;
+    wal_window_us = window_us;
+    wal_batch_max = batch_max;
+}
+
+/* everything the WAL holds is in the data files, the index checkpoints
+ * and the LSM tables; put them all on disk and empty it. nothing else
+ * may be running
+ */
+static void wal_retire(void) {
+    int fd = open(db_dir, O_RDONLY | O_CLOEXEC);
+    if (engine == DB_ENGINE_FILES) {
+        index_checkpoint();
+    }
+    if (fd < 0 || syncfs(fd) < 0) {
+        perror("syncfs");
+    } else {
+        wal_reset();
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+/* keep the database's files under dir rather than /tmp, so that several
+ * servers can run on one machine. call before db_open
+ */
+int db_directory(const char *dir) {
+    if (strlen(dir) >= DB_DIR_MAX) {
+        fprintf(stderr, "%s: directory name too long\n", dir);
+        return -1;
+    }
+    if (mkdir(dir, 0777) < 0 && errno != EEXIST) {
+        perror(dir);
+        return -1;
+    }
+    strcpy(db_dir, dir);
+    return 0;
+}
+
+/* pass every change from now on to fn (repl.c); call after db_open, so
+ * the changes replayed at startup aren't passed on again
+ */
+void db_replicate(db_change_fn fn) {
+    change_fn = fn;
+}
+
+int db_open(int storage) {
+    engine = storage;
+    int status = 0;
+    if (engine == DB_ENGINE_LOG) {
+        status = log_open(db_dir, log_replay, log_relocate);
+    } else if (engine == DB_ENGINE_LSM) {
+        status = lsm_open(db_dir);
+    } else {
+        status = index_open();
+    }
+    if (status == 0 && durable) {
+        status = engine == DB_ENGINE_LOG ? wal_open(db_dir, wal_window_us, wal_batch_max, NULL, log_sync) :
+            wal_open(db_dir, wal_window_us, wal_batch_max, wal_replay, NULL);
+        if (status == 0 && engine == DB_ENGINE_FILES) {
+            /* what was replayed is checkpointed, so the WAL only ever
+             * holds one run's changes */
+            wal_retire();
+        }
+    }
+    return status;
+}
+
+/* the next keys of a scan of the whole table (see database.h). the
+ * file and log engines walk each segment's records in slot order, which
+ * a key keeps for as long as it lives; the cursor is "segment.slot" of
+ * the next record to look at
+ */
+int db_scan(char *cursor, char *buf, int max) {
+    if (engine == DB_ENGINE_LSM) {
+        return lsm_scan(cursor, DB_CURSOR_MAX, buf, max);
+    }
+    int seg = 0, index = 0, used = 0;
+    if (cursor[0] && (sscanf(cursor, "%d.%d", &seg, &index) != 2 || seg < 0 || seg >= NSEGMENTS)) {
+        return -1;
+    }
+    for (; seg < NSEGMENTS; seg++, index = 0) {
+        struct segment *sg = &segments[seg];
+        pthread_rwlock_rdlock(&sg->lock);
+        for (; index < sg->next_unused; index++) {
+            struct db_record *r = record(sg, index);
+            if (r->status != VALID) {
+                continue;
+            }
+            char *key = record_key(sg, r);
+            int len = strlen(key) + 1;
+            if (used + len > max) {
+                pthread_rwlock_unlock(&sg->lock);
+                sprintf(cursor, "%d.%d", seg, index);
+                return used > 0 ? used : -1;
+            }
+            memcpy(buf + used, key, len);
+            used += len;
+        }
+        pthread_rwlock_unlock(&sg->lock);
+    }
+    cursor[0] = 0;
+    return used;
+}
+
+int count_valid_objects() {
+    if (engine == DB_ENGINE_LSM) {
+        return lsm_count();
+    }
+    int count = 0;
+    for (int i = 0; i < NSEGMENTS; i++) {
+        count += __atomic_load_n(&segments[i].live_objects, __ATOMIC_RELAXED);
+    }
+    return count;
+}
+
+void db_usage(struct db_usage *u) {
+    memset(u, 0, sizeof(*u));
+    for (int i = 0; i < NSEGMENTS; i++) {
+        struct segment *sg = &segments[i];
+        pthread_rwlock_rdlock(&sg->lock);
+        u->keys += sg->live_objects;
+        if (sg->cur_index.entries) {
+            u->index_bytes += (long)(sg->cur_index.mask + 1) * sizeof(struct index_entry);
+        }
+        if (sg->old_index.entries) {
+            u->index_bytes += (long)(sg->old_index.mask + 1) * sizeof(struct index_entry);
+        }
+        u->record_bytes += (long)sg->n_record_chunks * RECORD_CHUNK * sizeof(struct db_record) +
+            (long)sg->max_free * sizeof(int);
+        u->key_bytes += (long)sg->n_arena_blocks * ARENA_BLOCK;
+        u->key_dead_bytes += sg->arena_dead;
+        pthread_rwlock_unlock(&sg->lock);
+    }
+}
+
+/* every engine keeps its files for the next start: the file engine
+ * checkpoints its index, the log and LSM engines close theirs. with a
+ * WAL, once that is all on disk the WAL is emptied. a file engine table
+ * that was never opened (the benchmarks) is removed instead
+ */
+void db_cleanup(void) {
+    if (engine == DB_ENGINE_LOG) {
+        log_close();
+    } else if (engine == DB_ENGINE_LSM) {
+        lsm_close();
+    } else if (!persist_index) {
+        /* too many files for a shell glob once there are a few 100k keys */
+        char cmd[DB_PATH_MAX + 64];
+        sprintf(cmd, "find '%s' -maxdepth 1 -name 'data.*' -delete", db_dir);
+        system(cmd);
+    }
+    if (durable && engine != DB_ENGINE_LOG) {
+        wal_retire();
+    } else if (persist_index) {
+        index_checkpoint();
+    }
+    if (durable) {
+        wal_close();
+    }
+}
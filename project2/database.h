@@ -1,19 +1,129 @@
 #ifndef DATABASE_H
 #define DATABASE_H
 
-#define MAX_KEYS 200
+#include <stdint.h>
+
+#define DB_ENGINE_FILES 0       /* one file per key under /tmp */
+#define DB_ENGINE_LOG 1         /* append-only segment files, see logstore.c */
+#define DB_ENGINE_LSM 2         /* sorted tables on disk, see lsmstore.c */
 
 struct db_record {
-    char record_name[31];
+    uint32_t key_ref;           /* block and offset of the key in the key arena */
+    uint16_t key_cap;           /* arena bytes reserved for the key */
+    uint8_t status;
+    uint32_t file;              /* log engine: where the value is */
+    uint32_t offset;
+    uint32_t len;
+};
+
+/* values up to this size are written from one buffer and cached;
+ * larger ones are streamed with db_write_begin/chunk/end
+ */
+#define DB_INLINE_MAX 4096
+
+/* the protocol's length field is 8 bytes and replies NUL-terminate it
+ */
+#define DB_VALUE_MAX 9999999
+
+/* db_directory(): longest directory name, and room for a file under it */
+#define DB_DIR_MAX 128
+#define DB_PATH_MAX (DB_DIR_MAX + 48)
+
+/* a value to send: len bytes at offset in the open file fd, or in the
+ * caller's buffer when fd is -1
+ */
+struct db_value {
+    int fd;
+    long offset;
+    int len;
+};
+
+/* a value being written in pieces: db_write_begin, db_write_chunk until
+ * all len bytes are in, then db_write_end, or db_write_abort to give up.
+ * the bytes collect in a temp file, so memory use doesn't depend on len.
+ */
+struct db_stream {
+    int fd;
+    int len;
+    int written;
+    uint32_t crc;
+    char path[DB_PATH_MAX];
+};
+
+/* one key of a db_*_batch() call. the caller sets name, and data and
+ * len for a write, or data to a DB_INLINE_MAX buffer for a read. status
+ * comes back 0 or -1, and for a read len and value as from
+ * db_read_value(), except that a value that fits is always read into
+ * data rather than opened.
+ */
+struct db_batch_op {
+    char *name;
+    char *data;
+    int len;
     int status;
+    struct db_value value;
+    uint32_t hash;              /* the rest is the batch's own */
+    int index;
+    uint64_t where;
+};
+
+#define DB_BATCH_ATOMIC 1       /* db_write_batch: store every value or none */
+
+/* db_scan: the cursor, "" to start and "" again once every key has been
+ * returned, is opaque and at most this long (a key and its NUL for the
+ * LSM engine). keys that live through a whole scan are returned exactly
+ * once; keys written or deleted meanwhile may or may not be
+ */
+#define DB_CURSOR_MAX 1025
+
+/* a change passed to the db_replicate() hook: a W of len bytes of data
+ * (or, for a value that was streamed in, with data NULL, the first len
+ * bytes of fd), or a D. fd's file is never written again, so the hook
+ * may dup it and read the value after it has returned
+ */
+struct db_change {
+    char op;
+    const char *key;
+    const char *data;
+    int fd;
+    int len;
 };
 
-extern struct db_record db_table[MAX_KEYS];
+/* called with every change made, while its keys are still locked, so
+ * each key's changes arrive in the order they were made. atomic says n
+ * changes are one DB_BATCH_ATOMIC batch
+ */
+typedef void (*db_change_fn)(struct db_change *changes, int n, int atomic);
+
+struct db_usage {
+    int keys;
+    long index_bytes;
+    long record_bytes;
+    long key_bytes;             /* arena allocated */
+    long key_dead_bytes;        /* of which abandoned by rewritten keys */
+};
 
+int db_directory(const char *dir);
+void db_durable(int window_us, int batch_max);
+void db_replicate(db_change_fn fn);
+int db_open(int engine);
 int db_write(char *name, char *data, int len);
 int db_read(char *name, char *buf);
+int db_read_value(char *name, char *buf, struct db_value *v);
+int db_write_begin(struct db_stream *s, int len);
+int db_write_chunk(struct db_stream *s, char *data, int n);
+int db_write_end(struct db_stream *s, char *name);
+void db_write_abort(struct db_stream *s);
 int db_delete(char *name);
+int db_read_batch(struct db_batch_op *ops, int n);
+int db_write_batch(struct db_batch_op *ops, int n, int flags);
+int db_delete_batch(struct db_batch_op *ops, int n);
+int db_scan(char *cursor, char *buf, int max);
+int db_partition(char *name, int parts);
+int find_key(char *key);
+int new_record(char *name);
 int count_valid_objects();
+void db_usage(struct db_usage *u);
 void db_cleanup(void);
 
 #endif
@@ -0,0 +1,411 @@
+/*
+ * file:        dbclient.c
+ * description: protocol v2 client and consistent-hash sharding (see
+ *              dbclient.h), used by dbtest and rebalance.
+ *
+ * the ring has RING_VNODES points per server, each the hash of the
+ * server's address and the point's number, so a server's points don't
+ * depend on which other servers there are: adding one takes over the
+ * arcs in front of its own points, about 1/N of the keys, and every
+ * other key stays where it was. many points per server keep the arcs,
+ * and so the load, even.
+ *
+ * a connection builds a frame of ops, sends it and reads the reply
+ * frame into the same buffer; replies are matched to ops by id, which
+ * is the op's index in the caller's array. client_batch splits the ops
+ * by server and sends every server its frame before reading any reply,
+ * so the servers work on them at the same time.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <endian.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "dbclient.h"
+
+/* "5000,5001" or "5000-5003" or a mix; returns how many ports, or -1 */
+int parse_ports(const char *s, int *ports, int max) {
+    int n = 0;
+    while (*s) {
+        char *end;
+        long lo = strtol(s, &end, 10), hi = lo;
+        if (end == s) {
+            return -1;
+        }
+        if (*end == '-') {
+            s = end + 1;
+            hi = strtol(s, &end, 10);
+            if (end == s) {
+                return -1;
+            }
+        }
+        if (lo < 1 || hi > 65535 || hi < lo || n + (hi - lo + 1) > max) {
+            return -1;
+        }
+        for (long p = lo; p <= hi; p++) {
+            ports[n++] = p;
+        }
+        if (*end != ',' && *end != 0) {
+            return -1;
+        }
+        s = *end ? end + 1 : end;
+    }
+    return n;
+}
+
+/* FNV-1a clusters strings that differ only at the end (port and point
+ * numbers), so it is finished with murmur3's mixer
+ */
+static uint32_t ring_hash(const char *s) {
+    uint32_t h = 2166136261u;
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+static int compare_points(const void *a, const void *b) {
+    const struct ring_point *x = a, *y = b;
+    if (x->hash != y->hash) {
+        return x->hash < y->hash ? -1 : 1;
+    }
+    return x->shard - y->shard;
+}
+
+int ring_build(struct ring *r, const int *ports, int n, int vnodes) {
+    r->n = n * vnodes;
+    r->points = malloc(r->n * sizeof(*r->points));
+    if (r->points == NULL || r->n == 0) {
+        free(r->points);
+        r->points = NULL;
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        for (int v = 0; v < vnodes; v++) {
+            char name[48];
+            sprintf(name, "127.0.0.1:%d#%d", ports[i], v);
+            r->points[i * vnodes + v] = (struct ring_point){.hash = ring_hash(name), .shard = i};
+        }
+    }
+    qsort(r->points, r->n, sizeof(*r->points), compare_points);
+    return 0;
+}
+
+/* which server, as an index into the ports the ring was built from */
+int ring_shard(struct ring *r, const char *key) {
+    uint32_t h = ring_hash(key);
+    int lo = 0, hi = r->n;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (r->points[mid].hash < h) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return r->points[lo == r->n ? 0 : lo].shard;
+}
+
+void ring_free(struct ring *r) {
+    free(r->points);
+    r->points = NULL;
+}
+
+static int write_full(int fd, const void *buf, int len) {
+    for (int done = 0; done < len; ) {
+        int n = send(fd, (const char *)buf + done, len - done, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+static int read_all(int fd, void *buf, int len) {
+    for (int done = 0; done < len; ) {
+        int n = read(fd, (char *)buf + done, len - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+int conn_open(struct db_conn *c, int port) {
+    memset(c, 0, sizeof(*c));
+    c->port = port;
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(port),
+                               .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    int one = 1;
+    c->sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (c->sock < 0 || connect(c->sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "can't connect to port %d: %s\n", port, strerror(errno));
+        if (c->sock >= 0) {
+            close(c->sock);
+        }
+        c->sock = -1;
+        return -1;
+    }
+    setsockopt(c->sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return 0;
+}
+
+static void frame_start(struct db_conn *c) {
+    c->len = 0;
+    c->count = 0;
+}
+
+static int frame_add(struct db_conn *c, char op, int flags, uint32_t id, const char *key, int key_len,
+                     const char *data, int len) {
+    long need = c->len + sizeof(struct v2_op) + key_len + len;
+    if (c->count == V2_OPS_MAX || key_len > V2_KEY_MAX || need > V2_FRAME_MAX) {
+        return -1;
+    }
+    if (need > c->cap) {
+        int cap = c->cap ? c->cap : 4096;
+        while (cap < need) {
+            cap *= 2;
+        }
+        char *p = realloc(c->buf, cap);
+        if (p == NULL) {
+            return -1;
+        }
+        c->buf = p;
+        c->cap = cap;
+    }
+    struct v2_op o = {.op = op, .flags = flags, .key_len = htole16(key_len), .id = htole32(id),
+                      .value_len = htole32(len)};
+    memcpy(c->buf + c->len, &o, sizeof(o));
+    memcpy(c->buf + c->len + sizeof(o), key, key_len);
+    if (len > 0) {
+        memcpy(c->buf + c->len + sizeof(o) + key_len, data, len);
+    }
+    c->len = need;
+    c->count++;
+    return 0;
+}
+
+static int frame_send(struct db_conn *c) {
+    struct v2_frame h = {.magic = V2_MAGIC, .version = V2_VERSION, .count = htole16(c->count),
+                         .length = htole32(c->len)};
+    return write_full(c->sock, &h, sizeof(h)) < 0 || write_full(c->sock, c->buf, c->len) < 0 ? -1 : 0;
+}
+
+/* read the reply frame into c->buf; returns its op count, -1 on error */
+static int frame_recv(struct db_conn *c) {
+    struct v2_frame h;
+    if (read_all(c->sock, &h, sizeof(h)) < 0 || h.magic != V2_MAGIC || h.version != V2_VERSION) {
+        return -1;
+    }
+    uint32_t length = le32toh(h.length);
+    if (length > c->cap) {
+        char *p = realloc(c->buf, length);
+        if (p == NULL) {
+            return -1;
+        }
+        c->buf = p;
+        c->cap = length;
+    }
+    if (read_all(c->sock, c->buf, length) < 0) {
+        return -1;
+    }
+    c->len = length;
+    return le16toh(h.count);
+}
+
+/* the reply op at *pos in host order, with its key and value */
+static int next_reply(struct db_conn *c, int *pos, struct v2_op *o, char **key, char **value) {
+    if (c->len - *pos < (int)sizeof(*o)) {
+        return -1;
+    }
+    memcpy(o, c->buf + *pos, sizeof(*o));
+    o->key_len = le16toh(o->key_len);
+    o->id = le32toh(o->id);
+    o->value_len = le32toh(o->value_len);
+    long end = *pos + sizeof(*o) + o->key_len + (long)o->value_len;
+    if (end > c->len) {
+        return -1;
+    }
+    *key = c->buf + *pos + sizeof(*o);
+    *value = *key + o->key_len;
+    *pos = end;
+    return 0;
+}
+
+/* fill in ops[] from the reply just read; ops without a reply are X */
+static int match_replies(struct db_conn *c, int count, struct client_op *ops, int n) {
+    int pos = 0;
+    for (int i = 0; i < count; i++) {
+        struct v2_op o;
+        char *key, *value;
+        if (next_reply(c, &pos, &o, &key, &value) < 0) {
+            return -1;
+        }
+        if (o.id < n) {
+            ops[o.id].status = o.op;
+            ops[o.id].value = value;
+            if (ops[o.id].op == 'R') {
+                ops[o.id].len = o.value_len;
+            }
+        }
+    }
+    return 0;
+}
+
+/* send ops as one frame and wait for the replies. flags go on every op:
+ * V2_BATCH to run them as database batches, with V2_ATOMIC for an
+ * all-or-nothing write. returns -1 if the exchange failed
+ */
+int conn_batch(struct db_conn *c, struct client_op *ops, int n, int flags) {
+    frame_start(c);
+    for (int i = 0; i < n; i++) {
+        ops[i].status = 'X';
+        if (frame_add(c, ops[i].op, flags, i, ops[i].key, strlen(ops[i].key), ops[i].data,
+                      ops[i].op == 'W' ? ops[i].len : 0) < 0) {
+            return -1;
+        }
+    }
+    int count;
+    if (frame_send(c) < 0 || (count = frame_recv(c)) < 0) {
+        return -1;
+    }
+    return match_replies(c, count, ops, n);
+}
+
+int conn_set(struct db_conn *c, const char *key, const void *data, int len) {
+    struct client_op op = {.op = 'W', .key = key, .data = data, .len = len};
+    return conn_batch(c, &op, 1, 0) == 0 && op.status == 'K' ? 0 : -1;
+}
+
+/* the value's length (up to max bytes of it in buf), -1 if not found */
+int conn_get(struct db_conn *c, const char *key, void *buf, int max) {
+    struct client_op op = {.op = 'R', .key = key};
+    if (conn_batch(c, &op, 1, 0) < 0 || op.status != 'K') {
+        return -1;
+    }
+    memcpy(buf, op.value, op.len < max ? op.len : max);
+    return op.len;
+}
+
+int conn_delete(struct db_conn *c, const char *key) {
+    struct client_op op = {.op = 'D', .key = key};
+    return conn_batch(c, &op, 1, 0) == 0 && op.status == 'K' ? 0 : -1;
+}
+
+/* the server's next keys after cursor ("" to start), NUL-terminated one
+ * after another at *keys (in c's buffer); cursor, V2_KEY_MAX + 1 bytes,
+ * is moved on and is "" after the last. returns their length or -1
+ */
+int conn_scan(struct db_conn *c, char *cursor, char **keys) {
+    frame_start(c);
+    struct v2_op o;
+    char *key;
+    int pos = 0;
+    if (frame_add(c, 'S', 0, 0, cursor, strlen(cursor), NULL, 0) < 0 || frame_send(c) < 0 ||
+        frame_recv(c) != 1 || next_reply(c, &pos, &o, &key, keys) < 0 || o.op != 'K' ||
+        o.key_len > V2_KEY_MAX) {
+        return -1;
+    }
+    memcpy(cursor, key, o.key_len);
+    cursor[o.key_len] = 0;
+    return o.value_len;
+}
+
+void conn_close(struct db_conn *c) {
+    if (c->sock >= 0) {
+        close(c->sock);
+    }
+    free(c->buf);
+    c->sock = -1;
+    c->buf = NULL;
+}
+
+int client_open(struct db_client *c, const int *ports, int n, int vnodes) {
+    memset(c, 0, sizeof(*c));
+    if (n < 1 || n > CLIENT_SHARDS_MAX || ring_build(&c->ring, ports, n, vnodes) < 0) {
+        return -1;
+    }
+    c->n = n;
+    for (int i = 0; i < n; i++) {
+        c->ports[i] = ports[i];
+        c->conns[i].sock = -1;
+    }
+    for (int i = 0; i < n; i++) {
+        if (conn_open(&c->conns[i], ports[i]) < 0) {
+            client_close(c);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* conn_batch over every server at once: each gets one frame with its
+ * keys' ops. V2_ATOMIC only holds per server
+ */
+int client_batch(struct db_client *c, struct client_op *ops, int n, int flags) {
+    for (int s = 0; s < c->n; s++) {
+        frame_start(&c->conns[s]);
+    }
+    for (int i = 0; i < n; i++) {
+        struct db_conn *conn = &c->conns[ring_shard(&c->ring, ops[i].key)];
+        ops[i].status = 'X';
+        if (frame_add(conn, ops[i].op, flags, i, ops[i].key, strlen(ops[i].key), ops[i].data,
+                      ops[i].op == 'W' ? ops[i].len : 0) < 0) {
+            return -1;
+        }
+    }
+    int status = 0;
+    for (int s = 0; s < c->n; s++) {
+        if (c->conns[s].count > 0 && frame_send(&c->conns[s]) < 0) {
+            c->conns[s].count = 0;          /* no reply to wait for */
+            status = -1;
+        }
+    }
+    for (int s = 0; s < c->n; s++) {
+        int count;
+        if (c->conns[s].count > 0 &&
+            ((count = frame_recv(&c->conns[s])) < 0 || match_replies(&c->conns[s], count, ops, n) < 0)) {
+            status = -1;
+        }
+    }
+    return status;
+}
+
+int client_set(struct db_client *c, const char *key, const void *data, int len) {
+    return conn_set(&c->conns[ring_shard(&c->ring, key)], key, data, len);
+}
+
+int client_get(struct db_client *c, const char *key, void *buf, int max) {
+    return conn_get(&c->conns[ring_shard(&c->ring, key)], key, buf, max);
+}
+
+int client_delete(struct db_client *c, const char *key) {
+    return conn_delete(&c->conns[ring_shard(&c->ring, key)], key);
+}
+
+void client_close(struct db_client *c) {
+    for (int i = 0; i < c->n; i++) {
+        conn_close(&c->conns[i]);
+    }
+    ring_free(&c->ring);
+}
@@ -0,0 +1,83 @@
+/*
+ * file:        dbclient.h
+ * description: client side of protocol v2, and sharding over several
+ *              dbservers: each key belongs to one server, picked by a
+ *              consistent-hash ring, so adding or removing a server
+ *              moves only the keys that land on (or came from) it.
+ */
+#ifndef DBCLIENT_H
+#define DBCLIENT_H
+
+#include <stdint.h>
+#include "proto2.h"
+
+#define RING_VNODES 160             /* points per server on the ring */
+#define CLIENT_SHARDS_MAX 64
+
+/* one op of conn_batch or client_batch. the caller sets op, key and,
+ * for a W, data and len; status comes back K or X, and for an R that
+ * found the key, value and len. value points into the reply buffer of
+ * the key's connection and is good until it is used again
+ */
+struct client_op {
+    char op;
+    const char *key;
+    const char *data;
+    int len;
+    char status;
+    char *value;
+};
+
+/* a connection to one server, with the frame being built on it */
+struct db_conn {
+    int sock;
+    int port;
+    char *buf;
+    int len;
+    int cap;
+    int count;                  /* ops in buf */
+};
+
+/* the ring: every server has vnodes points, sorted by hash; a key
+ * belongs to the server of the first point at or after its hash
+ */
+struct ring_point {
+    uint32_t hash;
+    int shard;                  /* index into the ports given to ring_build */
+};
+
+struct ring {
+    struct ring_point *points;
+    int n;
+};
+
+/* a client of n servers */
+struct db_client {
+    int n;
+    int ports[CLIENT_SHARDS_MAX];
+    struct db_conn conns[CLIENT_SHARDS_MAX];
+    struct ring ring;
+};
+
+int parse_ports(const char *s, int *ports, int max);
+
+int ring_build(struct ring *r, const int *ports, int n, int vnodes);
+int ring_shard(struct ring *r, const char *key);
+void ring_free(struct ring *r);
+
+int conn_open(struct db_conn *c, int port);
+int conn_batch(struct db_conn *c, struct client_op *ops, int n, int flags);
+int conn_set(struct db_conn *c, const char *key, const void *data, int len);
+int conn_get(struct db_conn *c, const char *key, void *buf, int max);
+int conn_delete(struct db_conn *c, const char *key);
+int conn_scan(struct db_conn *c, char *cursor, char **keys);
+void conn_close(struct db_conn *c);
+
+int client_open(struct db_client *c, const int *ports, int n, int vnodes);
+int client_batch(struct db_client *c, struct client_op *ops, int n, int flags);
+int client_set(struct db_client *c, const char *key, const void *data, int len);
+int client_get(struct db_client *c, const char *key, void *buf, int max);
+int client_delete(struct db_client *c, const char *key);
+void client_close(struct db_client *c);
+
+#endif
@@ -1,53 +1,129 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
 #include <netinet/in.h>
 #include <pthread.h>
 #include <time.h>
+#include <signal.h>
 #include "proj2.h"
 #include "database.h"
+#include "cache.h"
+#include "logstore.h"
+#include "lsmstore.h"
 #include "queue.h"
+#include "dbserver.h"
+#include "reactor.h"
+#include "admin.h"
+#include "proto2.h"
+#include "wal.h"
+#include "repl.h"
 
 #define PORT 5000
 #define WORKERS 4
+#define MAX_WORKERS 64
+#define POOL_TICK_MS 100
+#define POOL_WAIT_NS 5000000L   /* mean queue wait that counts as backlog */
+#define QUEUE_MAX 1024
+#define CACHE_BYTES (64L << 20)
+#define MAX_STAT_THREADS 512
 
-void handle_work(int sock_fd);
+void handle_work(int sock_fd, long wait, long enqueued);
+static int write_reply(int fd, struct request *response, char *data, int len);
 
-int stat_reads = 0;
-int stat_writes = 0;
-int stat_deletes = 0;
-int stat_failed = 0;
 int stat_objects = 0; 
-pthread_mutex_t stat_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* everything one thread counts, allocated by that thread and padded
+ * out to whole cache lines. `stats reset` bumps latency_gen instead of
+ * writing into other threads' histograms; each thread clears its own
+ * the next time it records, and until then print_latency skips them */
+struct thread_counters {
+    struct request_stats c;
+    int latency_gen;
+    struct histogram latency[3][LAT_KINDS];
+} __attribute__((aligned(64)));
+
+static struct thread_counters *stat_threads[MAX_STAT_THREADS];
+static int n_stat_threads;
+static int latency_gen;
+static __thread struct thread_counters *my_counters;
+__thread struct request_stats *thread_stats;
 
 int shutdown_flag = 0;
-int listener_sock_fd = -1;
+int acceptors = 0;
+int listen_backlog = SOMAXCONN;
+int listener_fds[MAX_ACCEPTORS];
 int server_port = PORT;
+int reactor_mode = 0;
+int shard_mode = 0;
+int storage_engine = DB_ENGINE_FILES;
+int wal_mode = 0;               /* -W: writes are answered once on disk */
+int replica_mode = 0;           /* -r: only the primary changes anything */
 
-void* listener_thread(void *arg) {
-    int port = *((int *)arg);
-    listener_sock_fd = socket(AF_INET, SOCK_STREAM, 0);
+/* the worker pool grows while requests back up and shrinks when
+ * workers sit idle; see pool_thread */
+int pool_min = WORKERS;
+int pool_max = WORKERS * 4;
+int pool_grow_ms = 300;         /* backlog this long adds workers */
+int pool_idle_ms = 3000;        /* idle this long removes one */
+
+/* admission control: at most queue_max requests (connections, in
+ * threaded mode) wait for a worker, and one that waited longer than
+ * queue_deadline_ns is answered X instead of run; 0 turns either off */
+int queue_max = QUEUE_MAX;
+long queue_deadline_ns = 0;
+long pool_grows, pool_shrinks;
+static int pool_size;
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t worker_tids[MAX_WORKERS];
+static int worker_started[MAX_WORKERS];     /* has a thread to join */
+static int worker_alive[MAX_WORKERS];
+static struct thread_counters *worker_counters[MAX_WORKERS];
+
+/* with more than one acceptor every socket binds the same port with
+ * SO_REUSEPORT and the kernel spreads new connections across them
+ */
+int open_listener(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
     int opt = 1;
-    if(listener_sock_fd < 0) {
+    if(fd < 0) {
         perror("Socket creation failed");
         exit(1);
     }
     struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(port), .sin_addr.s_addr = 0};
-    setsockopt(listener_sock_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-    if (bind(listener_sock_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    if (acceptors > 1 && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        perror("SO_REUSEPORT");
+        exit(1);
+    }
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
         perror("can't bind");
         exit(1);
     }
-    if (listen(listener_sock_fd,5) < 0){
+    if (listen(fd, listen_backlog) < 0){
         perror("listen failed");
         exit(1);
     }
-    printf("Listener thread running on port %d\n",port);
+    return fd;
+}
+
+/* workers do blocking I/O on the connections, so only the reactor asks
+ * accept4 for non-blocking ones. a connection can't be answered until a
+ * worker reads its request, so when the queue is full the listener
+ * holds on to it and stops accepting; the rest wait in the kernel's
+ * backlog
+ */
+void* listener_thread(void *arg) {
+    int listen_fd = listener_fds[(long)arg];
+    stats_register();
+    printf("Listener thread running on port %d\n", server_port);
     while(!shutdown_flag){
-        int fd = accept(listener_sock_fd,NULL,NULL);
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
         if (fd < 0) {
             if (shutdown_flag) {
                 break;  
@@ -55,161 +131,933 @@ void* listener_thread(void *arg) {
             perror("Accept failed");
             continue;
         }
-        enqueue_work(fd);
+        thread_stats->accepted++;
+        int depth, held = 0;
+        while ((depth = try_enqueue_work(fd)) == QUEUE_FULL && !shutdown_flag) {
+            if (held++ == 0) {
+                thread_stats->deferred++;
+            }
+            usleep(1000);
+        }
+        if (depth == QUEUE_FULL) {
+            close(fd);
+            break;
+        }
+        count_queued(depth);
     }
-    close(listener_sock_fd);
+    close(listen_fd);
     printf("Exiting\n");
     return NULL;
 }
 
+/* a connection that waited in the queue past the deadline: its first
+ * request is read (and any body skipped) and answered X, and the
+ * connection is closed
+ */
+static void shed_connection(int fd) {
+    struct request req, response;
+    char chunk[STREAM_CHUNK];
+    if (read_full(fd, &req, 1) != 1) {
+        return;
+    }
+    if ((unsigned char)req.op_status == V2_MAGIC) {
+        v2_shed(fd);
+        return;
+    }
+    if (read_full(fd, (char *)&req + 1, sizeof(req) - 1) != sizeof(req) - 1) {
+        return;
+    }
+    for (int left = req.op_status == 'W' ? request_len(&req) : 0; left > 0; ) {
+        int n = left < STREAM_CHUNK ? left : STREAM_CHUNK;
+        if (read_full(fd, chunk, n) != n) {
+            return;
+        }
+        left -= n;
+    }
+    shed_request(&req, &response, 1);
+    write_reply(fd, &response, NULL, 0);
+}
+
+/* a worker that is started again keeps counting where its
+ * predecessor left off
+ */
+static void worker_stats(int id) {
+    if (worker_counters[id] == NULL) {
+        stats_register();
+        worker_counters[id] = my_counters;
+    }
+    my_counters = worker_counters[id];
+    thread_stats = &my_counters->c;
+}
+
+/* the pool shrank below us; leave unless it has grown back since
+ */
+static int worker_retire(int id) {
+    pthread_mutex_lock(&pool_mutex);
+    int retire = id >= pool_size;
+    if (retire) {
+        worker_alive[id] = 0;
+    }
+    pthread_mutex_unlock(&pool_mutex);
+    return retire;
+}
+
 void* worker_thread(void *arg) {
+    int id = (long)arg;
+    worker_stats(id);
     while (1) {
-        int fd = dequeue_work();
+        long enqueued;
+        int fd = dequeue_work(id, &enqueued);
+        if (fd == QUEUE_RETIRE) {
+            if (worker_retire(id)) {
+                break;
+            }
+            continue;
+        }
         if (fd == -1){
             break;
         }
+        long wait = clock_ns() - enqueued;
+        if (queue_deadline_ns > 0 && wait > queue_deadline_ns) {
+            if (reactor_mode) {
+                reactor_expire(fd, wait);
+            } else {
+                shed_connection(fd);
+                close(fd);
+            }
+            continue;
+        }
         usleep(random() % 10000);
-        handle_work(fd);
+        if (reactor_mode) {
+            reactor_handle(fd, wait);
+            continue;
+        }
+        handle_work(fd, wait, enqueued);
         close(fd);
     }
     return NULL;
 }
 
-void handle_work(int sock_fd) {
-    struct request req;
-    struct request response;
-    char buf_write[4096];
-    char buf_read[4096];
-    int len;
-    int status;
+/* workers 0..size-1 take new work. missing ones are started (a worker
+ * that retired is joined first); ones above size retire by themselves
+ * once their queue is empty
+ */
+static void pool_resize(int size) {
+    pthread_mutex_lock(&pool_mutex);
+    pool_size = size;
+    queue_set_active(size);
+    for (int i = 0; i < size; i++) {
+        if (worker_alive[i]) {
+            continue;
+        }
+        if (worker_started[i]) {
+            pthread_join(worker_tids[i], NULL);
+        }
+        if (pthread_create(&worker_tids[i], NULL, worker_thread, (void *)(long)i) != 0) {
+            perror("pthread_create worker");
+            exit(1);
+        }
+        worker_started[i] = worker_alive[i] = 1;
+    }
+    pthread_mutex_unlock(&pool_mutex);
+}
 
-    if (read(sock_fd, &req, sizeof(req)) <=0) {
-        perror("Failed to read request");
-        close(sock_fd);
-        pthread_mutex_lock(&stat_mutex);
-        stat_failed++;
-        pthread_mutex_unlock(&stat_mutex);
-        return;
+/* every tick, look at the queue: more requests waiting than workers,
+ * or a mean queue wait over POOL_WAIT_NS since the last tick, is a
+ * backlog; an empty queue with a worker parked is idle. a backlog that
+ * lasts pool_grow_ms grows the pool by half; idleness that lasts
+ * pool_idle_ms shrinks it by one. growing fast and shrinking slowly,
+ * with both counts starting over after a change, keeps the pool from
+ * flapping
+ */
+void* pool_thread(void *arg) {
+    static struct histogram wait;
+    long last_count = 0, last_sum = 0;
+    int busy_ms = 0, idle_ms = 0;
+    while (!shutdown_flag) {
+        usleep(POOL_TICK_MS * 1000);
+        long count = 0, sum = 0;
+        for (int op = 0; op < 3; op++) {
+            latency_sum(op, LAT_WAIT, &wait);
+            count += wait.count;
+            sum += wait.sum;
+        }
+        /* after `stats reset` the totals start again from zero */
+        long mean = count > last_count && sum >= last_sum ? (sum - last_sum) / (count - last_count) : 0;
+        last_count = count;
+        last_sum = sum;
+
+        int size = pool_size;
+        int depth = queue_length();
+        if (depth > size || mean > POOL_WAIT_NS) {
+            busy_ms += POOL_TICK_MS;
+            idle_ms = 0;
+        } else if (depth == 0 && queue_idle_workers() > 0) {
+            idle_ms += POOL_TICK_MS;
+            busy_ms = 0;
+        } else {
+            busy_ms = idle_ms = 0;
+        }
+        if (busy_ms >= pool_grow_ms && size < pool_max) {
+            int step = size / 2 > 1 ? size / 2 : 1;
+            pool_resize(size + step < pool_max ? size + step : pool_max);
+            pool_grows++;
+            busy_ms = 0;
+        } else if (idle_ms >= pool_idle_ms && size > pool_min) {
+            pool_resize(size - 1);
+            pool_shrinks++;
+            idle_ms = 0;
+        }
     }
+    return NULL;
+}
 
-    if (req.op_status == 'Q') {
-        shutdown_flag = 1;
-        close(sock_fd);
-        queue_shutdown();
-        queue_cleanup();
-        db_cleanup();
-        exit(0);
+long clock_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static int latency_index(char op) {
+    char *p = op ? strchr(LAT_OPS, op) : NULL;
+    return p ? p - LAT_OPS : -1;
+}
+
+/* called once by each thread that will count anything, before it does
+ */
+struct request_stats *stats_register(void) {
+    struct thread_counters *t = aligned_alloc(64, sizeof(*t));
+    if (!t) {
+        perror("malloc");
+        exit(1);
+    }
+    memset(t, 0, sizeof(*t));
+    t->latency_gen = __atomic_load_n(&latency_gen, __ATOMIC_RELAXED);
+    int i = __atomic_fetch_add(&n_stat_threads, 1, __ATOMIC_RELAXED);
+    if (i >= MAX_STAT_THREADS) {
+        fprintf(stderr, "too many threads\n");
+        exit(1);
     }
+    __atomic_store_n(&stat_threads[i], t, __ATOMIC_RELEASE);
+    my_counters = t;
+    thread_stats = &t->c;
+    return thread_stats;
+}
 
-    switch (req.op_status) {
-        case 'W':
-            len = atoi(req.len);
-            if (len > 4096) {
-                len = 4096;
+/* the threads registered so far; entries may still be NULL while a
+ * thread is registering */
+static int stat_thread_count(void) {
+    int n = __atomic_load_n(&n_stat_threads, __ATOMIC_RELAXED);
+    return n < MAX_STAT_THREADS ? n : MAX_STAT_THREADS;
+}
+
+void stats_sum(struct request_stats *sum) {
+    memset(sum, 0, sizeof(*sum));
+    for (int i = 0; i < stat_thread_count(); i++) {
+        struct thread_counters *t = __atomic_load_n(&stat_threads[i], __ATOMIC_ACQUIRE);
+        if (t == NULL) {
+            continue;
+        }
+        sum->reads += __atomic_load_n(&t->c.reads, __ATOMIC_RELAXED);
+        sum->writes += __atomic_load_n(&t->c.writes, __ATOMIC_RELAXED);
+        sum->deletes += __atomic_load_n(&t->c.deletes, __ATOMIC_RELAXED);
+        sum->failed += __atomic_load_n(&t->c.failed, __ATOMIC_RELAXED);
+        sum->forwarded += __atomic_load_n(&t->c.forwarded, __ATOMIC_RELAXED);
+        sum->bytes_in += __atomic_load_n(&t->c.bytes_in, __ATOMIC_RELAXED);
+        sum->bytes_out += __atomic_load_n(&t->c.bytes_out, __ATOMIC_RELAXED);
+        sum->accepted += __atomic_load_n(&t->c.accepted, __ATOMIC_RELAXED);
+        sum->shed_busy += __atomic_load_n(&t->c.shed_busy, __ATOMIC_RELAXED);
+        sum->shed_expired += __atomic_load_n(&t->c.shed_expired, __ATOMIC_RELAXED);
+        sum->deferred += __atomic_load_n(&t->c.deferred, __ATOMIC_RELAXED);
+        long high = __atomic_load_n(&t->c.queue_high, __ATOMIC_RELAXED);
+        if (high > sum->queue_high) {
+            sum->queue_high = high;
+        }
+    }
+}
+
+void count_queued(int depth) {
+    if (depth > thread_stats->queue_high) {
+        thread_stats->queue_high = depth;
+    }
+}
+
+void record_latency(char op, long wait, long service, long total) {
+    struct thread_counters *t = my_counters;
+    int i = latency_index(op);
+    int gen = __atomic_load_n(&latency_gen, __ATOMIC_RELAXED);
+    if (t->latency_gen != gen) {
+        for (int j = 0; j < 3; j++) {
+            for (int k = 0; k < LAT_KINDS; k++) {
+                hist_reset(&t->latency[j][k]);
             }
-            if (read(sock_fd, buf_write, len) != len) {
-                perror("Failed to read provided data");
-                response.op_status = 'X';
-                break;
+        }
+        __atomic_store_n(&t->latency_gen, gen, __ATOMIC_RELEASE);
+    }
+    if (i >= 0) {
+        hist_record(&t->latency[i][LAT_WAIT], wait);
+        hist_record(&t->latency[i][LAT_SERVICE], service);
+        hist_record(&t->latency[i][LAT_TOTAL], total);
+    }
+}
+
+/* one op's (index into LAT_OPS) latency of one kind, over all threads
+ * that have recorded since the last reset
+ */
+void latency_sum(int op, int kind, struct histogram *h) {
+    int gen = __atomic_load_n(&latency_gen, __ATOMIC_RELAXED);
+    hist_reset(h);
+    for (int j = 0; j < stat_thread_count(); j++) {
+        struct thread_counters *t = __atomic_load_n(&stat_threads[j], __ATOMIC_ACQUIRE);
+        if (t && __atomic_load_n(&t->latency_gen, __ATOMIC_ACQUIRE) == gen) {
+            hist_merge(h, &t->latency[op][kind]);
+        }
+    }
+}
+
+static void reset_latency(void) {
+    __atomic_fetch_add(&latency_gen, 1, __ATOMIC_RELAXED);
+}
+
+static void print_latency(void) {
+    static const char *kinds[LAT_KINDS] = {"queue wait", "service", "total"};
+    static struct histogram merged;
+    struct histogram *h = &merged;
+    printf("Latency (us)          count       p50       p90       p99     p99.9       max\n");
+    for (int i = 0; i < 3; i++) {
+        for (int k = 0; k < LAT_KINDS; k++) {
+            latency_sum(i, k, h);
+            if (h->count == 0) {
+                continue;
             }
-            status = db_write(req.name, buf_write, len);
-            if (status == 0) {
-                response.op_status = 'K';
-            } else {
-                response.op_status = 'X';
+            printf("  %c %-10s %10ld %9.1f %9.1f %9.1f %9.1f %9.1f\n", LAT_OPS[i], kinds[k], h->count,
+                   hist_percentile(h, 0.5) / 1e3, hist_percentile(h, 0.9) / 1e3,
+                   hist_percentile(h, 0.99) / 1e3, hist_percentile(h, 0.999) / 1e3, h->max / 1e3);
+        }
+    }
+}
+
+void set_response(struct request *response, char status, int len) {
+    response->op_status = status;
+    memset(response->name, 0 , sizeof(response->name));
+    snprintf(response->len, sizeof(response->len), "%d", len);
+}
+
+void count_failed_request(void) {
+    thread_stats->failed++;
+}
+
+void count_request(char op, char status) {
+    struct request_stats *st = thread_stats;
+    st->reads += op == 'R';
+    st->writes += op == 'W';
+    st->deletes += op == 'D';
+    st->failed += status == 'X';
+}
+
+/* answer X to a request that won't be run: the queue was full, or it
+ * waited past the deadline
+ */
+void shed_request(struct request *req, struct request *response, int expired) {
+    set_response(response, 'X', 0);
+    count_request(req->op_status, 'X');
+    if (expired) {
+        thread_stats->shed_expired++;
+    } else {
+        thread_stats->shed_busy++;
+    }
+}
+
+/* length of a W body. the field is up to 8 digits and need not be
+ * NUL-terminated, so atoi() could run off its end
+ */
+int request_len(struct request *req) {
+    int len = 0;
+    for (int i = 0; i < sizeof(req->len) && req->len[i] >= '0' && req->len[i] <= '9'; i++) {
+        len = len * 10 + req->len[i] - '0';
+    }
+    return len;
+}
+
+/* last step of a streamed W: ok says whether every chunk made it into s */
+void finish_write(struct request *req, struct db_stream *s, int ok, struct request *response) {
+    if (ok && replica_mode) {
+        db_write_abort(s);
+        ok = 0;
+    }
+    int status = ok ? db_write_end(s, req->name) : -1;
+    set_response(response, status == 0 ? 'K' : 'X', 0);
+    count_request('W', response->op_status);
+}
+
+/* run one operation against the database, counting it. data holds
+ * the value of a W, which may be bigger than DB_INLINE_MAX. for R the
+ * length of the value is returned and value says where it is: in
+ * buf_read, or (value->fd >= 0) in a file the caller reads from and
+ * closes. *status is set to K or X.
+ */
+int execute_op(char op, char *key, char *data, int data_len, char *buf_read, struct db_value *value,
+               char *status) {
+    struct db_stream s;
+    int len = 0;
+    int rv = -1;
+
+    value->fd = -1;
+    if (replica_mode && (op == 'W' || op == 'D')) {
+        *status = 'X';
+        count_request(op, *status);
+        return 0;
+    }
+    switch (op) {
+        case 'W':
+            if (data_len <= DB_INLINE_MAX) {
+                rv = db_write(key, data, data_len);
+            } else if (db_write_begin(&s, data_len) == 0) {
+                if (db_write_chunk(&s, data, data_len) == 0) {
+                    rv = db_write_end(&s, key);
+                } else {
+                    db_write_abort(&s);
+                }
             }
-            snprintf(response.len, sizeof(response.len), "%d", 0);
             break;
         case 'R':
-            len = db_read(req.name, buf_read);
+            len = db_read_value(key, buf_read, value);
             if (len > 0) {
-                response.op_status = 'K';
-                snprintf(response.len, sizeof(response.len), "%d", len);
+                rv = 0;
             } else {
-                response.op_status = 'X';
-                snprintf(response.len, sizeof(response.len), "%d", 0);
+                if (value->fd >= 0) {
+                    close(value->fd);
+                    value->fd = -1;
+                }
+                len = 0;
             }
             break;
         case 'D':
-            status = db_delete(req.name);
-            if (status == 0) {
-                response.op_status = 'K';
-                snprintf(response.len, sizeof(response.len), "%d", 0);
-                break;
-            } 
-            response.op_status = 'X';
-            snprintf(response.len, sizeof(response.len), "%d", 0);
+            rv = db_delete(key);
             break;
         default:
             perror("invalid operation");
-            response.op_status = 'X';
-            snprintf(response.len, sizeof(response.len), "%d", 0);
             break;
     }
 
-    memset(response.name, 0 , sizeof(response.name));
-    write(sock_fd, &response, sizeof(response));
-    if (req.op_status == 'R' && response.op_status == 'K') {
-        write(sock_fd, buf_read, len);
+    *status = rv == 0 ? 'K' : 'X';
+    count_request(op, *status);
+    return len;
+}
+
+/* run one complete request against the database. data holds the body of
+ * a W request. for R the length of the value is returned and value says
+ * where it is: in buf_read, or (value->fd >= 0) in a file the caller
+ * sends from and closes.
+ */
+int process_request(struct request *req, char *data, struct request *response, char *buf_read,
+                    struct db_value *value) {
+    char status;
+
+    if (req->op_status == 'Q') {
+        shutdown_flag = 1;
+        queue_shutdown();
+        queue_cleanup();
+        repl_stop();
+        db_cleanup();
+        exit(0);
+    }
+
+    int len = execute_op(req->op_status, req->name, data, request_len(req), buf_read, value, &status);
+    set_response(response, status, len);
+    return len;
+}
+
+/* read exactly len bytes. returns len, 0 on EOF before the first byte,
+ * -1 on error or EOF part way through.
+ */
+int read_full(int fd, void *buf, int len) {
+    int done = 0;
+    while (done < len) {
+        int n = read(fd, (char *)buf + done, len - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            thread_stats->bytes_in += done;
+            return (n == 0 && done == 0) ? 0 : -1;
+        }
+        done += n;
+    }
+    thread_stats->bytes_in += done;
+    return done;
+}
+
+static int write_reply(int fd, struct request *response, char *data, int len) {
+    struct iovec iov[2] = {{response, sizeof(*response)}, {data, len}};
+    int iovcnt = len > 0 ? 2 : 1;
+    int total = sizeof(*response) + len;
+    while (total > 0) {
+        int n = writev(fd, iov, iovcnt);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        total -= n;
+        for (int i = 0; i < iovcnt; i++) {
+            int step = n < iov[i].iov_len ? n : iov[i].iov_len;
+            iov[i].iov_base = (char *)iov[i].iov_base + step;
+            iov[i].iov_len -= step;
+            n -= step;
+        }
+    }
+    thread_stats->bytes_out += sizeof(*response) + len;
+    return 0;
+}
+
+/* reply with a value that is in a file: the header goes out with
+ * MSG_MORE so it shares a segment with the start of the value, which the
+ * kernel copies from the file to the socket without passing through us
+ */
+static int send_file_reply(int fd, struct request *response, struct db_value *value) {
+    int sent = 0;
+    while (sent < sizeof(*response)) {
+        int n = send(fd, (char *)response + sent, sizeof(*response) - sent, MSG_MORE | MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        sent += n;
+    }
+    off_t offset = value->offset;
+    int left = value->len;
+    while (left > 0) {
+        int n = sendfile(fd, value->fd, &offset, left);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        left -= n;
+    }
+    thread_stats->bytes_out += sizeof(*response) + value->len;
+    return 0;
+}
+
+/* a W too big to buffer: the body goes to the database a chunk at a
+ * time. if storing fails part way the rest of the body is still read,
+ * so the connection stays in step. returns -1 if the client went away.
+ */
+static int stream_write(int fd, struct request *req, int len, struct request *response) {
+    char chunk[STREAM_CHUNK];
+    struct db_stream s;
+    int ok = db_write_begin(&s, len) == 0;
+    while (len > 0) {
+        int n = len < STREAM_CHUNK ? len : STREAM_CHUNK;
+        if (read_full(fd, chunk, n) != n) {
+            perror("Failed to read provided data");
+            if (ok) {
+                db_write_abort(&s);
+            }
+            count_request('W', 'X');
+            return -1;
+        }
+        if (ok && db_write_chunk(&s, chunk, n) < 0) {
+            db_write_abort(&s);
+            ok = 0;
+        }
+        len -= n;
+    }
+    finish_write(req, &s, ok, response);
+    return 0;
+}
+
+/* serve requests on one connection until the client closes it. old
+ * clients send a single request and close after the reply; newer ones
+ * keep the socket open and may pipeline several requests, which are
+ * answered strictly in the order they were sent. a connection that
+ * opens with V2_MAGIC speaks the v2 protocol instead (proto2.c).
+ *
+ * only the first request waited in the queue (wait, since enqueued);
+ * later ones are timed from when their header has been read.
+ */
+void handle_work(int sock_fd, long wait, long enqueued) {
+    struct request req;
+    struct request response;
+    char buf_write[DB_INLINE_MAX];
+    char buf_read[DB_INLINE_MAX];
+    int len = 0;
+    int n;
+
+    if ((n = read_full(sock_fd, &req, 1)) > 0 && (unsigned char)req.op_status == V2_MAGIC) {
+        v2_serve(sock_fd, wait, enqueued);
+        return;
     }
+    if (n > 0 && read_full(sock_fd, (char *)&req + 1, sizeof(req) - 1) != sizeof(req) - 1) {
+        n = -1;
+    }
+    for (; n > 0; n = read_full(sock_fd, &req, sizeof(req))) {
+        long start = clock_ns();
+        if (req.op_status == 'Q') {
+            close(sock_fd);
+        }
 
-    pthread_mutex_lock(&stat_mutex);
-    if (req.op_status == 'R') stat_reads++;
-    if (req.op_status == 'W') stat_writes++;
-    if (req.op_status == 'D') stat_deletes++;
-    if (response.op_status == 'X') stat_failed++;
-    pthread_mutex_unlock(&stat_mutex);
+        if (req.op_status == 'W' && (len = request_len(&req)) > DB_INLINE_MAX) {
+            if (stream_write(sock_fd, &req, len, &response) < 0 ||
+                write_reply(sock_fd, &response, NULL, 0) < 0) {
+                return;
+            }
+            long end = clock_ns();
+            record_latency('W', wait, end - start, end - (enqueued ? enqueued : start));
+            wait = enqueued = 0;
+            continue;
+        }
+        if (req.op_status == 'W') {
+            if (read_full(sock_fd, buf_write, len) != len) {
+                perror("Failed to read provided data");
+                set_response(&response, 'X', 0);
+                write_reply(sock_fd, &response, NULL, 0);
+                count_request('W', 'X');
+                return;
+            }
+        }
+
+        struct db_value value;
+        len = process_request(&req, buf_write, &response, buf_read, &value);
+        if (value.fd >= 0) {
+            int status = send_file_reply(sock_fd, &response, &value);
+            close(value.fd);
+            if (status < 0) {
+                return;
+            }
+        } else if (write_reply(sock_fd, &response, buf_read, len) < 0) {
+            return;
+        }
+        long end = clock_ns();
+        record_latency(req.op_status, wait, end - start, end - (enqueued ? enqueued : start));
+        wait = enqueued = 0;
+    }
+    if (n < 0) {
+        perror("Failed to read request");
+        count_failed_request();
+    }
+}
+
+static const char *repl_states[] = {"connecting", "snapshot", "streaming"};
+
+/* a primary's backlog and each replica's progress, or a replica's own */
+static void print_replication(void) {
+    static struct repl_stats rs;
+    repl_get_stats(&rs);
+    if (rs.primary) {
+        printf("Replication: primary, change %lu, backlog %lu..%lu (%.1f of %.1f MB), %d replicas, "
+               "%ld fell behind\n", rs.head, rs.first, rs.head, rs.backlog_bytes / 1048576.0,
+               rs.backlog_max / 1048576.0, rs.replicas, rs.fell_behind);
+        for (int i = 0; i < rs.replicas; i++) {
+            struct repl_replica_stats *r = &rs.replica[i];
+            printf("  replica %s: %s, applied %lu, %lu behind, lag %.1f ms, %ld bytes unsent, %ld snapshots\n",
+                   r->addr, repl_states[r->state], r->acked, rs.head > r->acked ? rs.head - r->acked : 0,
+                   r->lag_us / 1e3, r->unsent, r->snapshots);
+        }
+    }
+    if (rs.following) {
+        printf("Replication: replica of %s, %s, applied %lu, primary at %lu, %lu behind, lag %.1f ms\n",
+               rs.primary_addr, repl_states[rs.state], rs.applied, rs.primary_head,
+               rs.primary_head > rs.applied ? rs.primary_head - rs.applied : 0, rs.lag_us / 1e3);
+        printf("  %ld changes applied, %ld failed, %ld connects, %ld snapshots (last %ld keys)\n",
+               rs.changes, rs.errors, rs.connects, rs.snapshots, rs.snapshot_keys);
+    }
 }
 
 void print_stats(void) {
-    pthread_mutex_lock(&stat_mutex);
+    struct request_stats sum;
+    stats_sum(&sum);
     printf("Database objects: %d\n", count_valid_objects());
-    printf("Read requests: %d\n", stat_reads);
-    printf("Write requests: %d\n", stat_writes);
-    printf("Delete requests: %d\n", stat_deletes);
-    printf("Failed requests: %d\n", stat_failed);
-    pthread_mutex_unlock(&stat_mutex);
+    printf("Read requests: %ld\n", sum.reads);
+    printf("Write requests: %ld\n", sum.writes);
+    printf("Delete requests: %ld\n", sum.deletes);
+    printf("Failed requests: %ld\n", sum.failed);
+    printf("Connections accepted: %ld\n", sum.accepted);
+    printf("Bytes in: %ld, bytes out: %ld\n", sum.bytes_in, sum.bytes_out);
+    for (int i = 0; shard_mode && i < acceptors; i++) {
+        struct request_stats shard;
+        reactor_get_stats(i, &shard);
+        printf("  shard %d: %ld requests run, %ld sent to other shards\n", i,
+               shard.reads + shard.writes + shard.deletes, shard.forwarded);
+    }
+
+    struct db_usage u;
+    db_usage(&u);
+    long total = u.index_bytes + u.record_bytes + u.key_bytes;
+    printf("Table memory: %ld bytes (index %ld, records %ld, keys %ld, %ld dead)\n",
+           total, u.index_bytes, u.record_bytes, u.key_bytes, u.key_dead_bytes);
+    if (u.keys > 0) {
+        printf("Memory per key: %.1f bytes\n", (double)total / u.keys);
+    }
     
-    printf("Requests in queue: %d\n", queue_length());
+    struct cache_stats cs;
+    cache_get_stats(&cs);
+    long lookups = cs.hits + cs.misses;
+    printf("Cache: %ld hits, %ld misses (%.1f%% hit rate), %ld evictions, %ld of %ld bytes\n",
+           cs.hits, cs.misses, lookups ? 100.0 * cs.hits / lookups : 0.0,
+           cs.evictions, cs.bytes, cs.budget);
+
+    if (storage_engine == DB_ENGINE_LOG) {
+        struct log_stats ls;
+        log_get_stats(&ls);
+        printf("Log: %d segment files, %ld bytes, %ld live (%.1f%% garbage), %ld compactions (%ld bytes)\n",
+               ls.files, ls.bytes, ls.live_bytes,
+               ls.bytes ? 100.0 * (ls.bytes - ls.live_bytes) / ls.bytes : 0.0,
+               ls.compactions, ls.compacted_bytes);
+    }
+    if (storage_engine == DB_ENGINE_LSM) {
+        struct lsm_stats ls;
+        lsm_get_stats(&ls);
+        printf("LSM: memtable %ld bytes, %ld flushes, %ld compactions (%ld bytes), %ld write stalls\n",
+               ls.mem_bytes, ls.flushes, ls.compactions, ls.compacted_bytes, ls.stalls);
+        for (int level = 0; level < LSM_LEVELS; level++) {
+            if (ls.tables[level] > 0) {
+                printf("  L%d: %d tables, %ld bytes\n", level, ls.tables[level], ls.level_bytes[level]);
+            }
+        }
+        printf("  %ld table block reads, %ld probes skipped by bloom filters\n",
+               ls.table_reads, ls.bloom_skips);
+    }
+    if (wal_mode) {
+        static struct wal_stats ws;
+        wal_get_stats(&ws);
+        printf("WAL: %ld syncs for %ld writes, %ld failed, %ld appends failed (window %d us, batch max %d)",
+               ws.syncs, ws.writes, ws.failures, ws.append_failures, ws.window_us, ws.batch_max);
+        if (ws.failed) {
+            printf(", refusing writes");
+        }
+        if (storage_engine != DB_ENGINE_LOG) {
+            printf(", %ld bytes logged", ws.bytes);
+        }
+        printf("\n");
+        if (ws.syncs > 0) {
+            printf("  writes per sync: mean %.1f, p50 %ld, p99 %ld, max %ld\n",
+                   (double)ws.batch.sum / ws.batch.count, hist_percentile(&ws.batch, 0.5),
+                   hist_percentile(&ws.batch, 0.99), ws.batch.max);
+            printf("  sync latency (us): mean %.1f, p50 %.1f, p99 %.1f, max %.1f\n",
+                   ws.latency.sum / 1e3 / ws.latency.count, hist_percentile(&ws.latency, 0.5) / 1e3,
+                   hist_percentile(&ws.latency, 0.99) / 1e3, ws.latency.max / 1e3);
+        }
+    }
+
+    print_replication();
+    print_latency();
+    if (shard_mode) {
+        return;
+    }
+    printf("Requests in queue: %d (high-water %ld in one worker's queue)\n", queue_length(),
+           sum.queue_high);
+    printf("Shed: %ld busy, %ld past deadline, %ld connections deferred (limit %d queued",
+           sum.shed_busy, sum.shed_expired, sum.deferred, queue_max);
+    if (queue_deadline_ns > 0) {
+        printf(", deadline %ld ms", queue_deadline_ns / 1000000);
+    }
+    printf(")\n");
+    printf("Workers: %d (%d..%d), grown %ld times, shrunk %ld times\n", queue_active_workers(),
+           pool_min, pool_max, pool_grows, pool_shrinks);
+    for (int i = 0; i < queue_workers(); i++) {
+        struct queue_worker_stats qs;
+        queue_worker_stats(i, &qs);
+        printf("  worker %d: %d queued, %ld run, %ld stolen%s\n", i, qs.depth, qs.taken, qs.steals,
+               i < queue_active_workers() ? "" : " (retired)");
+    }
 }
 
 int main(int argc, char *argv[]) {
-    if (argc > 1) {
-        server_port = atoi(argv[1]);
+    int opt;
+    long cache_bytes = CACHE_BYTES;
+    char *admin_addr = NULL;
+    int wal_window_us = 0, wal_batch_max = WAL_BATCH_MAX;
+    char *data_dir = NULL;
+    char *primary_addr = NULL;
+    int repl_port = 0;
+    long repl_backlog_mb = REPL_BACKLOG_BYTES >> 20;
+    while ((opt = getopt(argc, argv, "eSa:b:c:d:m:q:r:s:w:D:P:W:")) != -1) {
+        switch (opt) {
+            case 'e':
+                reactor_mode = 1;
+                break;
+            case 'S':
+                shard_mode = reactor_mode = 1;
+                break;
+            case 'a':
+                acceptors = atoi(optarg);
+                if (acceptors < 1 || acceptors > MAX_ACCEPTORS) {
+                    fprintf(stderr, "acceptors must be 1..%d\n", MAX_ACCEPTORS);
+                    exit(1);
+                }
+                break;
+            case 'b':
+                listen_backlog = atoi(optarg);
+                break;
+            case 'c':
+                cache_bytes = atol(optarg);
+                break;
+            case 'd':
+                queue_deadline_ns = atol(optarg) * 1000000L;
+                break;
+            case 'm':
+                admin_addr = optarg;
+                break;
+            case 'D':
+                data_dir = optarg;
+                break;
+            case 'P':
+                /* PORT[:BACKLOG-MB] */
+                sscanf(optarg, "%d:%ld", &repl_port, &repl_backlog_mb);
+                if (repl_port < 1 || repl_backlog_mb < (REPL_BACKLOG_MIN >> 20)) {
+                    fprintf(stderr, "replication port must be > 0 and backlog >= %ld MB\n",
+                            REPL_BACKLOG_MIN >> 20);
+                    exit(1);
+                }
+                break;
+            case 'r':
+                primary_addr = optarg;
+                replica_mode = 1;
+                break;
+            case 'q':
+                queue_max = atoi(optarg);
+                break;
+            case 'w':
+                /* MIN[:MAX[:GROW-MS[:IDLE-MS]]] */
+                if (sscanf(optarg, "%d:%d:%d:%d", &pool_min, &pool_max, &pool_grow_ms, &pool_idle_ms) == 1) {
+                    pool_max = pool_min;
+                }
+                if (pool_min < 1 || pool_max < pool_min || pool_max > MAX_WORKERS) {
+                    fprintf(stderr, "workers must be 1 <= min <= max <= %d\n", MAX_WORKERS);
+                    exit(1);
+                }
+                break;
+            case 'W':
+                /* WINDOW-US[:BATCH-MAX] */
+                wal_mode = 1;
+                sscanf(optarg, "%d:%d", &wal_window_us, &wal_batch_max);
+                if (wal_window_us < 0 || wal_batch_max < 1) {
+                    fprintf(stderr, "WAL commit window must be >= 0 us and batch max >= 1\n");
+                    exit(1);
+                }
+                break;
+            case 's':
+                if (strcmp(optarg, "files") == 0) {
+                    storage_engine = DB_ENGINE_FILES;
+                } else if (strcmp(optarg, "log") == 0) {
+                    storage_engine = DB_ENGINE_LOG;
+                } else if (strcmp(optarg, "lsm") == 0) {
+                    storage_engine = DB_ENGINE_LSM;
+                } else {
+                    fprintf(stderr, "unknown storage engine %s (files, log, lsm)\n", optarg);
+                    exit(1);
+                }
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-e] [-S] [-a acceptors] [-b backlog] [-c cache-bytes] [-d deadline-ms] [-m admin-port|admin-socket] [-q max-queued] [-r [primary-host:]repl-port] [-s files|log|lsm] [-w min[:max[:grow-ms[:idle-ms]]]] [-D data-dir] [-P repl-port[:backlog-mb]] [-W window-us[:batch-max]] [port]\n", argv[0]);
+                exit(1);
+        }
+    }
+    cache_init(cache_bytes);
+    if (data_dir && db_directory(data_dir) < 0) {
+        exit(1);
+    }
+    if (wal_mode) {
+        db_durable(wal_window_us, wal_batch_max);
+    }
+    if (db_open(storage_engine) < 0) {
+        fprintf(stderr, "can't open database\n");
+        exit(1);
+    }
+    if (repl_port && repl_listen(repl_port, repl_backlog_mb << 20) < 0) {
+        exit(1);
+    }
+    if (primary_addr && repl_follow(primary_addr) < 0) {
+        exit(1);
+    }
+    if (optind < argc) {
+        server_port = atoi(argv[optind]);
+    }
+    signal(SIGPIPE, SIG_IGN);
+    if (acceptors == 0 && shard_mode) {
+        /* one shard per CPU unless -a says otherwise */
+        acceptors = sysconf(_SC_NPROCESSORS_ONLN);
+        acceptors = acceptors < 1 ? 1 : acceptors > MAX_ACCEPTORS ? MAX_ACCEPTORS : acceptors;
+    }
+    if (acceptors == 0) {
+        acceptors = 1;
+    }
+    queue_init(pool_max);
+    queue_set_limit(queue_max);
+    for (int i = 0; i < acceptors; i++) {
+        listener_fds[i] = open_listener(server_port);
+    }
+    if (reactor_mode) {
+        reactor_init();
+    }
+    if (admin_addr) {
+        admin_open(admin_addr);
     }
-    queue_init();
 
-    pthread_t listener_tid;
-    pthread_t worker_tids[WORKERS];
+    pthread_t listener_tids[MAX_ACCEPTORS];
+    pthread_t admin_tid;
+    pthread_t pool_tid;
 
-    if (pthread_create(&listener_tid, NULL, listener_thread, &server_port) != 0) {
-        perror("pthread_create listener");
-        exit(1);
+    for (int i = 0; i < acceptors; i++) {
+        if (pthread_create(&listener_tids[i], NULL, reactor_mode ? reactor_thread : listener_thread,
+                           (void *)(long)i) != 0) {
+            perror("pthread_create listener");
+            exit(1);
+        }
     }
-    for (int i = 0; i < WORKERS; i++) {
-        if (pthread_create(&worker_tids[i], NULL, worker_thread, NULL) != 0) {
-            perror("pthread_create worker");
+    if (!shard_mode) {
+        pool_resize(pool_min);
+        if (pool_min < pool_max && pthread_create(&pool_tid, NULL, pool_thread, NULL) != 0) {
+            perror("pthread_create pool");
             exit(1);
         }
     }
+    if (admin_addr && pthread_create(&admin_tid, NULL, admin_thread, NULL) != 0) {
+        perror("pthread_create admin");
+        exit(1);
+    }
     char line[128];
     while (!shutdown_flag && fgets(line, sizeof(line), stdin) != NULL) {
-        if (strncmp(line, "stats", 5) == 0) {
+        if (strncmp(line, "stats reset", 11) == 0) {
+            reset_latency();
+            printf("Latency histograms cleared\n");
+        } else if (strncmp(line, "stats", 5) == 0) {
             print_stats();
         } else if (strncmp(line, "quit", 4) == 0) {
             shutdown_flag = 1;
-            close(listener_sock_fd);
+            for (int i = 0; i < acceptors; i++) {
+                shutdown(listener_fds[i], SHUT_RDWR);
+            }
+            reactor_stop();
+            admin_stop();
             queue_shutdown();
             queue_cleanup();
+            repl_stop();
             db_cleanup();
             break;
         } else {
-            printf("Invalid command, Supported commands - stats, quit\n");
+            printf("Invalid command, Supported commands - stats, stats reset, quit\n");
+        }
+    }
+    for (int i = 0; i < acceptors; i++) {
+        pthread_join(listener_tids[i], NULL);
+    }
+    if (!shard_mode && pool_min < pool_max) {
+        pthread_join(pool_tid, NULL);
+    }
+    for (int i = 0; i < MAX_WORKERS; i++) {
+        if (worker_started[i]) {
+            pthread_join(worker_tids[i], NULL);
         }
     }
-    pthread_join(listener_tid, NULL);
-    for (int i = 0; i < WORKERS; i++) {
-        pthread_join(worker_tids[i], NULL);
+    if (admin_addr) {
+        pthread_join(admin_tid, NULL);
     }
     
     return 0;
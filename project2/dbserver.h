@@ -0,0 +1,75 @@
+#ifndef DBSERVER_H
+#define DBSERVER_H
+
+#include "proj2.h"
+#include "database.h"
+#include "histogram.h"
+
+/* bodies of W requests larger than DB_INLINE_MAX are read and stored in
+ * pieces this big
+ */
+#define STREAM_CHUNK (64 << 10)
+
+#define MAX_ACCEPTORS 64
+
+/* -W: writers one fdatasync covers at most, unless given */
+#define WAL_BATCH_MAX 64
+
+/* each thread that accepts, queues or serves requests counts into its
+ * own set (see stats_register), which only it writes; print_stats adds
+ * them up, so counting shares no cache line between cores
+ */
+struct request_stats {
+    long reads;
+    long writes;
+    long deletes;
+    long failed;
+    long forwarded;             /* shard mode: requests sent to another shard */
+    long bytes_in;              /* request headers and bodies */
+    long bytes_out;             /* reply headers and values */
+    long accepted;              /* connections */
+    long queue_high;            /* deepest worker queue this thread pushed to */
+    long shed_busy;             /* answered X because the queue was full */
+    long shed_expired;          /* answered X after waiting past the deadline */
+    long deferred;              /* connections held back until the queue had room */
+};
+
+/* R, W and D latency: time queued for a worker, time being served, and
+ * from queued (or read, for later requests on a connection a worker
+ * already holds) to reply written */
+enum { LAT_WAIT, LAT_SERVICE, LAT_TOTAL, LAT_KINDS };
+#define LAT_OPS "RWD"
+
+extern __thread struct request_stats *thread_stats;
+extern int shard_mode;
+extern int reactor_mode;
+extern int storage_engine;
+extern int wal_mode;
+extern int replica_mode;
+extern int pool_min, pool_max;
+extern long pool_grows, pool_shrinks;
+
+extern int shutdown_flag;
+extern int server_port;
+extern int acceptors;
+extern int listener_fds[MAX_ACCEPTORS];
+
+int process_request(struct request *req, char *data, struct request *response, char *buf_read,
+                    struct db_value *value);
+int execute_op(char op, char *key, char *data, int data_len, char *buf_read, struct db_value *value,
+               char *status);
+void set_response(struct request *response, char status, int len);
+struct request_stats *stats_register(void);
+void stats_sum(struct request_stats *sum);
+void latency_sum(int op, int kind, struct histogram *h);
+void count_request(char op, char status);
+void count_failed_request(void);
+void shed_request(struct request *req, struct request *response, int expired);
+void count_queued(int depth);
+int request_len(struct request *req);
+int read_full(int fd, void *buf, int len);
+long clock_ns(void);
+void record_latency(char op, long wait, long service, long total);
+void finish_write(struct request *req, struct db_stream *s, int ok, struct request *response);
+
+#endif
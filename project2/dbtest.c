@@ -19,13 +19,16 @@
 #include <assert.h>
 
 #include "proj2.h"
+#include "proto2.h"
+#include "dbclient.h"
 
 /* --------- argument parsing ---------- */
 
 static struct argp_option options[] = {
     {"threads",      't', "NUM",  0, "number of threads"},
     {"count",        'n', "NUM",  0, "number of requests"},
-    {"port",         'p', "PORT", 0, "TCP port to connect to (default 5000)"},
+    {"port",         'p', "PORT", 0, "TCP port to connect to (default 5000); a list "
+                                         "(5000,5001 or 5000-5003) shards keys over several servers"},
     {"set",          'S', "KEY",  0, "set KEY to VALUE"},
     {"get",          'G', "KEY",  0, "get value for KEY"},
     {"delete",       'D', "KEY",  0, "delete KEY"},
@@ -34,6 +37,19 @@ static struct argp_option options[] = {
     {"test",         'T',  0,     0, "10 simultaneous requests"},
     {"log",          'l', "FILE", 0, "log output to FILE"},
     {"overload",     'O',  0,     0, "try to create >200 keys"},
+    {"pipeline",     'P', "NUM",  0, "pipeline NUM requests on one connection"},
+    {"large",        'L', "BYTES", 0, "write, read back and delete values of BYTES"},
+    {"v2",           'V', "NUM",  0, "protocol v2: frames of NUM ops on one connection"},
+    {"batch",        'B', "NUM",  0, "protocol v2: batched writes, reads and deletes of NUM keys"},
+    {"shards",       'H', "KEYS", 0, "write, read back and delete KEYS keys over the --port servers, "
+                                     "checking each is on its server and timing it"},
+    {"keep",         'k',  0,     0, "--shards: leave the keys in place"},
+    {"verify",       'y',  0,     0, "--shards, --persist: only read back and check the keys a --keep run left"},
+    {"persist",      'K', "KEYS", 0, "write, delete and rewrite KEYS keys around fillers bigger than "
+                                     "a log file (--keep), or check what is left after a restart (--verify)"},
+    {"vnodes",       'v', "NUM",  0, "points per server on the hash ring (default 160)"},
+    {"replica",      'R', "PORT", 0, "time how long --count writes to --port take to show up on "
+                                     "the replica at PORT, one at a time and in batches"},
     {0}
 };
 
@@ -47,6 +63,18 @@ struct args {
     int op;
     int test;
     int overload;
+    int pipeline;
+    int large;
+    int v2;
+    int batch;
+    int shards;
+    int keep;
+    int verify;
+    int persist;
+    int vnodes;
+    int replica;
+    int ports[CLIENT_SHARDS_MAX];
+    int nports;
     char *key;
     char *val;
     char *logfile;
@@ -64,6 +92,7 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
         a->count = 1000;
         a->port = 5000;
         a->max = 200;
+        a->vnodes = RING_VNODES;
         a->logfp = NULL;
         pthread_mutex_init(&a->logm, NULL);
         break;
@@ -71,7 +100,31 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
     case 'O':
         a->overload = 1;
         break;
+
+    case 'P':
+        a->pipeline = atoi(arg);
+        if (a->pipeline < 1 || a->pipeline > 150)
+            printf("pipeline depth must be 1..150\n"), argp_usage(state);
+        break;
         
+    case 'L':
+        a->large = atoi(arg);
+        if (a->large < 1 || a->large > 9999999)
+            printf("value size must be 1..9999999\n"), argp_usage(state);
+        break;
+
+    case 'V':
+        a->v2 = atoi(arg);
+        if (a->v2 < 1 || a->v2 > 1000)
+            printf("ops per frame must be 1..1000\n"), argp_usage(state);
+        break;
+
+    case 'B':
+        a->batch = atoi(arg);
+        if (a->batch < 1 || a->batch > V2_BATCH_MAX)
+            printf("batch size must be 1..%d\n", V2_BATCH_MAX), argp_usage(state);
+        break;
+
     case 'l':
         a->logfile = arg;
         if ((a->logfp = fopen(arg, "w")) == NULL)
@@ -119,9 +172,42 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
         a->count = atoi(arg); break;
 
     case 'p':
-        a->port = atoi(arg);
+        a->nports = parse_ports(arg, a->ports, CLIENT_SHARDS_MAX);
+        if (a->nports < 1)
+            printf("bad port list %s\n", arg), argp_usage(state);
+        a->port = a->ports[0];
+        break;
+
+    case 'H':
+        a->shards = atoi(arg);
+        if (a->shards < 1)
+            printf("key count must be >= 1\n"), argp_usage(state);
+        break;
+
+    case 'k':
+        a->keep = 1;
+        break;
+
+    case 'y':
+        a->verify = 1;
+        break;
+
+    case 'K':
+        a->persist = atoi(arg);
+        if (a->persist < 1)
+            printf("key count must be >= 1\n"), argp_usage(state);
+        break;
+
+    case 'v':
+        a->vnodes = atoi(arg);
+        if (a->vnodes < 1 || a->vnodes > 10000)
+            printf("vnodes must be 1..10000\n"), argp_usage(state);
         break;
         
+    case 'R':
+        a->replica = atoi(arg);
+        break;
+
     case ARGP_KEY_ARG:
         if (state->arg_num == 0 && a->op == OP_SET)
             a->val = arg;
@@ -559,22 +645,782 @@ void do_overload(struct args *a)
     }
 }
     
+int read_reply(int sock, struct request *rq, char *buf, int max)
+{
+    for (void *ptr = rq, *end = ptr + sizeof(*rq); ptr < end; ) {
+        int n = read(sock, ptr, end-ptr);
+        if (n <= 0)
+            return -1;
+        ptr += n;
+    }
+    int len = atoi(rq->len);
+    if (len > max)
+        return -1;
+    for (void *ptr = buf, *end = ptr + len; ptr < end; ) {
+        int n = read(sock, ptr, end-ptr);
+        if (n <= 0)
+            return -1;
+        ptr += n;
+    }
+    return len;
+}
+
+/* send --pipeline requests back to back on a single connection before
+ * reading any of the replies, then check they come back in order.
+ */
+void do_pipeline(struct args *a)
+{
+    int depth = a->pipeline, errors = 0, ops = 0;
+    int sock = do_connect(&a->addr);
+    int lens[depth], crcs[depth];
+    char data[1024];
+    struct request rq;
+
+    for (int round = 0; round < (a->count + depth - 1) / depth; round++) {
+        for (int j = 0; j < depth; j++) {
+            memset(&rq, 0, sizeof(rq));
+            rq.op_status = 'W';
+            sprintf(rq.name, "PIPE-%d", j);
+            lens[j] = 20 + random() % 600;
+            randstr(data, lens[j]);
+            crcs[j] = crc32(-1, (unsigned char*)data, lens[j]);
+            sprintf(rq.len, "%d", lens[j]);
+            write(sock, &rq, sizeof(rq));
+            write(sock, data, lens[j]);
+        }
+        for (int j = 0; j < depth; j++, ops++)
+            if (read_reply(sock, &rq, data, sizeof(data)) < 0 ||
+                rq.op_status != 'K')
+                printf("PIPELINE W PIPE-%d: FAILED\n", j), errors++;
+
+        for (int j = 0; j < depth; j++) {
+            memset(&rq, 0, sizeof(rq));
+            rq.op_status = 'R';
+            sprintf(rq.name, "PIPE-%d", j);
+            sprintf(rq.len, "0");
+            write(sock, &rq, sizeof(rq));
+        }
+        for (int j = 0; j < depth; j++, ops++) {
+            int len = read_reply(sock, &rq, data, sizeof(data));
+            int _crc = crc32(-1, (unsigned char*)data, len);
+            if (len != lens[j] || _crc != crcs[j])
+                printf("PIPELINE R PIPE-%d: bad reply (len %d)\n", j, len),
+                    errors++;
+        }
+
+        for (int j = 0; j < depth; j++) {
+            memset(&rq, 0, sizeof(rq));
+            rq.op_status = 'D';
+            sprintf(rq.name, "PIPE-%d", j);
+            write(sock, &rq, sizeof(rq));
+        }
+        for (int j = 0; j < depth; j++, ops++)
+            if (read_reply(sock, &rq, data, sizeof(data)) < 0 ||
+                rq.op_status != 'K')
+                printf("PIPELINE D PIPE-%d: FAILED\n", j), errors++;
+    }
+    close(sock);
+    printf("pipeline: %d requests on one connection, %d errors\n",
+           ops, errors);
+}
+
+int write_all(int sock, void *buf, int len)
+{
+    for (void *ptr = buf, *end = ptr + len; ptr < end; ) {
+        int n = write(sock, ptr, end-ptr);
+        if (n <= 0)
+            return -1;
+        ptr += n;
+    }
+    return len;
+}
+
+/* --large: values far bigger than a socket buffer, several in flight
+ * on one connection, read back and checked, then deleted.
+ */
+void do_large(struct args *a)
+{
+    int n = 4, errors = 0;
+    int sock = do_connect(&a->addr);
+    int lens[n], crcs[n];
+    char *data = malloc(a->large);
+    struct request rq;
+
+    for (int j = 0; j < n; j++) {
+        memset(&rq, 0, sizeof(rq));
+        rq.op_status = 'W';
+        sprintf(rq.name, "LARGE-%d", j);
+        lens[j] = a->large - j * (a->large / n);
+        randstr(data, lens[j]);
+        crcs[j] = crc32(-1, (unsigned char*)data, lens[j]);
+        sprintf(rq.len, "%d", lens[j]);
+        if (write_all(sock, &rq, sizeof(rq)) < 0 ||
+            write_all(sock, data, lens[j]) < 0 ||
+            read_reply(sock, &rq, data, 0) < 0 || rq.op_status != 'K')
+            printf("LARGE W LARGE-%d (%d bytes): FAILED\n", j, lens[j]), errors++;
+    }
+
+    for (int j = 0; j < n; j++) {
+        memset(&rq, 0, sizeof(rq));
+        rq.op_status = 'R';
+        sprintf(rq.name, "LARGE-%d", j);
+        write_all(sock, &rq, sizeof(rq));
+    }
+    for (int j = 0; j < n; j++) {
+        int len = read_reply(sock, &rq, data, a->large);
+        int _crc = crc32(-1, (unsigned char*)data, len);
+        if (len != lens[j] || _crc != crcs[j])
+            printf("LARGE R LARGE-%d: bad reply (len %d)\n", j, len),
+                errors++;
+    }
+
+    for (int j = 0; j < n; j++) {
+        memset(&rq, 0, sizeof(rq));
+        rq.op_status = 'D';
+        sprintf(rq.name, "LARGE-%d", j);
+        write_all(sock, &rq, sizeof(rq));
+        if (read_reply(sock, &rq, data, 0) < 0 || rq.op_status != 'K')
+            printf("LARGE D LARGE-%d: FAILED\n", j), errors++;
+    }
+    close(sock);
+    free(data);
+    printf("large: %d values of up to %d bytes, %d errors\n",
+           n, a->large, errors);
+}
+
+/* --------- protocol v2 ---------- */
+
+struct v2_buf {
+    char *buf;
+    int len;
+};
+
+static void v2_add(struct v2_buf *f, char op, int flags, uint32_t id, char *key,
+                   void *val, int val_len)
+{
+    struct v2_op o = {.op = op, .flags = flags, .key_len = strlen(key), .id = id,
+                      .value_len = val_len};
+    f->buf = realloc(f->buf, f->len + sizeof(o) + o.key_len + val_len);
+    memcpy(f->buf + f->len, &o, sizeof(o));
+    memcpy(f->buf + f->len + sizeof(o), key, o.key_len);
+    memcpy(f->buf + f->len + sizeof(o) + o.key_len, val, val_len);
+    f->len += sizeof(o) + o.key_len + val_len;
+}
+
+/* send the ops in f as one frame and read the reply frame back into f.
+ * returns the number of ops in the reply, -1 on error (x86: the wire
+ * is little-endian, so no byte swapping here)
+ */
+static int v2_exchange(int sock, struct v2_buf *f, int count)
+{
+    struct v2_frame h = {.magic = V2_MAGIC, .version = V2_VERSION,
+                         .count = count, .length = f->len};
+    if (write_all(sock, &h, sizeof(h)) < 0 || write_all(sock, f->buf, f->len) < 0)
+        return -1;
+    for (void *ptr = &h, *end = ptr + sizeof(h); ptr < end; ) {
+        int n = read(sock, ptr, end-ptr);
+        if (n <= 0)
+            return -1;
+        ptr += n;
+    }
+    if (h.magic != V2_MAGIC || h.version != V2_VERSION)
+        return -1;
+    f->buf = realloc(f->buf, h.length);
+    f->len = h.length;
+    for (void *ptr = f->buf, *end = ptr + h.length; ptr < end; ) {
+        int n = read(sock, ptr, end-ptr);
+        if (n <= 0)
+            return -1;
+        ptr += n;
+    }
+    return h.count;
+}
+
+/* the next reply op in f at *pos, with its value
+ */
+static struct v2_op *v2_next(struct v2_buf *f, int *pos, char **val)
+{
+    struct v2_op *o = (void*)(f->buf + *pos);
+    if (*pos + sizeof(*o) > f->len ||
+        *pos + sizeof(*o) + o->key_len + o->value_len > f->len)
+        return NULL;
+    *val = f->buf + *pos + sizeof(*o) + o->key_len;
+    *pos += sizeof(*o) + o->key_len + o->value_len;
+    return o;
+}
+
+/* --v2: frames of writes, reads and deletes of keys longer than the
+ * old protocol allows, with replies matched to requests by id. each
+ * write frame also reads back its first key (ops run in order, so it
+ * must see the write) and sends an unknown op, which must get an X.
+ */
+void do_v2(struct args *a)
+{
+    int n = a->v2, errors = 0, ops = 0, frames = 0;
+    int sock = do_connect(&a->addr);
+    int lens[n], crcs[n];
+    char keys[n][200];
+    char *data = malloc(100000);
+    struct v2_buf f = {0};
+    uint32_t base = random();
+
+    for (int round = 0; round < (a->count + n - 1) / n; round++) {
+        f.len = 0;
+        for (int j = 0; j < n; j++) {
+            int klen = 31 + random() % 150;
+            sprintf(keys[j], "V2-%d-", j);
+            memset(keys[j] + strlen(keys[j]), 'k', klen - strlen(keys[j]));
+            keys[j][klen] = 0;
+            lens[j] = j == n-1 ? 100000 : 20 + random() % 600;
+            randstr(data, lens[j]);
+            crcs[j] = crc32(-1, (unsigned char*)data, lens[j]);
+            v2_add(&f, 'W', 0, base + j, keys[j], data, lens[j]);
+        }
+        v2_add(&f, 'R', 0, base + n, keys[0], NULL, 0);
+        v2_add(&f, 'Z', 0, base + n + 1, keys[0], NULL, 0);
+        int got = v2_exchange(sock, &f, n + 2);
+        frames++;
+        if (got != n + 2)
+            printf("V2 W frame: %d replies\n", got), errors++;
+        for (int j = 0, pos = 0; j < got; j++, ops++) {
+            char *val;
+            struct v2_op *o = v2_next(&f, &pos, &val);
+            if (o == NULL) {
+                printf("V2 W frame: short reply\n"), errors++;
+                break;
+            }
+            uint32_t i = o->id - base;
+            if (i < n && o->op != 'K')
+                printf("V2 W %s: FAILED\n", keys[i]), errors++;
+            else if (i == n && (o->op != 'K' || o->value_len != lens[0] ||
+                                (int)crc32(-1, (unsigned char*)val, lens[0]) != crcs[0]))
+                printf("V2 R %s after W: bad reply\n", keys[0]), errors++;
+            else if (i == n+1 && o->op != 'X')
+                printf("V2 unknown op: not X\n"), errors++;
+            else if (i > n+1)
+                printf("V2 W frame: unknown id %u\n", o->id), errors++;
+        }
+
+        f.len = 0;
+        for (int j = 0; j < n; j++)
+            v2_add(&f, 'R', 0, base + j, keys[j], NULL, 0);
+        got = v2_exchange(sock, &f, n);
+        frames++;
+        if (got != n)
+            printf("V2 R frame: %d replies\n", got), errors++;
+        for (int j = 0, pos = 0; j < got; j++, ops++) {
+            char *val;
+            struct v2_op *o = v2_next(&f, &pos, &val);
+            uint32_t i = o ? o->id - base : n;
+            if (i >= n || o->op != 'K' || o->value_len != lens[i] ||
+                (int)crc32(-1, (unsigned char*)val, lens[i]) != crcs[i])
+                printf("V2 R: bad reply\n"), errors++;
+        }
+
+        f.len = 0;
+        for (int j = 0; j < n; j++)
+            v2_add(&f, 'D', 0, base + j, keys[j], NULL, 0);
+        got = v2_exchange(sock, &f, n);
+        frames++;
+        if (got != n)
+            printf("V2 D frame: %d replies\n", got), errors++;
+        for (int j = 0, pos = 0; j < got; j++, ops++) {
+            char *val;
+            struct v2_op *o = v2_next(&f, &pos, &val);
+            if (o == NULL || o->id - base >= n || o->op != 'K')
+                printf("V2 D: FAILED\n"), errors++;
+        }
+        base += n + 2;
+    }
+    close(sock);
+    free(f.buf);
+    free(data);
+    printf("v2: %d ops in %d frames, %d errors\n", ops, frames, errors);
+}
+
+/* send one batch of n ops (op, with flags) on keys, W values from data,
+ * and check every reply is want; for an R that found its key, the value
+ * must match crcs. returns the number of errors
+ */
+static int v2_batch(int sock, char op, int flags, int n, char keys[][40], char **data,
+                    int *lens, int *crcs, char want, uint32_t base)
+{
+    struct v2_buf f = {0};
+    int errors = 0;
+    for (int j = 0; j < n; j++)
+        v2_add(&f, op, flags, base + j, keys[j], op == 'W' ? data[j] : NULL,
+               op == 'W' ? lens[j] : 0);
+    int got = v2_exchange(sock, &f, n);
+    if (got != n)
+        printf("BATCH %c: %d replies\n", op, got), errors++;
+    for (int j = 0, pos = 0; j < got; j++) {
+        char *val;
+        struct v2_op *o = v2_next(&f, &pos, &val);
+        uint32_t i = o ? o->id - base : n;
+        if (i >= n || o->op != want)
+            printf("BATCH %c: got %c, wanted %c\n", op, o ? o->op : '?', want), errors++;
+        else if (op == 'R' && want == 'K' &&
+                 (o->value_len != lens[i] ||
+                  (int)crc32(-1, (unsigned char*)val, lens[i]) != crcs[i]))
+            printf("BATCH R %s: bad value\n", keys[i]), errors++;
+    }
+    free(f.buf);
+    return errors;
+}
+
+/* --batch: MSET, MGET, MDEL of a batch of keys; an all-or-nothing MSET
+ * with one value too big to go in must leave the old values alone
+ */
+void do_batch(struct args *a)
+{
+    int n = a->batch, errors = 0, batches = 0;
+    int sock = do_connect(&a->addr);
+    int lens[n], crcs[n];
+    char keys[n][40], *data[n];
+    uint32_t base = random();
+
+    for (int round = 0; round < (a->count + n - 1) / n; round++) {
+        for (int j = 0; j < n; j++) {
+            sprintf(keys[j], "BATCH-%d-%d", round, j);
+            lens[j] = 1 + random() % 1000;
+            data[j] = malloc(8000);
+            randstr(data[j], lens[j]);
+            crcs[j] = crc32(-1, (unsigned char*)data[j], lens[j]);
+        }
+        errors += v2_batch(sock, 'W', V2_BATCH, n, keys, data, lens, crcs, 'K', base);
+        errors += v2_batch(sock, 'R', V2_BATCH, n, keys, data, lens, crcs, 'K', base);
+
+        /* too big for an atomic batch: nothing may change */
+        int old_len = lens[n-1];
+        lens[n-1] = 5000;
+        randstr(data[n-1], lens[n-1]);
+        errors += v2_batch(sock, 'W', V2_BATCH | V2_ATOMIC, n, keys, data, lens, crcs, 'X', base);
+        lens[n-1] = old_len;
+        errors += v2_batch(sock, 'R', V2_BATCH, n, keys, data, lens, crcs, 'K', base);
+
+        for (int j = 0; j < n; j++) {
+            lens[j] = 1 + random() % 1000;
+            randstr(data[j], lens[j]);
+            crcs[j] = crc32(-1, (unsigned char*)data[j], lens[j]);
+        }
+        errors += v2_batch(sock, 'W', V2_BATCH | V2_ATOMIC, n, keys, data, lens, crcs, 'K', base);
+        errors += v2_batch(sock, 'R', V2_BATCH, n, keys, data, lens, crcs, 'K', base);
+        errors += v2_batch(sock, 'D', V2_BATCH, n, keys, data, lens, crcs, 'K', base);
+        errors += v2_batch(sock, 'R', V2_BATCH, n, keys, data, lens, crcs, 'X', base);
+        batches += 8;
+        base += n;
+        for (int j = 0; j < n; j++)
+            free(data[j]);
+    }
+    close(sock);
+    printf("batch: %d batches of %d keys, %d errors\n", batches, n, errors);
+}
+
+/* --------- sharding over several servers ---------- */
+
+/* -S/-G/-D with several ports: send it to the key's server
+ */
+void do_sharded_op(struct args *a)
+{
+    struct db_client c;
+    char buf[4096];
+
+    if (client_open(&c, a->ports, a->nports, a->vnodes) < 0)
+        exit(1);
+    int shard = ring_shard(&c.ring, a->key);
+    if (a->op == OP_SET)
+        printf("%d: %s\n", c.ports[shard],
+               client_set(&c, a->key, a->val, strlen(a->val)) == 0 ? "ok" : "WRITE: FAILED (X)");
+    else if (a->op == OP_DELETE)
+        printf("%d: %s\n", c.ports[shard],
+               client_delete(&c, a->key) == 0 ? "ok" : "DEL: FAILED (X)");
+    else {
+        int len = client_get(&c, a->key, buf, sizeof(buf));
+        if (len < 0)
+            printf("%d: READ: FAILED (X)\n", c.ports[shard]);
+        else
+            printf("%d: =\"%.*s\"\n", c.ports[shard], len < sizeof(buf) ? len : (int)sizeof(buf), buf);
+    }
+    client_close(&c);
+}
+
+/* --shards: key i of KEYS and its value, the same in every run so a
+ * --verify run can check what a --keep run wrote
+ */
+static void shard_key(char *key, int i)
+{
+    sprintf(key, "SHARD-%08d", i);
+}
+
+static int shard_value(char *buf, int i)
+{
+    int len = 20 + (i * 7919) % 600;
+    for (int j = 0; j < len; j++)
+        buf[j] = 'A' + (i * 31 + j * 7) % 25;
+    return len;
+}
+
+struct shard_thread {
+    struct args *a;
+    int first;
+    char op;
+    int errors;
+};
+
+/* one thread's share of a phase: keys first, first + nthreads, ... in
+ * requests of --batch keys (1 by default), all over one client
+ */
+void *shard_thread(void *ptr)
+{
+    struct shard_thread *t = ptr;
+    struct args *a = t->a;
+    int per = a->batch ? a->batch : 1;
+    struct client_op ops[per];
+    char keys[per][32], values[per][1024], want[1024];
+    struct db_client c;
+
+    if (client_open(&c, a->ports, a->nports, a->vnodes) < 0) {
+        t->errors++;
+        return NULL;
+    }
+    for (int i = t->first; i < a->shards; ) {
+        int n = 0;
+        for (; n < per && i < a->shards; n++, i += a->nthreads) {
+            shard_key(keys[n], i);
+            ops[n] = (struct client_op){.op = t->op, .key = keys[n], .data = values[n]};
+            if (t->op == 'W')
+                ops[n].len = shard_value(values[n], i);
+        }
+        if (client_batch(&c, ops, n, per > 1 ? V2_BATCH : 0) < 0) {
+            printf("SHARDS %c: request failed\n", t->op);
+            t->errors += n;
+            continue;
+        }
+        for (int j = 0; j < n; j++) {
+            int idx = atoi(keys[j] + 6);
+            int len = t->op == 'R' ? shard_value(want, idx) : 0;
+            if (ops[j].status != 'K')
+                printf("SHARDS %c %s: FAILED (%c)\n", t->op, keys[j], ops[j].status), t->errors++;
+            else if (t->op == 'R' && (ops[j].len != len || memcmp(ops[j].value, want, len) != 0))
+                printf("SHARDS R %s: bad value (len %d)\n", keys[j], ops[j].len), t->errors++;
+        }
+    }
+    client_close(&c);
+    return NULL;
+}
+
+/* run one phase over --threads threads; returns the errors
+ */
+int shard_phase(struct args *a, char op)
+{
+    pthread_t th[a->nthreads];
+    struct shard_thread t[a->nthreads];
+    struct timespec t0, t1;
+    int errors = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int i = 0; i < a->nthreads; i++) {
+        t[i] = (struct shard_thread){.a = a, .first = i, .op = op};
+        pthread_create(&th[i], NULL, shard_thread, &t[i]);
+    }
+    for (int i = 0; i < a->nthreads; i++) {
+        pthread_join(th[i], NULL);
+        errors += t[i].errors;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    printf("  %c: %d keys in %.3f s, %.0f ops/s\n", op, a->shards, secs, a->shards / secs);
+    return errors;
+}
+
+/* scan every server and check each SHARD- key is on the server the ring
+ * gives it; prints how many each has
+ */
+int shard_placement(struct args *a)
+{
+    struct ring ring;
+    int errors = 0, total = 0;
+
+    ring_build(&ring, a->ports, a->nports, a->vnodes);
+    printf("  keys per server:");
+    for (int s = 0; s < a->nports; s++) {
+        struct db_conn c;
+        char cursor[V2_KEY_MAX + 1] = "", *keys;
+        int count = 0, misplaced = 0, len;
+
+        if (conn_open(&c, a->ports[s]) < 0) {
+            errors++;
+            continue;
+        }
+        do {
+            if ((len = conn_scan(&c, cursor, &keys)) < 0) {
+                printf(" (scan of %d failed)", a->ports[s]), errors++;
+                break;
+            }
+            for (char *k = keys; k < keys + len; k += strlen(k) + 1) {
+                if (strncmp(k, "SHARD-", 6) != 0)
+                    continue;
+                count++;
+                misplaced += ring_shard(&ring, k) != s;
+            }
+        } while (cursor[0]);
+        conn_close(&c);
+        printf(" %d:%d", a->ports[s], count);
+        if (misplaced)
+            printf(" (%d misplaced)", misplaced);
+        errors += misplaced;
+        total += count;
+    }
+    printf(" (ideal %d)\n", a->shards / a->nports);
+    if (total != a->shards)
+        printf("  %d keys found, should be %d\n", total, a->shards), errors++;
+    ring_free(&ring);
+    return errors;
+}
+
+void do_shards(struct args *a)
+{
+    int errors = 0;
+
+    printf("shards: %d keys over %d servers, %d threads, %d per request\n",
+           a->shards, a->nports, a->nthreads, a->batch ? a->batch : 1);
+    if (!a->verify)
+        errors += shard_phase(a, 'W');
+    errors += shard_phase(a, 'R');
+    errors += shard_placement(a);
+    if (!a->keep)
+        errors += shard_phase(a, 'D');
+    printf("shards: %d errors\n", errors);
+}
+
+/* --------- surviving a restart ---------- */
+
+#define PERSIST_FILLERS 70          /* of 1 MB: more than one 64 MB log file */
+#define PERSIST_FILL_LEN (1 << 20)
+
+/* --persist: key i of KEYS is written, the keys i % 3 == 0 deleted, then
+ * the keys i % 4 == 0 written again with another value. a round of
+ * fillers bigger than a log file follows each step: the first stays, the
+ * second is deleted, so the log engine compacts the file holding the
+ * deletes while the older file with the first values is still there
+ * (and the lsm engine flushes)
+ */
+static void persist_key(char *key, int i)
+{
+    sprintf(key, "PERSIST-%08d", i);
+}
+
+/* key i's value at the end of a --keep run in buf, or -1 if it is gone
+ */
+static int persist_value(char *buf, int i)
+{
+    if (i % 4 == 0)
+        return shard_value(buf, i + 100000);
+    if (i % 3 == 0)
+        return -1;
+    return shard_value(buf, i);
+}
+
+/* write (or delete) one round of fillers; returns the errors
+ */
+static int persist_fill(struct db_client *c, char round, const char *fill, int del)
+{
+    char key[32];
+    int errors = 0;
+
+    for (int j = 0; j < PERSIST_FILLERS; j++) {
+        sprintf(key, "PFILL-%c-%04d", round, j);
+        if ((del ? client_delete(c, key) : client_set(c, key, fill, PERSIST_FILL_LEN)) < 0)
+            printf("PERSIST %s: FAILED (X)\n", key), errors++;
+    }
+    return errors;
+}
+
+void do_persist(struct args *a)
+{
+    struct db_client c;
+    char key[32], value[1024], got[1024];
+    int errors = 0, len;
+    char *fill = malloc(PERSIST_FILL_LEN);
+
+    if (fill == NULL || client_open(&c, a->ports, a->nports, a->vnodes) < 0)
+        exit(1);
+    if (!a->verify) {
+        memset(fill, 'f', PERSIST_FILL_LEN);
+        for (int i = 0; i < a->persist; i++) {
+            persist_key(key, i);
+            if (client_set(&c, key, value, shard_value(value, i)) < 0)
+                printf("PERSIST W %s: FAILED (X)\n", key), errors++;
+        }
+        errors += persist_fill(&c, 'A', fill, 0);
+        for (int i = 0; i < a->persist; i += 3) {
+            persist_key(key, i);
+            if (client_delete(&c, key) < 0)
+                printf("PERSIST D %s: FAILED (X)\n", key), errors++;
+        }
+        errors += persist_fill(&c, 'B', fill, 0);
+        for (int i = 0; i < a->persist; i += 4) {
+            persist_key(key, i);
+            if (client_set(&c, key, value, persist_value(value, i)) < 0)
+                printf("PERSIST W %s: FAILED (X)\n", key), errors++;
+        }
+        errors += persist_fill(&c, 'B', fill, 1);
+    }
+    for (int i = 0; i < a->persist; i++) {
+        int want = persist_value(value, i);
+        persist_key(key, i);
+        len = client_get(&c, key, got, sizeof(got));
+        if (want < 0 && len >= 0)
+            printf("PERSIST R %s: deleted key is back\n", key), errors++;
+        else if (want >= 0 && len < 0)
+            printf("PERSIST R %s: FAILED (X)\n", key), errors++;
+        else if (want >= 0 && (len != want || memcmp(got, value, len) != 0))
+            printf("PERSIST R %s: bad value (len %d)\n", key, len), errors++;
+    }
+    for (int j = 0; j < PERSIST_FILLERS; j++) {
+        sprintf(key, "PFILL-A-%04d", j);
+        if ((len = client_get(&c, key, got, sizeof(got))) != PERSIST_FILL_LEN || got[0] != 'f')
+            printf("PERSIST R %s: FAILED (%d)\n", key, len), errors++;
+        sprintf(key, "PFILL-B-%04d", j);
+        if (client_get(&c, key, got, sizeof(got)) >= 0)
+            printf("PERSIST R %s: deleted key is back\n", key), errors++;
+    }
+    client_close(&c);
+    free(fill);
+    printf("persist: %d keys, %d errors\n", a->persist, errors);
+}
+
+/* --------- replication lag ---------- */
+
+static int compare_long(const void *a, const void *b)
+{
+    long x = *(long *)a, y = *(long *)b;
+    return (x > y) - (x < y);
+}
+
+static long now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+/* read key from the replica until it has value (or, with len -1, until
+ * it doesn't have key); returns when, or -1 after 10 s
+ */
+static long replica_wait(struct db_conn *r, char *key, char *value, int len)
+{
+    char buf[1024];
+    for (long give_up = now_us() + 10000000L; now_us() < give_up; ) {
+        int got = conn_get(r, key, buf, sizeof(buf));
+        if (len < 0 ? got < 0 : got == len && memcmp(buf, value, len) == 0)
+            return now_us();
+    }
+    printf("REPLICA %s: not %s after 10 s\n", key, len < 0 ? "deleted" : "there");
+    return -1;
+}
+
+/* --replica: each key is written to the primary and then read from the
+ * replica until it shows up, for the lag a client reading its own writes
+ * from a replica would see. then --count keys are written in batches of
+ * 32 as fast as they go, and after that deleted, timing how long the
+ * replica takes to catch up with each
+ */
+void do_replica(struct args *a)
+{
+    struct db_conn p, r;
+    char key[32], value[1024];
+    long lag[a->count], t0, t1;
+    int errors = 0, n = 0;
+
+    if (conn_open(&p, a->port) < 0 || conn_open(&r, a->replica) < 0)
+        exit(1);
+    printf("replica: %d keys written to %d, read from %d\n", a->count, a->port, a->replica);
+    for (int i = 0; i < a->count; i++) {
+        sprintf(key, "REPL-%08d", i);
+        int len = shard_value(value, i);
+        if (conn_set(&p, key, value, len) < 0) {
+            printf("REPLICA %s: WRITE FAILED\n", key), errors++;
+            continue;
+        }
+        t0 = now_us();
+        if ((t1 = replica_wait(&r, key, value, len)) < 0)
+            errors++;
+        else
+            lag[n++] = t1 - t0;
+    }
+    if (n > 0) {
+        qsort(lag, n, sizeof(lag[0]), compare_long);
+        printf("  one at a time, write to readable on the replica (us): p50 %ld, p90 %ld, p99 %ld, max %ld\n",
+               lag[n / 2], lag[n * 9 / 10], lag[n * 99 / 100], lag[n - 1]);
+    }
+
+    for (int phase = 0; phase < 2; phase++) {
+        char op = phase ? 'D' : 'W';
+        char keys[32][32], values[32][1024];
+        struct client_op ops[32];
+        t0 = now_us();
+        for (int i = 0; i < a->count; ) {
+            int m = 0;
+            for (; m < 32 && i < a->count; m++, i++) {
+                sprintf(keys[m], "REPL-%08d", i);
+                ops[m] = (struct client_op){.op = op, .key = keys[m], .data = values[m]};
+                if (op == 'W')
+                    ops[m].len = shard_value(values[m], i + 1);
+            }
+            if (conn_batch(&p, ops, m, V2_BATCH) < 0)
+                printf("REPLICA %c: batch failed\n", op), errors += m;
+        }
+        t1 = now_us();
+        int len = shard_value(value, a->count);
+        long done = replica_wait(&r, keys[(a->count - 1) % 32], value, op == 'W' ? len : -1);
+        if (done < 0)
+            errors++;
+        else
+            printf("  %c in batches of 32: %.0f ops/s on the primary, replica caught up %.1f ms after the last\n",
+                   op, a->count / ((t1 - t0) / 1e6), (done - t1) / 1e3);
+    }
+    conn_close(&p);
+    conn_close(&r);
+    printf("replica: %d errors\n", errors);
+}
+
 int main(int argc, char **argv)
 {
     struct args args;
     memset(&args, 0, sizeof(args));
     
     argp_parse(&argp, argc, argv, 0, 0, &args);
+    if (args.nports == 0) {
+        args.ports[0] = args.port;
+        args.nports = 1;
+    }
             
     args.addr = (struct sockaddr_in){
         .sin_family = AF_INET,
         .sin_port = htons(args.port),
         .sin_addr.s_addr = inet_addr("127.0.0.1")}; /* localhost */
 
-    if (args.test)
+    if (args.shards)
+        do_shards(&args);
+    else if (args.persist)
+        do_persist(&args);
+    else if (args.replica)
+        do_replica(&args);
+    else if (args.nports > 1 && (args.op == OP_SET || args.op == OP_GET || args.op == OP_DELETE))
+        do_sharded_op(&args);
+    else if (args.test)
         do_test(&args);
     else if (args.overload)
         do_overload(&args);
+    else if (args.pipeline)
+        do_pipeline(&args);
+    else if (args.large)
+        do_large(&args);
+    else if (args.v2)
+        do_v2(&args);
+    else if (args.batch)
+        do_batch(&args);
     else if (args.op == OP_SET)
         do_set(&args, args.key, args.val, strlen(args.val), NULL, 0);
     else if (args.op == OP_GET)
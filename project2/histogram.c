@@ -0,0 +1,93 @@
+/*
+ * file:        histogram.c
+ * description: log-bucketed latency histograms. values below
+ *              2^HIST_SUB_BITS get a bucket each; above that, bucket
+ *              (e, s) holds values whose top bit is e and whose next
+ *              HIST_SUB_BITS bits are s. each histogram has a single
+ *              writer, so recording is a couple of plain stores, no
+ *              locked instructions; other threads may read it (or merge
+ *              it into their own) at any time.
+ */
+#include "histogram.h"
+
+#define SUB_COUNT (1 << HIST_SUB_BITS)
+
+static int bucket_of(long value) {
+    if (value < SUB_COUNT) {
+        return value < 0 ? 0 : value;
+    }
+    int e = 63 - __builtin_clzl(value);
+    if (e >= HIST_MAX_BITS) {
+        return HIST_BUCKETS - 1;
+    }
+    int shift = e - HIST_SUB_BITS;
+    return ((shift + 1) << HIST_SUB_BITS) + ((value >> shift) & (SUB_COUNT - 1));
+}
+
+/* the largest value that lands in bucket i
+ */
+static long bucket_top(int i) {
+    if (i < SUB_COUNT) {
+        return i;
+    }
+    int shift = (i >> HIST_SUB_BITS) - 1;
+    long sub = i & (SUB_COUNT - 1);
+    return ((SUB_COUNT + sub + 1) << shift) - 1;
+}
+
+void hist_record(struct histogram *h, long value) {
+    long *b = &h->buckets[bucket_of(value)];
+    __atomic_store_n(b, *b + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->count, h->count + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->sum, h->sum + value, __ATOMIC_RELAXED);
+    if (value > h->max) {
+        __atomic_store_n(&h->max, value, __ATOMIC_RELAXED);
+    }
+}
+
+/* add src, which its owner may be recording into, to dst
+ */
+void hist_merge(struct histogram *dst, struct histogram *src) {
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        dst->buckets[i] += __atomic_load_n(&src->buckets[i], __ATOMIC_RELAXED);
+    }
+    dst->count += __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+    dst->sum += __atomic_load_n(&src->sum, __ATOMIC_RELAXED);
+    long max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+    if (max > dst->max) {
+        dst->max = max;
+    }
+}
+
+/* smallest bucket bound with at least fraction p of the values at or
+ * below it; the max is exact, so never report more than that
+ */
+long hist_percentile(struct histogram *h, double p) {
+    long count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+    long max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    long want = (long)(p * count + 0.999999);
+    long seen = 0;
+    if (count == 0) {
+        return 0;
+    }
+    if (want < 1) {
+        want = 1;
+    }
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+        if (seen >= want) {
+            long top = bucket_top(i);
+            return top < max ? top : max;
+        }
+    }
+    return max;
+}
+
+void hist_reset(struct histogram *h) {
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        __atomic_store_n(&h->buckets[i], 0, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&h->count, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->sum, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->max, 0, __ATOMIC_RELAXED);
+}
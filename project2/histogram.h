@@ -0,0 +1,25 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+/* log-bucketed latency histogram in the style of HdrHistogram: every
+ * power of two is split into 2^HIST_SUB_BITS linear buckets, so any
+ * recorded value is known to within about 3%, from 1ns up to about 36
+ * minutes, in a fixed 9KB.
+ */
+#define HIST_SUB_BITS 5
+#define HIST_MAX_BITS 41
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+struct histogram {
+    long count;
+    long sum;
+    long max;
+    long buckets[HIST_BUCKETS];
+};
+
+void hist_record(struct histogram *h, long value);
+long hist_percentile(struct histogram *h, double p);
+void hist_merge(struct histogram *dst, struct histogram *src);
+void hist_reset(struct histogram *h);
+
+#endif
@@ -0,0 +1,79 @@
+/*
+ * file:        indexbench.c
+ * description: microbenchmark for database key lookup - cost of
+ *              find_key() and of inserting new keys against the number
+ *              of keys in the table.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "database.h"
+
+#define LOOKUPS 1000000
+#define MAX_SIZE 4000000
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+    int sizes[] = {100, 1000, 10000, 100000, 1000000, MAX_SIZE};
+    int nsizes = sizeof(sizes) / sizeof(sizes[0]);
+    int loaded = 0;
+    long found = 0;
+    char (*names)[32] = malloc(MAX_SIZE * sizeof(*names));
+    char (*misses)[32] = malloc(MAX_SIZE * sizeof(*misses));
+    int *order = malloc(LOOKUPS * sizeof(int));
+
+    if (!names || !misses || !order) {
+        perror("malloc");
+        return 1;
+    }
+    for (int i = 0; i < MAX_SIZE; i++) {
+        sprintf(names[i], "key-%d", i);
+        sprintf(misses[i], "miss-%d", i);
+    }
+
+    printf("%10s %12s %14s %14s %12s\n", "keys", "insert ns", "hit ns", "miss ns", "bytes/key");
+    for (int s = 0; s < nsizes; s++) {
+        int first = loaded;
+        double t0 = now();
+        for (; loaded < sizes[s]; loaded++) {
+            if (new_record(names[loaded]) < 0) {
+                fprintf(stderr, "insert failed at %d keys\n", loaded);
+                return 1;
+            }
+        }
+        double insert = now() - t0;
+        srandom(1);
+        for (int i = 0; i < LOOKUPS; i++) {
+            order[i] = random() % loaded;
+        }
+
+        t0 = now();
+        for (int i = 0; i < LOOKUPS; i++) {
+            found += find_key(names[order[i]]) >= 0;
+        }
+        double hit = now() - t0;
+
+        t0 = now();
+        for (int i = 0; i < LOOKUPS; i++) {
+            found += find_key(misses[order[i]]) >= 0;
+        }
+        double miss = now() - t0;
+
+        struct db_usage u;
+        db_usage(&u);
+        printf("%10d %12.1f %14.1f %14.1f %12.1f\n", loaded,
+               insert * 1e9 / (loaded - first), hit * 1e9 / LOOKUPS, miss * 1e9 / LOOKUPS,
+               (double)(u.index_bytes + u.record_bytes + u.key_bytes) / loaded);
+    }
+    if (found != (long)LOOKUPS * nsizes) {
+        fprintf(stderr, "lookup mismatch: %ld\n", found);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,131 @@
+/*
+ * file:        lockbench.c
+ * description: multi-threaded stress benchmark for the database table.
+ *              runs the same workload with 1..N threads and reports
+ *              throughput and speedup; reads check that every value
+ *              returned belongs to the key that was asked for.
+ *
+ * usage: lockbench [max-threads] [seconds-per-run]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include "database.h"
+#include "cache.h"
+
+#define BENCH_DIR "/tmp/lockbench"
+#define INDEX_KEYS 200000
+#define DATA_KEYS 2000
+
+struct worker {
+    pthread_t tid;
+    int id;
+    int data;                   /* 0 = index lookups only, 1 = read/write/delete mix */
+    long ops;
+    long errors;
+    char pad[64];
+};
+
+static volatile int running;
+static char (*names)[32];
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *worker_main(void *arg) {
+    struct worker *w = arg;
+    unsigned int seed = w->id * 7919 + 1;
+    char val[128], buf[4096];
+    long ops = 0, errors = 0;
+
+    while (running) {
+        if (!w->data) {
+            errors += find_key(names[rand_r(&seed) % INDEX_KEYS]) < 0;
+            ops++;
+            continue;
+        }
+        char *key = names[INDEX_KEYS + rand_r(&seed) % DATA_KEYS];
+        int op = rand_r(&seed) % 100;
+        if (op < 80) {
+            int n = db_read(key, buf);
+            /* a missing key is fine (deleted), a foreign value is not */
+            if (n > 0 && (n <= strlen(key) || memcmp(buf, key, strlen(key)) != 0 || buf[strlen(key)] != ':')) {
+                errors++;
+            }
+        } else if (op < 95) {
+            int n = sprintf(val, "%s:%d:%ld", key, w->id, ops);
+            if (db_write(key, val, n) < 0) {
+                errors++;
+            }
+        } else {
+            db_delete(key);
+        }
+        ops++;
+    }
+    w->ops = ops;
+    w->errors = errors;
+    return NULL;
+}
+
+static void run(const char *label, int data, int max_threads, double seconds) {
+    double base = 0;
+    printf("%s\n%8s %14s %10s %8s\n", label, "threads", "ops/sec", "speedup", "errors");
+    for (int n = 1; n <= max_threads; n *= 2) {
+        struct worker *w = calloc(n, sizeof(*w));
+        running = 1;
+        double t0 = now();
+        for (int i = 0; i < n; i++) {
+            w[i].id = i;
+            w[i].data = data;
+            pthread_create(&w[i].tid, NULL, worker_main, &w[i]);
+        }
+        usleep(seconds * 1e6);
+        running = 0;
+        long ops = 0, errors = 0;
+        for (int i = 0; i < n; i++) {
+            pthread_join(w[i].tid, NULL);
+            ops += w[i].ops;
+            errors += w[i].errors;
+        }
+        double rate = ops / (now() - t0);
+        if (n == 1) {
+            base = rate;
+        }
+        printf("%8d %14.0f %10.2f %8ld\n", n, rate, rate / base, errors);
+        free(w);
+        if (n < max_threads && n * 2 > max_threads) {
+            n = max_threads / 2;
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int max_threads = argc > 1 ? atoi(argv[1]) : 2 * sysconf(_SC_NPROCESSORS_ONLN);
+    double seconds = argc > 2 ? atof(argv[2]) : 1.0;
+
+    if (db_directory(BENCH_DIR) < 0) {
+        exit(1);
+    }
+    names = malloc((INDEX_KEYS + DATA_KEYS) * sizeof(*names));
+    for (int i = 0; i < INDEX_KEYS + DATA_KEYS; i++) {
+        sprintf(names[i], "key-%d", i);
+    }
+    for (int i = 0; i < INDEX_KEYS; i++) {
+        new_record(names[i]);
+    }
+
+    run("index lookups (find_key)", 0, max_threads, seconds);
+    run("80% read / 15% write / 5% delete, data files", 1, max_threads, seconds);
+    /* small enough that the clock hand is always evicting */
+    cache_init(64 << 10);
+    run("same mix with a 64 KB value cache", 1, max_threads, seconds);
+    db_cleanup();
+    rmdir(BENCH_DIR);
+    return 0;
+}
@@ -0,0 +1,644 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <zlib.h>
+#include "logstore.h"
+
+/* log-structured value storage (bitcask style).
+ *
+ * values are appended to large segment files, DIR/dblog/NNNNNNNN.log; the
+ * caller keeps the key -> (file, offset, len) directory in memory. only
+ * the newest file is written to; once it passes LOG_FILE_MAX it is
+ * sealed and a new one started. overwritten and deleted values stay in
+ * their files as garbage until a background thread compacts the file:
+ * values that are still current are re-appended to the active file and
+ * the old file is deleted.
+ *
+ * for every sealed file the background thread also writes a hint file,
+ * NNNNNNNN.hint, holding just keys and locations, so a restart rebuilds
+ * the directory without reading any values. a file with no hint (the
+ * one that was active when the server stopped without log_close) is
+ * scanned instead, and anything after its last intact record is cut off.
+ *
+ * records are a header, the key bytes and the value bytes; deletes are
+ * written as tombstone records so they survive a restart. tombstones
+ * don't count as live bytes: compaction keeps one only while an older
+ * file remains and the key is still deleted. a batch goes
+ * out in one write; if it is atomic, every record but its last is
+ * flagged LOG_BATCH, and a scan that finds the batch cut short stops
+ * where it began, so a restart sees all of it or none.
+ */
+#define LOG_FILE_MAX (64 << 20)
+#define MAX_LOG_FILES 65536
+#define COMPACT_DEAD_PERCENT 50
+#define COMPACT_INTERVAL 1          /* seconds */
+
+struct log_header {
+    uint32_t crc;               /* of the rest of the header, key and value */
+    uint32_t vlen;
+    uint16_t klen;
+    uint8_t flags;
+    uint8_t pad;
+};
+
+struct hint_entry {
+    uint32_t offset;
+    uint32_t vlen;
+    uint16_t klen;
+    uint8_t flags;
+    uint8_t pad;
+};
+
+struct log_file {
+    int fd;
+    int sealed;
+    int hinted;
+    long size;
+    long live;                  /* bytes of records still referenced */
+};
+
+static char log_dir[PATH_MAX];
+static struct log_file files[MAX_LOG_FILES];
+static uint32_t first_file = 0;
+static uint32_t active_file = 0;
+static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t compactor_tid;
+static int compactor_stop = 0;
+static log_relocate_fn relocate_value;
+static long n_compactions = 0;
+static long compacted_bytes = 0;
+static uint32_t unsynced_file = 0;  /* files before this one are on disk */
+
+typedef void (*scan_fn)(void *ctx, const char *key, struct log_loc *loc, int flags, const char *data);
+
+static inline long record_size(int klen, int vlen) {
+    return sizeof(struct log_header) + klen + vlen;
+}
+
+static void file_name(char *buf, uint32_t id, const char *ext) {
+    sprintf(buf, "%s/%08u.%s", log_dir, id, ext);
+}
+
+static uint32_t record_crc(struct log_header *h, const char *key, const char *data) {
+    uint32_t crc = crc32(0, (unsigned char *)&h->vlen, sizeof(*h) - sizeof(h->crc));
+    crc = crc32(crc, (unsigned char *)key, h->klen);
+    /* crc32() with a NULL buffer returns the initial value, not crc */
+    return h->vlen ? crc32(crc, (unsigned char *)data, h->vlen) : crc;
+}
+
+/* read the record at off into *buf and check it. returns its size, or
+ * -1 if it is torn or corrupt
+ */
+static long read_record(int fd, long off, struct log_header *h, char **buf, long *max) {
+    if (pread(fd, h, sizeof(*h), off) != sizeof(*h)) {
+        return -1;
+    }
+    long need = h->klen + h->vlen + 1;
+    if (need > *max) {
+        char *p = realloc(*buf, need);
+        if (p == NULL) {
+            return -1;
+        }
+        *buf = p;
+        *max = need;
+    }
+    if (pread(fd, *buf, h->klen + h->vlen, off + sizeof(*h)) != h->klen + h->vlen ||
+        record_crc(h, *buf, *buf + h->klen) != h->crc) {
+        return -1;
+    }
+    return record_size(h->klen, h->vlen);
+}
+
+/* the end of the atomic batch starting at off, or -1 if the file ends
+ * (or is damaged) before its last record
+ */
+static long batch_end(int fd, long off) {
+    char *buf = NULL;
+    long max = 0, size;
+    struct log_header h;
+    while ((size = read_record(fd, off, &h, &buf, &max)) > 0) {
+        off += size;
+        if (!(h.flags & LOG_BATCH)) {
+            free(buf);
+            return off;
+        }
+    }
+    free(buf);
+    return -1;
+}
+
+/* walk the records of a segment file in order. stops at the first torn
+ * or corrupt record, or the start of a batch that doesn't end, and
+ * returns the offset where it started, which is the end of the intact
+ * part of the file.
+ */
+static long scan_records(uint32_t id, scan_fn fn, void *ctx) {
+    int fd = files[id].fd;
+    long off = 0, batch_ok = 0;
+    char *buf = NULL;
+    long max = 0;
+    struct log_header h;
+
+    while (read_record(fd, off, &h, &buf, &max) > 0) {
+        if ((h.flags & LOG_BATCH) && off >= batch_ok && (batch_ok = batch_end(fd, off)) < 0) {
+            break;
+        }
+        char key[h.klen + 1];
+        memcpy(key, buf, h.klen);
+        key[h.klen] = 0;
+        struct log_loc loc = {.file = id, .offset = off + sizeof(h) + h.klen, .len = h.vlen};
+        fn(ctx, key, &loc, h.flags, buf + h.klen);
+        off += record_size(h.klen, h.vlen);
+    }
+    free(buf);
+    return off;
+}
+
+static void replay_record(void *ctx, const char *key, struct log_loc *loc, int flags, const char *data) {
+    if (!(flags & LOG_TOMBSTONE)) {
+        files[loc->file].live += record_size(strlen(key), loc->len);
+    }
+    ((log_replay_fn)ctx)(key, loc, flags);
+}
+
+static int load_hint(uint32_t id, log_replay_fn replay) {
+    char name[PATH_MAX];
+    file_name(name, id, "hint");
+    int fd = open(name, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    char *buf = NULL;
+    if (fstat(fd, &st) < 0 || (buf = malloc(st.st_size + 1)) == NULL ||
+        read(fd, buf, st.st_size) != st.st_size) {
+        free(buf);
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    for (long off = 0; off + sizeof(struct hint_entry) <= st.st_size; ) {
+        struct hint_entry e;
+        memcpy(&e, buf + off, sizeof(e));
+        off += sizeof(e);
+        if (off + e.klen > st.st_size) {
+            break;
+        }
+        char key[e.klen + 1];
+        memcpy(key, buf + off, e.klen);
+        key[e.klen] = 0;
+        off += e.klen;
+        struct log_loc loc = {.file = id, .offset = e.offset, .len = e.vlen};
+        replay_record(replay, key, &loc, e.flags, NULL);
+    }
+    free(buf);
+    return 0;
+}
+
+static void hint_record(void *ctx, const char *key, struct log_loc *loc, int flags, const char *data) {
+    FILE *fp = ctx;
+    struct hint_entry e = {.offset = loc->offset, .vlen = loc->len, .klen = strlen(key), .flags = flags};
+    fwrite(&e, sizeof(e), 1, fp);
+    fwrite(key, e.klen, 1, fp);
+}
+
+static void write_hint(uint32_t id) {
+    char name[PATH_MAX], tmp[PATH_MAX + 8];
+    file_name(name, id, "hint");
+    sprintf(tmp, "%s.tmp", name);
+    FILE *fp = fopen(tmp, "w");
+    if (fp == NULL) {
+        perror("hint file");
+        return;
+    }
+    scan_records(id, hint_record, fp);
+    if (fclose(fp) != 0 || rename(tmp, name) != 0) {
+        perror("hint file");
+        unlink(tmp);
+    }
+}
+
+static int open_file(uint32_t id, int flags) {
+    if (id >= MAX_LOG_FILES) {
+        fprintf(stderr, "log: out of segment file numbers\n");
+        return -1;
+    }
+    char name[PATH_MAX];
+    file_name(name, id, "log");
+    int fd = open(name, flags | O_RDWR | O_CLOEXEC, 0666);
+    if (fd < 0) {
+        perror(name);
+        return -1;
+    }
+    files[id] = (struct log_file){.fd = fd};
+    return 0;
+}
+
+/* caller holds log_mutex */
+static int roll_file(void) {
+    if (open_file(active_file + 1, O_CREAT | O_TRUNC) < 0) {
+        return -1;
+    }
+    files[active_file].sealed = 1;
+    active_file++;
+    pthread_cond_signal(&log_cond);
+    return 0;
+}
+
+/* the file a record of size bytes goes to; caller holds log_mutex */
+static struct log_file *file_for(long size) {
+    struct log_file *f = &files[active_file];
+    if (f->size > 0 && f->size + size > LOG_FILE_MAX) {
+        if (roll_file() < 0) {
+            return NULL;
+        }
+        f = &files[active_file];
+    }
+    return f;
+}
+
+int log_append(const char *key, const char *data, int len, int flags, struct log_loc *loc) {
+    struct log_header h = {.vlen = len, .klen = strlen(key), .flags = flags};
+    h.crc = record_crc(&h, key, data);
+    long size = record_size(h.klen, len);
+    struct iovec iov[3] = {{&h, sizeof(h)}, {(void *)key, h.klen}, {(void *)data, len}};
+
+    pthread_mutex_lock(&log_mutex);
+    struct log_file *f = file_for(size);
+    if (f == NULL) {
+        pthread_mutex_unlock(&log_mutex);
+        return -1;
+    }
+    if (pwritev(f->fd, iov, 3, f->size) != size) {
+        perror("log append");
+        pthread_mutex_unlock(&log_mutex);
+        return -1;
+    }
+    loc->file = active_file;
+    loc->offset = f->size + sizeof(h) + h.klen;
+    loc->len = len;
+    f->size += size;
+    if (!(flags & LOG_TOMBSTONE)) {
+        __atomic_fetch_add(&f->live, size, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&log_mutex);
+    return 0;
+}
+
+/* append n records in one go, all to the same file, back to back, and
+ * fill in where each went. either all are written or, on error, none
+ * count
+ */
+int log_append_batch(struct log_batch_rec *recs, int n, int atomic) {
+    struct log_header *hs = malloc(n * sizeof(*hs));
+    struct iovec *iov = malloc(3 * n * sizeof(*iov));
+    long total = 0, live = 0;
+    if (hs == NULL || iov == NULL) {
+        free(hs);
+        free(iov);
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        int flags = recs[i].flags | (atomic && i < n - 1 ? LOG_BATCH : 0);
+        hs[i] = (struct log_header){.vlen = recs[i].len, .klen = strlen(recs[i].key), .flags = flags};
+        hs[i].crc = record_crc(&hs[i], recs[i].key, recs[i].data);
+        iov[3 * i] = (struct iovec){&hs[i], sizeof(hs[i])};
+        iov[3 * i + 1] = (struct iovec){(void *)recs[i].key, hs[i].klen};
+        iov[3 * i + 2] = (struct iovec){(void *)recs[i].data, recs[i].len};
+        total += record_size(hs[i].klen, recs[i].len);
+        if (!(recs[i].flags & LOG_TOMBSTONE)) {
+            live += record_size(hs[i].klen, recs[i].len);
+        }
+    }
+
+    pthread_mutex_lock(&log_mutex);
+    struct log_file *f = file_for(total);
+    int err = f == NULL;
+    long off = err ? 0 : f->size;
+    for (int i = 0; !err && i < n; ) {
+        int count = n - i < IOV_MAX / 3 ? n - i : IOV_MAX / 3;
+        long bytes = 0;
+        for (int j = i; j < i + count; j++) {
+            bytes += record_size(hs[j].klen, recs[j].len);
+        }
+        if (pwritev(f->fd, &iov[3 * i], 3 * count, off) != bytes) {
+            perror("log append");
+            err = 1;
+        }
+        off += bytes;
+        i += count;
+    }
+    if (!err) {
+        off = f->size;
+        for (int i = 0; i < n; i++) {
+            recs[i].loc.file = active_file;
+            recs[i].loc.offset = off + sizeof(hs[i]) + hs[i].klen;
+            recs[i].loc.len = recs[i].len;
+            off += record_size(hs[i].klen, recs[i].len);
+        }
+        f->size += total;
+        __atomic_fetch_add(&f->live, live, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&log_mutex);
+    free(hs);
+    free(iov);
+    return err ? -1 : 0;
+}
+
+/* append a value that is in a file rather than in memory: the first len
+ * bytes of fd, whose crc32 the caller has worked out. the bytes are
+ * copied file to file by the kernel.
+ */
+int log_append_file(const char *key, int fd, long len, uint32_t value_crc, struct log_loc *loc) {
+    struct log_header h = {.vlen = len, .klen = strlen(key)};
+    h.crc = crc32(0, (unsigned char *)&h.vlen, sizeof(h) - sizeof(h.crc));
+    h.crc = crc32(h.crc, (unsigned char *)key, h.klen);
+    h.crc = crc32_combine(h.crc, value_crc, len);
+    long size = record_size(h.klen, len);
+    struct iovec iov[2] = {{&h, sizeof(h)}, {(void *)key, h.klen}};
+
+    pthread_mutex_lock(&log_mutex);
+    struct log_file *f = file_for(size);
+    if (f == NULL) {
+        pthread_mutex_unlock(&log_mutex);
+        return -1;
+    }
+    loff_t in = 0, out = f->size + sizeof(h) + h.klen;
+    int err = pwritev(f->fd, iov, 2, f->size) != sizeof(h) + h.klen;
+    while (!err && in < len) {
+        ssize_t n = copy_file_range(fd, &in, f->fd, &out, len - in, 0);
+        err = n <= 0;
+    }
+    if (err) {
+        perror("log append");
+        pthread_mutex_unlock(&log_mutex);
+        return -1;
+    }
+    loc->file = active_file;
+    loc->offset = f->size + sizeof(h) + h.klen;
+    loc->len = len;
+    f->size += size;
+    __atomic_fetch_add(&f->live, size, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&log_mutex);
+    return 0;
+}
+
+/* make every record appended so far durable: fdatasync each file
+ * written since the last call. the descriptors are duplicated so the
+ * syncs can run without log_mutex while compaction closes files
+ */
+int log_sync(void) {
+    pthread_mutex_lock(&log_mutex);
+    uint32_t from = unsynced_file > first_file ? unsynced_file : first_file;
+    int n = 0, status = 0, *fds = malloc((active_file - from + 1) * sizeof(int));
+    for (uint32_t id = from; fds && id <= active_file; id++) {
+        if (files[id].fd >= 0 && (fds[n] = fcntl(files[id].fd, F_DUPFD_CLOEXEC, 0)) >= 0) {
+            n++;
+        }
+    }
+    if (fds) {
+        unsynced_file = active_file;
+    }
+    pthread_mutex_unlock(&log_mutex);
+    if (fds == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        if (fdatasync(fds[i]) < 0) {
+            status = -1;
+        }
+        close(fds[i]);
+    }
+    free(fds);
+    return status;
+}
+
+int log_read(struct log_loc *loc, char *buf, int max) {
+    int len = loc->len < max ? loc->len : max;
+    return pread(files[loc->file].fd, buf, len, loc->offset);
+}
+
+/* a descriptor of its own for the file holding loc, so the value can be
+ * sent after the caller drops its lock even if compaction removes the
+ * file in the meantime
+ */
+int log_open_value(struct log_loc *loc) {
+    return fcntl(files[loc->file].fd, F_DUPFD_CLOEXEC, 0);
+}
+
+/* the value at loc has been overwritten or deleted */
+void log_release(const char *key, struct log_loc *loc) {
+    __atomic_fetch_sub(&files[loc->file].live, record_size(strlen(key), loc->len), __ATOMIC_RELAXED);
+}
+
+static int older_files(uint32_t id) {
+    for (uint32_t i = first_file; i < id; i++) {
+        if (files[i].fd >= 0 && files[i].size > 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void compact_record(void *ctx, const char *key, struct log_loc *loc, int flags, const char *data) {
+    /* a tombstone matters only while an older file may hold a value it hides */
+    if (!(flags & LOG_TOMBSTONE) || *(int *)ctx) {
+        relocate_value(key, loc, data, flags);
+    }
+}
+
+static void compact_file(uint32_t id) {
+    int keep_tombstones = older_files(id);
+    long size = files[id].size;
+    scan_records(id, compact_record, &keep_tombstones);
+    /* the copies must be on disk before the originals go */
+    log_sync();
+
+    char name[PATH_MAX];
+    pthread_mutex_lock(&log_mutex);
+    close(files[id].fd);
+    files[id] = (struct log_file){.fd = -1};
+    while (first_file < active_file && files[first_file].fd < 0) {
+        first_file++;
+    }
+    n_compactions++;
+    compacted_bytes += size;
+    pthread_mutex_unlock(&log_mutex);
+    file_name(name, id, "log");
+    unlink(name);
+    file_name(name, id, "hint");
+    unlink(name);
+}
+
+static void *compactor_main(void *arg) {
+    pthread_mutex_lock(&log_mutex);
+    while (!compactor_stop) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += COMPACT_INTERVAL;
+        pthread_cond_timedwait(&log_cond, &log_mutex, &ts);
+
+        for (uint32_t id = first_file; id < active_file && !compactor_stop; id++) {
+            if (files[id].fd >= 0 && files[id].sealed && !files[id].hinted) {
+                pthread_mutex_unlock(&log_mutex);
+                write_hint(id);
+                pthread_mutex_lock(&log_mutex);
+                files[id].hinted = 1;
+            }
+        }
+
+        /* the sealed file with the most garbage, if it is mostly garbage */
+        uint32_t victim = 0;
+        long best = -1;
+        for (uint32_t id = first_file; id < active_file; id++) {
+            struct log_file *f = &files[id];
+            if (f->fd < 0 || !f->sealed || f->size == 0) {
+                continue;
+            }
+            long dead = (f->size - f->live) * 100 / f->size;
+            if (dead >= COMPACT_DEAD_PERCENT && dead > best) {
+                victim = id;
+                best = dead;
+            }
+        }
+        if (best >= 0 && !compactor_stop) {
+            pthread_mutex_unlock(&log_mutex);
+            compact_file(victim);
+            pthread_mutex_lock(&log_mutex);
+        }
+    }
+    pthread_mutex_unlock(&log_mutex);
+    return NULL;
+}
+
+static int compare_ids(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* rebuild the caller's index from the files left by the last run, then
+ * start a fresh active file and the compactor
+ */
+int log_open(const char *dir_name, log_replay_fn replay, log_relocate_fn relocate) {
+    relocate_value = relocate;
+    snprintf(log_dir, sizeof(log_dir), "%s/dblog", dir_name);
+    for (int i = 0; i < MAX_LOG_FILES; i++) {
+        files[i].fd = -1;
+    }
+    if (mkdir(log_dir, 0777) < 0 && errno != EEXIST) {
+        perror(log_dir);
+        return -1;
+    }
+    DIR *dir = opendir(log_dir);
+    if (dir == NULL) {
+        perror(log_dir);
+        return -1;
+    }
+    uint32_t *ids = NULL;
+    int n = 0, max = 0;
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        uint32_t id;
+        char ext[8];
+        if (sscanf(de->d_name, "%u.%7s", &id, ext) != 2 || strcmp(ext, "log") != 0 ||
+            id >= MAX_LOG_FILES - 1) {
+            continue;
+        }
+        if (n == max) {
+            max = max ? max * 2 : 64;
+            ids = realloc(ids, max * sizeof(*ids));
+        }
+        ids[n++] = id;
+    }
+    closedir(dir);
+    qsort(ids, n, sizeof(*ids), compare_ids);
+
+    first_file = n > 0 ? ids[0] : 1;
+    for (int i = 0; i < n; i++) {
+        uint32_t id = ids[i];
+        if (open_file(id, 0) < 0) {
+            continue;
+        }
+        struct stat st;
+        fstat(files[id].fd, &st);
+        if (st.st_size == 0) {
+            char name[PATH_MAX];
+            file_name(name, id, "log");
+            unlink(name);
+            close(files[id].fd);
+            files[id].fd = -1;
+            continue;
+        }
+        if (load_hint(id, replay) == 0) {
+            files[id].size = st.st_size;
+            files[id].hinted = 1;
+        } else {
+            files[id].size = scan_records(id, replay_record, replay);
+            if (files[id].size < st.st_size) {
+                fprintf(stderr, "log: %08u.log truncated to last intact record at %ld\n",
+                        id, files[id].size);
+                ftruncate(files[id].fd, files[id].size);
+            }
+        }
+        files[id].sealed = 1;
+    }
+    active_file = n > 0 ? ids[n - 1] + 1 : 1;
+    free(ids);
+    if (open_file(active_file, O_CREAT | O_TRUNC) < 0) {
+        return -1;
+    }
+    compactor_stop = 0;
+    if (pthread_create(&compactor_tid, NULL, compactor_main, NULL) != 0) {
+        perror("pthread_create compactor");
+        return -1;
+    }
+    return 0;
+}
+
+void log_get_stats(struct log_stats *st) {
+    memset(st, 0, sizeof(*st));
+    pthread_mutex_lock(&log_mutex);
+    for (uint32_t id = first_file; id <= active_file; id++) {
+        if (files[id].fd >= 0) {
+            st->files++;
+            st->bytes += files[id].size;
+            st->live_bytes += __atomic_load_n(&files[id].live, __ATOMIC_RELAXED);
+        }
+    }
+    st->compactions = n_compactions;
+    st->compacted_bytes = compacted_bytes;
+    pthread_mutex_unlock(&log_mutex);
+}
+
+/* stop compacting and leave a hint for the active file so the next
+ * start does not have to scan it
+ */
+void log_close(void) {
+    pthread_mutex_lock(&log_mutex);
+    compactor_stop = 1;
+    pthread_cond_signal(&log_cond);
+    pthread_mutex_unlock(&log_mutex);
+    pthread_join(compactor_tid, NULL);
+
+    if (files[active_file].fd >= 0 && files[active_file].size > 0) {
+        write_hint(active_file);
+    }
+    for (uint32_t id = first_file; id <= active_file; id++) {
+        if (files[id].fd >= 0) {
+            fsync(files[id].fd);
+            close(files[id].fd);
+            files[id].fd = -1;
+        }
+    }
+}
@@ -0,0 +1,57 @@
+#ifndef LOGSTORE_H
+#define LOGSTORE_H
+
+#include <stdint.h>
+
+#define LOG_TOMBSTONE 1
+#define LOG_BATCH 2             /* more records of the same atomic batch follow */
+
+/* where a value lives: segment file number, offset of the value bytes
+ * in it and their length
+ */
+struct log_loc {
+    uint32_t file;
+    uint32_t offset;
+    uint32_t len;
+};
+
+/* one record of log_append_batch(); loc is filled in */
+struct log_batch_rec {
+    const char *key;
+    const char *data;
+    int len;
+    int flags;
+    struct log_loc loc;
+};
+
+/* called once per record, oldest first, while the index is rebuilt */
+typedef void (*log_replay_fn)(const char *key, struct log_loc *loc, int flags);
+
+/* called by the compactor for each record in a segment it is about to
+ * delete: for a value, must re-append data with log_append() if loc is
+ * still the key's current location; for a tombstone (flags
+ * LOG_TOMBSTONE, only while older files remain), must re-append it if
+ * the key is still deleted. either under the key's lock
+ */
+typedef void (*log_relocate_fn)(const char *key, struct log_loc *loc, const char *data, int flags);
+
+struct log_stats {
+    int files;
+    long bytes;
+    long live_bytes;
+    long compactions;
+    long compacted_bytes;
+};
+
+int log_open(const char *dir, log_replay_fn replay, log_relocate_fn relocate);
+int log_append(const char *key, const char *data, int len, int flags, struct log_loc *loc);
+int log_append_batch(struct log_batch_rec *recs, int n, int atomic);
+int log_append_file(const char *key, int fd, long len, uint32_t value_crc, struct log_loc *loc);
+int log_sync(void);
+int log_read(struct log_loc *loc, char *buf, int max);
+int log_open_value(struct log_loc *loc);
+void log_release(const char *key, struct log_loc *loc);
+void log_get_stats(struct log_stats *st);
+void log_close(void);
+
+#endif
@@ -0,0 +1,142 @@
+/*
+ * file:        lsmbench.c
+ * description: storage engine benchmark - loads N keys through
+ *              db_write() with the per-file layout and with the LSM
+ *              engine, then times random reads of present and missing
+ *              keys, overwrites and deletes. each engine runs in its own
+ *              process so neither sees the other's page cache or index.
+ *
+ * usage: lsmbench [keys] [files|lsm|both]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/statvfs.h>
+#include <sys/wait.h>
+#include "database.h"
+
+#define BENCH_DIR "/tmp/lsmbench"    /* of its own, leaving a dbserver's files alone */
+#define VALUE_LEN 100
+#define PROBES 200000
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long disk_used(void) {
+    struct statvfs vfs;
+    statvfs("/tmp", &vfs);
+    return (long)(vfs.f_blocks - vfs.f_bfree) * vfs.f_frsize;
+}
+
+static long rss_bytes(void) {
+    long pages = 0;
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if (fp) {
+        fscanf(fp, "%*d %ld", &pages);
+        fclose(fp);
+    }
+    return pages * sysconf(_SC_PAGESIZE);
+}
+
+static void make_value(char *buf, int key, int version) {
+    int n = sprintf(buf, "%d:%d:", key, version);
+    memset(buf + n, 'v', VALUE_LEN - n);
+}
+
+static void report(const char *what, long ops, double secs, long errors) {
+    printf("  %-22s %10.0f ops/sec %10.2f us/op %8ld errors\n", what, ops / secs, secs * 1e6 / ops, errors);
+}
+
+static void run(const char *label, int engine, int keys) {
+    char key[32], value[VALUE_LEN], buf[4096];
+    unsigned int seed = 1;
+    long errors = 0;
+
+    printf("%s, %d keys of %d bytes\n", label, keys, VALUE_LEN);
+    system("rm -rf " BENCH_DIR);
+    long disk0 = disk_used(), rss0 = rss_bytes();
+    if (db_directory(BENCH_DIR) < 0 || db_open(engine) < 0) {
+        printf("  can't open database\n");
+        exit(1);
+    }
+
+    double t0 = now();
+    for (int i = 0; i < keys; i++) {
+        sprintf(key, "key%09d", i);
+        make_value(value, i, 0);
+        errors += db_write(key, value, VALUE_LEN) < 0;
+    }
+    report("load", keys, now() - t0, errors);
+
+    errors = 0;
+    t0 = now();
+    for (int i = 0; i < PROBES; i++) {
+        int k = rand_r(&seed) % keys;
+        sprintf(key, "key%09d", k);
+        make_value(value, k, 0);
+        errors += db_read(key, buf) != VALUE_LEN || memcmp(buf, value, VALUE_LEN) != 0;
+    }
+    report("random read", PROBES, now() - t0, errors);
+
+    errors = 0;
+    t0 = now();
+    for (int i = 0; i < PROBES; i++) {
+        sprintf(key, "key%09d-", rand_r(&seed) % keys);
+        errors += db_read(key, buf) >= 0;
+    }
+    report("read missing key", PROBES, now() - t0, errors);
+
+    errors = 0;
+    t0 = now();
+    for (int i = 0; i < PROBES; i++) {
+        int k = rand_r(&seed) % keys;
+        sprintf(key, "key%09d", k);
+        make_value(value, k, 1);
+        errors += db_write(key, value, VALUE_LEN) < 0;
+    }
+    report("random overwrite", PROBES, now() - t0, errors);
+
+    errors = 0;
+    t0 = now();
+    for (int i = 0; i < PROBES / 10; i++) {
+        sprintf(key, "key%09d", i * 7 % keys);
+        errors += db_delete(key) < 0;
+    }
+    report("delete", PROBES / 10, now() - t0, errors);
+
+    printf("  %d objects, %.1f MB on disk, %.1f MB resident\n", count_valid_objects(),
+           (disk_used() - disk0) / 1048576.0, (rss_bytes() - rss0) / 1048576.0);
+    db_cleanup();
+}
+
+static void run_child(const char *label, int engine, int keys) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        run(label, engine, keys);
+        exit(0);
+    }
+    waitpid(pid, NULL, 0);
+}
+
+int main(int argc, char *argv[]) {
+    int keys = argc > 1 ? atoi(argv[1]) : 1000000;
+    const char *which = argc > 2 ? argv[2] : "both";
+
+    if (keys < PROBES / 10 * 7) {
+        keys = PROBES / 10 * 7;
+    }
+    if (strcmp(which, "lsm") != 0) {
+        run_child("per-file layout (data.N)", DB_ENGINE_FILES, keys);
+    }
+    if (strcmp(which, "files") != 0) {
+        run_child("LSM tree (dblsm)", DB_ENGINE_LSM, keys);
+    }
+    system("rm -rf " BENCH_DIR);
+    return 0;
+}
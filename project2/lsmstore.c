@@ -0,0 +1,1635 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include "lsmstore.h"
+
+/* log-structured merge tree, for data sets that don't fit in memory.
+ *
+ * writes go to an in-memory skiplist (the memtable). when it passes
+ * MEMTABLE_MAX it becomes immutable, a fresh one takes its place, and a
+ * background thread writes it out as a sorted table file in level 0.
+ * level 0 tables may overlap each other; every deeper level is a set of
+ * non-overlapping tables covering increasing key ranges, each level
+ * LEVEL_MULTIPLIER times the size of the one above. when level 0 has
+ * too many tables or a level grows past its size the background thread
+ * merges tables into the next level down, dropping overwritten values
+ * and, at the bottom, tombstones.
+ *
+ * a lookup checks the memtables, then level 0 newest first, then one
+ * table per deeper level. each table keeps its block index and a bloom
+ * filter in memory, so a table without the key is usually skipped
+ * without reading it and one with the key costs a single block read.
+ *
+ * the set of live tables is a refcounted version; readers pin the
+ * current version and never block on the background thread. the
+ * MANIFEST file lists the tables of the current version and is
+ * rewritten (tmp + rename) whenever it changes. the memtable is flushed
+ * by lsm_close, or on demand by lsm_flush; writes since the last flush
+ * are lost if the server dies (unless a WAL has them).
+ *
+ * values too big to buffer are kept out of the tree: lsm_put_blob moves
+ * the file holding the value to DIR/dblsm/NNNNNNNNNN.blob and the tree
+ * only stores a struct blob_ref. a blob is unlinked when the entry
+ * pointing to it is overwritten in the memtable or dropped by
+ * compaction; a blob whose entry was still in the memtable when the
+ * server died is never referenced again and stays behind.
+ *
+ * table file layout:
+ *   data blocks   entries of struct sst_entry, key + NUL, value
+ *   index         per block: offset, size, last key + NUL
+ *   bloom filter  bloom_bits / 8 bytes
+ *   footer        struct sst_footer
+ */
+#define MEMTABLE_MAX (4 << 20)
+#define BLOCK_SIZE 4096
+#define TABLE_MAX (2 << 20)
+#define L0_COMPACT_TRIGGER 4
+#define L0_STALL 12
+#define LEVEL1_MAX (10L << 20)
+#define LEVEL_MULTIPLIER 10
+#define BLOOM_BITS_PER_KEY 10
+#define BLOOM_PROBES 7
+#define SKIP_HEIGHT 12
+#define SST_MAGIC 0x4c534d31     /* "LSM1" */
+
+#define ENTRY_TOMBSTONE 1
+#define ENTRY_BLOB 2
+
+struct blob_ref {
+    uint64_t id;
+    uint64_t len;
+};
+
+struct sst_entry {
+    uint32_t vlen;
+    uint16_t klen;
+    uint8_t flags;
+    uint8_t pad;
+};
+
+struct sst_index_entry {
+    uint32_t offset;
+    uint32_t size;
+    uint16_t klen;
+};
+
+struct sst_footer {
+    uint64_t index_offset;
+    uint64_t bloom_offset;
+    uint32_t index_len;
+    uint32_t bloom_bits;
+    uint32_t nblocks;
+    uint32_t nkeys;
+    uint32_t magic;
+    uint32_t ntombstones;       /* of the nkeys */
+};
+
+struct mem_node {
+    char *value;
+    uint32_t vlen;
+    uint8_t flags;
+    uint8_t height;
+    char *key;
+    struct mem_node *next[];
+};
+
+struct memtable {
+    struct mem_node *head;
+    int height;
+    long bytes;
+    long entries;
+    long tombstones;            /* of the entries */
+    unsigned int seed;
+};
+
+struct block_handle {
+    uint32_t offset;
+    uint32_t size;
+    char *last_key;
+};
+
+struct sstable {
+    uint32_t id;
+    int fd;
+    long size;
+    int nblocks;
+    struct block_handle *blocks;
+    char *index_buf;
+    uint8_t *bloom;
+    uint32_t bloom_bits;
+    uint32_t nkeys;
+    uint32_t ntombstones;
+    char *smallest;
+    char *largest;
+    int refs;
+    int obsolete;               /* unlink when the last reference goes */
+};
+
+struct version {
+    int refs;
+    int n[LSM_LEVELS];
+    struct sstable **t[LSM_LEVELS];     /* level 0 newest first, others by key */
+};
+
+static char lsm_dir[PATH_MAX];
+static struct memtable *mem, *imm;
+static struct version *current;
+static pthread_rwlock_t mem_lock = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+
+/* lsm_mutex orders memtable switches and version changes; readers only
+ * take mem_lock */
+static pthread_mutex_t lsm_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t stall_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t bg_tid;
+static int bg_stop;
+static uint32_t next_file = 1;
+static uint64_t next_blob = 1;
+static char *compact_ptr[LSM_LEVELS];
+
+static long n_table_reads, n_bloom_skips, n_flushes, n_compactions, n_compacted_bytes, n_stalls;
+
+static void stat_add(long *counter, long n) {
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+static uint32_t bloom_hash(const char *key) {
+    uint32_t h = 2166136261u;
+    while (*key) {
+        h ^= (unsigned char)*key++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void table_name(char *buf, uint32_t id) {
+    sprintf(buf, "%s/%08u.sst", lsm_dir, id);
+}
+
+static void blob_name(char *buf, uint64_t id) {
+    sprintf(buf, "%s/%010lu.blob", lsm_dir, (unsigned long)id);
+}
+
+static void blob_unlink(const char *value) {
+    struct blob_ref ref;
+    char name[PATH_MAX];
+    memcpy(&ref, value, sizeof(ref));
+    blob_name(name, ref.id);
+    unlink(name);
+}
+
+static struct mem_node *node_new(const char *key, int height) {
+    int klen = strlen(key);
+    struct mem_node *n = calloc(1, sizeof(*n) + height * sizeof(n->next[0]) + klen + 1);
+    if (n == NULL) {
+        return NULL;
+    }
+    n->height = height;
+    n->key = (char *)&n->next[height];
+    memcpy(n->key, key, klen + 1);
+    return n;
+}
+
+static struct memtable *mem_new(void) {
+    struct memtable *m = calloc(1, sizeof(*m));
+    if (m == NULL || (m->head = node_new("", SKIP_HEIGHT)) == NULL) {
+        free(m);
+        return NULL;
+    }
+    m->height = 1;
+    m->seed = 12345;
+    return m;
+}
+
+static void mem_free(struct memtable *m) {
+    struct mem_node *n = m->head;
+    while (n) {
+        struct mem_node *next = n->next[0];
+        free(n->value);
+        free(n);
+        n = next;
+    }
+    free(m);
+}
+
+/* last node < key at every level, in prev[]; returns the node after
+ * prev[0], which is the first node >= key
+ */
+static struct mem_node *mem_seek(struct memtable *m, const char *key, struct mem_node **prev) {
+    struct mem_node *x = m->head;
+    for (int level = m->height - 1; level >= 0; level--) {
+        while (x->next[level] && strcmp(x->next[level]->key, key) < 0) {
+            x = x->next[level];
+        }
+        if (prev) {
+            prev[level] = x;
+        }
+    }
+    return x->next[0];
+}
+
+static struct mem_node *mem_get(struct memtable *m, const char *key) {
+    struct mem_node *n = mem_seek(m, key, NULL);
+    return (n && strcmp(n->key, key) == 0) ? n : NULL;
+}
+
+static struct mem_node *mem_node_new(struct memtable *m, const char *key) {
+    int height = 1;
+    while (height < SKIP_HEIGHT && (rand_r(&m->seed) & 3) == 0) {
+        height++;
+    }
+    return node_new(key, height);
+}
+
+/* put value (malloc'd, or NULL) under key. spare is a node for the key
+ * if it turns out to be new, allocated by the caller so that this can't
+ * fail; it is freed if the key is already there
+ */
+static void mem_link(struct memtable *m, const char *key, char *value, int len, int flags,
+                     struct mem_node *spare) {
+    struct mem_node *prev[SKIP_HEIGHT];
+    struct mem_node *n = mem_seek(m, key, prev);
+    if (n && strcmp(n->key, key) == 0) {
+        m->bytes += len - (long)n->vlen;
+        if (n->flags & ENTRY_BLOB) {
+            blob_unlink(n->value);
+        }
+        free(n->value);
+        free(spare);
+        m->tombstones -= n->flags & ENTRY_TOMBSTONE;
+    } else {
+        n = spare;
+        int height = n->height;
+        for (int level = m->height; level < height; level++) {
+            prev[level] = m->head;
+        }
+        if (height > m->height) {
+            m->height = height;
+        }
+        for (int level = 0; level < height; level++) {
+            n->next[level] = prev[level]->next[level];
+            prev[level]->next[level] = n;
+        }
+        m->bytes += sizeof(*n) + height * sizeof(n->next[0]) + strlen(key) + 1 + len;
+        m->entries++;
+    }
+    n->value = value;
+    n->vlen = len;
+    n->flags = flags;
+    m->tombstones += flags & ENTRY_TOMBSTONE;
+}
+
+static int mem_put(struct memtable *m, const char *key, const char *data, int len, int flags) {
+    char *value = NULL;
+    if (len > 0 && (value = malloc(len)) == NULL) {
+        return -1;
+    }
+    if (len > 0) {
+        memcpy(value, data, len);
+    }
+    struct mem_node *spare = NULL;
+    if (mem_get(m, key) == NULL && (spare = mem_node_new(m, key)) == NULL) {
+        free(value);
+        return -1;
+    }
+    mem_link(m, key, value, len, flags, spare);
+    return 0;
+}
+
+static int bloom_may_contain(struct sstable *t, uint32_t h) {
+    if (t->bloom_bits == 0) {
+        return 1;
+    }
+    uint32_t delta = (h >> 17) | (h << 15);
+    for (int i = 0; i < BLOOM_PROBES; i++) {
+        uint32_t bit = h % t->bloom_bits;
+        if (!(t->bloom[bit / 8] & (1 << (bit % 8)))) {
+            return 0;
+        }
+        h += delta;
+    }
+    return 1;
+}
+
+static void table_unref(struct sstable *t) {
+    if (__atomic_sub_fetch(&t->refs, 1, __ATOMIC_ACQ_REL) > 0) {
+        return;
+    }
+    close(t->fd);
+    if (t->obsolete) {
+        char name[PATH_MAX];
+        table_name(name, t->id);
+        unlink(name);
+    }
+    free(t->blocks);
+    free(t->index_buf);
+    free(t->bloom);
+    free(t->smallest);
+    free(t);
+}
+
+static char *read_block(struct sstable *t, int b) {
+    char *buf = malloc(t->blocks[b].size);
+    if (buf == NULL) {
+        return NULL;
+    }
+    if (pread(t->fd, buf, t->blocks[b].size, t->blocks[b].offset) != t->blocks[b].size) {
+        perror("sstable read");
+        free(buf);
+        return NULL;
+    }
+    stat_add(&n_table_reads, 1);
+    return buf;
+}
+
+static struct sstable *table_open(uint32_t id) {
+    char name[PATH_MAX];
+    table_name(name, id);
+    struct sstable *t = calloc(1, sizeof(*t));
+    if (t == NULL) {
+        return NULL;
+    }
+    t->id = id;
+    t->refs = 1;
+    if ((t->fd = open(name, O_RDONLY | O_CLOEXEC)) < 0) {
+        perror(name);
+        free(t);
+        return NULL;
+    }
+    struct stat st;
+    struct sst_footer f;
+    if (fstat(t->fd, &st) < 0 || st.st_size < sizeof(f) ||
+        pread(t->fd, &f, sizeof(f), st.st_size - sizeof(f)) != sizeof(f) ||
+        f.magic != SST_MAGIC || f.nblocks == 0) {
+        fprintf(stderr, "%s: not a valid table\n", name);
+        close(t->fd);
+        free(t);
+        return NULL;
+    }
+    t->size = st.st_size;
+    t->nblocks = f.nblocks;
+    t->bloom_bits = f.bloom_bits;
+    t->nkeys = f.nkeys;
+    t->ntombstones = f.ntombstones;
+    t->index_buf = malloc(f.index_len);
+    t->blocks = malloc(f.nblocks * sizeof(*t->blocks));
+    t->bloom = malloc(f.bloom_bits / 8 + 1);
+    if (!t->index_buf || !t->blocks || !t->bloom ||
+        pread(t->fd, t->index_buf, f.index_len, f.index_offset) != f.index_len ||
+        pread(t->fd, t->bloom, f.bloom_bits / 8, f.bloom_offset) != f.bloom_bits / 8) {
+        fprintf(stderr, "%s: can't load index\n", name);
+        table_unref(t);
+        return NULL;
+    }
+    char *p = t->index_buf;
+    for (int b = 0; b < t->nblocks; b++) {
+        struct sst_index_entry e;
+        memcpy(&e, p, sizeof(e));
+        t->blocks[b] = (struct block_handle){.offset = e.offset, .size = e.size, .last_key = p + sizeof(e)};
+        p += sizeof(e) + e.klen + 1;
+    }
+    t->largest = t->blocks[t->nblocks - 1].last_key;
+
+    /* smallest key is the first one in the first block */
+    char *block = read_block(t, 0);
+    if (block == NULL) {
+        table_unref(t);
+        return NULL;
+    }
+    t->smallest = strdup(block + sizeof(struct sst_entry));
+    free(block);
+    return t;
+}
+
+/* where a lookup leaves what it found: up to max bytes of a value in
+ * buf, or the reference to a blob
+ */
+struct found {
+    char *buf;
+    int max;
+    int flags;
+    struct blob_ref ref;
+};
+
+/* entry value length, or the blob length for a blob */
+static long found_copy(struct found *f, int flags, const char *value, uint32_t vlen) {
+    f->flags = flags;
+    if (flags & ENTRY_BLOB) {
+        memcpy(&f->ref, value, sizeof(f->ref));
+        return f->ref.len;
+    }
+    memcpy(f->buf, value, vlen < f->max ? vlen : f->max);
+    return vlen;
+}
+
+/* look key up in one table: the value length (see found_copy) if the
+ * table has it, -2 if it doesn't, -1 on error
+ */
+static long table_get(struct sstable *t, const char *key, uint32_t h, struct found *f) {
+    if (!bloom_may_contain(t, h)) {
+        stat_add(&n_bloom_skips, 1);
+        return -2;
+    }
+    int lo = 0, hi = t->nblocks - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (strcmp(t->blocks[mid].last_key, key) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    char *block = read_block(t, lo);
+    if (block == NULL) {
+        return -1;
+    }
+    long result = -2;
+    for (char *p = block; p < block + t->blocks[lo].size; ) {
+        struct sst_entry e;
+        memcpy(&e, p, sizeof(e));
+        char *k = p + sizeof(e);
+        int cmp = strcmp(k, key);
+        if (cmp == 0) {
+            result = found_copy(f, e.flags, k + e.klen + 1, e.vlen);
+            break;
+        }
+        if (cmp > 0) {
+            break;
+        }
+        p = k + e.klen + 1 + e.vlen;
+    }
+    free(block);
+    return result;
+}
+
+/* sequential reader over a table, used by compaction */
+struct table_iter {
+    struct sstable *t;
+    int block;
+    char *buf;
+    char *pos;
+    struct sst_entry e;
+    char *key;
+    char *value;
+    int error;
+};
+
+static int iter_next(struct table_iter *it) {
+    while (it->buf == NULL || it->pos >= it->buf + it->t->blocks[it->block].size) {
+        free(it->buf);
+        it->buf = NULL;
+        it->key = NULL;
+        if (++it->block >= it->t->nblocks) {
+            return 0;
+        }
+        if ((it->buf = read_block(it->t, it->block)) == NULL) {
+            it->error = 1;
+            return 0;
+        }
+        it->pos = it->buf;
+    }
+    memcpy(&it->e, it->pos, sizeof(it->e));
+    it->key = it->pos + sizeof(it->e);
+    it->value = it->key + it->e.klen + 1;
+    it->pos = it->value + it->e.vlen;
+    return 1;
+}
+
+static void iter_init(struct table_iter *it, struct sstable *t) {
+    *it = (struct table_iter){.t = t, .block = -1};
+    iter_next(it);
+}
+
+/* like iter_init, but at the first key after `after` */
+static void iter_seek(struct table_iter *it, struct sstable *t, const char *after) {
+    int lo = 0, hi = t->nblocks;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (strcmp(t->blocks[mid].last_key, after) <= 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    *it = (struct table_iter){.t = t, .block = lo - 1};
+    while (iter_next(it) && strcmp(it->key, after) <= 0) {
+    }
+}
+
+/* writes one table; the caller adds keys in increasing order */
+struct table_builder {
+    int fd;
+    uint32_t id;
+    long offset;
+    char *block;
+    int block_len;
+    int block_max;
+    char *index;
+    long index_len;
+    long index_max;
+    uint32_t *hashes;
+    long nkeys;
+    long ntombstones;
+    long max_keys;
+    int nblocks;
+    char last_key[65536 + 1];
+};
+
+static int grow(char **buf, long *max, long need) {
+    if (need <= *max) {
+        return 0;
+    }
+    long n = *max ? *max : 4096;
+    while (n < need) {
+        n *= 2;
+    }
+    char *p = realloc(*buf, n);
+    if (p == NULL) {
+        return -1;
+    }
+    *buf = p;
+    *max = n;
+    return 0;
+}
+
+static int write_all(int fd, const void *buf, long len) {
+    const char *p = buf;
+    while (len > 0) {
+        long n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static struct table_builder *builder_new(void) {
+    struct table_builder *b = calloc(1, sizeof(*b));
+    if (b == NULL) {
+        return NULL;
+    }
+    pthread_mutex_lock(&lsm_mutex);
+    b->id = next_file++;
+    pthread_mutex_unlock(&lsm_mutex);
+    char name[PATH_MAX];
+    table_name(name, b->id);
+    if ((b->fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666)) < 0) {
+        perror(name);
+        free(b);
+        return NULL;
+    }
+    return b;
+}
+
+static void builder_abandon(struct table_builder *b) {
+    char name[PATH_MAX];
+    table_name(name, b->id);
+    close(b->fd);
+    unlink(name);
+    free(b->block);
+    free(b->index);
+    free(b->hashes);
+    free(b);
+}
+
+static int builder_flush_block(struct table_builder *b) {
+    if (b->block_len == 0) {
+        return 0;
+    }
+    int klen = strlen(b->last_key);
+    struct sst_index_entry e = {.offset = b->offset, .size = b->block_len, .klen = klen};
+    if (write_all(b->fd, b->block, b->block_len) < 0 ||
+        grow(&b->index, &b->index_max, b->index_len + sizeof(e) + klen + 1) < 0) {
+        return -1;
+    }
+    memcpy(b->index + b->index_len, &e, sizeof(e));
+    memcpy(b->index + b->index_len + sizeof(e), b->last_key, klen + 1);
+    b->index_len += sizeof(e) + klen + 1;
+    b->offset += b->block_len;
+    b->block_len = 0;
+    b->nblocks++;
+    return 0;
+}
+
+static int builder_add(struct table_builder *b, const char *key, int flags, const char *value, uint32_t vlen) {
+    int klen = strlen(key);
+    long size = sizeof(struct sst_entry) + klen + 1 + vlen;
+    if (b->block_len > 0 && b->block_len + size > BLOCK_SIZE && builder_flush_block(b) < 0) {
+        return -1;
+    }
+    long block_max = b->block_max;
+    if (grow(&b->block, &block_max, b->block_len + size) < 0) {
+        return -1;
+    }
+    b->block_max = block_max;
+    if (b->nkeys == b->max_keys) {
+        long n = b->max_keys ? b->max_keys * 2 : 1024;
+        uint32_t *p = realloc(b->hashes, n * sizeof(*p));
+        if (p == NULL) {
+            return -1;
+        }
+        b->hashes = p;
+        b->max_keys = n;
+    }
+    struct sst_entry e = {.vlen = vlen, .klen = klen, .flags = flags};
+    char *p = b->block + b->block_len;
+    memcpy(p, &e, sizeof(e));
+    memcpy(p + sizeof(e), key, klen + 1);
+    memcpy(p + sizeof(e) + klen + 1, value, vlen);
+    b->block_len += size;
+    b->hashes[b->nkeys++] = bloom_hash(key);
+    b->ntombstones += flags & ENTRY_TOMBSTONE;
+    memcpy(b->last_key, key, klen + 1);
+    return 0;
+}
+
+static long builder_size(struct table_builder *b) {
+    return b->offset + b->block_len;
+}
+
+/* write index, bloom filter and footer, sync, and open the result */
+static struct sstable *builder_finish(struct table_builder *b) {
+    if (builder_flush_block(b) < 0) {
+        builder_abandon(b);
+        return NULL;
+    }
+    uint32_t bits = b->nkeys * BLOOM_BITS_PER_KEY;
+    bits = (bits < 64 ? 64 : bits + 7) / 8 * 8;
+    uint8_t *bloom = calloc(bits / 8, 1);
+    if (bloom == NULL) {
+        builder_abandon(b);
+        return NULL;
+    }
+    for (long i = 0; i < b->nkeys; i++) {
+        uint32_t h = b->hashes[i];
+        uint32_t delta = (h >> 17) | (h << 15);
+        for (int j = 0; j < BLOOM_PROBES; j++) {
+            uint32_t bit = h % bits;
+            bloom[bit / 8] |= 1 << (bit % 8);
+            h += delta;
+        }
+    }
+    struct sst_footer f = {
+        .index_offset = b->offset, .index_len = b->index_len,
+        .bloom_offset = b->offset + b->index_len, .bloom_bits = bits,
+        .nblocks = b->nblocks, .nkeys = b->nkeys, .magic = SST_MAGIC, .ntombstones = b->ntombstones,
+    };
+    int err = write_all(b->fd, b->index, b->index_len) < 0 ||
+              write_all(b->fd, bloom, bits / 8) < 0 ||
+              write_all(b->fd, &f, sizeof(f)) < 0 || fdatasync(b->fd) < 0;
+    free(bloom);
+    if (err) {
+        perror("sstable write");
+        builder_abandon(b);
+        return NULL;
+    }
+    uint32_t id = b->id;
+    close(b->fd);
+    free(b->block);
+    free(b->index);
+    free(b->hashes);
+    free(b);
+    return table_open(id);
+}
+
+static void version_unref(struct version *v) {
+    if (__atomic_sub_fetch(&v->refs, 1, __ATOMIC_ACQ_REL) > 0) {
+        return;
+    }
+    for (int level = 0; level < LSM_LEVELS; level++) {
+        for (int i = 0; i < v->n[level]; i++) {
+            table_unref(v->t[level][i]);
+        }
+        free(v->t[level]);
+    }
+    free(v);
+}
+
+static struct version *version_get(void) {
+    pthread_rwlock_rdlock(&mem_lock);
+    struct version *v = current;
+    __atomic_add_fetch(&v->refs, 1, __ATOMIC_RELAXED);
+    pthread_rwlock_unlock(&mem_lock);
+    return v;
+}
+
+static int compare_smallest(const void *a, const void *b) {
+    return strcmp((*(struct sstable **)a)->smallest, (*(struct sstable **)b)->smallest);
+}
+
+/* copy of v without the tables in del, with add placed in level (in
+ * front for level 0, sorted by key otherwise). the deleted tables are
+ * marked obsolete and go away with the last version holding them.
+ */
+static struct version *version_edit(struct version *v, struct sstable **del, int ndel,
+                                    int level, struct sstable **add, int nadd) {
+    struct version *nv = calloc(1, sizeof(*nv));
+    if (nv == NULL) {
+        return NULL;
+    }
+    nv->refs = 1;
+    for (int l = 0; l < LSM_LEVELS; l++) {
+        int extra = l == level ? nadd : 0;
+        nv->t[l] = malloc((v->n[l] + extra + 1) * sizeof(struct sstable *));
+        if (nv->t[l] == NULL) {
+            nv->n[l] = 0;
+            version_unref(nv);
+            return NULL;
+        }
+        if (l == level && level == 0) {
+            for (int i = 0; i < nadd; i++) {
+                nv->t[l][nv->n[l]++] = add[i];
+            }
+        }
+        for (int i = 0; i < v->n[l]; i++) {
+            int gone = 0;
+            for (int j = 0; j < ndel; j++) {
+                gone |= v->t[l][i] == del[j];
+            }
+            if (!gone) {
+                nv->t[l][nv->n[l]++] = v->t[l][i];
+            }
+        }
+        if (l == level && level > 0) {
+            for (int i = 0; i < nadd; i++) {
+                nv->t[l][nv->n[l]++] = add[i];
+            }
+            qsort(nv->t[l], nv->n[l], sizeof(struct sstable *), compare_smallest);
+        }
+        for (int i = 0; i < nv->n[l]; i++) {
+            __atomic_add_fetch(&nv->t[l][i]->refs, 1, __ATOMIC_RELAXED);
+        }
+    }
+    for (int j = 0; j < ndel; j++) {
+        del[j]->obsolete = 1;
+    }
+    return nv;
+}
+
+/* caller holds lsm_mutex */
+static void write_manifest(void) {
+    char name[PATH_MAX], tmp[PATH_MAX + 8];
+    sprintf(name, "%s/MANIFEST", lsm_dir);
+    sprintf(tmp, "%s.tmp", name);
+    FILE *fp = fopen(tmp, "w");
+    if (fp == NULL) {
+        perror(tmp);
+        return;
+    }
+    fprintf(fp, "next %u\nblob %lu\n", next_file,
+            (unsigned long)__atomic_load_n(&next_blob, __ATOMIC_RELAXED));
+    for (int level = 0; level < LSM_LEVELS; level++) {
+        for (int i = 0; i < current->n[level]; i++) {
+            fprintf(fp, "table %d %u\n", level, current->t[level][i]->id);
+        }
+    }
+    if (fflush(fp) != 0 || fdatasync(fileno(fp)) < 0 || fclose(fp) != 0 || rename(tmp, name) < 0) {
+        perror("manifest");
+    }
+}
+
+/* caller holds lsm_mutex */
+static void install_version(struct version *nv, int flushed) {
+    pthread_rwlock_wrlock(&mem_lock);
+    struct version *old = current;
+    current = nv;
+    struct memtable *done = flushed ? imm : NULL;
+    if (flushed) {
+        imm = NULL;
+    }
+    pthread_rwlock_unlock(&mem_lock);
+    write_manifest();
+    version_unref(old);
+    if (done) {
+        mem_free(done);
+    }
+    pthread_cond_broadcast(&stall_cond);
+}
+
+static void flush_memtable(void) {
+    struct table_builder *b = builder_new();
+    struct sstable *t = NULL;
+    if (b) {
+        int err = 0;
+        for (struct mem_node *n = imm->head->next[0]; n && !err; n = n->next[0]) {
+            err = builder_add(b, n->key, n->flags, n->value, n->vlen) < 0;
+        }
+        if (err) {
+            builder_abandon(b);
+        } else {
+            t = builder_finish(b);
+        }
+    }
+    pthread_mutex_lock(&lsm_mutex);
+    if (t == NULL) {
+        /* keep the memtable and try again on the next round */
+        fprintf(stderr, "lsm: memtable flush failed\n");
+        pthread_mutex_unlock(&lsm_mutex);
+        sleep(1);
+        return;
+    }
+    struct version *nv = version_edit(current, NULL, 0, 0, &t, 1);
+    table_unref(t);
+    if (nv) {
+        install_version(nv, 1);
+        n_flushes++;
+    }
+    pthread_mutex_unlock(&lsm_mutex);
+}
+
+static long level_max_bytes(int level) {
+    long max = LEVEL1_MAX;
+    while (level-- > 1) {
+        max *= LEVEL_MULTIPLIER;
+    }
+    return max;
+}
+
+static long level_bytes(struct version *v, int level) {
+    long bytes = 0;
+    for (int i = 0; i < v->n[level]; i++) {
+        bytes += v->t[level][i]->size;
+    }
+    return bytes;
+}
+
+/* level most in need of compaction, or -1 */
+static int pick_level(struct version *v) {
+    int best = -1;
+    double best_score = 1.0;
+    for (int level = 0; level < LSM_LEVELS - 1; level++) {
+        double score = level == 0 ? (double)v->n[0] / L0_COMPACT_TRIGGER
+                                  : (double)level_bytes(v, level) / level_max_bytes(level);
+        if (score >= best_score) {
+            best = level;
+            best_score = score;
+        }
+    }
+    return best;
+}
+
+static int overlaps(struct sstable *t, const char *smallest, const char *largest) {
+    return strcmp(t->largest, smallest) >= 0 && strcmp(t->smallest, largest) <= 0;
+}
+
+/* merge inputs (newest first) into new tables for level out. the
+ * newest copy of each key wins; tombstones are dropped if no level
+ * below out has anything they could be hiding. blobs of the copies
+ * that lose are added to dead, to be unlinked once the result is in
+ * place.
+ */
+static int merge_tables(struct version *v, struct sstable **in, int nin, int out,
+                        struct sstable ***result, int *nresult, char **dead, long *dead_len) {
+    long dead_max = 0;
+    int drop_tombstones = 1;
+    for (int level = out + 1; level < LSM_LEVELS; level++) {
+        drop_tombstones &= v->n[level] == 0;
+    }
+    struct table_iter *it = calloc(nin, sizeof(*it));
+    struct sstable **tables = NULL;
+    int ntables = 0;
+    struct table_builder *b = NULL;
+    int err = it == NULL;
+
+    for (int i = 0; i < nin && !err; i++) {
+        iter_init(&it[i], in[i]);
+    }
+    while (!err) {
+        int min = -1;
+        for (int i = 0; i < nin; i++) {
+            if (it[i].key && (min < 0 || strcmp(it[i].key, it[min].key) < 0)) {
+                min = i;
+            }
+        }
+        if (min < 0) {
+            break;
+        }
+        struct table_iter *m = &it[min];
+        if (!(drop_tombstones && (m->e.flags & ENTRY_TOMBSTONE))) {
+            if (b == NULL && (b = builder_new()) == NULL) {
+                err = 1;
+                break;
+            }
+            err = builder_add(b, m->key, m->e.flags, m->value, m->e.vlen) < 0;
+        }
+        /* skip older copies of the same key */
+        for (int i = 0; i < nin; i++) {
+            if (i != min && it[i].key && strcmp(it[i].key, m->key) == 0) {
+                if ((it[i].e.flags & ENTRY_BLOB) &&
+                    grow(dead, &dead_max, *dead_len + sizeof(struct blob_ref)) == 0) {
+                    memcpy(*dead + *dead_len, it[i].value, sizeof(struct blob_ref));
+                    *dead_len += sizeof(struct blob_ref);
+                }
+                iter_next(&it[i]);
+            }
+        }
+        iter_next(m);
+        if (!err && b && builder_size(b) >= TABLE_MAX) {
+            struct sstable **p = realloc(tables, (ntables + 1) * sizeof(*p));
+            struct sstable *t = p ? builder_finish(b) : NULL;
+            b = NULL;
+            if (p) {
+                tables = p;
+            }
+            if (t == NULL) {
+                err = 1;
+            } else {
+                tables[ntables++] = t;
+            }
+        }
+    }
+    if (!err && b) {
+        struct sstable **p = realloc(tables, (ntables + 1) * sizeof(*p));
+        struct sstable *t = p ? builder_finish(b) : NULL;
+        b = NULL;
+        if (p) {
+            tables = p;
+        }
+        if (t == NULL) {
+            err = 1;
+        } else {
+            tables[ntables++] = t;
+        }
+    }
+    if (b) {
+        builder_abandon(b);
+    }
+    for (int i = 0; i < nin && it; i++) {
+        err |= it[i].error;
+        free(it[i].buf);
+    }
+    free(it);
+    if (err) {
+        for (int i = 0; i < ntables; i++) {
+            tables[i]->obsolete = 1;
+            table_unref(tables[i]);
+        }
+        free(tables);
+        return -1;
+    }
+    *result = tables;
+    *nresult = ntables;
+    return 0;
+}
+
+static void compact(int level) {
+    struct version *v = version_get();
+    struct sstable **in = malloc((v->n[level] + v->n[level + 1]) * sizeof(*in));
+    if (in == NULL) {
+        version_unref(v);
+        return;
+    }
+    int nin = 0;
+    if (level == 0) {
+        for (int i = 0; i < v->n[0]; i++) {
+            in[nin++] = v->t[0][i];
+        }
+    } else {
+        /* round robin through the key space of the level */
+        int pick = 0;
+        for (int i = 0; i < v->n[level] && compact_ptr[level]; i++) {
+            if (strcmp(v->t[level][i]->smallest, compact_ptr[level]) > 0) {
+                pick = i;
+                break;
+            }
+        }
+        in[nin++] = v->t[level][pick];
+        free(compact_ptr[level]);
+        compact_ptr[level] = strdup(in[0]->largest);
+    }
+    const char *smallest = in[0]->smallest, *largest = in[0]->largest;
+    for (int i = 1; i < nin; i++) {
+        if (strcmp(in[i]->smallest, smallest) < 0) {
+            smallest = in[i]->smallest;
+        }
+        if (strcmp(in[i]->largest, largest) > 0) {
+            largest = in[i]->largest;
+        }
+    }
+    for (int i = 0; i < v->n[level + 1]; i++) {
+        if (overlaps(v->t[level + 1][i], smallest, largest)) {
+            in[nin++] = v->t[level + 1][i];
+        }
+    }
+
+    struct sstable **out = NULL;
+    int nout = 0;
+    char *dead = NULL;
+    long dead_len = 0;
+    long bytes = 0;
+    for (int i = 0; i < nin; i++) {
+        bytes += in[i]->size;
+    }
+    if (level > 0 && nin == 1) {
+        /* nothing to merge with: move the table down as it is */
+        pthread_mutex_lock(&lsm_mutex);
+        struct version *nv = version_edit(current, in, 1, level + 1, in, 1);
+        if (nv) {
+            in[0]->obsolete = 0;
+            install_version(nv, 0);
+        }
+        pthread_mutex_unlock(&lsm_mutex);
+    } else if (merge_tables(v, in, nin, level + 1, &out, &nout, &dead, &dead_len) == 0) {
+        pthread_mutex_lock(&lsm_mutex);
+        struct version *nv = version_edit(current, in, nin, level + 1, out, nout);
+        if (nv) {
+            install_version(nv, 0);
+            n_compactions++;
+            n_compacted_bytes += bytes;
+            for (long off = 0; off < dead_len; off += sizeof(struct blob_ref)) {
+                blob_unlink(dead + off);
+            }
+        }
+        pthread_mutex_unlock(&lsm_mutex);
+        for (int i = 0; i < nout; i++) {
+            table_unref(out[i]);
+        }
+        free(out);
+    } else {
+        fprintf(stderr, "lsm: compaction of level %d failed\n", level);
+        sleep(1);
+    }
+    free(dead);
+    free(in);
+    version_unref(v);
+}
+
+static void *bg_main(void *arg) {
+    pthread_mutex_lock(&lsm_mutex);
+    while (1) {
+        if (imm) {
+            pthread_mutex_unlock(&lsm_mutex);
+            flush_memtable();
+            pthread_mutex_lock(&lsm_mutex);
+            continue;
+        }
+        if (bg_stop) {
+            break;
+        }
+        int level = pick_level(current);
+        if (level >= 0) {
+            pthread_mutex_unlock(&lsm_mutex);
+            compact(level);
+            pthread_mutex_lock(&lsm_mutex);
+            continue;
+        }
+        pthread_cond_wait(&work_cond, &lsm_mutex);
+    }
+    pthread_mutex_unlock(&lsm_mutex);
+    return NULL;
+}
+
+/* value length if key is live, -2 if absent or deleted, -1 on error */
+static long lookup(const char *key, struct found *f) {
+    pthread_rwlock_rdlock(&mem_lock);
+    struct memtable *tables[2] = {mem, imm};
+    for (int i = 0; i < 2; i++) {
+        struct mem_node *n = tables[i] ? mem_get(tables[i], key) : NULL;
+        if (n) {
+            long result = found_copy(f, n->flags, n->value, n->vlen);
+            pthread_rwlock_unlock(&mem_lock);
+            return (n->flags & ENTRY_TOMBSTONE) ? -2 : result;
+        }
+    }
+    struct version *v = current;
+    __atomic_add_fetch(&v->refs, 1, __ATOMIC_RELAXED);
+    pthread_rwlock_unlock(&mem_lock);
+
+    uint32_t h = bloom_hash(key);
+    long result = -2;
+    for (int i = 0; i < v->n[0] && result == -2; i++) {
+        struct sstable *t = v->t[0][i];
+        if (strcmp(key, t->smallest) >= 0 && strcmp(key, t->largest) <= 0) {
+            result = table_get(t, key, h, f);
+        }
+    }
+    for (int level = 1; level < LSM_LEVELS && result == -2; level++) {
+        int lo = 0, hi = v->n[level];
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (strcmp(v->t[level][mid]->largest, key) < 0) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        if (lo < v->n[level] && strcmp(key, v->t[level][lo]->smallest) >= 0) {
+            result = table_get(v->t[level][lo], key, h, f);
+        }
+    }
+    version_unref(v);
+    if (result >= 0 && (f->flags & ENTRY_TOMBSTONE)) {
+        result = -2;
+    }
+    return result;
+}
+
+/* wait until the memtable has room, swapping in a fresh one if it is
+ * full; caller holds lsm_mutex
+ */
+static int mem_room(void) {
+    while (mem->bytes >= MEMTABLE_MAX) {
+        if (imm == NULL && current->n[0] < L0_STALL) {
+            struct memtable *m = mem_new();
+            if (m == NULL) {
+                return -1;
+            }
+            pthread_rwlock_wrlock(&mem_lock);
+            imm = mem;
+            mem = m;
+            pthread_rwlock_unlock(&mem_lock);
+            pthread_cond_signal(&work_cond);
+            break;
+        }
+        n_stalls++;
+        pthread_cond_wait(&stall_cond, &lsm_mutex);
+    }
+    return 0;
+}
+
+static int insert(const char *key, const char *data, int len, int flags) {
+    pthread_mutex_lock(&lsm_mutex);
+    if (mem_room() < 0) {
+        pthread_mutex_unlock(&lsm_mutex);
+        return -1;
+    }
+    pthread_rwlock_wrlock(&mem_lock);
+    int status = mem_put(mem, key, data, len, flags);
+    pthread_rwlock_unlock(&mem_lock);
+    pthread_mutex_unlock(&lsm_mutex);
+    return status;
+}
+
+int lsm_put(const char *key, const char *data, int len) {
+    return insert(key, data, len, 0);
+}
+
+/* put n distinct keys, all or none: every allocation is made before
+ * the first key goes in, and they go in together under the memtable
+ * lock, so a reader sees either none of them or all
+ */
+int lsm_put_batch(const char **keys, const char **data, const int *lens, int n) {
+    char **values = calloc(n, sizeof(*values));
+    struct mem_node **spares = calloc(n, sizeof(*spares));
+    int status = -1;
+    if (values == NULL || spares == NULL) {
+        goto out;
+    }
+    for (int i = 0; i < n; i++) {
+        if (lens[i] > 0 && (values[i] = malloc(lens[i])) == NULL) {
+            goto out;
+        }
+        if (lens[i] > 0) {
+            memcpy(values[i], data[i], lens[i]);
+        }
+    }
+    pthread_mutex_lock(&lsm_mutex);
+    if (mem_room() < 0) {
+        pthread_mutex_unlock(&lsm_mutex);
+        goto out;
+    }
+    for (int i = 0; i < n; i++) {
+        if (mem_get(mem, keys[i]) == NULL && (spares[i] = mem_node_new(mem, keys[i])) == NULL) {
+            pthread_mutex_unlock(&lsm_mutex);
+            goto out;
+        }
+    }
+    pthread_rwlock_wrlock(&mem_lock);
+    for (int i = 0; i < n; i++) {
+        mem_link(mem, keys[i], values[i], lens[i], 0, spares[i]);
+        values[i] = NULL;
+        spares[i] = NULL;
+    }
+    pthread_rwlock_unlock(&mem_lock);
+    pthread_mutex_unlock(&lsm_mutex);
+    status = 0;
+out:
+    for (int i = 0; values && spares && i < n; i++) {
+        free(values[i]);
+        free(spares[i]);
+    }
+    free(values);
+    free(spares);
+    return status;
+}
+
+/* store the len bytes in file path (which is moved into the store) as
+ * key's value
+ */
+int lsm_put_blob(const char *key, const char *path, long len) {
+    struct blob_ref ref = {.id = __atomic_fetch_add(&next_blob, 1, __ATOMIC_RELAXED), .len = len};
+    char name[PATH_MAX];
+    blob_name(name, ref.id);
+    if (rename(path, name) < 0) {
+        perror(name);
+        return -1;
+    }
+    int status = insert(key, (char *)&ref, sizeof(ref), ENTRY_BLOB);
+    if (status < 0) {
+        unlink(name);
+    }
+    return status;
+}
+
+/* the first max bytes of key's value in buf, or for a blob, with fd
+ * set, an open descriptor to read it from instead. returns the full
+ * length of the value, -1 if there is none.
+ */
+long lsm_read_value(const char *key, char *buf, int max, int *fd) {
+    struct found f = {.buf = buf, .max = max};
+    long len = lookup(key, &f);
+    if (fd) {
+        *fd = -1;
+    }
+    if (len < 0 || !(f.flags & ENTRY_BLOB)) {
+        return len < 0 ? -1 : len;
+    }
+    char name[PATH_MAX];
+    blob_name(name, f.ref.id);
+    int blob = open(name, O_RDONLY | O_CLOEXEC);
+    if (blob < 0) {
+        perror(name);
+        return -1;
+    }
+    if (fd) {
+        *fd = blob;
+        return len;
+    }
+    int n = pread(blob, buf, len < max ? len : max, 0);
+    close(blob);
+    return n < 0 ? -1 : len;
+}
+
+int lsm_get(const char *key, char *buf, int max) {
+    long len = lsm_read_value(key, buf, max, NULL);
+    return len < 0 ? -1 : (len < max ? len : max);
+}
+
+/* -1 if key isn't there: the lookup is what tells the caller so */
+int lsm_delete(const char *key) {
+    struct found f = {0};
+    if (lookup(key, &f) < 0 || insert(key, NULL, 0, ENTRY_TOMBSTONE) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/* an estimate of the live keys, from counts kept as memtables fill and
+ * tables are written, so writes never look a key up to keep it: every
+ * value less every tombstone and the older value each one hides. a key
+ * written again counts twice, and one written and deleted in the same
+ * memtable counts -1, until compaction merges them; once everything is
+ * in the bottom level it is exact
+ */
+long lsm_count(void) {
+    long keys = 0;
+    pthread_mutex_lock(&lsm_mutex);
+    pthread_rwlock_rdlock(&mem_lock);
+    keys += mem->entries - 2 * mem->tombstones;
+    if (imm) {
+        keys += imm->entries - 2 * imm->tombstones;
+    }
+    pthread_rwlock_unlock(&mem_lock);
+    for (int level = 0; level < LSM_LEVELS; level++) {
+        for (int i = 0; i < current->n[level]; i++) {
+            keys += current->t[level][i]->nkeys - 2L * current->t[level][i]->ntombstones;
+        }
+    }
+    pthread_mutex_unlock(&lsm_mutex);
+    return keys < 0 ? 0 : keys;
+}
+
+/* lsm_scan collects, from each source - the two memtables, each level 0
+ * table, each deeper level - its first `limit` keys after the cursor,
+ * tagged with the source's age (0 is the newest). a source that had
+ * more stops the scan at its last key collected: past that, the newest
+ * version of a key may not have been seen
+ */
+struct scan_key {
+    char *key;
+    int source;
+    int dead;
+};
+
+struct scan {
+    const char *after;
+    int limit;
+    struct scan_key *keys;
+    int n;
+    int cap;
+    const char *bound;
+    int error;
+};
+
+static void scan_add(struct scan *sc, const char *key, int source, int flags) {
+    if (sc->n == sc->cap) {
+        int cap = sc->cap ? sc->cap * 2 : 256;
+        struct scan_key *p = realloc(sc->keys, cap * sizeof(*p));
+        if (p == NULL) {
+            sc->error = 1;
+            return;
+        }
+        sc->keys = p;
+        sc->cap = cap;
+    }
+    char *copy = strdup(key);
+    if (copy == NULL) {
+        sc->error = 1;
+        return;
+    }
+    sc->keys[sc->n++] = (struct scan_key){.key = copy, .source = source, .dead = flags & ENTRY_TOMBSTONE};
+}
+
+/* the source just added from has more keys after its last one */
+static void scan_cut(struct scan *sc) {
+    const char *last = sc->keys[sc->n - 1].key;
+    if (sc->bound == NULL || strcmp(last, sc->bound) < 0) {
+        sc->bound = last;
+    }
+}
+
+/* caller holds mem_lock */
+static void scan_mem(struct scan *sc, struct memtable *m, int source) {
+    int taken = 0;
+    for (struct mem_node *x = mem_seek(m, sc->after, NULL); x && !sc->error; x = x->next[0]) {
+        if (strcmp(x->key, sc->after) == 0) {
+            continue;
+        }
+        if (taken == sc->limit) {
+            scan_cut(sc);
+            break;
+        }
+        scan_add(sc, x->key, source, x->flags);
+        taken++;
+    }
+}
+
+/* the tables of one source in key order: one level 0 table, or a level */
+static void scan_tables(struct scan *sc, struct sstable **t, int n, int source) {
+    int taken = 0;
+    for (int i = 0; i < n && !sc->error; i++) {
+        if (strcmp(t[i]->largest, sc->after) <= 0) {
+            continue;
+        }
+        struct table_iter it;
+        iter_seek(&it, t[i], sc->after);
+        for (; it.key && !sc->error; iter_next(&it)) {
+            if (taken == sc->limit) {
+                scan_cut(sc);
+                break;
+            }
+            scan_add(sc, it.key, source, it.e.flags);
+            taken++;
+        }
+        sc->error |= it.error;
+        free(it.buf);
+        if (taken == sc->limit) {
+            break;
+        }
+    }
+}
+
+static int compare_scan_keys(const void *a, const void *b) {
+    const struct scan_key *x = a, *y = b;
+    int cmp = strcmp(x->key, y->key);
+    return cmp ? cmp : x->source - y->source;
+}
+
+/* live keys after `after` ("" for the first), in key order, packed NUL-
+ * terminated into buf, up to max bytes; after is set to the last key
+ * looked at, or "" once there are no more. returns the bytes used, or
+ * -1 on error or if the next key won't fit in after_max or max bytes
+ */
+long lsm_scan(char *after, int after_max, char *buf, int max) {
+    struct scan sc = {.after = after, .limit = max / 16 + 1};
+
+    pthread_rwlock_rdlock(&mem_lock);
+    scan_mem(&sc, mem, 0);
+    if (imm) {
+        scan_mem(&sc, imm, 1);
+    }
+    struct version *v = current;
+    __atomic_add_fetch(&v->refs, 1, __ATOMIC_RELAXED);
+    pthread_rwlock_unlock(&mem_lock);
+    for (int i = 0; i < v->n[0]; i++) {
+        scan_tables(&sc, &v->t[0][i], 1, 2 + i);
+    }
+    for (int level = 1; level < LSM_LEVELS; level++) {
+        scan_tables(&sc, v->t[level], v->n[level], 1 + v->n[0] + level);
+    }
+    version_unref(v);
+
+    qsort(sc.keys, sc.n, sizeof(*sc.keys), compare_scan_keys);
+    long used = 0;
+    const char *last = NULL;
+    int i;
+    for (i = 0; i < sc.n && !sc.error; i++) {
+        struct scan_key *k = &sc.keys[i];
+        if (i > 0 && strcmp(k->key, sc.keys[i - 1].key) == 0) {
+            continue;               /* an older version */
+        }
+        if (sc.bound && strcmp(k->key, sc.bound) > 0) {
+            break;
+        }
+        int len = strlen(k->key) + 1;
+        if (len > after_max || (!k->dead && used + len > max)) {
+            break;
+        }
+        if (!k->dead) {
+            memcpy(buf + used, k->key, len);
+            used += len;
+        }
+        last = k->key;
+    }
+    if (sc.error || (last == NULL && i < sc.n)) {
+        used = -1;
+    } else if (i == sc.n && sc.bound == NULL) {
+        after[0] = 0;
+    } else {
+        strcpy(after, last);
+    }
+    for (int j = 0; j < sc.n; j++) {
+        free(sc.keys[j].key);
+    }
+    free(sc.keys);
+    return used;
+}
+
+void lsm_get_stats(struct lsm_stats *st) {
+    memset(st, 0, sizeof(*st));
+    pthread_mutex_lock(&lsm_mutex);
+    pthread_rwlock_rdlock(&mem_lock);
+    st->mem_bytes = mem->bytes + (imm ? imm->bytes : 0);
+    pthread_rwlock_unlock(&mem_lock);
+    for (int level = 0; level < LSM_LEVELS; level++) {
+        st->tables[level] = current->n[level];
+        st->level_bytes[level] = level_bytes(current, level);
+    }
+    st->flushes = n_flushes;
+    st->compactions = n_compactions;
+    st->compacted_bytes = n_compacted_bytes;
+    st->stalls = n_stalls;
+    pthread_mutex_unlock(&lsm_mutex);
+    st->keys = lsm_count();
+    st->table_reads = __atomic_load_n(&n_table_reads, __ATOMIC_RELAXED);
+    st->bloom_skips = __atomic_load_n(&n_bloom_skips, __ATOMIC_RELAXED);
+}
+
+/* load the tables listed in the MANIFEST and remove any others (left by
+ * a flush or compaction that was cut short)
+ */
+int lsm_open(const char *dir_name) {
+    snprintf(lsm_dir, sizeof(lsm_dir), "%s/dblsm", dir_name);
+    if (mkdir(lsm_dir, 0777) < 0 && errno != EEXIST) {
+        perror(lsm_dir);
+        return -1;
+    }
+    if ((mem = mem_new()) == NULL || (current = calloc(1, sizeof(*current))) == NULL) {
+        return -1;
+    }
+    current->refs = 1;
+
+    char name[PATH_MAX];
+    sprintf(name, "%s/MANIFEST", lsm_dir);
+    FILE *fp = fopen(name, "r");
+    char line[128];
+    while (fp && fgets(line, sizeof(line), fp)) {
+        int level;
+        uint32_t id;
+        unsigned long blob;
+        if (sscanf(line, "blob %lu", &blob) == 1) {
+            next_blob = blob;
+            continue;
+        }
+        if (sscanf(line, "next %u", &next_file) == 1) {
+            continue;
+        }
+        if (sscanf(line, "table %d %u", &level, &id) != 2 || level < 0 || level >= LSM_LEVELS) {
+            continue;
+        }
+        struct sstable *t = table_open(id);
+        if (t == NULL) {
+            fclose(fp);
+            return -1;
+        }
+        struct sstable **p = realloc(current->t[level], (current->n[level] + 1) * sizeof(*p));
+        if (p == NULL) {
+            fclose(fp);
+            return -1;
+        }
+        current->t[level] = p;
+        p[current->n[level]++] = t;
+    }
+    if (fp) {
+        fclose(fp);
+    }
+
+    DIR *dir = opendir(lsm_dir);
+    struct dirent *de;
+    while (dir && (de = readdir(dir)) != NULL) {
+        uint32_t id;
+        unsigned long blob;
+        char ext[8];
+        if (sscanf(de->d_name, "%lu.%7s", &blob, ext) == 2 && strcmp(ext, "blob") == 0) {
+            if (blob >= next_blob) {
+                next_blob = blob + 1;
+            }
+            continue;
+        }
+        if (sscanf(de->d_name, "%u.%7s", &id, ext) != 2 || strcmp(ext, "sst") != 0) {
+            continue;
+        }
+        int live = 0;
+        for (int level = 0; level < LSM_LEVELS; level++) {
+            for (int i = 0; i < current->n[level]; i++) {
+                live |= current->t[level][i]->id == id;
+            }
+        }
+        if (!live) {
+            table_name(name, id);
+            unlink(name);
+        }
+        if (id >= next_file) {
+            next_file = id + 1;
+        }
+    }
+    if (dir) {
+        closedir(dir);
+    }
+
+    bg_stop = 0;
+    if (pthread_create(&bg_tid, NULL, bg_main, NULL) != 0) {
+        perror("pthread_create lsm");
+        return -1;
+    }
+    return 0;
+}
+
+/* put everything written so far in a table and wait until that is
+ * installed; -1 if there is no memory for a new memtable
+ */
+int lsm_flush(void) {
+    int status = 0;
+    pthread_mutex_lock(&lsm_mutex);
+    while (imm) {
+        pthread_cond_wait(&stall_cond, &lsm_mutex);
+    }
+    if (mem->entries > 0) {
+        struct memtable *m = mem_new();
+        if (m == NULL) {
+            status = -1;
+        } else {
+            pthread_rwlock_wrlock(&mem_lock);
+            imm = mem;
+            mem = m;
+            pthread_rwlock_unlock(&mem_lock);
+            pthread_cond_signal(&work_cond);
+            while (imm) {
+                pthread_cond_wait(&stall_cond, &lsm_mutex);
+            }
+        }
+    }
+    pthread_mutex_unlock(&lsm_mutex);
+    return status;
+}
+
+/* flush the memtable and stop the background thread; compaction that
+ * is still owed is picked up on the next start
+ */
+void lsm_close(void) {
+    pthread_mutex_lock(&lsm_mutex);
+    while (imm) {
+        pthread_cond_wait(&stall_cond, &lsm_mutex);
+    }
+    if (mem->entries > 0) {
+        struct memtable *m = mem_new();
+        if (m) {
+            pthread_rwlock_wrlock(&mem_lock);
+            imm = mem;
+            mem = m;
+            pthread_rwlock_unlock(&mem_lock);
+        }
+    }
+    bg_stop = 1;
+    pthread_cond_signal(&work_cond);
+    pthread_mutex_unlock(&lsm_mutex);
+    pthread_join(bg_tid, NULL);
+
+    pthread_mutex_lock(&lsm_mutex);
+    write_manifest();
+    pthread_mutex_unlock(&lsm_mutex);
+}
@@ -0,0 +1,37 @@
+#ifndef LSMSTORE_H
+#define LSMSTORE_H
+
+#define LSM_LEVELS 7
+
+struct lsm_stats {
+    long keys;
+    long mem_bytes;             /* active + immutable memtable */
+    int tables[LSM_LEVELS];
+    long level_bytes[LSM_LEVELS];
+    long table_reads;           /* blocks read from SSTables */
+    long bloom_skips;           /* table probes a bloom filter ruled out */
+    long flushes;
+    long compactions;
+    long compacted_bytes;
+    long stalls;                /* writers that waited for a flush */
+};
+
+/* the store keeps no per-key locks: callers must serialize writes and
+ * deletes of the same key, and reads of it against those (a read may
+ * open a blob the next write unlinks). dbserver does, with the segment
+ * locks.
+ */
+int lsm_open(const char *dir);
+int lsm_put(const char *key, const char *data, int len);
+int lsm_put_batch(const char **keys, const char **data, const int *lens, int n);
+int lsm_put_blob(const char *key, const char *path, long len);
+int lsm_get(const char *key, char *buf, int max);
+long lsm_read_value(const char *key, char *buf, int max, int *fd);
+int lsm_delete(const char *key);
+long lsm_count(void);
+long lsm_scan(char *after, int after_max, char *buf, int max);
+int lsm_flush(void);
+void lsm_get_stats(struct lsm_stats *st);
+void lsm_close(void);
+
+#endif
@@ -0,0 +1,788 @@
+/*
+ * file:        proto2.c
+ * description: the version 2 protocol (see proto2.h): checking and
+ *              running a request frame and building its reply, for both
+ *              the threaded server (v2_serve) and the reactor, which
+ *              reads frames itself and calls v2_run_frame.
+ *
+ * a frame is read whole before any op in it runs, and checked whole, so
+ * a malformed frame runs nothing; the connection is then closed, since
+ * there is no telling where the next frame starts. an op that is merely
+ * wrong (empty key, key with a NUL in it, unknown op) gets an X.
+ *
+ * replies are built in memory, values included; a value only on disk is
+ * read into the reply rather than sent with sendfile as the old protocol
+ * does. so a reply is held to V2_FRAME_MAX bytes: a value (or scan page)
+ * that would take it past that is answered X instead.
+ *
+ * a run of ops with the same op and V2_BATCH set goes to the database
+ * as one batch (db_read_batch and friends), which sorts the keys by
+ * where they are stored and does the I/O for all of them in one pass.
+ * each op still gets its own K or X.
+ *
+ * a sharded reactor splits a frame by the shard that owns each key
+ * (v2_split_frame); the frame then visits each owner in turn, which
+ * runs its own ops (v2_run_part) and adds their replies.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <endian.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "dbserver.h"
+#include "proto2.h"
+
+/* converts the header to host order and says whether it is one we take
+ */
+int v2_frame_check(struct v2_frame *h) {
+    h->count = le16toh(h->count);
+    h->length = le32toh(h->length);
+    if (h->magic != V2_MAGIC || h->version != V2_VERSION) {
+        return -1;
+    }
+    if (h->count == 0 || h->count > V2_OPS_MAX || h->length > V2_FRAME_MAX ||
+        h->length < h->count * sizeof(struct v2_op)) {
+        return -1;
+    }
+    return 0;
+}
+
+/* the op at *pos in host order, with its key and value; moves *pos past
+ * it. -1 if it runs off the end of the frame
+ */
+static int next_op(char *body, uint32_t length, uint32_t *pos, struct v2_op *op, char **key, char **value) {
+    if (length - *pos < sizeof(*op)) {
+        return -1;
+    }
+    memcpy(op, body + *pos, sizeof(*op));
+    op->key_len = le16toh(op->key_len);
+    op->id = le32toh(op->id);
+    op->value_len = le32toh(op->value_len);
+    *pos += sizeof(*op);
+    if (op->key_len > V2_KEY_MAX || length - *pos < op->key_len ||
+        length - *pos - op->key_len < op->value_len) {
+        return -1;
+    }
+    *key = body + *pos;
+    *value = *key + op->key_len;
+    *pos += op->key_len + op->value_len;
+    return 0;
+}
+
+struct parsed_op {
+    struct v2_op h;
+    char *key;
+    char *value;
+};
+
+/* every op in the frame, or NULL if it is malformed */
+static struct parsed_op *parse_frame(struct v2_frame *h, char *body) {
+    struct parsed_op *ops = malloc(h->count * sizeof(*ops));
+    uint32_t pos = 0;
+    for (int i = 0; ops && i < h->count; i++) {
+        if (next_op(body, h->length, &pos, &ops[i].h, &ops[i].key, &ops[i].value) < 0) {
+            pos = -1;
+            break;
+        }
+    }
+    if (pos != h->length) {
+        free(ops);
+        return NULL;
+    }
+    return ops;
+}
+
+/* how many ops from ops[0] on make up a batch: 1 unless it is flagged */
+static int batch_len(struct parsed_op *ops, int left) {
+    char op = ops[0].h.op;
+    int max = op == 'R' ? V2_BATCH_MAX : left;
+    int n = 1;
+    if (!(ops[0].h.flags & V2_BATCH) || (op != 'R' && op != 'W' && op != 'D')) {
+        return 1;
+    }
+    while (n < left && n < max && ops[n].h.op == op && (ops[n].h.flags & V2_BATCH)) {
+        n++;
+    }
+    return n;
+}
+
+static int key_valid(struct v2_op *op, char *key) {
+    return op->key_len > 0 && memchr(key, 0, op->key_len) == NULL;
+}
+
+static char *reply_reserve(struct v2_reply *out, long n) {
+    long need = out->len + n;
+    if (need > out->cap) {
+        long cap = out->cap ? out->cap : 4096;
+        while (cap < need) {
+            cap *= 2;
+        }
+        char *buf = realloc(out->buf, cap);
+        if (buf == NULL) {
+            return NULL;
+        }
+        out->buf = buf;
+        out->cap = cap;
+    }
+    char *p = out->buf + out->len;
+    out->len += n;
+    return p;
+}
+
+static int reply_start(struct v2_reply *out) {
+    out->len = 0;
+    return reply_reserve(out, sizeof(struct v2_frame)) ? 0 : -1;
+}
+
+static void reply_finish(struct v2_reply *out, int count) {
+    struct v2_frame h = {.magic = V2_MAGIC, .version = V2_VERSION, .count = htole16(count),
+                         .length = htole32(out->len - sizeof(h))};
+    memcpy(out->buf, &h, sizeof(h));
+}
+
+/* whether an op with value_len bytes still fits in the reply. X and K
+ * without a value always do: they only cost a header, and a frame has
+ * at most V2_OPS_MAX ops
+ */
+static int reply_fits(struct v2_reply *out, long value_len) {
+    return out->len - (long)sizeof(struct v2_frame) + (long)sizeof(struct v2_op) + value_len <= V2_FRAME_MAX;
+}
+
+/* an op's reply header with room for value_len bytes after it; returns
+ * where the value goes
+ */
+static char *reply_op(struct v2_reply *out, char status, uint32_t id, long value_len) {
+    struct v2_op op = {.op = status, .id = htole32(id), .value_len = htole32(value_len)};
+    char *p = reply_reserve(out, sizeof(op) + value_len);
+    if (p == NULL) {
+        return NULL;
+    }
+    memcpy(p, &op, sizeof(op));
+    return p + sizeof(op);
+}
+
+/* the reply to an R that found len bytes, in buf or value's file,
+ * which is closed
+ */
+static int reply_value(struct v2_reply *out, uint32_t id, char *buf, struct db_value *value, int len) {
+    if (!reply_fits(out, len)) {
+        if (value->fd >= 0) {
+            close(value->fd);
+        }
+        thread_stats->failed++;
+        return reply_op(out, 'X', id, 0) ? 0 : -1;
+    }
+    char *p = reply_op(out, 'K', id, len);
+    if (p == NULL) {
+        if (value->fd >= 0) {
+            close(value->fd);
+        }
+        return -1;
+    }
+    if (value->fd < 0) {
+        memcpy(p, buf, len);
+        return 0;
+    }
+    int got = 0;
+    while (got < len) {
+        int n = pread(value->fd, p + got, len - got, value->offset + got);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        got += n;
+    }
+    close(value->fd);
+    if (got < len) {
+        /* the value went away under us: take the reply back and say X */
+        out->len -= sizeof(struct v2_op) + len;
+        thread_stats->failed++;
+        return reply_op(out, 'X', id, 0) ? 0 : -1;
+    }
+    return 0;
+}
+
+/* S: the next keys of a scan, with the cursor to carry on from as the
+ * reply's key
+ */
+static int run_scan(struct v2_reply *out, struct parsed_op *p) {
+    char cursor[DB_CURSOR_MAX];
+    char *keys = malloc(V2_SCAN_BYTES);
+    int len = -1;
+    if (keys && p->h.key_len < sizeof(cursor)) {
+        memcpy(cursor, p->key, p->h.key_len);
+        cursor[p->h.key_len] = 0;
+        len = db_scan(cursor, keys, V2_SCAN_BYTES);
+    }
+    count_request('S', len < 0 ? 'X' : 'K');
+    if (len < 0) {
+        free(keys);
+        return reply_op(out, 'X', p->h.id, 0) ? 0 : -1;
+    }
+    int cursor_len = strlen(cursor);
+    if (!reply_fits(out, cursor_len + len)) {
+        free(keys);
+        thread_stats->failed++;
+        return reply_op(out, 'X', p->h.id, 0) ? 0 : -1;
+    }
+    char *v = reply_op(out, 'K', p->h.id, cursor_len + len);
+    if (v) {
+        struct v2_op *h = (struct v2_op *)(v - sizeof(*h));
+        h->key_len = htole16(cursor_len);
+        h->value_len = htole32(len);
+        memcpy(v, cursor, cursor_len);
+        memcpy(v + cursor_len, keys, len);
+    }
+    free(keys);
+    return v ? 0 : -1;
+}
+
+/* run one op and add its reply
+ */
+static int run_op(struct v2_reply *out, struct parsed_op *p) {
+    struct v2_op *op = &p->h;
+    char key[V2_KEY_MAX + 1];
+    char buf_read[DB_INLINE_MAX];
+    struct db_value value;
+    char status;
+
+    if (op->op == 'S') {
+        return run_scan(out, p);
+    }
+    if (!key_valid(op, p->key) || (op->op != 'R' && op->op != 'W' && op->op != 'D')) {
+        count_request(op->op, 'X');
+        return reply_op(out, 'X', op->id, 0) ? 0 : -1;
+    }
+    memcpy(key, p->key, op->key_len);
+    key[op->key_len] = 0;
+    int len = execute_op(op->op, key, p->value, op->value_len, buf_read, &value, &status);
+    if (status != 'K' || op->op != 'R') {
+        return reply_op(out, status, op->id, 0) ? 0 : -1;
+    }
+    return reply_value(out, op->id, buf_read, &value, len);
+}
+
+/* run n ops of the same kind as one database batch and add their
+ * replies, in frame order. a W batch with V2_ATOMIC on any op stores
+ * every value or none; a bad key in it fails the lot
+ */
+static int run_batch(struct v2_reply *out, struct parsed_op *ops, int n) {
+    char op = ops[0].h.op;
+    int atomic = 0, bad = 0, key_bytes = 0;
+    for (int i = 0; i < n; i++) {
+        atomic |= op == 'W' && (ops[i].h.flags & V2_ATOMIC);
+        bad += !key_valid(&ops[i].h, ops[i].key);
+        key_bytes += ops[i].h.key_len + 1;
+    }
+    struct db_batch_op *b = calloc(n, sizeof(*b));
+    char *keys = malloc(key_bytes);
+    char *bufs = op == 'R' ? malloc((long)n * DB_INLINE_MAX) : NULL;
+    int status = -1;
+    if (b == NULL || keys == NULL || (op == 'R' && bufs == NULL)) {
+        goto out;
+    }
+
+    int m = 0;
+    char *name = keys;
+    for (int i = 0; i < n && !(atomic && bad); i++) {
+        if (!key_valid(&ops[i].h, ops[i].key)) {
+            continue;
+        }
+        memcpy(name, ops[i].key, ops[i].h.key_len);
+        name[ops[i].h.key_len] = 0;
+        b[m].name = name;
+        b[m].data = op == 'R' ? bufs + (long)m * DB_INLINE_MAX : ops[i].value;
+        b[m].len = ops[i].h.value_len;
+        b[m].value.fd = -1;
+        name += ops[i].h.key_len + 1;
+        m++;
+    }
+    if (op != 'R' && replica_mode) {
+        for (int i = 0; i < m; i++) {
+            b[i].status = -1;
+        }
+    } else if (op == 'R') {
+        db_read_batch(b, m);
+    } else if (op == 'W') {
+        db_write_batch(b, m, atomic ? DB_BATCH_ATOMIC : 0);
+    } else {
+        db_delete_batch(b, m);
+    }
+
+    status = 0;
+    for (int i = 0, j = 0; i < n; i++) {
+        struct db_batch_op *r = NULL;
+        if (!(atomic && bad) && key_valid(&ops[i].h, ops[i].key)) {
+            r = &b[j++];
+        }
+        int ok = r && r->status == 0 && (op != 'R' || r->len > 0);
+        count_request(op, ok ? 'K' : 'X');
+        if (status < 0) {
+            if (r && r->value.fd >= 0) {
+                close(r->value.fd);
+            }
+            continue;
+        }
+        if (ok && op == 'R') {
+            status = reply_value(out, ops[i].h.id, r->data, &r->value, r->len);
+        } else {
+            if (r && r->value.fd >= 0) {
+                close(r->value.fd);
+            }
+            status = reply_op(out, ok ? 'K' : 'X', ops[i].h.id, 0) ? 0 : -1;
+        }
+    }
+out:
+    free(b);
+    free(keys);
+    free(bufs);
+    return status;
+}
+
+/* op runners. a frame's single ops on different keys don't wait for
+ * each other: each key's ops make a chain, run in frame order, and the
+ * chains are taken by the thread running the frame and by V2_RUNNERS
+ * threads shared by every frame, whichever is free. each op's reply is
+ * added as it completes, so a slow read doesn't hold up the ops after
+ * it and the replies come back in completion order. a batch or scan
+ * waits for every chain before it, and runs alone.
+ */
+#define V2_RUNNERS 8
+
+struct frame_run {
+    struct parsed_op *ops;
+    int *next;                  /* next op on the same key, or -1 */
+    int *heads;                 /* first op of each chain */
+    int chains;
+    int taken;                  /* chains handed out */
+    int running;                /* of those, not finished */
+    int queued;                 /* on the runnable list */
+    pthread_cond_t done;        /* running went to 0 with all taken */
+    pthread_mutex_t lock;       /* out */
+    struct v2_reply *out;
+    int status;
+    long wait;
+    long start;
+    struct frame_run *next_run; /* on the runnable list */
+};
+
+static pthread_once_t runners_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t runner_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t runner_wake = PTHREAD_COND_INITIALIZER;
+static struct frame_run *runnable;      /* frames with chains left to take */
+static struct frame_run **runnable_tail = &runnable;
+
+/* the first op of a chain of fr not yet taken, or -1. caller holds
+ * runner_lock
+ */
+static int take_chain(struct frame_run *fr) {
+    if (fr->taken == fr->chains) {
+        return -1;
+    }
+    int head = fr->heads[fr->taken++];
+    fr->running++;
+    if (fr->taken == fr->chains && fr->queued) {
+        struct frame_run **p = &runnable;
+        while (*p != fr) {
+            p = &(*p)->next_run;
+        }
+        *p = fr->next_run;
+        if (runnable_tail == &fr->next_run) {
+            runnable_tail = p;
+        }
+        fr->queued = 0;
+    }
+    return head;
+}
+
+/* run a chain's ops and add each reply to the frame's as it is done.
+ * an op whose value no longer fits the frame's reply gets X
+ */
+static __thread struct v2_reply op_reply;   /* run_chain's, kept while small */
+
+static void run_chain(struct frame_run *fr, int i) {
+    struct v2_reply tmp = op_reply;
+    for (; i >= 0; i = fr->next[i]) {
+        long begin = clock_ns();
+        tmp.len = 0;
+        int status = run_op(&tmp, &fr->ops[i]);
+        long end = clock_ns();
+        record_latency(fr->ops[i].h.op, fr->wait, end - begin, end - fr->start);
+        pthread_mutex_lock(&fr->lock);
+        if (status < 0 || fr->status < 0) {
+            fr->status = -1;
+        } else if (reply_fits(fr->out, tmp.len - (long)sizeof(struct v2_op))) {
+            char *p = reply_reserve(fr->out, tmp.len);
+            if (p) {
+                memcpy(p, tmp.buf, tmp.len);
+            } else {
+                fr->status = -1;
+            }
+        } else {
+            thread_stats->failed++;
+            fr->status = reply_op(fr->out, 'X', fr->ops[i].h.id, 0) ? 0 : -1;
+        }
+        pthread_mutex_unlock(&fr->lock);
+    }
+    if (tmp.cap > V2_SCAN_BYTES * 2) {
+        free(tmp.buf);
+        tmp = (struct v2_reply){0};
+    }
+    op_reply = tmp;
+    pthread_mutex_lock(&runner_lock);
+    if (--fr->running == 0 && fr->taken == fr->chains) {
+        pthread_cond_signal(&fr->done);
+    }
+    pthread_mutex_unlock(&runner_lock);
+}
+
+static void *runner_thread(void *arg) {
+    stats_register();
+    pthread_mutex_lock(&runner_lock);
+    while (1) {
+        while (runnable == NULL) {
+            pthread_cond_wait(&runner_wake, &runner_lock);
+        }
+        struct frame_run *fr = runnable;
+        int head = take_chain(fr);
+        pthread_mutex_unlock(&runner_lock);
+        run_chain(fr, head);
+        pthread_mutex_lock(&runner_lock);
+    }
+    return NULL;
+}
+
+static void start_runners(void) {
+    for (int i = 0; i < V2_RUNNERS; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, runner_thread, NULL) != 0) {
+            perror("pthread_create v2 runner");
+            return;
+        }
+        pthread_detach(tid);
+    }
+}
+
+/* run the chains of fr: hand them to the runners and take them too,
+ * then wait for the ones the runners took
+ */
+static void run_chains(struct frame_run *fr) {
+    fr->taken = fr->running = 0;
+    if (fr->chains == 0) {
+        return;
+    }
+    pthread_mutex_lock(&runner_lock);
+    if (fr->chains > 1) {
+        pthread_once(&runners_once, start_runners);
+        fr->next_run = NULL;
+        fr->queued = 1;
+        *runnable_tail = fr;
+        runnable_tail = &fr->next_run;
+        pthread_cond_broadcast(&runner_wake);
+    }
+    int head;
+    while ((head = take_chain(fr)) >= 0) {
+        pthread_mutex_unlock(&runner_lock);
+        run_chain(fr, head);
+        pthread_mutex_lock(&runner_lock);
+    }
+    while (fr->running > 0) {
+        pthread_cond_wait(&fr->done, &runner_lock);
+    }
+    pthread_mutex_unlock(&runner_lock);
+    fr->chains = 0;
+}
+
+static uint32_t chain_hash(const char *key, int len) {
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)key[i]) * 16777619u;
+    }
+    return h;
+}
+
+/* run every op of s, and build the reply in out: single ops as chains,
+ * batches and scans alone in between. -1 if the reply can't be built
+ */
+static int run_frame_ops(struct v2_split *s, long wait, long start, struct v2_reply *out) {
+    int size = 1;
+    while (size < 2 * s->count) {
+        size *= 2;
+    }
+    struct frame_run fr = {.ops = s->ops, .out = out, .wait = wait, .start = start};
+    int *last = malloc(size * sizeof(*last));       /* by key: its chain's last op */
+    fr.next = malloc(s->count * sizeof(*fr.next));
+    fr.heads = malloc(s->count * sizeof(*fr.heads));
+    if (last == NULL || fr.next == NULL || fr.heads == NULL) {
+        free(last);
+        free(fr.next);
+        free(fr.heads);
+        return -1;
+    }
+    pthread_cond_init(&fr.done, NULL);
+    pthread_mutex_init(&fr.lock, NULL);
+    memset(last, -1, size * sizeof(*last));
+
+    for (int i = 0; i < s->count && fr.status == 0; ) {
+        struct parsed_op *p = &s->ops[i];
+        int n = batch_len(p, s->count - i);
+        if (n == 1 && p->h.op != 'S') {
+            uint32_t slot = chain_hash(p->key, p->h.key_len) & (size - 1);
+            while (last[slot] >= 0 && (s->ops[last[slot]].h.key_len != p->h.key_len ||
+                                       memcmp(s->ops[last[slot]].key, p->key, p->h.key_len))) {
+                slot = (slot + 1) & (size - 1);
+            }
+            if (last[slot] >= 0) {
+                fr.next[last[slot]] = i;
+            } else {
+                fr.heads[fr.chains++] = i;
+            }
+            fr.next[i] = -1;
+            last[slot] = i++;
+            continue;
+        }
+        run_chains(&fr);
+        memset(last, -1, size * sizeof(*last));
+        if (fr.status < 0) {
+            break;
+        }
+        long begin = clock_ns();
+        fr.status = n > 1 ? run_batch(out, p, n) : run_op(out, p);
+        long end = clock_ns();
+        for (int j = i; j < i + n; j++) {
+            record_latency(s->ops[j].h.op, wait, end - begin, end - start);
+        }
+        i += n;
+    }
+    run_chains(&fr);
+    pthread_cond_destroy(&fr.done);
+    pthread_mutex_destroy(&fr.lock);
+    free(last);
+    free(fr.next);
+    free(fr.heads);
+    return fr.status;
+}
+
+/* which part runs op p, counted on from home: the one that owns its
+ * key, or home itself for an op without one (S, a bad key)
+ */
+static int op_part(struct parsed_op *p, int home, int parts) {
+    char key[V2_KEY_MAX + 1];
+    if (parts == 1 || p->h.op == 'S' || !key_valid(&p->h, p->key)) {
+        return 0;
+    }
+    memcpy(key, p->key, p->h.key_len);
+    key[p->h.key_len] = 0;
+    return (db_partition(key, parts) - home + parts) % parts;
+}
+
+/* parse a frame, say which of parts runs each op and start its reply
+ * in out. a frame with an atomic batch is not split: part 0 runs it
+ * all, so the batch and the ops around it keep their order. -1 if the
+ * frame is malformed or there is no memory
+ */
+int v2_split_frame(struct v2_frame *h, char *body, int home, int parts, struct v2_split *s,
+                   struct v2_reply *out) {
+    s->ops = parse_frame(h, body);
+    s->part = malloc(h->count * sizeof(*s->part));
+    s->count = h->count;
+    if (s->ops == NULL || s->part == NULL || reply_start(out) < 0) {
+        v2_split_free(s);
+        return -1;
+    }
+    int atomic = 0;
+    for (int i = 0; i < s->count; ) {
+        int n = batch_len(&s->ops[i], s->count - i);
+        for (int j = i; n > 1 && j < i + n; j++) {
+            atomic |= s->ops[j].h.op == 'W' && (s->ops[j].h.flags & V2_ATOMIC);
+        }
+        i += n;
+    }
+    for (int i = 0; i < s->count; i++) {
+        s->part[i] = atomic ? 0 : op_part(&s->ops[i], home, parts);
+    }
+    return 0;
+}
+
+/* the next part after `after` with ops to run, or -1 */
+int v2_next_part(struct v2_split *s, int after) {
+    int next = -1;
+    for (int i = 0; i < s->count; i++) {
+        if (s->part[i] > after && (next < 0 || s->part[i] < next)) {
+            next = s->part[i];
+        }
+    }
+    return next;
+}
+
+/* run the ops of one part, in frame order, and add their replies to
+ * out; a batch split between parts runs as one smaller batch in each.
+ * each op's latency is recorded with the queue wait, and its total
+ * counted from start. -1 if the reply can't be built
+ */
+int v2_run_part(struct v2_split *s, int part, long wait, long start, struct v2_reply *out) {
+    struct parsed_op *mine = malloc(s->count * sizeof(*mine));
+    if (mine == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < s->count; ) {
+        int n = batch_len(&s->ops[i], s->count - i), m = 0;
+        for (int j = i; j < i + n; j++) {
+            if (s->part[j] == part) {
+                mine[m++] = s->ops[j];
+            }
+        }
+        i += n;
+        if (m == 0) {
+            continue;
+        }
+        long begin = clock_ns();
+        if ((n > 1 ? run_batch(out, mine, m) : run_op(out, mine)) < 0) {
+            free(mine);
+            return -1;
+        }
+        long end = clock_ns();
+        for (int j = 0; j < m; j++) {
+            record_latency(mine[j].h.op, wait, end - begin, end - start);
+        }
+    }
+    free(mine);
+    return 0;
+}
+
+/* every part has run: finish the reply */
+void v2_split_finish(struct v2_split *s, struct v2_reply *out) {
+    reply_finish(out, s->count);
+    v2_split_free(s);
+}
+
+void v2_split_free(struct v2_split *s) {
+    free(s->ops);
+    free(s->part);
+    s->ops = NULL;
+    s->part = NULL;
+}
+
+/* run every op in a frame and build the reply in out (see the op
+ * runners above). -1 if the frame is malformed (nothing has run) or the
+ * reply can't be built
+ */
+int v2_run_frame(struct v2_frame *h, char *body, long wait, long start, struct v2_reply *out) {
+    struct v2_split s;
+    if (v2_split_frame(h, body, 0, 1, &s, out) < 0 || run_frame_ops(&s, wait, start, out) < 0) {
+        v2_split_free(&s);
+        return -1;
+    }
+    v2_split_finish(&s, out);
+    return 0;
+}
+
+/* answer every op in a frame X without running it
+ */
+int v2_shed_frame(struct v2_frame *h, char *body, int expired, struct v2_reply *out) {
+    struct parsed_op *ops = parse_frame(h, body);
+    if (ops == NULL || reply_start(out) < 0) {
+        free(ops);
+        return -1;
+    }
+    for (int i = 0; i < h->count; i++) {
+        struct request req = {.op_status = ops[i].h.op}, response;
+        shed_request(&req, &response, expired);
+        if (reply_op(out, 'X', ops[i].h.id, 0) == NULL) {
+            free(ops);
+            return -1;
+        }
+    }
+    free(ops);
+    reply_finish(out, h->count);
+    return 0;
+}
+
+static int send_all(int fd, char *buf, int len) {
+    int sent = 0;
+    while (sent < len) {
+        int n = send(fd, buf + sent, len - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        sent += n;
+    }
+    thread_stats->bytes_out += len;
+    return 0;
+}
+
+/* read the rest of a frame whose first `have` header bytes are in h,
+ * growing *body to fit. 0 at a clean end of the connection, -1 on a
+ * bad or cut off frame
+ */
+static int read_frame(int fd, struct v2_frame *h, int have, char **body, int *body_cap) {
+    int n = read_full(fd, (char *)h + have, sizeof(*h) - have);
+    if (n == 0 && have == 0) {
+        return 0;
+    }
+    if (n <= 0 || v2_frame_check(h) < 0) {
+        return -1;
+    }
+    if (h->length > *body_cap) {
+        char *p = realloc(*body, h->length);
+        if (p == NULL) {
+            return -1;
+        }
+        *body = p;
+        *body_cap = h->length;
+    }
+    return read_full(fd, *body, h->length) == h->length ? 1 : -1;
+}
+
+/* threaded server: serve frames on a connection whose first byte, the
+ * magic, has been read already
+ */
+void v2_serve(int fd, long wait, long enqueued) {
+    struct v2_frame h = {.magic = V2_MAGIC};
+    struct v2_reply out = {0};
+    char *body = NULL;
+    int body_cap = 0, have = 1, n;
+
+    while ((n = read_frame(fd, &h, have, &body, &body_cap)) > 0) {
+        long start = enqueued ? enqueued : clock_ns();
+        have = 0;
+        if (v2_run_frame(&h, body, wait, start, &out) < 0) {
+            n = -1;
+            break;
+        }
+        if (send_all(fd, out.buf, out.len) < 0) {
+            break;
+        }
+        wait = enqueued = 0;
+    }
+    if (n < 0) {
+        fprintf(stderr, "bad v2 frame\n");
+        count_failed_request();
+    }
+    free(body);
+    free(out.buf);
+}
+
+/* threaded server: answer the first frame X, for a connection that
+ * waited too long in the queue
+ */
+void v2_shed(int fd) {
+    struct v2_frame h = {.magic = V2_MAGIC};
+    struct v2_reply out = {0};
+    char *body = NULL;
+    int body_cap = 0;
+    if (read_frame(fd, &h, 1, &body, &body_cap) > 0 && v2_shed_frame(&h, body, 1, &out) == 0) {
+        send_all(fd, out.buf, out.len);
+    }
+    free(body);
+    free(out.buf);
+}
@@ -0,0 +1,94 @@
+/*
+ * file:        proto2.h
+ * description: version 2 of the wire protocol. a connection whose first
+ *              byte is V2_MAGIC speaks this for its whole life; any
+ *              other first byte is the first byte of a struct request.
+ *
+ *   frame:  struct v2_frame, then count ops back to back (length bytes)
+ *   op:     struct v2_op, then key_len key bytes, then value_len bytes
+ *
+ * integers are little-endian. the reply to a frame is a frame with one
+ * op per request op, in the order they completed: op is K or X, id is
+ * the request's, the key is left out (key_len 0) and an R that
+ * succeeded carries the value. ops on the same key run in frame order,
+ * so a later op sees an earlier op's write; ops on different keys may
+ * run at once. the ops of a batch (see V2_BATCH) run together, in
+ * whatever order the database finds best, and the last write of a key
+ * in a batch wins; a batch or S runs after every op before it and
+ * before any op after it. a sharded server (dbserver -S) runs each
+ * key's ops on the shard that owns it, so there only the ops on one
+ * key keep frame order, unless the frame has an atomic batch.
+ *
+ * S scans the keys: its key is a cursor, empty to start, and the reply
+ * K carries the next cursor as its key (empty when there are no more)
+ * and up to V2_SCAN_BYTES of keys, each NUL-terminated, as its value.
+ * the keys come in no particular order.
+ *
+ * a reply frame is at most V2_FRAME_MAX bytes of ops as well: an R or S
+ * whose value would take the reply past that gets X, as if it had
+ * failed. a single value always fits, so such ops can be sent again in
+ * a frame of their own.
+ */
+#ifndef PROTO2_H
+#define PROTO2_H
+
+#include <stdint.h>
+
+#define V2_MAGIC 0xb2
+#define V2_VERSION 2
+#define V2_KEY_MAX 1024
+#define V2_OPS_MAX 4096
+#define V2_FRAME_MAX (16 << 20)     /* bytes of ops in one request frame */
+#define V2_BATCH_MAX 256            /* keys in one R batch */
+#define V2_SCAN_BYTES (64 << 10)    /* of keys in an S reply */
+
+/* op flags */
+#define V2_BATCH 1      /* run with the ops next to it that have the same op
+                         * and V2_BATCH as one batch: MGET, MSET, MDEL */
+#define V2_ATOMIC 2     /* W batch: store every value or none */
+
+struct v2_frame {
+    uint8_t magic;
+    uint8_t version;
+    uint16_t count;             /* ops */
+    uint32_t length;            /* bytes after this header */
+} __attribute__((packed));
+
+struct v2_op {
+    uint8_t op;                 /* R/W/D/S, K/X in replies */
+    uint8_t flags;              /* V2_BATCH, V2_ATOMIC */
+    uint16_t key_len;
+    uint32_t id;                /* chosen by the client, echoed back */
+    uint32_t value_len;
+} __attribute__((packed));
+
+/* a reply being built */
+struct v2_reply {
+    char *buf;
+    int len;
+    int cap;
+};
+
+/* a frame whose ops are run by several reactor shards (-S): each op
+ * goes to the shard that owns its key, numbered from the one that read
+ * the frame (part 0), and each part runs its own ops in frame order
+ */
+struct v2_split {
+    struct parsed_op *ops;
+    int *part;                  /* of each op */
+    int count;
+};
+
+int v2_frame_check(struct v2_frame *h);
+int v2_run_frame(struct v2_frame *h, char *body, long wait, long start, struct v2_reply *out);
+int v2_split_frame(struct v2_frame *h, char *body, int home, int parts, struct v2_split *s,
+                   struct v2_reply *out);
+int v2_next_part(struct v2_split *s, int after);
+int v2_run_part(struct v2_split *s, int part, long wait, long start, struct v2_reply *out);
+void v2_split_finish(struct v2_split *s, struct v2_reply *out);
+void v2_split_free(struct v2_split *s);
+int v2_shed_frame(struct v2_frame *h, char *body, int expired, struct v2_reply *out);
+void v2_serve(int fd, long wait, long enqueued);
+void v2_shed(int fd);
+
+#endif
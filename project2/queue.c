@@ -1,87 +1,363 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
+#include <limits.h>
+#include <sched.h>
+#include <time.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
 #include "queue.h"
 
-static work_item *queue_head = NULL;
-static work_item *queue_tail = NULL;
-static int queued_requests = 0;
-static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+/*
+ * Work is spread over one queue per worker. Producers (the listener or
+ * the reactor) hand requests out round-robin; a worker takes from its
+ * own queue first and, when that is empty, steals from its peers, so a
+ * worker stuck on a slow request doesn't hold up what was queued
+ * behind it.
+ *
+ * Each queue is a bounded multi-producer/multi-consumer ring. Every
+ * slot carries a sequence number saying whose turn it is: a producer
+ * may fill slot pos when seq == pos, a consumer may empty it when
+ * seq == pos + 1. So producers only contend with each other on one CAS
+ * of the tail, and the owner and thieves on the head, and nothing is
+ * allocated per item. Both take from the head, so a queue stays FIFO.
+ *
+ * A worker that finds no work anywhere spins a little, then parks on
+ * its own futex word. A producer wakes the owner of the queue it pushed
+ * to if that worker is parked, else any parked worker, which will steal
+ * the item; with nobody parked it makes no syscall at all.
+ *
+ * Queues are set up for the most workers there may ever be, but work
+ * only goes to the first n_active. When the pool shrinks, a worker
+ * numbered n_active or above empties its own queue and then gets
+ * QUEUE_RETIRE from dequeue_work; anything a producer slipped in after
+ * that is stolen by the others, who look at every queue that has been
+ * in use (n_span).
+ */
 
+#define QUEUE_SIZE (1 << 14)        /* per worker, power of two */
+#define SPIN_TRIES 100
+#define CACHE_LINE 64
+
+struct slot {
+    unsigned long seq;
+    int sock_fd;
+    long enqueued;              /* CLOCK_MONOTONIC ns */
+};
+
+/* the ends of the ring and the parking word each get their own cache
+ * line so producers, the owner and thieves don't bounce each other's */
+struct worker_queue {
+    struct slot *slots;
+    long taken;                 /* counters written only by the owner */
+    long steals;
+    unsigned long tail __attribute__((aligned(CACHE_LINE)));
+    unsigned long head __attribute__((aligned(CACHE_LINE)));
+    int parked __attribute__((aligned(CACHE_LINE)));    /* futex word */
+};
+
+static struct worker_queue *queues;
+static int n_queues;            /* allocated */
+static int n_active;            /* given new work */
+static int n_span;              /* ever active, so may hold work */
+static unsigned int next_queue;
+static int sleepers;
+static int queue_limit;         /* try_enqueue_work: most items queued, 0 for no limit */
 static int shutdown_flag = 0;
+static int spin_tries;
 
-void queue_init() {
-    queue_head = queue_tail = NULL;
-    queued_requests = 0;
-    shutdown_flag = 0;
-    pthread_mutex_init(&queue_mutex, NULL);
-    pthread_cond_init(&queue_cond, NULL);
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
 }
 
-void queue_shutdown() {
-    pthread_mutex_lock(&queue_mutex);
-    shutdown_flag = 1;
-    pthread_cond_broadcast(&queue_cond);
-    pthread_mutex_unlock(&queue_mutex);
+static long futex(int *addr, int op, int val) {
+    return syscall(SYS_futex, addr, op, val, NULL, NULL, 0);
 }
 
-void enqueue_work(int sock_fd) {
-    work_item* item = malloc(sizeof(work_item));
-    if (!item) {
-        perror("malloc");
-        close(sock_fd);
+static long clock_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static int ring_push(struct worker_queue *q, int sock_fd, long enqueued) {
+    unsigned long pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    while (1) {
+        struct slot *s = &q->slots[pos & (QUEUE_SIZE - 1)];
+        long diff = (long)(__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                s->sock_fd = sock_fd;
+                s->enqueued = enqueued;
+                __atomic_store_n(&s->seq, pos + 1, __ATOMIC_RELEASE);
+                return 0;
+            }
+        } else if (diff < 0) {
+            return -1;          /* full */
+        } else {
+            pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static int ring_pop(struct worker_queue *q, int *sock_fd, long *enqueued) {
+    unsigned long pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    while (1) {
+        struct slot *s = &q->slots[pos & (QUEUE_SIZE - 1)];
+        long diff = (long)(__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) - (pos + 1));
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&q->head, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                *sock_fd = s->sock_fd;
+                *enqueued = s->enqueued;
+                __atomic_store_n(&s->seq, pos + QUEUE_SIZE, __ATOMIC_RELEASE);
+                return 0;
+            }
+        } else if (diff < 0) {
+            return -1;          /* empty */
+        } else {
+            pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/* items claimed by a producer and not yet by a consumer */
+static int ring_length(struct worker_queue *q) {
+    unsigned long h = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+    unsigned long t = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+    long count = (long)(t - h);
+    return count < 0 ? 0 : count > QUEUE_SIZE ? QUEUE_SIZE : count;
+}
+
+/* own queue first, then the peers in turn
+ */
+static int take_work(int self, int *sock_fd, long *enqueued) {
+    struct worker_queue *q = &queues[self];
+    if (ring_pop(q, sock_fd, enqueued) == 0) {
+        q->taken++;
+        return 0;
+    }
+    int span = __atomic_load_n(&n_span, __ATOMIC_RELAXED);
+    for (int i = 1; i < span; i++) {
+        if (ring_pop(&queues[(self + i) % span], sock_fd, enqueued) == 0) {
+            q->taken++;
+            q->steals++;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* wake one parked worker, preferring the given one. clearing parked
+ * with a CAS makes sure two producers don't both pick the same worker
+ */
+static void wake_worker(int first) {
+    if (__atomic_load_n(&sleepers, __ATOMIC_SEQ_CST) == 0) {
         return;
     }
-    item->sock_fd = sock_fd;
-    item->next = NULL;
-    pthread_mutex_lock(&queue_mutex);
-    if (queue_tail == NULL) {
-        queue_head = queue_tail = item;
-    } else {
-        queue_tail->next = item;
-        queue_tail = item;
+    int span = __atomic_load_n(&n_span, __ATOMIC_RELAXED);
+    for (int i = 0; i < span; i++) {
+        struct worker_queue *q = &queues[(first + i) % span];
+        int one = 1;
+        if (__atomic_load_n(&q->parked, __ATOMIC_RELAXED) == 1 &&
+            __atomic_compare_exchange_n(&q->parked, &one, 0, 0,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            futex(&q->parked, FUTEX_WAKE_PRIVATE, 1);
+            return;
+        }
     }
-    queued_requests++;
-    pthread_cond_signal(&queue_cond);
-    pthread_mutex_unlock(&queue_mutex);
 }
 
-int dequeue_work(void) {
-    pthread_mutex_lock(&queue_mutex);
-    while (queue_head == NULL && !shutdown_flag) {
-        pthread_cond_wait(&queue_cond, &queue_mutex);
+void queue_init(int workers) {
+    for (int i = 0; i < n_queues; i++) {
+        free(queues[i].slots);
+    }
+    free(queues);
+    queues = aligned_alloc(CACHE_LINE, workers * sizeof(*queues));
+    if (!queues) {
+        perror("malloc");
+        exit(1);
+    }
+    memset(queues, 0, workers * sizeof(*queues));
+    for (int i = 0; i < workers; i++) {
+        queues[i].slots = malloc(QUEUE_SIZE * sizeof(struct slot));
+        if (!queues[i].slots) {
+            perror("malloc");
+            exit(1);
+        }
+        for (unsigned long j = 0; j < QUEUE_SIZE; j++) {
+            queues[i].slots[j].seq = j;
+        }
+    }
+    n_queues = n_active = n_span = workers;
+    next_queue = 0;
+    sleepers = 0;
+    shutdown_flag = 0;
+    /* on one CPU the producer can't run while we spin */
+    spin_tries = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SPIN_TRIES : 0;
+}
+
+/* hand new work to workers 0..workers-1 only. workers above that are
+ * woken so they can see they should retire
+ */
+void queue_set_active(int workers) {
+    workers = workers < 1 ? 1 : workers > n_queues ? n_queues : workers;
+    __atomic_store_n(&n_active, workers, __ATOMIC_SEQ_CST);
+    if (workers > __atomic_load_n(&n_span, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&n_span, workers, __ATOMIC_SEQ_CST);
     }
-    if (shutdown_flag && queue_head == NULL) {
-        pthread_mutex_unlock(&queue_mutex);
-        return -1;
+    for (int i = workers; i < n_span; i++) {
+        int one = 1;
+        if (__atomic_compare_exchange_n(&queues[i].parked, &one, 0, 0,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            futex(&queues[i].parked, FUTEX_WAKE_PRIVATE, 1);
+        }
+    }
+}
+
+void queue_shutdown() {
+    __atomic_store_n(&shutdown_flag, 1, __ATOMIC_SEQ_CST);
+    for (int i = 0; i < n_queues; i++) {
+        __atomic_store_n(&queues[i].parked, 0, __ATOMIC_SEQ_CST);
+        futex(&queues[i].parked, FUTEX_WAKE_PRIVATE, INT_MAX);
+    }
+}
+
+/* a worker's ring only fills if QUEUE_SIZE connections are waiting for
+ * it (or, when bounded, its share of queue_limit); the item then goes
+ * to the next one. if every ring is full a bounded enqueue gives up,
+ * otherwise the producer waits for room. returns how deep the ring it
+ * went on is, or QUEUE_FULL
+ */
+static int enqueue(int sock_fd, int bounded) {
+    int active = __atomic_load_n(&n_active, __ATOMIC_RELAXED);
+    int i = __atomic_fetch_add(&next_queue, 1, __ATOMIC_RELAXED) % active;
+    int limit = __atomic_load_n(&queue_limit, __ATOMIC_RELAXED);
+    int share = bounded && limit > 0 ? (limit + active - 1) / active : 0;
+    long now = clock_ns();
+    for (int tries = 0; ; tries++) {
+        if ((share == 0 || ring_length(&queues[i]) < share) && ring_push(&queues[i], sock_fd, now) == 0) {
+            break;
+        }
+        if (tries >= active) {
+            if (share) {
+                return QUEUE_FULL;
+            }
+            sched_yield();
+        }
+        i = (i + 1) % active;
+    }
+    /* pairs with parked = 1 in dequeue_work: either we see the parked
+     * worker or its last look round sees our item */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    wake_worker(i);
+    return ring_length(&queues[i]);
+}
+
+int enqueue_work(int sock_fd) {
+    return enqueue(sock_fd, 0);
+}
+
+/* enqueue unless queue_limit items are already waiting
+ */
+int try_enqueue_work(int sock_fd) {
+    return enqueue(sock_fd, 1);
+}
+
+void queue_set_limit(int max) {
+    __atomic_store_n(&queue_limit, max, __ATOMIC_RELAXED);
+}
+
+/* *enqueued is when the item was queued, so the caller can tell how
+ * long it waited. returns -1 at shutdown and QUEUE_RETIRE once the pool
+ * has shrunk below this worker and its queue is empty
+ */
+int dequeue_work(int worker, long *enqueued) {
+    struct worker_queue *q = &queues[worker];
+    int sock_fd;
+    while (1) {
+        if (worker >= __atomic_load_n(&n_active, __ATOMIC_SEQ_CST)) {
+            if (ring_pop(q, &sock_fd, enqueued) == 0) {
+                q->taken++;
+                return sock_fd;
+            }
+            /* a producer may have picked us to wake for its item */
+            wake_worker(0);
+            return QUEUE_RETIRE;
+        }
+        for (int i = 0; i <= spin_tries; i++) {
+            if (take_work(worker, &sock_fd, enqueued) == 0) {
+                return sock_fd;
+            }
+            cpu_relax();
+        }
+        __atomic_fetch_add(&sleepers, 1, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&q->parked, 1, __ATOMIC_SEQ_CST);
+        int got = take_work(worker, &sock_fd, enqueued) == 0;
+        int stop = !got && (__atomic_load_n(&shutdown_flag, __ATOMIC_SEQ_CST) ||
+                            worker >= __atomic_load_n(&n_active, __ATOMIC_SEQ_CST));
+        if (!got && !stop) {
+            futex(&q->parked, FUTEX_WAIT_PRIVATE, 1);
+        }
+        int claimed = __atomic_exchange_n(&q->parked, 0, __ATOMIC_SEQ_CST) == 0;
+        __atomic_fetch_sub(&sleepers, 1, __ATOMIC_SEQ_CST);
+        if (got) {
+            /* a producer chose to wake us after we had already found
+             * work; its item needs someone else */
+            if (claimed) {
+                wake_worker(worker + 1);
+            }
+            return sock_fd;
+        }
+        if (stop) {
+            if (!__atomic_load_n(&shutdown_flag, __ATOMIC_SEQ_CST)) {
+                continue;       /* retiring: back to the top */
+            }
+            return -1;
+        }
     }
-    work_item *item = queue_head;
-    queue_head = item->next;
-    if (queue_head == NULL)
-        queue_tail = NULL;
-    queued_requests--;
-    int sock_fd = item->sock_fd;
-    free(item);
-    pthread_mutex_unlock(&queue_mutex);
-    return sock_fd;
 }
 
 int queue_length() {
-    pthread_mutex_lock(&queue_mutex);
-    int count = queued_requests;
-    pthread_mutex_unlock(&queue_mutex);
+    int count = 0;
+    for (int i = 0; i < n_queues; i++) {
+        count += ring_length(&queues[i]);
+    }
     return count;
 }
 
+/* workers whose queues have been in use, so have figures to show */
+int queue_workers() {
+    return __atomic_load_n(&n_span, __ATOMIC_RELAXED);
+}
+
+int queue_active_workers() {
+    return __atomic_load_n(&n_active, __ATOMIC_RELAXED);
+}
+
+/* workers parked for want of work */
+int queue_idle_workers() {
+    return __atomic_load_n(&sleepers, __ATOMIC_RELAXED);
+}
+
+void queue_worker_stats(int worker, struct queue_worker_stats *st) {
+    struct worker_queue *q = &queues[worker];
+    st->depth = ring_length(q);
+    st->taken = __atomic_load_n(&q->taken, __ATOMIC_RELAXED);
+    st->steals = __atomic_load_n(&q->steals, __ATOMIC_RELAXED);
+}
+
 void queue_cleanup() {
-    pthread_mutex_lock(&queue_mutex);
-    while (queue_head) {
-        work_item *temp = queue_head;
-        queue_head = queue_head->next;
-        close(temp->sock_fd);
-        free(temp);
-    }
-    queue_tail = NULL;
-    pthread_mutex_unlock(&queue_mutex);
+    int sock_fd;
+    long enqueued;
+    for (int i = 0; i < n_span; i++) {
+        while (ring_pop(&queues[i], &sock_fd, &enqueued) == 0) {
+            close(sock_fd);
+        }
+    }
 }
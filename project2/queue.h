@@ -1,18 +1,27 @@
 #ifndef QUEUE_H
 #define QUEUE_H
 
-#include <pthread.h>
+struct queue_worker_stats {
+    int depth;                  /* waiting in this worker's queue */
+    long taken;                 /* requests it has run */
+    long steals;                /* of those, taken from a peer's queue */
+};
 
-typedef struct work_item {
-    int sock_fd;
-    struct work_item *next;
-} work_item;
+#define QUEUE_RETIRE -2
+#define QUEUE_FULL -3
 
-void queue_init();
-void enqueue_work(int sock_fd);
-int dequeue_work();
+void queue_init(int workers);
+void queue_set_active(int workers);
+int enqueue_work(int sock_fd);
+int try_enqueue_work(int sock_fd);
+void queue_set_limit(int max);
+int dequeue_work(int worker, long *enqueued);
 void queue_shutdown();
 int queue_length();
+int queue_workers();
+int queue_active_workers();
+int queue_idle_workers();
+void queue_worker_stats(int worker, struct queue_worker_stats *st);
 void queue_cleanup();
 
 #endif
@@ -0,0 +1,191 @@
+/*
+ * file:        queuebench.c
+ * description: work queue contention benchmark - N producer and N
+ *              consumer threads push integers through the per-consumer
+ *              lock-free rings in queue.c and through the mutex/condvar
+ *              linked list they replaced, for N = 1, 2, 4 ... max-threads.
+ *              every item must come out exactly once.
+ *
+ * usage: queuebench [max-threads] [items-per-run]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "queue.h"
+
+/* the old queue, kept here as the baseline */
+
+typedef struct work_item {
+    int sock_fd;
+    struct work_item *next;
+} work_item;
+
+static work_item *list_head, *list_tail;
+static int list_queued, list_shutdown_flag;
+static pthread_mutex_t list_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t list_cond = PTHREAD_COND_INITIALIZER;
+
+static void list_init(int consumers) {
+    list_head = list_tail = NULL;
+    list_queued = 0;
+    list_shutdown_flag = 0;
+}
+
+static void list_shutdown(void) {
+    pthread_mutex_lock(&list_mutex);
+    list_shutdown_flag = 1;
+    pthread_cond_broadcast(&list_cond);
+    pthread_mutex_unlock(&list_mutex);
+}
+
+static int list_enqueue(int sock_fd) {
+    work_item *item = malloc(sizeof(work_item));
+    item->sock_fd = sock_fd;
+    item->next = NULL;
+    pthread_mutex_lock(&list_mutex);
+    if (list_tail == NULL) {
+        list_head = list_tail = item;
+    } else {
+        list_tail->next = item;
+        list_tail = item;
+    }
+    int depth = ++list_queued;
+    pthread_cond_signal(&list_cond);
+    pthread_mutex_unlock(&list_mutex);
+    return depth;
+}
+
+static int list_dequeue(int consumer, long *enqueued) {
+    pthread_mutex_lock(&list_mutex);
+    while (list_head == NULL && !list_shutdown_flag) {
+        pthread_cond_wait(&list_cond, &list_mutex);
+    }
+    if (list_head == NULL) {
+        pthread_mutex_unlock(&list_mutex);
+        return -1;
+    }
+    work_item *item = list_head;
+    list_head = item->next;
+    if (list_head == NULL)
+        list_tail = NULL;
+    list_queued--;
+    int sock_fd = item->sock_fd;
+    free(item);
+    pthread_mutex_unlock(&list_mutex);
+    return sock_fd;
+}
+
+struct queue_ops {
+    const char *name;
+    void (*init)(int);
+    int (*enqueue)(int);
+    int (*dequeue)(int, long *);
+    void (*shutdown)(void);
+};
+
+static struct queue_ops queues[] = {
+    {"linked list", list_init, list_enqueue, list_dequeue, list_shutdown},
+    {"stealing rings", queue_init, enqueue_work, dequeue_work, queue_shutdown},
+};
+
+struct worker {
+    pthread_t tid;
+    struct queue_ops *q;
+    int id;
+    int first, count;           /* producers: items to push */
+    long sum;                   /* consumers: checksum of items taken */
+    long taken;
+    char pad[64];
+};
+
+static long consumed;
+
+static void *producer(void *arg) {
+    struct worker *w = arg;
+    for (int i = 0; i < w->count; i++) {
+        w->q->enqueue(w->first + i);
+    }
+    return NULL;
+}
+
+static void *consumer(void *arg) {
+    struct worker *w = arg;
+    int item;
+    long enqueued;
+    while ((item = w->q->dequeue(w->id, &enqueued)) >= 0) {
+        w->sum += item;
+        w->taken++;
+        __atomic_fetch_add(&consumed, 1, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double run(struct queue_ops *q, int threads, int items, int *ok) {
+    struct worker prod[threads], cons[threads];
+    int per = items / threads;
+
+    q->init(threads);
+    consumed = 0;
+    memset(prod, 0, sizeof(prod));
+    memset(cons, 0, sizeof(cons));
+    double t0 = now();
+    for (int i = 0; i < threads; i++) {
+        cons[i].q = q;
+        cons[i].id = i;
+        pthread_create(&cons[i].tid, NULL, consumer, &cons[i]);
+    }
+    for (int i = 0; i < threads; i++) {
+        prod[i].q = q;
+        prod[i].first = i * per;
+        prod[i].count = per;
+        pthread_create(&prod[i].tid, NULL, producer, &prod[i]);
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(prod[i].tid, NULL);
+    }
+    while (__atomic_load_n(&consumed, __ATOMIC_RELAXED) < (long)per * threads) {
+        sched_yield();
+    }
+    double secs = now() - t0;
+    q->shutdown();
+
+    long n = (long)per * threads, sum = 0, taken = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(cons[i].tid, NULL);
+        sum += cons[i].sum;
+        taken += cons[i].taken;
+    }
+    *ok = taken == n && sum == n * (n - 1) / 2;
+    return n / secs;
+}
+
+int main(int argc, char *argv[]) {
+    int max_threads = argc > 1 ? atoi(argv[1]) : 64;
+    int items = argc > 2 ? atoi(argv[2]) : 2000000;
+    int nq = sizeof(queues) / sizeof(queues[0]);
+
+    printf("%d items per run, N producers + N consumers\n", items);
+    printf("%8s", "N");
+    for (int j = 0; j < nq; j++) {
+        printf(" %16s", queues[j].name);
+    }
+    printf("\n");
+    for (int t = 1; t <= max_threads; t *= 2) {
+        printf("%8d", t);
+        for (int j = 0; j < nq; j++) {
+            int ok;
+            double rate = run(&queues[j], t, items, &ok);
+            printf(" %11.2f M/s%s", rate / 1e6, ok ? "  " : " !");
+        }
+        printf("\n");
+    }
+    return 0;
+}
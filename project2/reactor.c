@@ -0,0 +1,686 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "proj2.h"
+#include "dbserver.h"
+#include "queue.h"
+#include "reactor.h"
+#include "proto2.h"
+
+#define MAX_EVENTS 256
+
+/*
+ * Event-driven front end: one thread owns every client socket, reads
+ * requests incrementally with edge-triggered epoll and only hands a
+ * connection to the worker queue once a whole request (header and body)
+ * has arrived.  Workers never block on the network; they run the
+ * database operation, leave the reply in the connection and post it back
+ * on the done list for the reactor to write out.
+ *
+ * Connections are persistent: a client may pipeline any number of
+ * requests, which are executed one at a time so replies go out in order.
+ *
+ * With -a N there are N reactors, each with its own SO_REUSEPORT
+ * listening socket, epoll set and done list; a connection stays with
+ * the reactor that accepted it.
+ *
+ * In shard mode (-S) there is one reactor per CPU, pinned to it, and no
+ * worker pool. Each shard owns the keys db_partition() maps to it and
+ * runs their requests itself; a request for another shard's key is
+ * pushed onto that shard's inbox, and the connection comes back on the
+ * done list once it has run. Neither list takes a lock, and requests
+ * are counted by the thread that runs them, so nothing on the request
+ * path is shared between cores except the cache.
+ *
+ * A W body larger than DB_INLINE_MAX is not buffered whole: it is read
+ * STREAM_CHUNK bytes at a time and each piece goes to a worker, which
+ * appends it to the database's stream before the reactor reads the next.
+ *
+ * The first byte of a connection says which protocol it speaks. A v2
+ * frame (proto2.h) is read whole and goes to a worker as one unit; its
+ * reply is built in memory. In shard mode a frame is split by the shard
+ * that owns each key and passed from owner to owner, the one that read
+ * it first, each running its own ops, then comes back on the done list.
+ */
+
+enum { CONN_HEADER, CONN_BODY, CONN_BUSY, CONN_REPLY };
+enum { STREAM_NONE, STREAM_NEW, STREAM_OPEN, STREAM_FAILED };
+enum { PROTO_UNKNOWN, PROTO_V1, PROTO_V2 };
+
+struct conn {
+    int fd;
+    int state;
+    int proto;
+    struct request req;
+    struct v2_frame frame;      /* v2: header of the frame being read or run */
+    int hdr_got;
+    char *buf;                  /* body for W, value for R, v2 frame; only while in use */
+    int body_len;               /* streamed W: length of the current piece */
+    int body_got;
+    int stream_state;
+    int stream_left;            /* streamed W: body still unread after this piece */
+    struct db_stream stream;
+    struct reactor *r;
+    struct request resp;
+    struct db_value value;      /* R reply sent from a file when value.fd >= 0 */
+    struct v2_reply out;        /* v2 reply; empty if the frame was malformed */
+    struct v2_split split;      /* shard mode: which shard runs each op */
+    int part;                   /* shard mode: of split, being run */
+    int data_len;
+    int out_sent;
+    long queued_at;             /* when the request (or piece) was dispatched */
+    long first_queued;          /* when the first piece was */
+    long wait_ns;               /* queued or forwarded, summed over pieces */
+    long service_ns;
+    struct conn *next_done;     /* link on an inbox or done list */
+};
+
+struct reactor {
+    int epoll_fd;
+    int wake_fd;
+    int listen_fd;
+    struct conn *done_list __attribute__((aligned(64)));
+    struct conn *inbox;         /* shard mode: requests for our keys */
+    struct request_stats *stats;    /* the reactor thread's own */
+};
+
+static struct conn **conns;     /* by fd, shared by all reactors */
+static int max_conns;
+static struct reactor reactors[MAX_ACCEPTORS];
+static __thread struct reactor *self;
+
+/* a list other threads push connections onto and its reactor empties:
+ * a lock-free stack that is only ever taken whole, so a popped entry
+ * can't come back underneath a push (no ABA). returns 1 if the list was
+ * empty, when the owner may be asleep and needs waking
+ */
+static int list_push(struct conn **head, struct conn *c) {
+    struct conn *old = __atomic_load_n(head, __ATOMIC_RELAXED);
+    do {
+        c->next_done = old;
+    } while (!__atomic_compare_exchange_n(head, &old, c, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    return old == NULL;
+}
+
+static struct conn *list_take(struct conn **head) {
+    return __atomic_exchange_n(head, NULL, __ATOMIC_ACQUIRE);
+}
+
+static void reactor_wake(struct reactor *r) {
+    uint64_t one = 1;
+    write(r->wake_fd, &one, sizeof(one));
+}
+
+/* hand a connection whose request has run back to its reactor
+ */
+static void post_done(struct conn *c) {
+    if (list_push(&c->r->done_list, c) && c->r != self) {
+        reactor_wake(c->r);
+    }
+}
+
+static void conn_execute(struct conn *c, long wait);
+
+static void conn_close(struct conn *c) {
+    epoll_ctl(c->r->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    conns[c->fd] = NULL;
+    if (c->value.fd >= 0) {
+        close(c->value.fd);
+    }
+    if (c->stream_state == STREAM_OPEN) {
+        db_write_abort(&c->stream);
+    }
+    free(c->buf);
+    free(c->out.buf);
+    v2_split_free(&c->split);
+    free(c);
+}
+
+static void conn_fail(struct conn *c) {
+    count_failed_request();
+    conn_close(c);
+}
+
+static int conn_buf(struct conn *c, int size) {
+    if (c->buf == NULL && (c->buf = malloc(size)) == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    return 0;
+}
+
+/* shard mode: pass a request on to the shard that runs it */
+static void shard_forward(struct conn *c, struct reactor *owner) {
+    c->queued_at = clock_ns();
+    thread_stats->forwarded++;
+    if (list_push(&owner->inbox, c)) {
+        reactor_wake(owner);
+    }
+}
+
+/* shard mode: run this shard's part of a v2 frame, then pass the frame
+ * on to the next shard with ops in it, or back to its own reactor once
+ * every part has run
+ */
+static void shard_run(struct conn *c, long wait) {
+    conn_execute(c, wait);
+    int next = c->out.len > 0 ? v2_next_part(&c->split, c->part) : -1;
+    if (next < 0) {
+        if (c->out.len > 0) {
+            v2_split_finish(&c->split, &c->out);
+        }
+        v2_split_free(&c->split);
+        post_done(c);
+        return;
+    }
+    c->part = next;
+    shard_forward(c, &reactors[(c->r - reactors + next) % acceptors]);
+}
+
+/* header and body are in; park the connection until a worker is done,
+ * or in shard mode run it here or send it to the shard that owns the key
+ */
+static void conn_dispatch(struct conn *c) {
+    c->state = CONN_BUSY;
+    c->queued_at = clock_ns();
+    if (c->first_queued == 0) {
+        c->first_queued = c->queued_at;
+    }
+    if (!shard_mode) {
+        /* a piece of a streamed W always goes: the stream is open */
+        int depth = c->stream_state != STREAM_NONE ? enqueue_work(c->fd) : try_enqueue_work(c->fd);
+        if (depth == QUEUE_FULL && c->proto == PROTO_V2) {
+            if (v2_shed_frame(&c->frame, c->buf, 0, &c->out) < 0) {
+                c->out.len = 0;
+            }
+            post_done(c);
+            return;
+        }
+        if (depth == QUEUE_FULL) {
+            shed_request(&c->req, &c->resp, 0);
+            c->data_len = 0;
+            post_done(c);
+            return;
+        }
+        count_queued(depth);
+        return;
+    }
+    if (c->proto == PROTO_V2) {
+        if (v2_split_frame(&c->frame, c->buf, c->r - reactors, acceptors, &c->split, &c->out) < 0) {
+            c->out.len = 0;
+            post_done(c);
+            return;
+        }
+        c->part = 0;
+        shard_run(c, 0);
+        return;
+    }
+    struct reactor *owner = &reactors[db_partition(c->req.name, acceptors)];
+    if (owner == c->r) {
+        conn_execute(c, 0);
+        post_done(c);
+        return;
+    }
+    shard_forward(c, owner);
+}
+
+/* a v2 frame header is in: read its body whole
+ */
+static int conn_read_frame(struct conn *c) {
+    if (v2_frame_check(&c->frame) < 0 || (c->buf = malloc(c->frame.length)) == NULL) {
+        fprintf(stderr, "bad v2 frame\n");
+        conn_fail(c);
+        return -1;
+    }
+    c->body_len = c->frame.length;
+    c->body_got = 0;
+    c->state = CONN_BODY;
+    return 0;
+}
+
+static void conn_read(struct conn *c) {
+    while (c->state == CONN_HEADER || c->state == CONN_BODY) {
+        int n;
+        if (c->state == CONN_HEADER && c->proto == PROTO_UNKNOWN) {
+            n = read(c->fd, &c->req, 1);
+        } else if (c->state == CONN_HEADER && c->proto == PROTO_V2) {
+            n = read(c->fd, (char *)&c->frame + c->hdr_got, sizeof(c->frame) - c->hdr_got);
+        } else if (c->state == CONN_HEADER) {
+            n = read(c->fd, (char *)&c->req + c->hdr_got, sizeof(c->req) - c->hdr_got);
+        } else {
+            n = read(c->fd, c->buf + c->body_got, c->body_len - c->body_got);
+        }
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Failed to read request");
+            conn_fail(c);
+            return;
+        }
+        if (n == 0) {
+            if (c->state == CONN_HEADER && c->hdr_got == 0) {
+                conn_close(c);
+            } else {
+                conn_fail(c);
+            }
+            return;
+        }
+        thread_stats->bytes_in += n;
+        if (c->state == CONN_BODY) {
+            c->body_got += n;
+            if (c->body_got == c->body_len) {
+                conn_dispatch(c);
+            }
+            continue;
+        }
+        if (c->proto == PROTO_UNKNOWN) {
+            c->proto = (unsigned char)c->req.op_status == V2_MAGIC ? PROTO_V2 : PROTO_V1;
+            c->frame.magic = c->req.op_status;
+        }
+        c->hdr_got += n;
+        if (c->proto == PROTO_V2) {
+            if (c->hdr_got == sizeof(c->frame) && conn_read_frame(c) < 0) {
+                return;
+            }
+            continue;
+        }
+        if (c->hdr_got < sizeof(c->req)) {
+            continue;
+        }
+        if (c->req.op_status != 'W') {
+            conn_dispatch(c);
+            continue;
+        }
+        c->body_len = request_len(&c->req);
+        if (c->body_len > DB_INLINE_MAX) {
+            c->stream_state = STREAM_NEW;
+            c->stream_left = c->body_len > STREAM_CHUNK ? c->body_len - STREAM_CHUNK : 0;
+            c->body_len -= c->stream_left;
+        }
+        if (conn_buf(c, c->stream_state ? STREAM_CHUNK : DB_INLINE_MAX) < 0) {
+            conn_fail(c);
+            return;
+        }
+        c->body_got = 0;
+        if (c->body_len == 0) {
+            conn_dispatch(c);
+        } else {
+            c->state = CONN_BODY;
+        }
+    }
+}
+
+/* one send of whatever is left of the reply. a value in a file goes
+ * header first with MSG_MORE, then straight from the file; a value in
+ * memory goes out together with the header in one sendmsg
+ */
+static int conn_send(struct conn *c) {
+    int total = sizeof(c->resp) + c->data_len;
+    if (c->proto == PROTO_V2) {
+        return send(c->fd, c->out.buf + c->out_sent, c->out.len - c->out_sent, MSG_NOSIGNAL);
+    }
+    if (c->value.fd >= 0 && c->out_sent >= sizeof(c->resp)) {
+        off_t offset = c->value.offset + c->out_sent - sizeof(c->resp);
+        int n = sendfile(c->fd, c->value.fd, &offset, total - c->out_sent);
+        if (n == 0) {
+            errno = EIO;        /* file shorter than promised */
+            return -1;
+        }
+        return n;
+    }
+    if (c->value.fd >= 0) {
+        return send(c->fd, (char *)&c->resp + c->out_sent, sizeof(c->resp) - c->out_sent,
+                    MSG_MORE | MSG_NOSIGNAL);
+    }
+    struct iovec iov[2];
+    int iovcnt = 0;
+    if (c->out_sent < sizeof(c->resp)) {
+        iov[iovcnt].iov_base = (char *)&c->resp + c->out_sent;
+        iov[iovcnt].iov_len = sizeof(c->resp) - c->out_sent;
+        iovcnt++;
+        if (c->data_len > 0) {
+            iov[iovcnt].iov_base = c->buf;
+            iov[iovcnt].iov_len = c->data_len;
+            iovcnt++;
+        }
+    } else {
+        int off = c->out_sent - sizeof(c->resp);
+        iov[iovcnt].iov_base = c->buf + off;
+        iov[iovcnt].iov_len = c->data_len - off;
+        iovcnt++;
+    }
+    struct msghdr msg = {.msg_iov = iov, .msg_iovlen = iovcnt};
+    return sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+}
+
+static void conn_flush(struct conn *c) {
+    int total = c->proto == PROTO_V2 ? c->out.len : sizeof(c->resp) + c->data_len;
+    while (c->out_sent < total) {
+        int n = conn_send(c);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            conn_close(c);
+            return;
+        }
+        c->out_sent += n;
+        thread_stats->bytes_out += n;
+    }
+    /* reply is out; go back for the next request. anything the client
+     * pipelined behind this one is already sitting in the socket buffer
+     * and edge-triggered epoll won't report it again, so read it now.
+     * a v2 frame's ops have recorded their own latency */
+    if (c->proto == PROTO_V1) {
+        record_latency(c->req.op_status, c->wait_ns, c->service_ns, clock_ns() - c->first_queued);
+    }
+    c->first_queued = c->wait_ns = c->service_ns = 0;
+    if (c->value.fd >= 0) {
+        close(c->value.fd);
+        c->value.fd = -1;
+    }
+    free(c->buf);
+    c->buf = NULL;
+    c->hdr_got = 0;
+    c->data_len = 0;
+    c->state = CONN_HEADER;
+    conn_read(c);
+}
+
+static void conn_accept(struct reactor *r) {
+    while (1) {
+        int fd = accept4(r->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK && !shutdown_flag) {
+                perror("Accept failed");
+            }
+            return;
+        }
+        if (fd >= max_conns) {
+            fprintf(stderr, "too many connections\n");
+            close(fd);
+            continue;
+        }
+        struct conn *c = calloc(1, sizeof(*c));
+        if (!c) {
+            perror("malloc");
+            close(fd);
+            continue;
+        }
+        thread_stats->accepted++;
+        c->fd = fd;
+        c->r = r;
+        c->state = CONN_HEADER;
+        c->value.fd = -1;
+        conns[fd] = c;
+        struct epoll_event ev = {.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.fd = fd};
+        if (epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            perror("epoll_ctl");
+            conns[fd] = NULL;
+            close(fd);
+            free(c);
+            continue;
+        }
+        conn_read(c);
+    }
+}
+
+static void drain_done(struct reactor *r) {
+    struct conn *list = list_take(&r->done_list);
+    while (list) {
+        struct conn *c = list;
+        list = c->next_done;
+        if (c->stream_state != STREAM_NONE) {
+            /* a piece of a streamed W is stored; read the next one */
+            c->body_len = c->stream_left < STREAM_CHUNK ? c->stream_left : STREAM_CHUNK;
+            c->stream_left -= c->body_len;
+            c->body_got = 0;
+            c->state = CONN_BODY;
+            conn_read(c);
+            continue;
+        }
+        if (c->proto == PROTO_V2 && c->out.len == 0) {
+            fprintf(stderr, "bad v2 frame\n");
+            conn_fail(c);
+            continue;
+        }
+        c->state = CONN_REPLY;
+        c->out_sent = 0;
+        conn_flush(c);
+    }
+}
+
+/* store one piece of a streamed W; after the last, finish the write
+ * and leave the reply. a storage failure part way through still lets
+ * the rest of the body be read, and the client gets an X
+ */
+static void reactor_stream(struct conn *c) {
+    if (c->stream_state == STREAM_NEW) {
+        int ok = db_write_begin(&c->stream, c->body_len + c->stream_left) == 0;
+        c->stream_state = ok ? STREAM_OPEN : STREAM_FAILED;
+    }
+    if (c->stream_state == STREAM_OPEN && db_write_chunk(&c->stream, c->buf, c->body_len) < 0) {
+        db_write_abort(&c->stream);
+        c->stream_state = STREAM_FAILED;
+    }
+    if (c->stream_left == 0) {
+        finish_write(&c->req, &c->stream, c->stream_state == STREAM_OPEN, &c->resp);
+        c->stream_state = STREAM_NONE;
+        c->data_len = 0;
+    }
+}
+
+/* run requests other shards forwarded to this one
+ */
+static void drain_inbox(struct reactor *r) {
+    struct conn *list = list_take(&r->inbox);
+    while (list) {
+        struct conn *c = list;
+        list = c->next_done;
+        if (c->proto == PROTO_V2) {
+            shard_run(c, clock_ns() - c->queued_at);
+            continue;
+        }
+        conn_execute(c, clock_ns() - c->queued_at);
+        post_done(c);
+    }
+}
+
+/* replies to send may lead straight to more requests (pipelined, or a
+ * shard's own keys), so go round until both lists stay empty
+ */
+static void drain_lists(struct reactor *r) {
+    while (__atomic_load_n(&r->done_list, __ATOMIC_RELAXED) ||
+           __atomic_load_n(&r->inbox, __ATOMIC_RELAXED)) {
+        drain_inbox(r);
+        drain_done(r);
+    }
+}
+
+static void conn_execute(struct conn *c, long wait) {
+    long start = clock_ns();
+    if (c->proto == PROTO_V2 && shard_mode) {
+        if (v2_run_part(&c->split, c->part, wait, c->first_queued, &c->out) < 0) {
+            c->out.len = 0;
+        }
+    } else if (c->proto == PROTO_V2) {
+        if (v2_run_frame(&c->frame, c->buf, wait, c->first_queued, &c->out) < 0) {
+            c->out.len = 0;
+        }
+    } else if (c->stream_state != STREAM_NONE) {
+        reactor_stream(c);
+    } else if (c->req.op_status == 'R' && conn_buf(c, DB_INLINE_MAX) < 0) {
+        set_response(&c->resp, 'X', 0);
+        c->data_len = 0;
+    } else {
+        c->data_len = process_request(&c->req, c->buf, &c->resp, c->buf, &c->value);
+    }
+    c->wait_ns += wait;
+    c->service_ns += clock_ns() - start;
+}
+
+/* called by a worker for a connection the reactor dispatched
+ */
+void reactor_handle(int fd, long wait) {
+    struct conn *c = conns[fd];
+    conn_execute(c, wait);
+    post_done(c);
+}
+
+/* called by a worker for a request that waited too long: answer X
+ * without running it. a piece of a streamed W still runs, as the rest
+ * of the body has to be read anyway
+ */
+void reactor_expire(int fd, long wait) {
+    struct conn *c = conns[fd];
+    if (c->stream_state != STREAM_NONE) {
+        reactor_handle(fd, wait);
+        return;
+    }
+    c->wait_ns += wait;
+    if (c->proto == PROTO_V2) {
+        if (v2_shed_frame(&c->frame, c->buf, 1, &c->out) < 0) {
+            c->out.len = 0;
+        }
+        post_done(c);
+        return;
+    }
+    shed_request(&c->req, &c->resp, 1);
+    c->data_len = 0;
+    post_done(c);
+}
+
+void reactor_stop(void) {
+    for (int i = 0; i < acceptors; i++) {
+        reactor_wake(&reactors[i]);
+    }
+}
+
+/* the request counts one reactor's thread has kept so far
+ */
+void reactor_get_stats(int shard, struct request_stats *st) {
+    struct request_stats *from = __atomic_load_n(&reactors[shard].stats, __ATOMIC_ACQUIRE);
+    memset(st, 0, sizeof(*st));
+    if (from) {
+        st->reads = __atomic_load_n(&from->reads, __ATOMIC_RELAXED);
+        st->writes = __atomic_load_n(&from->writes, __ATOMIC_RELAXED);
+        st->deletes = __atomic_load_n(&from->deletes, __ATOMIC_RELAXED);
+        st->forwarded = __atomic_load_n(&from->forwarded, __ATOMIC_RELAXED);
+    }
+}
+
+/* called before any reactor thread starts, once the listening sockets
+ * are open
+ */
+void reactor_init(void) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+        max_conns = rl.rlim_cur;
+    }
+    if (max_conns <= 0 || max_conns > (1 << 20)) {
+        max_conns = 1 << 20;
+    }
+    conns = calloc(max_conns, sizeof(*conns));
+    if (!conns) {
+        perror("reactor setup failed");
+        exit(1);
+    }
+    for (int i = 0; i < acceptors; i++) {
+        struct reactor *r = &reactors[i];
+        r->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        r->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        r->listen_fd = listener_fds[i];
+        r->done_list = r->inbox = NULL;
+        if (r->epoll_fd < 0 || r->wake_fd < 0) {
+            perror("reactor setup failed");
+            exit(1);
+        }
+        fcntl(r->listen_fd, F_SETFL, fcntl(r->listen_fd, F_GETFL) | O_NONBLOCK);
+
+        struct epoll_event ev = {.events = EPOLLIN | EPOLLET, .data.fd = r->listen_fd};
+        epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, r->listen_fd, &ev);
+        ev.data.fd = r->wake_fd;
+        epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, r->wake_fd, &ev);
+    }
+}
+
+void* reactor_thread(void *arg) {
+    int id = (long)arg;
+    struct reactor *r = &reactors[id];
+    self = r;
+    __atomic_store_n(&r->stats, stats_register(), __ATOMIC_RELEASE);
+    if (shard_mode) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(id % sysconf(_SC_NPROCESSORS_ONLN), &cpus);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+            fprintf(stderr, "can't pin shard %d\n", id);
+        }
+        printf("Shard %d running on port %d\n", id, server_port);
+    } else {
+        printf("Reactor thread running on port %d\n", server_port);
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    while (!shutdown_flag) {
+        int n = epoll_wait(r->epoll_fd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            if (fd == r->listen_fd) {
+                conn_accept(r);
+                continue;
+            }
+            if (fd == r->wake_fd) {
+                uint64_t val;
+                while (read(r->wake_fd, &val, sizeof(val)) > 0)
+                    ;
+                continue;
+            }
+            struct conn *c = conns[fd];
+            if (c == NULL) {
+                continue;
+            }
+            if (c->state == CONN_REPLY && (events[i].events & EPOLLOUT)) {
+                conn_flush(c);
+            } else if (c->state == CONN_HEADER || c->state == CONN_BODY) {
+                conn_read(c);
+            }
+        }
+        drain_lists(r);
+    }
+    close(r->listen_fd);
+    printf("Exiting\n");
+    return NULL;
+}
@@ -0,0 +1,11 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+void reactor_init(void);
+void* reactor_thread(void *arg);
+void reactor_handle(int fd, long wait);
+void reactor_expire(int fd, long wait);
+void reactor_stop(void);
+void reactor_get_stats(int shard, struct request_stats *st);
+
+#endif
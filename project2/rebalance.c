@@ -0,0 +1,233 @@
+/*
+ * file:        rebalance.c
+ * description: moves keys between dbservers after the set of servers
+ *              changes, so each key is on the server the client ring
+ *              (dbclient.c) now gives it. every server is scanned; a
+ *              key on the wrong one is read from it, written to its
+ *              owner and then deleted from it, a batch at a time, so
+ *              only the keys that changed owner cross the network.
+ *
+ * usage: rebalance [-n] [-v vnodes] PORTS [OLD-PORTS]
+ *
+ * PORTS are the servers from now on (5000-5003, or 5000,5001,...);
+ * OLD-PORTS are any others that still hold keys - servers being taken
+ * out - and are emptied. with -n nothing moves; it only counts.
+ *
+ * writers should already be using the new set of servers, or be held
+ * off: a key written to its new owner between our read and our write
+ * there would be overwritten by the older value.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "dbclient.h"
+
+#define MOVE_FRAME_BYTES (8 << 20)      /* of values in one W frame */
+
+static int dry_run;
+static long scanned, moved, moved_bytes, errors;
+static long moved_to[CLIENT_SHARDS_MAX];
+
+/* write the values read into ops[0..n) to dst, in frames of at most
+ * MOVE_FRAME_BYTES; the ops that failed come back X
+ */
+static void write_values(struct db_conn *dst, struct client_op *ops, struct client_op *w, int n) {
+    for (int i = 0; i < n; ) {
+        int m = 0;
+        long bytes = 0;
+        for (; i + m < n && (m == 0 || bytes + ops[i + m].len <= MOVE_FRAME_BYTES); m++) {
+            w[m] = (struct client_op){.op = 'W', .key = ops[i + m].key, .data = ops[i + m].value,
+                                      .len = ops[i + m].len};
+            bytes += ops[i + m].len;
+        }
+        if (conn_batch(dst, w, m, V2_BATCH) < 0) {
+            fprintf(stderr, "write to %d failed\n", dst->port);
+            for (int j = 0; j < m; j++) {
+                w[j].status = 'X';
+            }
+        }
+        for (int j = 0; j < m; j++) {
+            ops[i + j].status = w[j].status;
+        }
+        i += m;
+    }
+}
+
+/* move n keys (all owned by dst) off src: read them, write them to dst,
+ * then delete the ones that made it from src. keys that didn't fit in
+ * the read's reply are moved after, in smaller batches
+ */
+static void move_keys(struct db_conn *src, struct db_conn *dst, int shard, char **keys, int n) {
+    struct client_op ops[n], w[n];
+    char *again[n];
+    for (int i = 0; i < n; i++) {
+        ops[i] = (struct client_op){.op = 'R', .key = keys[i]};
+    }
+    if (conn_batch(src, ops, n, V2_BATCH) < 0) {
+        fprintf(stderr, "read from %d failed\n", src->port);
+        errors += n;
+        return;
+    }
+    int m = 0, a = 0;
+    for (int i = 0; i < n; i++) {
+        if (ops[i].status == 'K') {
+            ops[m++] = ops[i];
+        } else if (n > 1) {
+            again[a++] = keys[i];       /* too big for the reply, or deleted meanwhile */
+        }
+    }
+    /* the values live in src's buffer, which the deletes will reuse */
+    write_values(dst, ops, w, m);
+    int d = 0;
+    for (int i = 0; i < m; i++) {
+        if (ops[i].status != 'K') {
+            fprintf(stderr, "%s: write to %d failed\n", ops[i].key, dst->port);
+            errors++;
+            continue;
+        }
+        moved++;
+        moved_bytes += ops[i].len;
+        moved_to[shard]++;
+        w[d++] = (struct client_op){.op = 'D', .key = ops[i].key};
+    }
+    if (d > 0 && conn_batch(src, w, d, V2_BATCH) < 0) {
+        fprintf(stderr, "delete from %d failed\n", src->port);
+        errors += d;
+    }
+    /* one at a time if nothing made it, so a key that is gone ends it */
+    if (a == n) {
+        for (int i = 0; i < n; i++) {
+            move_keys(src, dst, shard, &again[i], 1);
+        }
+    } else if (a > 0) {
+        move_keys(src, dst, shard, again, a);
+    }
+}
+
+/* every key on the server at port that the ring doesn't give to it */
+static void drain(int port, struct ring *ring, struct db_conn *owners, int nowners) {
+    struct db_conn src;
+    char cursor[V2_KEY_MAX + 1] = "", *page;
+    if (conn_open(&src, port) < 0) {
+        errors++;
+        return;
+    }
+    /* the scan will see the keys already moved here again */
+    for (int s = 0; s < nowners && !dry_run; s++) {
+        if (owners[s].port == port) {
+            scanned -= moved_to[s];
+        }
+    }
+    do {
+        int len = conn_scan(&src, cursor, &page);
+        if (len < 0) {
+            fprintf(stderr, "scan of %d failed\n", port);
+            errors++;
+            break;
+        }
+        /* the page is in src's buffer too: keep a copy */
+        char *copy = malloc(len);
+        memcpy(copy, page, len);
+
+        int n = 0;
+        for (char *k = copy; k < copy + len; k += strlen(k) + 1) {
+            n++;
+        }
+        char **keys = malloc(n * sizeof(*keys));
+        int *dest = malloc(n * sizeof(*dest));
+        n = 0;
+        for (char *k = copy; k < copy + len; k += strlen(k) + 1) {
+            scanned++;
+            int s = ring_shard(ring, k);
+            if (owners[s].port != port) {
+                keys[n] = k;
+                dest[n++] = s;
+            }
+        }
+        /* a batch per destination, at most V2_BATCH_MAX keys (one R batch) */
+        for (int s = 0; s < nowners; s++) {
+            char *batch[V2_BATCH_MAX];
+            int m = 0;
+            for (int i = 0; i <= n; i++) {
+                if (m == V2_BATCH_MAX || (i == n && m > 0)) {
+                    if (dry_run) {
+                        moved += m;
+                        moved_to[s] += m;
+                    } else {
+                        move_keys(&src, &owners[s], s, batch, m);
+                    }
+                    m = 0;
+                }
+                if (i < n && dest[i] == s) {
+                    batch[m++] = keys[i];
+                }
+            }
+        }
+        free(keys);
+        free(dest);
+        free(copy);
+    } while (cursor[0]);
+    conn_close(&src);
+}
+
+int main(int argc, char *argv[]) {
+    int ports[CLIENT_SHARDS_MAX], old[CLIENT_SHARDS_MAX];
+    int n, nold = 0, vnodes = RING_VNODES, opt;
+
+    while ((opt = getopt(argc, argv, "nv:")) != -1) {
+        if (opt == 'n') {
+            dry_run = 1;
+        } else if (opt == 'v') {
+            vnodes = atoi(optarg);
+        } else {
+            break;
+        }
+    }
+    if (optind >= argc || (n = parse_ports(argv[optind], ports, CLIENT_SHARDS_MAX)) < 1 ||
+        (optind + 1 < argc && (nold = parse_ports(argv[optind + 1], old, CLIENT_SHARDS_MAX)) < 0) ||
+        vnodes < 1) {
+        fprintf(stderr, "usage: %s [-n] [-v vnodes] PORTS [OLD-PORTS]\n", argv[0]);
+        exit(1);
+    }
+
+    struct ring ring;
+    struct db_conn owners[CLIENT_SHARDS_MAX];
+    if (ring_build(&ring, ports, n, vnodes) < 0) {
+        exit(1);
+    }
+    for (int i = 0; i < n; i++) {
+        if (conn_open(&owners[i], ports[i]) < 0) {
+            exit(1);
+        }
+    }
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int i = 0; i < n; i++) {
+        drain(ports[i], &ring, owners, n);
+    }
+    for (int i = 0; i < nold; i++) {
+        int kept = 0;
+        for (int j = 0; j < n; j++) {
+            kept |= old[i] == ports[j];
+        }
+        if (!kept) {
+            drain(old[i], &ring, owners, n);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+    printf("%s %ld of %ld keys (%.1f%%), %.1f MB in %.2f s; to",
+           dry_run ? "would move" : "moved", moved, scanned, scanned ? 100.0 * moved / scanned : 0.0,
+           moved_bytes / 1048576.0, secs);
+    for (int i = 0; i < n; i++) {
+        printf(" %d:%ld", ports[i], moved_to[i]);
+        conn_close(&owners[i]);
+    }
+    printf(", %ld errors\n", errors);
+    ring_free(&ring);
+    return errors ? 1 : 0;
+}
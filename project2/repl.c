@@ -0,0 +1,1046 @@
+/*
+ * file:        repl.c
+ * description: asynchronous primary -> replica replication.
+ *
+ * a primary (dbserver -P) numbers every change it makes (db_replicate)
+ * and keeps the latest in an in-memory backlog: a ring of messages
+ * already in the form they are sent in. each replica that connects gets
+ * a thread that sends it the backlog from where the replica left off and
+ * then each change as it is logged, so writers never wait for replicas.
+ *
+ * a replica (dbserver -r) says which log it follows and the last change
+ * of it that it applied. if the next change is still in the backlog the
+ * primary carries on from there. if not - a new replica, one that fell
+ * more than the backlog behind, or a primary that has restarted and so
+ * started a new log - it sends a snapshot first: the replica drops every
+ * key, the primary scans its own and sends each value, and between
+ * batches of values sends the log from the change it had reached when
+ * the scan began, so the backlog never has to hold a whole snapshot's
+ * worth of changes. a change made during the scan may arrive twice, in
+ * the snapshot and in the log, but applying the log in order over it
+ * still ends with the primary's values.
+ *
+ * a value that was streamed in is not read while the writer holds its
+ * key's lock: its message goes into the backlog with room for the value,
+ * and a fill thread reads the value into place afterwards. senders stop
+ * at the first message still waiting for its value (ready).
+ *
+ * the replica applies changes in order, a run of the same op as one
+ * database batch (an atomic batch stays atomic), and acknowledges the
+ * last one it applied along with its lag. an idle primary sends a
+ * heartbeat every REPL_BEAT_MS, so a replica that has caught up knows it.
+ *
+ * everything on the wire is little-endian:
+ *   replica -> primary: struct repl_hello, then a struct repl_ack now and then
+ *   primary -> replica: struct repl_msg, key, value; repeated
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <endian.h>
+#include <pthread.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "database.h"
+#include "proto2.h"
+#include "repl.h"
+
+#define REPL_MAGIC 0x4c504552       /* "REPL" */
+#define REPL_VERSION 2
+#define REPL_BEAT_MS 100
+#define REPL_RETRY_MS 1000          /* between attempts to reach the primary */
+#define REPL_SEND_BYTES (256 << 10) /* sent (or received) at a time */
+#define REPL_SCAN_BYTES (16 << 10)  /* of keys per scan */
+#define REPL_READ_BATCH 64          /* snapshot: values per database read */
+#define REPL_APPLY_BATCH 256        /* replica: changes per database batch */
+#define REPL_FILLS_MAX 64           /* streamed values waiting to be read in */
+
+/* message types besides W and D */
+#define REPL_MSG_IDENT 'I'          /* seq is the primary's log id */
+#define REPL_MSG_BEGIN 'B'          /* a snapshot follows: drop every key; the log
+                                     * carries on, mixed in with it, from seq + 1 */
+#define REPL_MSG_END 'E'            /* snapshot done */
+#define REPL_MSG_BEAT 'H'           /* seq is the primary's last change */
+#define REPL_MSG_LOST 'L'           /* change seq couldn't be read: start over */
+
+#define REPL_MSG_BATCH 1            /* flags: an atomic batch goes on in the next message */
+
+struct repl_hello {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t log_id;                /* of the log the replica follows, 0 for none */
+    uint64_t applied;               /* last change of it applied */
+};
+
+struct repl_msg {
+    uint8_t type;
+    uint8_t flags;
+    uint16_t key_len;
+    uint32_t value_len;
+    uint64_t seq;                   /* of a change; 0 for a snapshot's values */
+    uint64_t time_us;               /* when the primary logged it (CLOCK_REALTIME) */
+};
+
+struct repl_ack {
+    uint64_t applied;
+    uint64_t lag_us;
+};
+
+static volatile int stopping;
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+static long msg_size(struct repl_msg *m) {
+    return sizeof(*m) + le16toh(m->key_len) + le32toh(m->value_len);
+}
+
+static int write_all(int fd, const void *buf, long len) {
+    for (long done = 0; done < len; ) {
+        ssize_t n = send(fd, (char *)buf + done, len - done, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+static int read_all(int fd, void *buf, long len) {
+    for (long done = 0; done < len; ) {
+        ssize_t n = recv(fd, (char *)buf + done, len - done, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+/* ---------- primary ---------- */
+
+/* the backlog. offsets count every byte ever logged; [tail, head) is
+ * still in the ring, at offset % backlog_size. a change that can't be
+ * logged still uses up its seq, so replicas see the gap and start over
+ */
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_grew = PTHREAD_COND_INITIALIZER;
+static char *backlog;
+static long backlog_size;
+static long head, tail;
+static uint64_t head_seq;
+static uint64_t tail_seq = 1;
+static uint64_t log_id;
+static long fell_behind;
+
+/* messages whose values fill_thread has yet to read in, oldest first.
+ * everything before the first one is ready to send
+ */
+struct fill {
+    long msg;                       /* offset of the message */
+    long value;                     /* and of its value */
+    int len;
+    int fd;
+    uint64_t seq;
+};
+
+static struct fill fills[REPL_FILLS_MAX];
+static int nfills;
+static long ready;
+static uint64_t ready_seq;
+static pthread_cond_t fill_wanted = PTHREAD_COND_INITIALIZER;
+static pthread_t fill_tid;
+static int fill_started;
+
+/* a connected replica; st and pos are under log_lock */
+struct replica {
+    int fd;
+    int active;
+    int started;                    /* has a thread to join */
+    pthread_t tid;
+    long pos;                       /* sent up to here, -1 until streaming */
+    char acks[4 * sizeof(struct repl_ack)];
+    int ack_len;
+    struct repl_replica_stats st;
+};
+
+static struct replica replicas[REPL_REPLICAS_MAX];
+static int listen_fd = -1;
+static pthread_t accept_tid;
+
+static void ring_put(long off, const void *src, long n) {
+    long at = off % backlog_size;
+    long first = n < backlog_size - at ? n : backlog_size - at;
+    memcpy(backlog + at, src, first);
+    memcpy(backlog, (char *)src + first, n - first);
+}
+
+static void ring_get(long off, void *dst, long n) {
+    long at = off % backlog_size;
+    long first = n < backlog_size - at ? n : backlog_size - at;
+    memcpy(dst, backlog + at, first);
+    memcpy((char *)dst + first, backlog, n - first);
+}
+
+/* drop the oldest messages until need more bytes fit; -1 if that would
+ * drop one still waiting for its value
+ */
+static int make_room(long need) {
+    while (tail < head && head - tail + need > backlog_size) {
+        if (nfills > 0 && tail == fills[0].msg) {
+            return -1;
+        }
+        struct repl_msg m;
+        ring_get(tail, &m, sizeof(m));
+        tail += msg_size(&m);
+        tail_seq = le64toh(m.seq) + 1;
+    }
+    return 0;
+}
+
+/* caller holds log_lock */
+static void set_ready(void) {
+    ready = nfills > 0 ? fills[0].msg : head;
+    ready_seq = nfills > 0 ? fills[0].seq - 1 : head_seq;
+}
+
+/* the db_replicate hook: number and log the changes. the keys are
+ * still locked, so a streamed value is left for fill_thread
+ */
+static void log_changes(struct db_change *c, int n, int atomic) {
+    uint64_t now = now_us();
+    pthread_mutex_lock(&log_lock);
+    for (int i = 0; i < n; i++) {
+        int key_len = strlen(c[i].key), value_len = c[i].op == 'W' ? c[i].len : 0;
+        int streamed = value_len > 0 && c[i].data == NULL, fd = -1;
+        long size = sizeof(struct repl_msg) + key_len + value_len;
+        head_seq++;
+        if (size > backlog_size ||
+            (streamed && (nfills == REPL_FILLS_MAX || (fd = fcntl(c[i].fd, F_DUPFD_CLOEXEC, 0)) < 0)) ||
+            make_room(size) < 0) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            continue;
+        }
+        struct repl_msg m = {.type = c[i].op, .flags = atomic && i < n - 1 ? REPL_MSG_BATCH : 0,
+                             .key_len = htole16(key_len), .value_len = htole32(value_len),
+                             .seq = htole64(head_seq), .time_us = htole64(now)};
+        ring_put(head, &m, sizeof(m));
+        ring_put(head + sizeof(m), c[i].key, key_len);
+        if (streamed) {
+            fills[nfills++] = (struct fill){.msg = head, .value = head + sizeof(m) + key_len,
+                                            .len = value_len, .fd = fd, .seq = head_seq};
+            pthread_cond_signal(&fill_wanted);
+        } else if (value_len > 0) {
+            ring_put(head + sizeof(m) + key_len, c[i].data, value_len);
+        }
+        head += size;
+    }
+    set_ready();
+    pthread_cond_broadcast(&log_grew);
+    pthread_mutex_unlock(&log_lock);
+}
+
+/* read streamed values into the messages waiting for them, in order.
+ * the ring between a fill's value and the next message is only written
+ * here, and nothing reads it before ready moves past it. a value that
+ * can't be read turns its message into REPL_MSG_LOST
+ */
+static void *fill_thread(void *arg) {
+    char *buf = malloc(REPL_SEND_BYTES);
+    pthread_mutex_lock(&log_lock);
+    while (!stopping) {
+        if (nfills == 0) {
+            pthread_cond_wait(&fill_wanted, &log_lock);
+            continue;
+        }
+        struct fill f = fills[0];
+        pthread_mutex_unlock(&log_lock);
+
+        long done = 0;
+        while (buf && done < f.len) {
+            long n = f.len - done < REPL_SEND_BYTES ? f.len - done : REPL_SEND_BYTES;
+            if (pread(f.fd, buf, n, done) != n) {
+                break;
+            }
+            ring_put(f.value + done, buf, n);
+            done += n;
+        }
+        close(f.fd);
+
+        pthread_mutex_lock(&log_lock);
+        if (done < f.len) {
+            fprintf(stderr, "repl: can't read the value of change %lu\n", f.seq);
+            struct repl_msg m;
+            ring_get(f.msg, &m, sizeof(m));
+            m.type = REPL_MSG_LOST;
+            ring_put(f.msg, &m, sizeof(m));
+        }
+        memmove(fills, fills + 1, --nfills * sizeof(*fills));
+        set_ready();
+        pthread_cond_broadcast(&log_grew);
+    }
+    for (int i = 0; i < nfills; i++) {
+        close(fills[i].fd);
+    }
+    nfills = 0;
+    pthread_mutex_unlock(&log_lock);
+    free(buf);
+    return NULL;
+}
+
+/* where the change after seq starts in the backlog, or -1 if it isn't
+ * there any more (or never was, or was lost). caller holds log_lock
+ */
+static long offset_after(uint64_t seq) {
+    if (seq == head_seq) {
+        return head;
+    }
+    for (long off = tail; off < head; ) {
+        struct repl_msg m;
+        ring_get(off, &m, sizeof(m));
+        if (le64toh(m.seq) == seq + 1) {
+            return m.type == REPL_MSG_LOST ? -1 : off;
+        }
+        if (le64toh(m.seq) > seq + 1) {
+            break;
+        }
+        off += msg_size(&m);
+    }
+    return -1;
+}
+
+/* messages to one replica, gathered into REPL_SEND_BYTES writes */
+struct out {
+    int fd;
+    char *buf;
+    long len;
+    int err;
+};
+
+static void out_flush(struct out *o) {
+    if (!o->err && o->len > 0 && write_all(o->fd, o->buf, o->len) < 0) {
+        o->err = 1;
+    }
+    o->len = 0;
+}
+
+static void out_put(struct out *o, const void *data, long n) {
+    if (o->len + n > REPL_SEND_BYTES) {
+        out_flush(o);
+    }
+    if (n > REPL_SEND_BYTES) {
+        if (!o->err && write_all(o->fd, data, n) < 0) {
+            o->err = 1;
+        }
+    } else if (n > 0) {
+        memcpy(o->buf + o->len, data, n);
+        o->len += n;
+    }
+}
+
+static void out_msg(struct out *o, char type, uint64_t seq, const char *key, const char *value, int len) {
+    int key_len = key ? strlen(key) : 0;
+    struct repl_msg m = {.type = type, .key_len = htole16(key_len), .value_len = htole32(len),
+                         .seq = htole64(seq), .time_us = htole64(now_us())};
+    out_put(o, &m, sizeof(m));
+    out_put(o, key, key_len);
+    out_put(o, value, len);
+}
+
+/* a value db_read_batch found, as a W of the snapshot */
+static void out_value(struct out *o, struct db_batch_op *op) {
+    if (op->status < 0) {
+        return;                     /* deleted since the scan saw it */
+    }
+    if (op->value.fd < 0) {
+        out_msg(o, 'W', 0, op->name, op->data, op->len);
+        return;
+    }
+    char *v = malloc(op->len);
+    if (v && pread(op->value.fd, v, op->len, op->value.offset) == op->len) {
+        out_msg(o, 'W', 0, op->name, v, op->len);
+    } else {
+        fprintf(stderr, "repl: can't read %s for a snapshot\n", op->name);
+        o->err = 1;
+    }
+    free(v);
+    close(op->value.fd);
+}
+
+/* take in whatever acks have come, without waiting; -1 once the
+ * replica has gone
+ */
+static int read_acks(struct replica *r) {
+    for (;;) {
+        ssize_t n = recv(r->fd, r->acks + r->ack_len, sizeof(r->acks) - r->ack_len, MSG_DONTWAIT);
+        if (n == 0) {
+            return -1;
+        }
+        if (n < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+        }
+        r->ack_len += n;
+        int whole = r->ack_len / sizeof(struct repl_ack) * sizeof(struct repl_ack);
+        if (whole > 0) {
+            struct repl_ack a;
+            memcpy(&a, r->acks + whole - sizeof(a), sizeof(a));
+            pthread_mutex_lock(&log_lock);
+            r->st.acked = le64toh(a.applied);
+            r->st.lag_us = le64toh(a.lag_us);
+            pthread_mutex_unlock(&log_lock);
+            memmove(r->acks, r->acks + whole, r->ack_len - whole);
+            r->ack_len -= whole;
+        }
+    }
+}
+
+/* send the log from *pos to where it was ready on the way in, through
+ * buf; -1 if *pos has fallen out of the backlog
+ */
+static int out_log(struct replica *r, struct out *o, long *pos, char *buf) {
+    pthread_mutex_lock(&log_lock);
+    long end = ready;
+    pthread_mutex_unlock(&log_lock);
+    while (*pos < end) {
+        pthread_mutex_lock(&log_lock);
+        if (*pos < tail) {
+            fell_behind++;
+            pthread_mutex_unlock(&log_lock);
+            fprintf(stderr, "repl: replica %s fell more than the backlog behind during a snapshot\n",
+                    r->st.addr);
+            return -1;
+        }
+        long n = end - *pos < REPL_SEND_BYTES ? end - *pos : REPL_SEND_BYTES;
+        ring_get(*pos, buf, n);
+        pthread_mutex_unlock(&log_lock);
+        out_put(o, buf, n);
+        *pos += n;
+    }
+    return 0;
+}
+
+/* send every key and its value, and the log as it grows meanwhile;
+ * returns where in the backlog the log carries on from, or -1 if the
+ * replica went away or fell behind
+ */
+static long send_snapshot(struct replica *r, struct out *o) {
+    pthread_mutex_lock(&log_lock);
+    long pos = head;
+    uint64_t start_seq = head_seq;
+    r->st.state = REPL_SNAPSHOT;
+    r->st.snapshots++;
+    pthread_mutex_unlock(&log_lock);
+
+    char cursor[DB_CURSOR_MAX] = "";
+    char *keys = malloc(REPL_SCAN_BYTES);
+    char *bufs = malloc((long)REPL_READ_BATCH * DB_INLINE_MAX);
+    char *log_buf = malloc(REPL_SEND_BYTES);
+    struct db_batch_op ops[REPL_READ_BATCH];
+    o->err |= keys == NULL || bufs == NULL || log_buf == NULL;
+    out_msg(o, REPL_MSG_BEGIN, start_seq, NULL, NULL, 0);
+    while (!o->err && !stopping) {
+        int len = db_scan(cursor, keys, REPL_SCAN_BYTES);
+        if (len < 0) {
+            fprintf(stderr, "repl: snapshot scan failed\n");
+            o->err = 1;
+            break;
+        }
+        for (char *k = keys; k < keys + len && !o->err; ) {
+            int n = 0;
+            for (; n < REPL_READ_BATCH && k < keys + len; n++, k += strlen(k) + 1) {
+                ops[n] = (struct db_batch_op){.name = k, .data = bufs + (long)n * DB_INLINE_MAX};
+            }
+            db_read_batch(ops, n);
+            for (int i = 0; i < n; i++) {
+                out_value(o, &ops[i]);
+            }
+            /* the replica acks the log as it applies it */
+            if (out_log(r, o, &pos, log_buf) < 0 || read_acks(r) < 0) {
+                o->err = 1;
+            }
+        }
+        if (cursor[0] == 0) {
+            break;
+        }
+    }
+    out_msg(o, REPL_MSG_END, start_seq, NULL, NULL, 0);
+    out_flush(o);
+    free(keys);
+    free(bufs);
+    free(log_buf);
+    return o->err || stopping ? -1 : pos;
+}
+
+/* send the log from pos on as it becomes ready, and a heartbeat at
+ * least every REPL_BEAT_MS, until the replica goes away or falls out of
+ * the backlog (it will then reconnect and get a snapshot)
+ */
+static void send_log(struct replica *r, long pos) {
+    char *buf = malloc(REPL_SEND_BYTES);
+    uint64_t last_beat = 0;
+    pthread_mutex_lock(&log_lock);
+    r->st.state = REPL_STREAMING;
+    pthread_mutex_unlock(&log_lock);
+    while (buf && !stopping) {
+        pthread_mutex_lock(&log_lock);
+        r->pos = pos;
+        /* pos starts at head, which may be past ready */
+        if (pos >= ready) {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += REPL_BEAT_MS * 1000000L;
+            ts.tv_sec += ts.tv_nsec / 1000000000L;
+            ts.tv_nsec %= 1000000000L;
+            while (pos >= ready && !stopping &&
+                   pthread_cond_timedwait(&log_grew, &log_lock, &ts) != ETIMEDOUT) {
+            }
+        }
+        if (pos < tail) {
+            fell_behind++;
+            pthread_mutex_unlock(&log_lock);
+            fprintf(stderr, "repl: replica %s fell more than the backlog behind\n", r->st.addr);
+            break;
+        }
+        long n = ready <= pos ? 0 : ready - pos < REPL_SEND_BYTES ? ready - pos : REPL_SEND_BYTES;
+        ring_get(pos, buf, n);
+        uint64_t seq = ready_seq;
+        int at_ready = pos + n == ready;
+        pthread_mutex_unlock(&log_lock);
+
+        int status = n > 0 ? write_all(r->fd, buf, n) : 0;
+        pos += n;
+        /* only at ready is pos sure to be between messages */
+        uint64_t now = now_us();
+        if (status == 0 && at_ready && now - last_beat >= REPL_BEAT_MS * 1000) {
+            struct repl_msg m = {.type = REPL_MSG_BEAT, .seq = htole64(seq), .time_us = htole64(now)};
+            status = write_all(r->fd, &m, sizeof(m));
+            last_beat = now;
+        }
+        if (status < 0 || read_acks(r) < 0) {
+            break;
+        }
+    }
+    free(buf);
+}
+
+static void *sender_thread(void *arg) {
+    struct replica *r = arg;
+    struct repl_hello h;
+    struct out o = {.fd = r->fd, .buf = malloc(REPL_SEND_BYTES)};
+    struct timeval tv = {.tv_sec = 1};
+
+    setsockopt(r->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    if (o.buf && read_all(r->fd, &h, sizeof(h)) == 0 && le32toh(h.magic) == REPL_MAGIC &&
+        le32toh(h.version) == REPL_VERSION) {
+        pthread_mutex_lock(&log_lock);
+        long pos = le64toh(h.log_id) == log_id ? offset_after(le64toh(h.applied)) : -1;
+        if (pos >= 0) {
+            r->st.acked = le64toh(h.applied);
+        }
+        pthread_mutex_unlock(&log_lock);
+        out_msg(&o, REPL_MSG_IDENT, log_id, NULL, NULL, 0);
+        out_flush(&o);
+        if (pos < 0) {
+            pos = send_snapshot(r, &o);
+        }
+        if (pos >= 0 && !o.err) {
+            send_log(r, pos);
+        }
+    } else {
+        fprintf(stderr, "repl: %s is not a replica\n", r->st.addr);
+    }
+    free(o.buf);
+    pthread_mutex_lock(&log_lock);
+    close(r->fd);
+    r->fd = -1;
+    r->active = 0;
+    pthread_mutex_unlock(&log_lock);
+    return NULL;
+}
+
+/* each replica that connects gets a slot and a sender thread; the
+ * thread that last had the slot is joined first
+ */
+static void *accept_thread(void *arg) {
+    while (!stopping) {
+        struct sockaddr_in addr;
+        socklen_t addr_len = sizeof(addr);
+        int fd = accept4(listen_fd, (struct sockaddr *)&addr, &addr_len, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (stopping) {
+                break;
+            }
+            perror("repl accept");
+            continue;
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        struct replica *r = NULL;
+        pthread_mutex_lock(&log_lock);
+        for (int i = 0; r == NULL && i < REPL_REPLICAS_MAX; i++) {
+            if (!replicas[i].active) {
+                r = &replicas[i];
+                r->active = 1;
+            }
+        }
+        pthread_mutex_unlock(&log_lock);
+        if (r == NULL) {
+            fprintf(stderr, "repl: more than %d replicas\n", REPL_REPLICAS_MAX);
+            close(fd);
+            continue;
+        }
+        if (r->started) {
+            pthread_join(r->tid, NULL);
+        }
+        pthread_mutex_lock(&log_lock);
+        r->fd = fd;
+        r->pos = -1;
+        r->ack_len = 0;
+        memset(&r->st, 0, sizeof(r->st));
+        snprintf(r->st.addr, sizeof(r->st.addr), "%s:%d", inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
+        pthread_mutex_unlock(&log_lock);
+        r->started = pthread_create(&r->tid, NULL, sender_thread, r) == 0;
+        if (!r->started) {
+            perror("pthread_create repl sender");
+            pthread_mutex_lock(&log_lock);
+            close(fd);
+            r->fd = -1;
+            r->active = 0;
+            pthread_mutex_unlock(&log_lock);
+        }
+    }
+    return NULL;
+}
+
+/* serve replicas on port, keeping the last backlog_bytes of changes for
+ * them to catch up from. call after db_open. each run starts a new log,
+ * numbered from 1, so replicas of an earlier run get a snapshot
+ */
+int repl_listen(int port, long backlog_bytes) {
+    backlog_size = backlog_bytes < REPL_BACKLOG_MIN ? REPL_BACKLOG_MIN : backlog_bytes;
+    backlog = malloc(backlog_size);
+    if (backlog == NULL) {
+        perror("repl backlog");
+        return -1;
+    }
+    log_id = (now_us() << 16 ^ getpid()) | 1;
+
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(port), .sin_addr.s_addr = 0};
+    int opt = 1;
+    listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) {
+        perror("repl socket");
+        return -1;
+    }
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listen_fd, 16) < 0) {
+        perror("can't bind replication port");
+        return -1;
+    }
+    fill_started = pthread_create(&fill_tid, NULL, fill_thread, NULL) == 0;
+    if (!fill_started) {
+        perror("pthread_create repl fill");
+        return -1;
+    }
+    db_replicate(log_changes);
+    if (pthread_create(&accept_tid, NULL, accept_thread, NULL) != 0) {
+        perror("pthread_create repl accept");
+        return -1;
+    }
+    return 0;
+}
+
+/* ---------- replica ---------- */
+
+/* follower is only written by the follow thread, under follow_lock */
+static pthread_mutex_t follow_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct repl_stats follower;
+static uint64_t follow_id;          /* log being followed; 0 until a snapshot is complete */
+static struct sockaddr_in primary;
+static pthread_t follow_tid;
+static int follow_fd = -1;
+
+/* what has come from the primary and not been handled: [start, end) */
+struct in {
+    int fd;
+    char *buf;
+    long start;
+    long end;
+    long cap;
+};
+
+/* wait until at least need bytes from start are in */
+static int in_fill(struct in *b, long need) {
+    if (b->start > 0) {
+        memmove(b->buf, b->buf + b->start, b->end - b->start);
+        b->end -= b->start;
+        b->start = 0;
+    }
+    if (need > b->cap) {
+        char *p = realloc(b->buf, need);
+        if (p == NULL) {
+            return -1;
+        }
+        b->buf = p;
+        b->cap = need;
+    }
+    while (b->end < need) {
+        ssize_t n = recv(b->fd, b->buf + b->end, b->cap - b->end, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        b->end += n;
+    }
+    return 0;
+}
+
+/* bytes from start needed before the next message - or, for an atomic
+ * batch, all of its messages - is in; 0 if it already is, -1 if what has
+ * come can't be a message
+ */
+static long unit_needed(struct in *b) {
+    for (long off = b->start; ; ) {
+        struct repl_msg m;
+        if (b->end - off < (long)sizeof(m)) {
+            return off - b->start + sizeof(m);
+        }
+        memcpy(&m, b->buf + off, sizeof(m));
+        if (le16toh(m.key_len) > V2_KEY_MAX || le32toh(m.value_len) > DB_VALUE_MAX) {
+            return -1;
+        }
+        if (b->end - off < msg_size(&m)) {
+            return off - b->start + msg_size(&m);
+        }
+        off += msg_size(&m);
+        if (!(m.flags & REPL_MSG_BATCH)) {
+            return 0;
+        }
+    }
+}
+
+/* a snapshot is coming: delete every key */
+static void drop_all(void) {
+    char cursor[DB_CURSOR_MAX] = "";
+    char *keys = malloc(REPL_SCAN_BYTES);
+    struct db_batch_op ops[REPL_APPLY_BATCH];
+    int len;
+    while (keys && (len = db_scan(cursor, keys, REPL_SCAN_BYTES)) >= 0) {
+        for (char *k = keys; k < keys + len; ) {
+            int n = 0;
+            for (; n < REPL_APPLY_BATCH && k < keys + len; n++, k += strlen(k) + 1) {
+                ops[n] = (struct db_batch_op){.name = k};
+            }
+            db_delete_batch(ops, n);
+        }
+        if (cursor[0] == 0) {
+            break;
+        }
+    }
+    free(keys);
+}
+
+/* apply the changes at the front of the buffer as one database batch:
+ * a whole atomic batch, or a run of up to REPL_APPLY_BATCH changes with
+ * the same op that are all in. -1 if a change is missing
+ */
+static int apply_run(struct in *b) {
+    char op = b->buf[b->start];
+    int atomic = b->buf[b->start + 1] & REPL_MSG_BATCH;
+    int n = 0;
+    long key_bytes = 0, end = b->start;
+    struct repl_msg m;
+    while (b->end - end >= (long)sizeof(m)) {
+        memcpy(&m, b->buf + end, sizeof(m));
+        if (m.type != op || b->end - end < msg_size(&m) || (!atomic && (m.flags & REPL_MSG_BATCH))) {
+            break;
+        }
+        n++;
+        key_bytes += le16toh(m.key_len) + 1;
+        end += msg_size(&m);
+        if (atomic ? !(m.flags & REPL_MSG_BATCH) : n == REPL_APPLY_BATCH) {
+            break;
+        }
+    }
+
+    struct db_batch_op *ops = calloc(n, sizeof(*ops));
+    char *names = malloc(key_bytes);
+    if (ops == NULL || names == NULL) {
+        free(ops);
+        free(names);
+        return -1;
+    }
+    /* a snapshot's values (seq 0) may be mixed in with the changes */
+    uint64_t last = follower.applied, logged = 0;
+    int changes = 0;
+    char *name = names;
+    for (long off = b->start, i = 0; i < n; i++) {
+        memcpy(&m, b->buf + off, sizeof(m));
+        int key_len = le16toh(m.key_len);
+        uint64_t seq = le64toh(m.seq);
+        if (seq != 0 && seq != last + 1) {
+            fprintf(stderr, "repl: missed changes %lu to %lu, starting over\n", last + 1, seq - 1);
+            free(ops);
+            free(names);
+            return -1;
+        }
+        memcpy(name, b->buf + off + sizeof(m), key_len);
+        name[key_len] = 0;
+        ops[i].name = name;
+        ops[i].data = b->buf + off + sizeof(m) + key_len;
+        ops[i].len = le32toh(m.value_len);
+        name += key_len + 1;
+        off += msg_size(&m);
+        if (seq != 0) {
+            last = seq;
+            changes++;
+        }
+        logged = le64toh(m.time_us);
+    }
+    int failed = 0;
+    if (op == 'W') {
+        failed = n - db_write_batch(ops, n, atomic ? DB_BATCH_ATOMIC : 0);
+    } else {
+        db_delete_batch(ops, n);    /* a key that is already gone is no error */
+    }
+    free(ops);
+    free(names);
+
+    uint64_t now = now_us();
+    pthread_mutex_lock(&follow_lock);
+    follower.applied = last;
+    follower.changes += changes;
+    follower.snapshot_keys += n - changes;
+    follower.lag_us = now > logged ? now - logged : 0;
+    follower.errors += failed;
+    pthread_mutex_unlock(&follow_lock);
+    b->start = end;
+    return 0;
+}
+
+static int send_ack(int fd) {
+    struct repl_ack a = {.applied = htole64(follower.applied), .lag_us = htole64(follower.lag_us)};
+    return write_all(fd, &a, sizeof(a));
+}
+
+/* follow the primary on fd until the connection breaks */
+static void follow(int fd) {
+    struct in b = {.fd = fd, .buf = malloc(REPL_SEND_BYTES), .cap = REPL_SEND_BYTES};
+    struct repl_hello h = {.magic = htole32(REPL_MAGIC), .version = htole32(REPL_VERSION),
+                           .log_id = htole64(follow_id), .applied = htole64(follower.applied)};
+    uint64_t offered = 0, acked = follower.applied;
+    int beat = 0;
+
+    if (b.buf == NULL || write_all(fd, &h, sizeof(h)) < 0) {
+        free(b.buf);
+        return;
+    }
+    for (;;) {
+        long need = unit_needed(&b);
+        if (need < 0) {
+            fprintf(stderr, "repl: bad message from the primary\n");
+            break;
+        }
+        if (need > 0) {
+            /* caught up with what has come: say how far we got */
+            if ((beat || follower.applied != acked) && send_ack(fd) < 0) {
+                break;
+            }
+            beat = 0;
+            acked = follower.applied;
+            if (in_fill(&b, need) < 0) {
+                break;
+            }
+            continue;
+        }
+        struct repl_msg m;
+        memcpy(&m, b.buf + b.start, sizeof(m));
+        if (m.type == REPL_MSG_LOST) {
+            fprintf(stderr, "repl: the primary lost change %lu, starting over\n", le64toh(m.seq));
+            break;
+        }
+        if (m.type == 'W' || m.type == 'D') {
+            if (apply_run(&b) < 0) {
+                break;
+            }
+            continue;
+        }
+        b.start += msg_size(&m);
+        uint64_t seq = le64toh(m.seq);
+        pthread_mutex_lock(&follow_lock);
+        if (m.type == REPL_MSG_IDENT) {
+            offered = seq;
+        } else if (m.type == REPL_MSG_BEGIN) {
+            follow_id = 0;
+            follower.applied = seq;
+            follower.state = REPL_SNAPSHOT;
+            follower.snapshots++;
+            follower.snapshot_keys = 0;
+        } else if (m.type == REPL_MSG_END) {
+            follow_id = offered;
+        } else if (m.type == REPL_MSG_BEAT) {
+            follower.primary_head = seq;
+            if (follower.applied >= seq) {
+                follower.lag_us = 0;
+            }
+            beat = 1;
+        }
+        if (m.type != REPL_MSG_BEGIN && follow_id != 0 && follow_id == offered) {
+            follower.state = REPL_STREAMING;
+        }
+        pthread_mutex_unlock(&follow_lock);
+        if (m.type == REPL_MSG_BEGIN) {
+            drop_all();
+        }
+    }
+    free(b.buf);
+}
+
+/* connect to the primary, follow it, and when the connection breaks try
+ * again every REPL_RETRY_MS, carrying on from the last change applied
+ */
+static void *follow_thread(void *arg) {
+    while (!stopping) {
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd >= 0 && connect(fd, (struct sockaddr *)&primary, sizeof(primary)) == 0) {
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            pthread_mutex_lock(&follow_lock);
+            follow_fd = stopping ? -1 : fd;
+            follower.connects++;
+            pthread_mutex_unlock(&follow_lock);
+            if (follow_fd >= 0) {
+                follow(fd);
+            }
+            pthread_mutex_lock(&follow_lock);
+            follow_fd = -1;
+            follower.state = REPL_CONNECTING;
+            pthread_mutex_unlock(&follow_lock);
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+        for (int ms = 0; ms < REPL_RETRY_MS && !stopping; ms += REPL_BEAT_MS) {
+            usleep(REPL_BEAT_MS * 1000);
+        }
+    }
+    return NULL;
+}
+
+/* replicate the primary whose replication port is [host:]port (host
+ * defaults to 127.0.0.1), from a thread of our own. call after db_open
+ */
+int repl_follow(const char *addr) {
+    char host[64] = "127.0.0.1";
+    const char *port = addr, *colon = strrchr(addr, ':');
+    if (colon) {
+        if (colon - addr >= sizeof(host)) {
+            fprintf(stderr, "primary address too long: %s\n", addr);
+            return -1;
+        }
+        memcpy(host, addr, colon - addr);
+        host[colon - addr] = 0;
+        port = colon + 1;
+    }
+    struct addrinfo hints = {.ai_family = AF_INET, .ai_socktype = SOCK_STREAM}, *res;
+    if (getaddrinfo(host, port, &hints, &res) != 0) {
+        fprintf(stderr, "can't resolve primary %s\n", addr);
+        return -1;
+    }
+    memcpy(&primary, res->ai_addr, sizeof(primary));
+    freeaddrinfo(res);
+    snprintf(follower.primary_addr, sizeof(follower.primary_addr), "%s:%.15s", host, port);
+    follower.following = 1;
+    if (pthread_create(&follow_tid, NULL, follow_thread, NULL) != 0) {
+        perror("pthread_create repl follow");
+        return -1;
+    }
+    return 0;
+}
+
+void repl_get_stats(struct repl_stats *st) {
+    pthread_mutex_lock(&follow_lock);
+    *st = follower;
+    pthread_mutex_unlock(&follow_lock);
+
+    pthread_mutex_lock(&log_lock);
+    st->primary = backlog != NULL;
+    st->head = head_seq;
+    st->first = tail < head ? tail_seq : head_seq + 1;
+    st->backlog_bytes = head - tail;
+    st->backlog_max = backlog_size;
+    st->fell_behind = fell_behind;
+    st->replicas = 0;
+    for (int i = 0; i < REPL_REPLICAS_MAX; i++) {
+        struct replica *r = &replicas[i];
+        if (r->active && r->fd >= 0) {
+            r->st.unsent = r->pos >= 0 ? head - r->pos : 0;
+            st->replica[st->replicas++] = r->st;
+        }
+    }
+    pthread_mutex_unlock(&log_lock);
+}
+
+/* stop serving and following; waits for every replication thread */
+void repl_stop(void) {
+    if (stopping) {
+        return;
+    }
+    stopping = 1;
+    if (listen_fd >= 0) {
+        shutdown(listen_fd, SHUT_RDWR);
+        pthread_join(accept_tid, NULL);
+        close(listen_fd);
+        listen_fd = -1;
+    }
+    pthread_mutex_lock(&log_lock);
+    for (int i = 0; i < REPL_REPLICAS_MAX; i++) {
+        if (replicas[i].active && replicas[i].fd >= 0) {
+            shutdown(replicas[i].fd, SHUT_RDWR);
+        }
+    }
+    pthread_cond_broadcast(&log_grew);
+    pthread_cond_signal(&fill_wanted);
+    pthread_mutex_unlock(&log_lock);
+    if (fill_started) {
+        pthread_join(fill_tid, NULL);
+        fill_started = 0;
+    }
+    for (int i = 0; i < REPL_REPLICAS_MAX; i++) {
+        if (replicas[i].started) {
+            pthread_join(replicas[i].tid, NULL);
+            replicas[i].started = 0;
+        }
+    }
+
+    pthread_mutex_lock(&follow_lock);
+    if (follow_fd >= 0) {
+        shutdown(follow_fd, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&follow_lock);
+    if (follower.following) {
+        pthread_join(follow_tid, NULL);
+    }
+}
@@ -0,0 +1,52 @@
+#ifndef REPL_H
+#define REPL_H
+
+#include <stdint.h>
+
+#define REPL_BACKLOG_BYTES (64L << 20)  /* changes kept for replicas to catch up from */
+#define REPL_BACKLOG_MIN (16L << 20)    /* room for the largest value */
+#define REPL_REPLICAS_MAX 16
+
+/* where a replica is, as seen from either end */
+enum { REPL_CONNECTING, REPL_SNAPSHOT, REPL_STREAMING };
+
+struct repl_replica_stats {
+    char addr[32];
+    int state;
+    uint64_t acked;             /* last change it has applied */
+    long lag_us;                /* its apply lag, as it last reported */
+    long unsent;                /* backlog bytes not yet sent to it */
+    long snapshots;
+};
+
+struct repl_stats {
+    /* primary: repl_listen() */
+    int primary;
+    uint64_t head;              /* last change logged */
+    uint64_t first;             /* oldest change still in the backlog */
+    long backlog_bytes;
+    long backlog_max;
+    long fell_behind;           /* times a replica fell out of the backlog */
+    int replicas;
+    struct repl_replica_stats replica[REPL_REPLICAS_MAX];
+
+    /* replica: repl_follow() */
+    int following;
+    char primary_addr[80];
+    int state;
+    uint64_t applied;           /* last change applied */
+    uint64_t primary_head;      /* the primary's last change, as of its last heartbeat */
+    long lag_us;                /* now - when the primary logged the last change applied */
+    long connects;
+    long snapshots;
+    long snapshot_keys;
+    long changes;               /* applied from the log */
+    long errors;                /* changes that failed to apply */
+};
+
+int repl_listen(int port, long backlog_bytes);
+int repl_follow(const char *primary);
+void repl_get_stats(struct repl_stats *st);
+void repl_stop(void);
+
+#endif
@@ -0,0 +1,37 @@
+#!/bin/bash
+
+# Sharding benchmark - shardbench.sh
+# Usage: ./shardbench.sh [max-servers] [keys] [threads]
+#
+# Starts servers one at a time on ports 6000, 6001, ... and after each
+# runs dbtest --shards over all of them, one key per request and in
+# batches, for the aggregate throughput as servers are added. Then
+# loads the keys onto all but the last server and rebalances them onto
+# all of them, which should move about 1/max-servers of the keys.
+
+MAX=${1:-4}
+KEYS=${2:-50000}
+THREADS=${3:-8}
+BASE=6000
+LAST=$((BASE+MAX-1))
+SERVER=./dbserver
+DBTEST=./dbtest
+
+rm -rf /tmp/dbshard.*
+for P in $(seq $BASE $LAST); do
+    ($SERVER -D /tmp/dbshard.$P $P < /dev/null > /dev/null &)
+    sleep 1
+    $DBTEST --port=$BASE-$P --shards=$KEYS --threads=$THREADS
+    $DBTEST --port=$BASE-$P --shards=$KEYS --threads=$THREADS --batch=32
+done
+
+echo "Adding a server: $MAX servers, keys loaded on the first $((MAX-1))"
+$DBTEST --port=$BASE-$((LAST-1)) --shards=$KEYS --threads=$THREADS --batch=32 --keep | tail -2
+./rebalance $BASE-$LAST
+$DBTEST --port=$BASE-$LAST --shards=$KEYS --threads=$THREADS --batch=32 --verify | tail -3
+
+for P in $(seq $BASE $LAST); do
+    $DBTEST --port=$P -q
+done
+sleep 1
+rm -rf /tmp/dbshard.*
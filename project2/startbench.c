@@ -0,0 +1,197 @@
+/*
+ * file:        startbench.c
+ * description: restart benchmark for the file engine's persistent
+ *              index - loads N keys, shuts down cleanly, and times
+ *              db_open() reloading them from the checkpoints, then
+ *              again after a crash (checkpoints plus index logs). the
+ *              index files are dropped from the page cache first, and
+ *              the load is compared with just reading them, and every
+ *              key is read back and checked. each run is a separate
+ *              process, so each starts with an empty table.
+ *
+ * usage: startbench [keys]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "database.h"
+
+#define BENCH_DIR "/tmp/startbench"   /* not /tmp: a dbserver may be using that */
+#define INDEX_DIR BENCH_DIR "/dbindex"
+#define VALUE_LEN 16
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void wipe(void) {
+    system("rm -rf " BENCH_DIR);
+}
+
+/* drop the index files from the page cache, or (with buf) read each
+ * one through; returns their total size
+ */
+static long index_files(char *buf, long max) {
+    DIR *dir = opendir(INDEX_DIR);
+    struct dirent *de;
+    long total = 0;
+    while (dir && (de = readdir(dir)) != NULL) {
+        char path[300];
+        snprintf(path, sizeof(path), "%s/%s", INDEX_DIR, de->d_name);
+        int fd = open(path, O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            continue;
+        }
+        if (buf) {
+            for (long n; (n = read(fd, buf, max)) > 0; ) {
+            }
+        } else {
+            fdatasync(fd);
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        }
+        total += st.st_size;
+        close(fd);
+    }
+    if (dir) {
+        closedir(dir);
+    }
+    return total;
+}
+
+static void key_name(char *key, int i) {
+    sprintf(key, "startbench-key-%09d", i);
+}
+
+static void load(int keys) {
+    char key[64], value[VALUE_LEN];
+    memset(value, 'v', VALUE_LEN);
+    db_open(DB_ENGINE_FILES);
+    double t0 = now();
+    for (int i = 0; i < keys; i++) {
+        key_name(key, i);
+        db_write(key, value, VALUE_LEN);
+    }
+    double t1 = now();
+    db_cleanup();
+    printf("  load %d keys: %.2f s; checkpoint at shutdown: %.3f s\n", keys, t1 - t0, now() - t1);
+}
+
+/* change a tenth of the keys and exit without a checkpoint */
+static void crash(int keys) {
+    char key[64], value[VALUE_LEN];
+    memset(value, 'w', VALUE_LEN);
+    db_open(DB_ENGINE_FILES);
+    for (int i = 0; i < keys / 10; i++) {
+        key_name(key, i * 10);
+        if (i % 2) {
+            db_write(key, value, VALUE_LEN);
+        } else {
+            db_delete(key);
+        }
+    }
+    _exit(0);
+}
+
+static double read_secs;
+static long index_bytes;
+
+/* the byte key i's value should be made of: 'v' from load(), or after
+ * crash() 'w' or 0 (deleted) for every 10th key
+ */
+static char want_value(int i, int crashed) {
+    if (!crashed || i % 10) {
+        return 'v';
+    }
+    return (i / 10) % 2 ? 'w' : 0;
+}
+
+/* keys whose value isn't the one load() and crash() left */
+static int bad_values(int keys, int crashed) {
+    char key[64], buf[DB_INLINE_MAX];
+    int bad = 0;
+    for (int i = 0; i < keys; i++) {
+        char want = want_value(i, crashed);
+        key_name(key, i);
+        int len = db_read(key, buf);
+        if (want == 0 ? len >= 0 : len != VALUE_LEN || buf[0] != want || buf[VALUE_LEN - 1] != want) {
+            bad++;
+        }
+    }
+    return bad;
+}
+
+static void restart(const char *what, int keys, int crashed) {
+    index_files(NULL, 0);
+    double t0 = now();
+    db_open(DB_ENGINE_FILES);
+    double secs = now() - t0;
+    int found = count_valid_objects();
+    int expect = crashed ? keys - (keys / 10 + 1) / 2 : keys;
+    int bad = bad_values(keys, crashed);
+    printf("  %-28s %8.3f s %10.0f keys/s %8.1f MB/s (%.1fx a plain read)%s", what, secs, found / secs,
+           index_bytes / secs / 1048576, secs / read_secs, found == expect ? "" : " WRONG KEY COUNT");
+    if (bad) {
+        printf(" %d WRONG VALUES", bad);
+    }
+    printf("\n");
+}
+
+static void run_child(void (*fn)(int), int keys) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        fn(keys);
+        exit(0);
+    }
+    waitpid(pid, NULL, 0);
+}
+
+static void restart_clean(int keys) {
+    restart("restart after clean stop", keys, 0);
+}
+
+static void restart_crash(int keys) {
+    restart("restart after crash", keys, 1);
+}
+
+/* time reading the index files, cold */
+static void plain_read(void) {
+    static char buf[1 << 20];
+    index_bytes = index_files(NULL, 0);
+    double t0 = now();
+    index_files(buf, sizeof(buf));
+    read_secs = now() - t0;
+    printf("  read index files (%.1f MB) cold: %.3f s, %.1f MB/s\n", index_bytes / 1048576.0, read_secs,
+           index_bytes / read_secs / 1048576);
+}
+
+int main(int argc, char *argv[]) {
+    int keys = argc > 1 ? atoi(argv[1]) : 1000000;
+
+    wipe();
+    if (db_directory(BENCH_DIR) < 0) {
+        exit(1);
+    }
+    printf("file engine index, %d keys\n", keys);
+    run_child(load, keys);
+    plain_read();
+    run_child(restart_clean, keys);
+    run_child(crash, keys);
+    plain_read();
+    run_child(restart_crash, keys);
+    wipe();
+    return 0;
+}
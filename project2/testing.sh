@@ -40,9 +40,88 @@ $DBTEST --port=$PORT -G key4
 echo "Running load test with 50 requests and 4 threads..."
 $DBTEST --port=$PORT --count=50 --threads=4
 
+echo "Running pipelined test (50 requests in flight on one connection)..."
+$DBTEST --port=$PORT --pipeline=50 --count=100
+
+echo "Running large value test (values of 1MB, streamed)..."
+$DBTEST --port=$PORT --large=1048576
+
+echo "Running protocol v2 test (frames of 20 ops, replies matched by id, batches of 50 keys)..."
+$DBTEST --port=$PORT --v2=20 --count=100
+$DBTEST --port=$PORT --batch=50 --count=200
+
 echo "Running random test mix (10 concurrent random requests)..."
 $DBTEST --port=$PORT --test
 
+echo "Running sharding test (keys spread over 2 servers, then rebalanced onto 3)..."
+for P in $((PORT+1)) $((PORT+2)); do
+    ($SERVER -D /tmp/dbshard.$P $P < /dev/null > /dev/null &)
+done
+sleep 1
+$DBTEST --port=$PORT,$((PORT+1)) --shards=2000 --batch=20 --keep
+./rebalance $PORT-$((PORT+2))
+$DBTEST --port=$PORT-$((PORT+2)) --shards=2000 --batch=20 --verify
+for P in $((PORT+1)) $((PORT+2)); do
+    $DBTEST --port=$P -q
+done
+
+echo "Running shard-mode test (v2 frames split between the shards that own their keys)..."
+P=$((PORT+7))
+rm -rf /tmp/dbsharded.$P
+($SERVER -S -a 4 -D /tmp/dbsharded.$P $P < /dev/null > /dev/null 2>&1 &)
+sleep 1
+$DBTEST --port=$P --v2=20 --count=100
+$DBTEST --port=$P --batch=50 --count=200
+$DBTEST --port=$P --shards=1000 --batch=20
+$DBTEST --port=$P -q
+sleep 1
+rm -rf /tmp/dbsharded.$P
+
+echo "Running replication test (a replica bootstraps from a snapshot, then follows the log)..."
+P=$((PORT+3)); R=$((PORT+4))
+($SERVER -D /tmp/dbrepl.$P -P $((PORT+5)) $P < /dev/null > /dev/null 2>&1 &)
+sleep 1
+$DBTEST --port=$P --shards=1000 --batch=20 --keep
+($SERVER -D /tmp/dbrepl.$R -r $((PORT+5)) $R < /dev/null > /dev/null 2>&1 &)
+sleep 2
+$DBTEST --port=$R --shards=1000 --batch=20 --verify --keep
+$DBTEST --port=$P -S repl1 value1
+$DBTEST --port=$P -D SHARD-00000000
+sleep 1
+$DBTEST --port=$R -G repl1
+$DBTEST --port=$R -G SHARD-00000000
+echo "(should fail)"
+$DBTEST --port=$R -S repl2 value2
+$DBTEST --port=$P --replica=$R --count=200
+$DBTEST --port=$R -q
+$DBTEST --port=$P -q
+
+echo "Running restart test (writes, deletes and rewrites survive a restart of each engine, and a crash with -W)..."
+P=$((PORT+6))
+for E in files log lsm wal; do
+    OPTS="-s $E"
+    [ $E = wal ] && OPTS="-W 100"
+    DIR=/tmp/dbpersist.$E
+    rm -rf $DIR
+    ($SERVER $OPTS -D $DIR $P < /dev/null > /dev/null 2>&1 &)
+    sleep 1
+    $DBTEST --port=$P --persist=1000 --keep
+    sleep 3  # the log engine compacts the sealed files once a second
+    if [ $E = wal ]; then
+        pkill -9 -f "dbserver -W 100 -D $DIR"
+    else
+        $DBTEST --port=$P -q
+    fi
+    sleep 1
+    ($SERVER $OPTS -D $DIR $P < /dev/null > /dev/null 2>&1 &)
+    sleep 1
+    echo "$E:"
+    $DBTEST --port=$P --persist=1000 --verify
+    $DBTEST --port=$P -q
+    sleep 1
+    rm -rf $DIR
+done
+
 echo "Invalid command..."
 echo "stats" | nc localhost $PORT
 
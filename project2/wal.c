@@ -0,0 +1,455 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <zlib.h>
+#include "wal.h"
+
+/* write-ahead log with group commit.
+ *
+ * a write is appended to WAL_FILE (or, for the log engine, to its own
+ * segment files) while the key's segment lock is held, then the writer
+ * calls wal_commit(), which returns once the append is on disk. commits
+ * are batched: one thread at a time runs the fdatasync, and every writer
+ * that arrives while it runs waits for the next one, so N concurrent
+ * writers cost one sync rather than N. the thread that starts a sync
+ * first waits up to the commit window for others to join, or until
+ * batch_max of them have, trading a little latency for bigger batches.
+ *
+ * records are a header, the key and the value, with a CRC over all of
+ * it, like the log engine's. wal_open replays the file and cuts it off
+ * after the last intact record. an atomic batch is one write with every
+ * record but the last flagged WAL_BATCH; replay stops at the start of a
+ * batch that doesn't end, so a torn batch is dropped whole.
+ *
+ * the log is kept short while the server runs: once WAL_FILE passes
+ * WAL_RETIRE_BYTES, wal_rotate() syncs it, renames it WAL_OLD_FILE and
+ * starts a new one, and the caller deletes the old one with wal_drop_old()
+ * once its changes are on disk elsewhere. until then a restart replays
+ * WAL_OLD_FILE before WAL_FILE, which is still in order.
+ */
+#define WAL_BATCH 1
+
+struct wal_header {
+    uint32_t crc;               /* of the rest of the header, key and value */
+    uint32_t vlen;
+    uint16_t klen;
+    uint8_t op;
+    uint8_t flags;
+};
+
+static char wal_path[PATH_MAX];
+static char old_path[PATH_MAX];
+static char dir_path[PATH_MAX];
+static int old_pending;          /* WAL_OLD_FILE is there; see wal_rotate */
+static int wal_fd = -1;
+static long wal_size;
+static pthread_mutex_t append_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int window_us;
+static int batch_max;
+static wal_sync_fn sync_fn;
+
+/* syncs are numbered; a commit arriving when begun syncs have started
+ * needs sync begun + 1, the first to start after its append
+ */
+static pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t commit_done = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t commit_gather = PTHREAD_COND_INITIALIZER;
+static long syncs_begun;
+static long syncs_done;
+static long last_failed;        /* number of the last sync that failed */
+static long failures;
+static long append_failures;
+static int failed;              /* an append or sync has failed (wal_failed) */
+static int syncing;
+static int next_batch;          /* commits waiting for the sync about to start */
+static long commits;
+static struct histogram batch_hist;
+static struct histogram latency_hist;
+
+static inline long record_size(int klen, int vlen) {
+    return sizeof(struct wal_header) + klen + vlen;
+}
+
+static uint32_t header_crc(struct wal_header *h, const char *key) {
+    uint32_t crc = crc32(0, (unsigned char *)&h->vlen, sizeof(*h) - sizeof(h->crc));
+    return crc32(crc, (unsigned char *)key, h->klen);
+}
+
+static uint32_t record_crc(struct wal_header *h, const char *key, const char *data) {
+    uint32_t crc = header_crc(h, key);
+    /* crc32() with a NULL buffer returns the initial value, not crc */
+    return h->vlen ? crc32(crc, (unsigned char *)data, h->vlen) : crc;
+}
+
+/* caller holds commit_lock */
+static void set_failed(void) {
+    if (!failed) {
+        fprintf(stderr, "wal: the log can no longer be trusted, refusing writes until restart\n");
+    }
+    __atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+}
+
+static void append_failed(void) {
+    pthread_mutex_lock(&commit_lock);
+    append_failures++;
+    set_failed();
+    pthread_mutex_unlock(&commit_lock);
+}
+
+static int sync_file(void) {
+    return fdatasync(wal_fd);
+}
+
+/* read the record at off into *buf and check it. returns its size, or
+ * -1 if it is torn or corrupt
+ */
+static long read_record(int fd, long off, struct wal_header *h, char **buf, long *max) {
+    if (pread(fd, h, sizeof(*h), off) != sizeof(*h)) {
+        return -1;
+    }
+    long need = h->klen + h->vlen + 1;
+    if (need > *max) {
+        char *p = realloc(*buf, need);
+        if (p == NULL) {
+            return -1;
+        }
+        *buf = p;
+        *max = need;
+    }
+    if (pread(fd, *buf, h->klen + h->vlen, off + sizeof(*h)) != h->klen + h->vlen ||
+        record_crc(h, *buf, *buf + h->klen) != h->crc) {
+        return -1;
+    }
+    return record_size(h->klen, h->vlen);
+}
+
+/* the end of the batch starting at off, or -1 if it never ends */
+static long batch_end(int fd, long off) {
+    char *buf = NULL;
+    long max = 0, size;
+    struct wal_header h;
+    while ((size = read_record(fd, off, &h, &buf, &max)) > 0) {
+        off += size;
+        if (!(h.flags & WAL_BATCH)) {
+            free(buf);
+            return off;
+        }
+    }
+    free(buf);
+    return -1;
+}
+
+/* replay every intact record; returns where they end */
+static long replay_file(int fd, wal_replay_fn replay) {
+    long off = 0, batch_ok = 0;
+    char *buf = NULL;
+    long max = 0;
+    struct wal_header h;
+
+    while (read_record(fd, off, &h, &buf, &max) > 0) {
+        if ((h.flags & WAL_BATCH) && off >= batch_ok && (batch_ok = batch_end(fd, off)) < 0) {
+            break;
+        }
+        char key[h.klen + 1];
+        memcpy(key, buf, h.klen);
+        key[h.klen] = 0;
+        replay(h.op, key, buf + h.klen, h.vlen);
+        off += record_size(h.klen, h.vlen);
+    }
+    free(buf);
+    return off;
+}
+
+/* start group commit. with replay, writes are logged to WAL_FILE in dir,
+ * which is replayed through it first (after WAL_OLD_FILE, if a retire was
+ * cut short); with sync, the caller keeps its own log and wal_commit()
+ * calls sync to make it durable
+ */
+int wal_open(const char *dir, int window, int max, wal_replay_fn replay, wal_sync_fn sync) {
+    window_us = window;
+    batch_max = max > 0 ? max : 1;
+    sync_fn = sync ? sync : sync_file;
+    if (sync) {
+        return 0;
+    }
+    snprintf(wal_path, sizeof(wal_path), "%s/%s", dir, WAL_FILE);
+    snprintf(old_path, sizeof(old_path), "%s/%s", dir, WAL_OLD_FILE);
+    snprintf(dir_path, sizeof(dir_path), "%s", dir);
+    int old_fd = open(old_path, O_RDONLY | O_CLOEXEC);
+    if (old_fd >= 0) {
+        replay_file(old_fd, replay);
+        close(old_fd);
+        old_pending = 1;
+    }
+    wal_fd = open(wal_path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    if (wal_fd < 0) {
+        perror(wal_path);
+        return -1;
+    }
+    struct stat st;
+    if (fstat(wal_fd, &st) < 0) {
+        perror(wal_path);
+        return -1;
+    }
+    wal_size = replay_file(wal_fd, replay);
+    if (wal_size < st.st_size) {
+        fprintf(stderr, "wal: truncated to last intact record at %ld\n", wal_size);
+        if (ftruncate(wal_fd, wal_size) < 0 || fdatasync(wal_fd) < 0) {
+            perror(wal_path);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* append n records in one write, in order. if atomic, a crash keeps
+ * all of them or none
+ */
+int wal_append_batch(struct wal_rec *recs, int n, int atomic) {
+    struct wal_header *hs = malloc(n * sizeof(*hs));
+    struct iovec *iov = malloc(3 * n * sizeof(*iov));
+    long total = 0;
+    if (hs == NULL || iov == NULL) {
+        free(hs);
+        free(iov);
+        append_failed();
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        hs[i] = (struct wal_header){.vlen = recs[i].len, .klen = strlen(recs[i].key),
+                                    .op = recs[i].op, .flags = atomic && i < n - 1 ? WAL_BATCH : 0};
+        hs[i].crc = record_crc(&hs[i], recs[i].key, recs[i].data);
+        iov[3 * i] = (struct iovec){&hs[i], sizeof(hs[i])};
+        iov[3 * i + 1] = (struct iovec){(void *)recs[i].key, hs[i].klen};
+        iov[3 * i + 2] = (struct iovec){(void *)recs[i].data, recs[i].len};
+        total += record_size(hs[i].klen, recs[i].len);
+    }
+
+    pthread_mutex_lock(&append_lock);
+    long off = wal_size;
+    int err = 0;
+    for (int i = 0; !err && i < n; ) {
+        int count = n - i < IOV_MAX / 3 ? n - i : IOV_MAX / 3;
+        long bytes = 0;
+        for (int j = i; j < i + count; j++) {
+            bytes += record_size(hs[j].klen, recs[j].len);
+        }
+        if (pwritev(wal_fd, &iov[3 * i], 3 * count, off) != bytes) {
+            perror("wal append");
+            err = 1;
+        }
+        off += bytes;
+        i += count;
+    }
+    if (!err) {
+        wal_size += total;
+    }
+    pthread_mutex_unlock(&append_lock);
+    free(hs);
+    free(iov);
+    if (err) {
+        append_failed();
+    }
+    return err ? -1 : 0;
+}
+
+int wal_append(char op, const char *key, const char *data, int len) {
+    struct wal_rec rec = {.op = op, .key = key, .data = data, .len = len};
+    return wal_append_batch(&rec, 1, 0);
+}
+
+/* append a W whose value is the first len bytes of fd, copied file to
+ * file by the kernel
+ */
+int wal_append_file(const char *key, int fd, long len, uint32_t value_crc) {
+    struct wal_header h = {.vlen = len, .klen = strlen(key), .op = 'W'};
+    h.crc = crc32_combine(header_crc(&h, key), value_crc, len);
+    struct iovec iov[2] = {{&h, sizeof(h)}, {(void *)key, h.klen}};
+
+    pthread_mutex_lock(&append_lock);
+    loff_t in = 0, out = wal_size + sizeof(h) + h.klen;
+    int err = pwritev(wal_fd, iov, 2, wal_size) != sizeof(h) + h.klen;
+    while (!err && in < len) {
+        ssize_t n = copy_file_range(fd, &in, wal_fd, &out, len - in, 0);
+        err = n <= 0;
+    }
+    if (err) {
+        perror("wal append");
+    } else {
+        wal_size += record_size(h.klen, len);
+    }
+    pthread_mutex_unlock(&append_lock);
+    if (err) {
+        append_failed();
+    }
+    return err ? -1 : 0;
+}
+
+static long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/* wait for the sync that starts first after this call, running it
+ * if no one else is. returns -1 if it (or a later one we slept
+ * through) failed
+ */
+int wal_commit(void) {
+    pthread_mutex_lock(&commit_lock);
+    long target = syncs_begun + 1;
+    if (++next_batch >= batch_max) {
+        pthread_cond_signal(&commit_gather);
+    }
+    while (syncs_done < target) {
+        if (syncing) {
+            pthread_cond_wait(&commit_done, &commit_lock);
+            continue;
+        }
+        syncing = 1;
+        if (window_us > 0) {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += window_us * 1000L;
+            ts.tv_sec += ts.tv_nsec / 1000000000L;
+            ts.tv_nsec %= 1000000000L;
+            while (next_batch < batch_max &&
+                   pthread_cond_timedwait(&commit_gather, &commit_lock, &ts) != ETIMEDOUT) {
+            }
+        }
+        int batch = next_batch;
+        next_batch = 0;
+        syncs_begun++;
+        pthread_mutex_unlock(&commit_lock);
+
+        long start = now_ns();
+        int status = sync_fn();
+        long end = now_ns();
+
+        pthread_mutex_lock(&commit_lock);
+        syncs_done++;
+        if (status < 0) {
+            perror("wal sync");
+            last_failed = syncs_done;
+            failures++;
+            set_failed();
+        }
+        commits += batch;
+        hist_record(&batch_hist, batch);
+        hist_record(&latency_hist, end - start);
+        syncing = 0;
+        pthread_cond_broadcast(&commit_done);
+    }
+    int status = last_failed >= target ? -1 : 0;
+    pthread_mutex_unlock(&commit_lock);
+    return status;
+}
+
+void wal_get_stats(struct wal_stats *st) {
+    pthread_mutex_lock(&commit_lock);
+    st->syncs = syncs_done;
+    st->writes = commits;
+    st->failures = failures;
+    st->append_failures = append_failures;
+    st->failed = failed;
+    st->window_us = window_us;
+    st->batch_max = batch_max;
+    st->batch = batch_hist;
+    st->latency = latency_hist;
+    pthread_mutex_unlock(&commit_lock);
+    st->bytes = __atomic_load_n(&wal_size, __ATOMIC_RELAXED);
+}
+
+/* whether an append or sync has failed since wal_open. a change whose
+ * append failed is made but not logged, and one whose sync failed may
+ * not be on disk, so the caller stops making changes
+ */
+int wal_failed(void) {
+    return __atomic_load_n(&failed, __ATOMIC_RELAXED);
+}
+
+/* empty the WAL; everything in it must already be on disk elsewhere */
+void wal_reset(void) {
+    pthread_mutex_lock(&append_lock);
+    if (ftruncate(wal_fd, 0) < 0 || fdatasync(wal_fd) < 0) {
+        perror(wal_path);
+    } else {
+        wal_size = 0;
+    }
+    pthread_mutex_unlock(&append_lock);
+    wal_drop_old();
+}
+
+/* whether WAL_FILE has grown past WAL_RETIRE_BYTES */
+int wal_full(void) {
+    return __atomic_load_n(&wal_size, __ATOMIC_RELAXED) >= WAL_RETIRE_BYTES;
+}
+
+/* make WAL_FILE WAL_OLD_FILE and carry on in a new one. every record
+ * appended so far is synced first, so commits still waiting on the old
+ * file are covered; the new file replaces the old one under wal_fd
+ * (dup2), so a sync that is running meanwhile syncs one or the other.
+ * while a WAL_OLD_FILE is still there nothing changes, so the caller
+ * tries again to retire that one
+ */
+int wal_rotate(void) {
+    char new_path[PATH_MAX + 4];
+    snprintf(new_path, sizeof(new_path), "%s.new", wal_path);
+    pthread_mutex_lock(&append_lock);
+    if (old_pending) {
+        pthread_mutex_unlock(&append_lock);
+        return 0;
+    }
+    int fd = open(new_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    int err = fd < 0 || fdatasync(wal_fd) < 0 || rename(wal_path, old_path) < 0;
+    if (!err && rename(new_path, wal_path) < 0) {
+        rename(old_path, wal_path);
+        err = 1;
+    }
+    if (!err) {
+        dup2(fd, wal_fd);
+        wal_size = 0;
+        old_pending = 1;
+        /* the new file's name must last before anything is synced to it */
+        int dir = open(dir_path, O_RDONLY | O_CLOEXEC);
+        err = dir < 0 || fsync(dir) < 0;
+        if (dir >= 0) {
+            close(dir);
+        }
+    }
+    if (err) {
+        perror(wal_path);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    pthread_mutex_unlock(&append_lock);
+    return err ? -1 : 0;
+}
+
+/* the changes in WAL_OLD_FILE are on disk elsewhere: delete it */
+void wal_drop_old(void) {
+    if (unlink(old_path) < 0 && errno != ENOENT) {
+        perror(old_path);
+        return;
+    }
+    old_pending = 0;
+}
+
+void wal_close(void) {
+    if (wal_fd >= 0) {
+        fdatasync(wal_fd);
+        close(wal_fd);
+        wal_fd = -1;
+    }
+}
@@ -0,0 +1,51 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include <stdint.h>
+#include "histogram.h"
+
+#define WAL_FILE "dbwal"         /* in the directory given to wal_open */
+#define WAL_OLD_FILE "dbwal.old" /* being retired (wal_rotate) */
+#define WAL_RETIRE_BYTES (64L << 20)
+
+/* one record of wal_append_batch() */
+struct wal_rec {
+    char op;                    /* W or D */
+    const char *key;
+    const char *data;
+    int len;
+};
+
+struct wal_stats {
+    long syncs;
+    long writes;                /* commits those syncs covered */
+    long failures;              /* syncs */
+    long append_failures;
+    int failed;                 /* wal_failed() */
+    long bytes;                 /* in WAL_FILE */
+    int window_us;
+    int batch_max;
+    struct histogram batch;     /* commits per sync */
+    struct histogram latency;   /* ns per sync */
+};
+
+/* called for each record in WAL_FILE, oldest first, by wal_open */
+typedef void (*wal_replay_fn)(char op, const char *key, const char *data, int len);
+
+/* make everything appended so far durable; 0 or -1 */
+typedef int (*wal_sync_fn)(void);
+
+int wal_open(const char *dir, int window_us, int batch_max, wal_replay_fn replay, wal_sync_fn sync);
+int wal_append(char op, const char *key, const char *data, int len);
+int wal_append_batch(struct wal_rec *recs, int n, int atomic);
+int wal_append_file(const char *key, int fd, long len, uint32_t value_crc);
+int wal_commit(void);
+void wal_get_stats(struct wal_stats *st);
+int wal_failed(void);
+void wal_reset(void);
+int wal_full(void);
+int wal_rotate(void);
+void wal_drop_old(void);
+void wal_close(void);
+
+#endif